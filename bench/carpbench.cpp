@@ -0,0 +1,471 @@
+// Runs the bench/*.carp corpus with warmups and repetitions, prints median and p95 times,
+// retired instructions and allocated bytes, and writes them as json so runs from different
+// commits can be compared with --compare.
+
+#include "compiler.h"
+#include "mymemory.h"
+#include "mytypes.h"
+#include "script.h"
+#include "vm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fileno _fileno
+#define close _close
+#else
+#include <unistd.h>
+#endif
+
+#if __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef CARP_BENCH_DIR
+#define CARP_BENCH_DIR "bench"
+#endif
+
+static const char* DefaultWorkloads[] = {
+    "fib", "loops", "strings", "natives", "scopes", "constants",
+};
+
+// Every allocation in the process goes through here, so bytes allocated include compiler and vm.
+// All replaceable forms are defined, so each delete matches the new that made the pointer.
+static std::atomic<u64> allocatedBytes = 0;
+
+static void* allocate(size_t size, size_t alignment)
+{
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* ptr = nullptr;
+    if(alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    {
+        ptr = malloc(size);
+    }
+    else
+    {
+#if _WIN32
+        ptr = _aligned_malloc(size, alignment);
+#else
+        // aligned_alloc needs the size to be a multiple of the alignment.
+        ptr = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+    }
+    if(ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static void deallocate(void* ptr, size_t alignment) noexcept
+{
+#if _WIN32
+    if(alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    {
+        _aligned_free(ptr);
+        return;
+    }
+#endif
+    free(ptr);
+}
+
+void* operator new(size_t size)
+{
+    return allocate(size, 0);
+}
+
+void* operator new[](size_t size)
+{
+    return allocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return allocate(size, size_t(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return allocate(size, size_t(alignment));
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deallocate(ptr, 0);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deallocate(ptr, 0);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    deallocate(ptr, 0);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    deallocate(ptr, 0);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+struct InstructionCounter
+{
+    i32 fd = -1;
+};
+
+static InstructionCounter openInstructionCounter()
+{
+    InstructionCounter counter;
+#if __linux__
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter.fd = (i32)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    return counter;
+}
+
+static void startInstructionCounter(const InstructionCounter& counter)
+{
+#if __linux__
+    if(counter.fd >= 0)
+    {
+        ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+// Returns -1 when hardware counters are not available, for example in containers.
+static i64 stopInstructionCounter(const InstructionCounter& counter)
+{
+#if __linux__
+    if(counter.fd >= 0)
+    {
+        ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+        u64 count = 0;
+        if(read(counter.fd, &count, sizeof(count)) == sizeof(count))
+        {
+            return (i64)count;
+        }
+    }
+#endif
+    return -1;
+}
+
+struct RunResult
+{
+    double compileMs;
+    double runMs;
+    i64 instructions;
+    u64 bytes;
+    bool success;
+};
+
+struct WorkloadResult
+{
+    std::string name;
+    std::vector<RunResult> runs;
+    double medianMs;
+    double p95Ms;
+    double minMs;
+    double compileMedianMs;
+    i64 instructions;
+    u64 bytes;
+    bool success;
+};
+
+struct BenchOptions
+{
+    i32 warmups = 2;
+    i32 repetitions = 10;
+    const char* jsonFile = "carpbench.json";
+    const char* compareFile = nullptr;
+    const char* label = "";
+    VMOptions vmOptions;
+};
+
+static double getMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Script prints go to the null device, so terminal speed does not end up in the timings.
+static RunResult runOnce(const std::string& filename, const InstructionCounter& counter, const VMOptions& vmOptions)
+{
+    RunResult result = {};
+    MyMemory mem{};
+    if(!loadScriptFile(mem, filename.c_str()))
+    {
+        return result;
+    }
+
+    fflush(stdout);
+    i32 savedStdout = dup(fileno(stdout));
+#if _WIN32
+    FILE* nullFile = freopen("NUL", "w", stdout);
+#else
+    FILE* nullFile = freopen("/dev/null", "w", stdout);
+#endif
+
+    u64 bytesStart = allocatedBytes.load(std::memory_order_relaxed);
+    startInstructionCounter(counter);
+    auto start = std::chrono::steady_clock::now();
+
+    Script& script = mem.scripts[addNewScript(mem)];
+    bool compiled = compile(mem, script);
+    auto compiledTime = std::chrono::steady_clock::now();
+    InterpretResult interpretResult = compiled ? runCode(script, vmOptions) : InterpretResult_CompileError;
+    auto end = std::chrono::steady_clock::now();
+
+    result.instructions = stopInstructionCounter(counter);
+    result.bytes = allocatedBytes.load(std::memory_order_relaxed) - bytesStart;
+    result.compileMs = getMs(start, compiledTime);
+    result.runMs = getMs(compiledTime, end);
+    result.success = interpretResult == InterpretResult_Ok;
+
+    fflush(stdout);
+    if(nullFile != nullptr && savedStdout >= 0)
+    {
+        dup2(savedStdout, fileno(stdout));
+    }
+    if(savedStdout >= 0)
+    {
+        close(savedStdout);
+    }
+    return result;
+}
+
+static double getPercentile(std::vector<double> values, double percentile)
+{
+    if(values.empty())
+    {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = size_t(percentile * double(values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+static WorkloadResult runWorkload(const std::string& name, const std::string& filename,
+    const InstructionCounter& counter, const BenchOptions& options)
+{
+    WorkloadResult workload = {.name = name, .success = true};
+    for(i32 i = 0; i < options.warmups; ++i)
+    {
+        runOnce(filename, counter, options.vmOptions);
+    }
+    std::vector<double> runTimes;
+    std::vector<double> compileTimes;
+    std::vector<double> instructions;
+    for(i32 i = 0; i < options.repetitions; ++i)
+    {
+        RunResult run = runOnce(filename, counter, options.vmOptions);
+        workload.runs.push_back(run);
+        workload.success = workload.success && run.success;
+        runTimes.push_back(run.compileMs + run.runMs);
+        compileTimes.push_back(run.compileMs);
+        instructions.push_back(double(run.instructions));
+        workload.bytes = run.bytes;
+    }
+    workload.medianMs = getPercentile(runTimes, 0.5);
+    workload.p95Ms = getPercentile(runTimes, 0.95);
+    workload.minMs = getPercentile(runTimes, 0.0);
+    workload.compileMedianMs = getPercentile(compileTimes, 0.5);
+    workload.instructions = (i64)getPercentile(instructions, 0.5);
+    return workload;
+}
+
+static bool writeJson(const std::vector<WorkloadResult>& workloads, const BenchOptions& options)
+{
+    FILE* file = fopen(options.jsonFile, "wb");
+    if(file == nullptr)
+    {
+        return false;
+    }
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"jit\": %s,\n  \"warmups\": %i,\n  \"repetitions\": %i,\n",
+        options.label, options.vmOptions.useJit ? "true" : "false", options.warmups, options.repetitions);
+    fprintf(file, "  \"workloads\": [\n");
+    for(size_t i = 0; i < workloads.size(); ++i)
+    {
+        const WorkloadResult& w = workloads[i];
+        fprintf(file, "    {\"name\": \"%s\", \"ok\": %s, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"min_ms\": %.4f, "
+            "\"compile_median_ms\": %.4f, ",
+            w.name.c_str(), w.success ? "true" : "false", w.medianMs, w.p95Ms, w.minMs, w.compileMedianMs);
+        if(w.instructions >= 0)
+        {
+            fprintf(file, "\"instructions\": %" PRIi64 ", ", w.instructions);
+        }
+        else
+        {
+            fprintf(file, "\"instructions\": null, ");
+        }
+        fprintf(file, "\"bytes_allocated\": %" PRIu64 "}%s\n", w.bytes, i + 1 < workloads.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+// Reads median_ms for a workload back from a json file written by writeJson.
+static double findBaselineMedian(const std::string& json, const std::string& name)
+{
+    std::string key = "\"name\": \"" + name + "\"";
+    size_t pos = json.find(key);
+    if(pos == std::string::npos)
+    {
+        return -1.0;
+    }
+    pos = json.find("\"median_ms\": ", pos);
+    if(pos == std::string::npos)
+    {
+        return -1.0;
+    }
+    return atof(json.c_str() + pos + strlen("\"median_ms\": "));
+}
+
+static void printCompare(const std::vector<WorkloadResult>& workloads, const char* compareFile)
+{
+    MyMemory mem{};
+    if(!loadScriptFile(mem, compareFile))
+    {
+        printf("Failed to read baseline: %s\n", compareFile);
+        return;
+    }
+    std::string json((const char*)mem.scriptFile.data());
+    printf("\n%-12s %12s %12s %9s\n", "Workload", "Baseline ms", "Median ms", "Change");
+    for(const WorkloadResult& w : workloads)
+    {
+        double baseline = findBaselineMedian(json, w.name);
+        if(baseline <= 0.0)
+        {
+            printf("%-12s %12s %12.3f\n", w.name.c_str(), "-", w.medianMs);
+            continue;
+        }
+        printf("%-12s %12.3f %12.3f %+8.1f%%\n", w.name.c_str(), baseline, w.medianMs,
+            100.0 * (w.medianMs - baseline) / baseline);
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    BenchOptions options{};
+    std::vector<std::string> names;
+    for(i32 i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            options.warmups = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+        {
+            options.repetitions = std::max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            options.jsonFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+        {
+            options.compareFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+        {
+            options.label = argv[++i];
+        }
+        else if(strcmp(argv[i], "--no-jit") == 0)
+        {
+            options.vmOptions.useJit = false;
+        }
+        else if(argv[i][0] == '-')
+        {
+            printf("Usage: carpbench [--warmup n] [--reps n] [--json out.json] [--compare baseline.json] "
+                "[--label text] [--no-jit] [workload...]\n");
+            return 64;
+        }
+        else
+        {
+            names.push_back(argv[i]);
+        }
+    }
+    if(names.empty())
+    {
+        names.assign(std::begin(DefaultWorkloads), std::end(DefaultWorkloads));
+    }
+
+    InstructionCounter counter = openInstructionCounter();
+    if(counter.fd < 0)
+    {
+        printf("Instruction counter not available.\n");
+    }
+
+    std::vector<WorkloadResult> workloads;
+    printf("%-12s %10s %10s %10s %10s %14s %14s\n",
+        "Workload", "Median ms", "p95 ms", "Min ms", "Compile ms", "Instructions", "Bytes");
+    for(const std::string& name : names)
+    {
+        std::string filename = name;
+        if(filename.find(".carp") == std::string::npos)
+        {
+            filename = std::string(CARP_BENCH_DIR) + "/" + name + ".carp";
+        }
+        WorkloadResult workload = runWorkload(name, filename, counter, options);
+        std::string instructions = workload.instructions >= 0 ? std::to_string(workload.instructions) : "-";
+        printf("%-12s %10.3f %10.3f %10.3f %10.3f %14s %14" PRIu64 "%s\n",
+            workload.name.c_str(), workload.medianMs, workload.p95Ms, workload.minMs,
+            workload.compileMedianMs, instructions.c_str(), workload.bytes, workload.success ? "" : " FAILED");
+        workloads.push_back(workload);
+    }
+
+    if(!writeJson(workloads, options))
+    {
+        printf("Failed to write: %s\n", options.jsonFile);
+        return 1;
+    }
+    printf("Wrote: %s\n", options.jsonFile);
+    if(options.compareFile != nullptr)
+    {
+        printCompare(workloads, options.compareFile);
+    }
+    return 0;
+}
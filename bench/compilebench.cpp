@@ -0,0 +1,251 @@
+// Grows one dimension of a generated script at a time and measures scanner tokens/sec and
+// compile() time, so quadratic lookups in the compiler show up as a growth exponent near 2.
+
+#include "compiler.h"
+#include "mymemory.h"
+#include "mytypes.h"
+#include "scanner.h"
+#include "script.h"
+#include "scriptgen.h"
+#include "token.h"
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct Dimension
+{
+    const char* name;
+    i32 ScriptGenOptions::* field;
+    i32 maxCount;
+};
+
+static const Dimension Dimensions[] = {
+    { "functions", &ScriptGenOptions::functions, 4096 },
+    { "variables", &ScriptGenOptions::variables, 8192 },
+    { "depth", &ScriptGenOptions::depth, 1024 },
+    { "literals", &ScriptGenOptions::literals, 16384 },
+    { "strings", &ScriptGenOptions::strings, 8192 },
+};
+
+// Anything growing faster than this between the two largest sizes gets flagged.
+static constexpr double SuperlinearExponent = 1.5;
+
+struct CompileMeasurement
+{
+    i32 count;
+    size_t bytes;
+    i64 tokens;
+    double scanMs;
+    double compileMs;
+    bool success;
+};
+
+static double getMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static void setSource(MyMemory& mem, const std::string& source)
+{
+    mem.scriptFile.assign(source.begin(), source.end());
+    mem.scriptFile.push_back('\0');
+}
+
+static CompileMeasurement measure(const std::string& source, i32 repetitions)
+{
+    CompileMeasurement result = {.bytes = source.size(), .scanMs = 1.0e30, .compileMs = 1.0e30, .success = true};
+    for(i32 rep = 0; rep < repetitions; ++rep)
+    {
+        MyMemory mem{};
+        setSource(mem, source);
+        const u8* src = mem.scriptFile.data();
+        Scanner scanner = {
+            .mem = mem,
+            .src = src,
+            .srcEnd = src + mem.scriptFile.size(),
+            .startToken = src,
+            .current = src,
+            .line = 1,
+            .hasErrors = false,
+        };
+        auto scanStart = std::chrono::steady_clock::now();
+        i64 tokens = 0;
+        while(scanToken(scanner).type != TokenType::END_OF_FILE)
+        {
+            ++tokens;
+        }
+        auto scanEnd = std::chrono::steady_clock::now();
+        result.tokens = tokens;
+        result.scanMs = std::min(result.scanMs, getMs(scanStart, scanEnd));
+
+        Script& script = mem.scripts[addNewScript(mem)];
+        auto compileStart = std::chrono::steady_clock::now();
+        result.success = compile(mem, script) && result.success;
+        auto compileEnd = std::chrono::steady_clock::now();
+        result.compileMs = std::min(result.compileMs, getMs(compileStart, compileEnd));
+    }
+    return result;
+}
+
+static double getGrowthExponent(const CompileMeasurement& a, const CompileMeasurement& b)
+{
+    if(a.compileMs <= 0.0 || b.compileMs <= 0.0 || a.count <= 0 || b.count <= a.count)
+    {
+        return 0.0;
+    }
+    return log(b.compileMs / a.compileMs) / log(double(b.count) / double(a.count));
+}
+
+int main(int argc, const char** argv)
+{
+    const char* emitFile = nullptr;
+    const char* jsonFile = "carpcompilebench.json";
+    const char* onlyDimension = nullptr;
+    i32 repetitions = 3;
+    i32 startCount = 128;
+    ScriptGenOptions emitOptions{};
+    for(i32 i = 1; i < argc; ++i)
+    {
+        bool hasValue = i + 1 < argc;
+        if(strcmp(argv[i], "--emit") == 0 && hasValue)
+        {
+            emitFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--json") == 0 && hasValue)
+        {
+            jsonFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--only") == 0 && hasValue)
+        {
+            onlyDimension = argv[++i];
+        }
+        else if(strcmp(argv[i], "--reps") == 0 && hasValue)
+        {
+            repetitions = std::max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--start") == 0 && hasValue)
+        {
+            startCount = std::max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--seed") == 0 && hasValue)
+        {
+            emitOptions.seed = (u32)atoi(argv[++i]);
+        }
+        else
+        {
+            bool found = false;
+            for(const Dimension& dimension : Dimensions)
+            {
+                if(hasValue && strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, dimension.name) == 0)
+                {
+                    emitOptions.*dimension.field = atoi(argv[++i]);
+                    found = true;
+                    break;
+                }
+            }
+            if(!found)
+            {
+                printf("Usage: carpcompilebench [--only dimension] [--start n] [--reps n] [--json out.json]\n"
+                    "       carpcompilebench --emit out.carp [--functions n] [--variables n] [--depth n] "
+                    "[--literals n] [--strings n] [--seed n]\n");
+                return 64;
+            }
+        }
+    }
+
+    if(emitFile != nullptr)
+    {
+        std::string source = generateScript(emitOptions);
+        FILE* file = fopen(emitFile, "wb");
+        if(file == nullptr || fwrite(source.data(), 1, source.size(), file) != source.size())
+        {
+            printf("Failed to write: %s\n", emitFile);
+            return 1;
+        }
+        fclose(file);
+        return 0;
+    }
+
+    FILE* json = fopen(jsonFile, "wb");
+    if(json == nullptr)
+    {
+        printf("Failed to write: %s\n", jsonFile);
+        return 1;
+    }
+    fprintf(json, "{\n  \"dimensions\": [\n");
+
+    bool firstDimension = true;
+    i32 flagged = 0;
+    i32 failed = 0;
+    for(const Dimension& dimension : Dimensions)
+    {
+        if(onlyDimension != nullptr && strcmp(onlyDimension, dimension.name) != 0)
+        {
+            continue;
+        }
+        printf("\n%-10s %8s %10s %10s %12s %12s %8s\n",
+            dimension.name, "Count", "Bytes", "Tokens", "Mtokens/s", "Compile ms", "Exp");
+        std::vector<CompileMeasurement> measurements;
+        // Generated scripts are valid, a failed compile is a compiler bug and ends the curve.
+        i32 failedCount = 0;
+        for(i32 count = startCount; count <= dimension.maxCount; count *= 2)
+        {
+            ScriptGenOptions options{};
+            options.*dimension.field = count;
+            CompileMeasurement m = measure(generateScript(options), repetitions);
+            m.count = count;
+            if(!m.success)
+            {
+                printf("%-10s %8i failed to compile\n", "", count);
+                failedCount = count;
+                ++failed;
+                break;
+            }
+            double exponent = measurements.empty() ? 0.0 : getGrowthExponent(measurements.back(), m);
+            printf("%-10s %8i %10zu %10lli %12.2f %12.3f %8.2f\n", "", count, m.bytes, (long long)m.tokens,
+                m.scanMs > 0.0 ? double(m.tokens) / m.scanMs / 1000.0 : 0.0, m.compileMs, exponent);
+            measurements.push_back(m);
+        }
+
+        double lastExponent = measurements.size() >= 2
+            ? getGrowthExponent(measurements[measurements.size() - 2], measurements.back()) : 0.0;
+        if(lastExponent > SuperlinearExponent)
+        {
+            printf("%-10s superlinear compile time, exponent %.2f\n", dimension.name, lastExponent);
+            ++flagged;
+        }
+
+        fprintf(json, "%s    {\"name\": \"%s\", \"exponent\": %.3f, ",
+            firstDimension ? "" : ",\n", dimension.name, lastExponent);
+        if(failedCount > 0)
+        {
+            fprintf(json, "\"failed_count\": %i, ", failedCount);
+        }
+        fprintf(json, "\"points\": [");
+        for(size_t i = 0; i < measurements.size(); ++i)
+        {
+            const CompileMeasurement& m = measurements[i];
+            fprintf(json, "%s{\"count\": %i, \"bytes\": %zu, \"tokens\": %lli, \"scan_ms\": %.4f, "
+                "\"compile_ms\": %.4f}",
+                i > 0 ? ", " : "", m.count, m.bytes, (long long)m.tokens, m.scanMs, m.compileMs);
+        }
+        fprintf(json, "]}");
+        firstDimension = false;
+    }
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    printf("\nWrote: %s\n", jsonFile);
+    // Non zero exit lets a ci step fail on compile errors or quadratic compile times.
+    if(failed > 0)
+    {
+        printf("%i dimension(s) failed to compile\n", failed);
+        return 1;
+    }
+    return flagged > 0 ? 2 : 0;
+}
@@ -0,0 +1,197 @@
+// Per call cost of a script function called through libcarpscript, the way a host handling
+// requests calls it. Compared against running the whole script for every request. Batches of a
+// branch-free formula run with lanes and with rows one at a time.
+// carpembedbench [calls]
+
+#include "array.h"
+#include "carpscript.h"
+
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static const char* HandlerSource = R"(
+let scale = 3;
+let offset = 7;
+let scalef = 1.5;
+fn handle(id: i32, weight: f32)
+{
+    let score = id * scale + offset;
+    if (weight > 0.5)
+    {
+        score = score + 1;
+    }
+    return score;
+}
+fn formula(x: f32, y: f32)
+{
+    let t = x * 2.5 + y * scalef;
+    let u = t * t - x / 3.0;
+    return u * 0.5 - -t;
+}
+fn sum(n: i32)
+{
+    let s = 0;
+    let i = 0;
+    while (i < n)
+    {
+        s = s + handle(i, 0.25);
+        i = i + 1;
+    }
+    return s;
+}
+)";
+
+static double msSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool benchCalls(CarpInstance* instance, i32 handle, i32 calls, const char* name)
+{
+    i64 total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(i32 i = 0; i < calls; ++i)
+    {
+        CarpValue args[] = { carpValue(i32(i & 1023)), carpValue(f32((i & 1) ? 0.75f : 0.25f)) };
+        CarpValue result;
+        if(carpCall(instance, handle, args, 2, &result) != InterpretResult_Ok)
+        {
+            return false;
+        }
+        i32 score = 0;
+        if(!carpGetValue(result, score))
+        {
+            fprintf(stderr, "Result has type: %i\n", result.type);
+            return false;
+        }
+        total += score;
+    }
+    double ms = msSince(start);
+    printf("%-24s %10i calls %10.2f ms %10.1f ns/call  checksum %" PRIi64 "\n",
+        name, calls, ms, ms * 1e6 / calls, total);
+    return true;
+}
+
+static bool benchBatch(CarpInstance* instance, i32 handle, i32 calls, const char* name)
+{
+    std::vector<i32> ids(calls);
+    std::vector<f32> weights(calls);
+    std::vector<i32> scores(calls);
+    for(i32 i = 0; i < calls; ++i)
+    {
+        ids[i] = i & 1023;
+        weights[i] = (i & 1) ? 0.75f : 0.25f;
+    }
+    CarpColumn args[] = { carpColumn(ids.data()), carpColumn(weights.data()) };
+    auto start = std::chrono::steady_clock::now();
+    if(carpCallBatch(instance, handle, args, 2, calls, carpColumn(scores.data())) != InterpretResult_Ok)
+    {
+        return false;
+    }
+    double ms = msSince(start);
+    i64 total = 0;
+    for(i32 score : scores)
+    {
+        total += score;
+    }
+    printf("%-24s %10i rows  %10.2f ms %10.1f ns/row   checksum %" PRIi64 "\n",
+        name, calls, ms, ms * 1e6 / calls, total);
+    return true;
+}
+
+static double batchFormula(CarpInstance* instance, i32 formula, std::vector<f32>& xs, std::vector<f32>& ys,
+    std::vector<f32>& outValues)
+{
+    CarpColumn args[] = { carpColumn(xs.data()), carpColumn(ys.data()) };
+    auto start = std::chrono::steady_clock::now();
+    if(carpCallBatch(instance, formula, args, 2, (i64)xs.size(), carpColumn(outValues.data())) != InterpretResult_Ok)
+    {
+        return -1.0;
+    }
+    return msSince(start);
+}
+
+static bool benchFormula(CarpInstance* instance, i32 formula, i32 rows, const char* name)
+{
+    std::vector<f32> xs(rows);
+    std::vector<f32> ys(rows);
+    for(i32 i = 0; i < rows; ++i)
+    {
+        xs[i] = f32(i % 1000) * 0.01f;
+        ys[i] = f32(i % 37) - 18.0f;
+    }
+    std::vector<f32> lanes(rows);
+    std::vector<f32> scalar(rows);
+    double lanesMs = batchFormula(instance, formula, xs, ys, lanes);
+    SimdLevel level = getArraySimdLevel();
+    setArraySimdLevel(SimdLevel_Scalar);
+    double scalarMs = batchFormula(instance, formula, xs, ys, scalar);
+    setArraySimdLevel(level);
+    if(lanesMs < 0.0 || scalarMs < 0.0 || memcmp(lanes.data(), scalar.data(), rows * sizeof(f32)) != 0)
+    {
+        fprintf(stderr, "Lane results differ from rows one at a time.\n");
+        return false;
+    }
+    printf("%-24s %10i rows  %10.2f ms %10.1f ns/row   %s lanes\n", name, rows, scalarMs, scalarMs * 1e6 / rows, "without");
+    printf("%-24s %10i rows  %10.2f ms %10.1f ns/row   %s lanes\n", name, rows, lanesMs, lanesMs * 1e6 / rows,
+        getSimdLevelName(level));
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    i32 calls = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    auto start = std::chrono::steady_clock::now();
+    CarpProgram* program = carpCompile(HandlerSource, strlen(HandlerSource));
+    if(program == nullptr)
+    {
+        return 1;
+    }
+    printf("%-24s %10.3f ms\n", "compile", msSince(start));
+    i32 handle = carpFindFunction(program, "handle");
+    i32 formula = carpFindFunction(program, "formula");
+    if(handle < 0 || formula < 0 || carpFindFunction(program, "missing") != -1)
+    {
+        fprintf(stderr, "Failed to find functions.\n");
+        return 1;
+    }
+
+    bool success = true;
+    for(bool useJit : { false, true })
+    {
+        VMOptions options{};
+        options.useJit = useJit;
+        CarpInstance* instance = carpCreateInstance(program, options);
+        if(instance == nullptr)
+        {
+            return 1;
+        }
+        success = success && benchCalls(instance, handle, calls, useJit ? "carpCall jit" : "carpCall interpreter");
+        success = success && benchBatch(instance, handle, calls, useJit ? "carpCallBatch jit" : "carpCallBatch interpreter");
+        success = success && benchFormula(instance, formula, calls, useJit ? "formula batch jit" : "formula batch interpreter");
+        carpDestroyInstance(instance);
+    }
+
+    // Whole script for every request, what a host without the library has to do.
+    i32 runs = calls / 100 > 0 ? calls / 100 : 1;
+    VMOptions options{};
+    options.useJit = false;
+    start = std::chrono::steady_clock::now();
+    for(i32 i = 0; i < runs && success; ++i)
+    {
+        CarpInstance* instance = carpCreateInstance(program, options);
+        CarpValue args[] = { carpValue(i32(i & 1023)), carpValue(0.25f) };
+        success = instance != nullptr && carpCall(instance, handle, args, 2, nullptr) == InterpretResult_Ok;
+        carpDestroyInstance(instance);
+    }
+    double ms = msSince(start);
+    printf("%-24s %10i runs  %10.2f ms %10.1f ns/run\n", "instance per request", runs, ms, ms * 1e6 / runs);
+
+    carpDestroyProgram(program);
+    return success ? 0 : 1;
+}
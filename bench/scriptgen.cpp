@@ -0,0 +1,81 @@
+#include "scriptgen.h"
+
+static u32 nextRandom(u32& state)
+{
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Capped, so deep nesting does not turn the source into mostly whitespace.
+static void appendIndent(std::string& out, i32 level)
+{
+    out.append(size_t(level < 8 ? level : 8) * 4, ' ');
+}
+
+std::string generateScript(const ScriptGenOptions& options)
+{
+    u32 random = options.seed != 0 ? options.seed : 1;
+    std::string out;
+    out.reserve(size_t(options.functions) * 96 + size_t(options.variables) * 64
+        + size_t(options.depth) * 48 + size_t(options.literals) * 24 + size_t(options.strings) * 48 + 256);
+
+    for(i32 i = 0; i < options.functions; ++i)
+    {
+        out += "fn gen_fn_" + std::to_string(i) + "(a: i32, b: i32)\n{\n";
+        out += "    let t = a * " + std::to_string(nextRandom(random) % 100 + 1) + " + b;\n";
+        out += "    return t - " + std::to_string(nextRandom(random) % 100) + ";\n}\n";
+    }
+
+    out += "let acc = 0;\n";
+    for(i32 i = 0; i < options.functions; ++i)
+    {
+        out += "acc = acc + gen_fn_" + std::to_string(i) + "(" + std::to_string(i % 1000) + ", 1);\n";
+    }
+
+    for(i32 i = 0; i < options.variables; ++i)
+    {
+        out += "let gen_var_" + std::to_string(i) + " = " + std::to_string(nextRandom(random) % 1000) + ";\n";
+    }
+    for(i32 i = 1; i < options.variables; ++i)
+    {
+        out += "gen_var_" + std::to_string(i) + " = gen_var_" + std::to_string(i) + " + gen_var_"
+            + std::to_string(nextRandom(random) % i) + ";\n";
+    }
+
+    for(i32 i = 0; i < options.depth; ++i)
+    {
+        appendIndent(out, i);
+        out += "{\n";
+        appendIndent(out, i + 1);
+        out += "let gen_depth_" + std::to_string(i) + " = ";
+        out += i > 0 ? "gen_depth_" + std::to_string(i - 1) + " + 1;\n" : std::string("acc;\n");
+    }
+    for(i32 i = options.depth - 1; i >= 0; --i)
+    {
+        if(i == options.depth - 1)
+        {
+            appendIndent(out, i + 1);
+            out += "acc = gen_depth_" + std::to_string(i) + ";\n";
+        }
+        appendIndent(out, i);
+        out += "}\n";
+    }
+
+    for(i32 i = 0; i < options.literals; i += 2)
+    {
+        out += "acc = acc + " + std::to_string(nextRandom(random) % 100000) + " * "
+            + std::to_string(nextRandom(random) % 100) + ";\n";
+    }
+
+    for(i32 i = 0; i < options.strings; ++i)
+    {
+        out += "let gen_str_" + std::to_string(i) + " = \"generated string " + std::to_string(i) + " "
+            + std::to_string(nextRandom(random)) + "\";\n";
+    }
+
+    out += "print acc;\n";
+    return out;
+}
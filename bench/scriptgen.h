@@ -0,0 +1,24 @@
+#pragma once
+
+#include "mytypes.h"
+
+#include <string>
+
+// Knobs for generating a synthetic script, each one grows a different part of the compiler.
+struct ScriptGenOptions
+{
+    // Function declarations, each called once from top level.
+    i32 functions = 16;
+    // Top level let declarations, each read back by a later assignment.
+    i32 variables = 16;
+    // Nested block scopes, one let per level.
+    i32 depth = 4;
+    // Numeric literals in straight line arithmetic.
+    i32 literals = 16;
+    // String literal declarations.
+    i32 strings = 16;
+    u32 seed = 1;
+};
+
+// Returns a valid carp script, same options and seed always give the same script.
+std::string generateScript(const ScriptGenOptions& options);
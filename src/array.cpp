@@ -0,0 +1,856 @@
+#include "array.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <string.h>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ARRAY_SIMD_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// Msvc allows avx2 intrinsics in any function.
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define ARRAY_SIMD_X64 0
+#endif
+
+static SimdLevel detectSimdLevel()
+{
+#if ARRAY_SIMD_X64
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4] = {};
+    __cpuid(regs, 1);
+    bool osSavesYmm = (regs[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+    __cpuidex(regs, 7, 0);
+    bool avx2 = osSavesYmm && (regs[1] & (1 << 5)) != 0;
+#else
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    // Sse2 is part of x86-64.
+    return avx2 ? SimdLevel_Avx2 : SimdLevel_Sse2;
+#else
+    return SimdLevel_Scalar;
+#endif
+}
+
+SimdLevel getSupportedSimdLevel()
+{
+    static const SimdLevel supported = detectSimdLevel();
+    return supported;
+}
+
+static std::atomic<i32> simdLevelLimit = SimdLevel_Avx2;
+
+static SimdLevel getSimdLevel()
+{
+    SimdLevel supported = getSupportedSimdLevel();
+    i32 limit = simdLevelLimit.load(std::memory_order_relaxed);
+    return limit < supported ? SimdLevel(limit) : supported;
+}
+
+SimdLevel setArraySimdLevel(SimdLevel level)
+{
+    simdLevelLimit.store(level, std::memory_order_relaxed);
+    return getSimdLevel();
+}
+
+SimdLevel getArraySimdLevel()
+{
+    return getSimdLevel();
+}
+
+const char* getSimdLevelName(SimdLevel level)
+{
+    switch(level)
+    {
+        case SimdLevel_Scalar: return "scalar";
+        case SimdLevel_Sse2: return "sse2";
+        case SimdLevel_Avx2: return "avx2";
+    }
+    return "unknown";
+}
+
+ScriptArrayRef arrayCreate(ValueType elementType, u64 count)
+{
+    if(elementType < ValueTypeBool || elementType > ValueTypeF64)
+    {
+        return nullptr;
+    }
+    ScriptArrayRef array = std::make_shared<ScriptArray>();
+    array->elementType = elementType;
+    array->structIndex = 0;
+    array->elementSize = getValueTypeSizeInBytes(elementType);
+    array->count = count;
+    u64 bytes = count * array->elementSize;
+    array->storage.assign((bytes + sizeof(u64) - 1) / sizeof(u64), 0);
+    return array;
+}
+
+ScriptArrayRef arrayCreateStructs(u16 structIndex, u32 structSize, u64 count)
+{
+    ScriptArrayRef array = std::make_shared<ScriptArray>();
+    array->elementType = ValueTypeStruct;
+    array->structIndex = structIndex;
+    array->elementSize = structSize;
+    array->count = count;
+    u64 bytes = count * structSize;
+    array->storage.assign((bytes + sizeof(u64) - 1) / sizeof(u64), 0);
+    return array;
+}
+
+TypeOfValue arrayGet(const ScriptArray& array, u64 index)
+{
+    TypeOfValue value = 0;
+    memcpy(&value, getArrayData(array) + index * array.elementSize, array.elementSize);
+    return value;
+}
+
+void arraySet(ScriptArray& array, u64 index, TypeOfValue value)
+{
+    memcpy(getArrayData(array) + index * array.elementSize, &value, array.elementSize);
+}
+
+// Scalar kernels for every element type, integers wrap around instead of overflowing.
+
+template<typename T>
+static T loadValue(TypeOfValue value)
+{
+    T result;
+    memcpy(&result, &value, sizeof(T));
+    return result;
+}
+
+template<typename T>
+static TypeOfValue storeValue(T value)
+{
+    TypeOfValue result = 0;
+    memcpy(&result, &value, sizeof(T));
+    return result;
+}
+
+// Integers wrap in unsigned math at least as wide as u32, narrower unsigned types would promote
+// to int and overflow it.
+template<typename T>
+using WrapType = std::conditional_t<(sizeof(T) < sizeof(u32)), u32, std::make_unsigned_t<T>>;
+
+template<typename T>
+static T addWrap(T a, T b)
+{
+    if constexpr(std::is_integral_v<T>)
+        return T(WrapType<T>(std::make_unsigned_t<T>(a)) + WrapType<T>(std::make_unsigned_t<T>(b)));
+    else
+        return a + b;
+}
+
+template<typename T>
+static T mulWrap(T a, T b)
+{
+    if constexpr(std::is_integral_v<T>)
+        return T(WrapType<T>(std::make_unsigned_t<T>(a)) * WrapType<T>(std::make_unsigned_t<T>(b)));
+    else
+        return a * b;
+}
+
+template<typename T>
+static void addScalar(T* dst, const T* a, const T* b, u64 count)
+{
+    for(u64 i = 0; i < count; ++i)
+        dst[i] = addWrap(a[i], b[i]);
+}
+
+template<typename T>
+static void mulScalar(T* dst, const T* a, const T* b, u64 count)
+{
+    for(u64 i = 0; i < count; ++i)
+        dst[i] = mulWrap(a[i], b[i]);
+}
+
+template<typename T>
+static void scaleScalar(T* values, T scalar, u64 count)
+{
+    for(u64 i = 0; i < count; ++i)
+        values[i] = mulWrap(values[i], scalar);
+}
+
+template<typename T>
+static T sumScalar(const T* values, u64 count)
+{
+    T sum = 0;
+    for(u64 i = 0; i < count; ++i)
+        sum = addWrap(sum, values[i]);
+    return sum;
+}
+
+template<typename T>
+static T dotScalar(const T* a, const T* b, u64 count)
+{
+    T sum = 0;
+    for(u64 i = 0; i < count; ++i)
+        sum = addWrap(sum, mulWrap(a[i], b[i]));
+    return sum;
+}
+
+// Min and max of values with a NaN are NaN, so every simd level gives the same result.
+template<typename T>
+static T minScalar(const T* values, u64 count)
+{
+    T result = values[0];
+    for(u64 i = 0; i < count; ++i)
+    {
+        if(values[i] != values[i])
+            return std::numeric_limits<T>::quiet_NaN();
+        result = values[i] < result ? values[i] : result;
+    }
+    return result;
+}
+
+template<typename T>
+static T maxScalar(const T* values, u64 count)
+{
+    T result = values[0];
+    for(u64 i = 0; i < count; ++i)
+    {
+        if(values[i] != values[i])
+            return std::numeric_limits<T>::quiet_NaN();
+        result = values[i] > result ? values[i] : result;
+    }
+    return result;
+}
+
+#if ARRAY_SIMD_X64
+
+// Sse2 kernels, 4 f32 or 2 f64 lanes. Tails run the scalar kernels.
+
+static void addF32Sse2(f32* dst, const f32* a, const f32* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    addScalar(dst + i, a + i, b + i, count - i);
+}
+
+static void mulF32Sse2(f32* dst, const f32* a, const f32* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    mulScalar(dst + i, a + i, b + i, count - i);
+}
+
+static void scaleF32Sse2(f32* values, f32 scalar, u64 count)
+{
+    __m128 s = _mm_set1_ps(scalar);
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm_storeu_ps(values + i, _mm_mul_ps(_mm_loadu_ps(values + i), s));
+    scaleScalar(values + i, scalar, count - i);
+}
+
+static f32 sumF32Sse2(const f32* values, u64 count)
+{
+    // Two accumulators hide the add latency.
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_loadu_ps(values + i));
+        sum1 = _mm_add_ps(sum1, _mm_loadu_ps(values + i + 4));
+    }
+    alignas(16) f32 lanes[4];
+    _mm_store_ps(lanes, _mm_add_ps(sum0, sum1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(values + i, count - i);
+}
+
+static f32 dotF32Sse2(const f32* a, const f32* b, u64 count)
+{
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    alignas(16) f32 lanes[4];
+    _mm_store_ps(lanes, _mm_add_ps(sum0, sum1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotScalar(a + i, b + i, count - i);
+}
+
+static f32 minF32Sse2(const f32* values, u64 count)
+{
+    if(count < 4)
+        return minScalar(values, count);
+    __m128 result = _mm_loadu_ps(values);
+    __m128 nan = _mm_cmpunord_ps(result, result);
+    u64 i = 4;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(values + i);
+        nan = _mm_or_ps(nan, _mm_cmpunord_ps(v, v));
+        result = _mm_min_ps(result, v);
+    }
+    if(_mm_movemask_ps(nan) != 0)
+        return std::numeric_limits<f32>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(16) f32 rest[8];
+    _mm_store_ps(rest, result);
+    memcpy(rest + 4, values + i, (count - i) * sizeof(f32));
+    return minScalar(rest, 4 + count - i);
+}
+
+static f32 maxF32Sse2(const f32* values, u64 count)
+{
+    if(count < 4)
+        return maxScalar(values, count);
+    __m128 result = _mm_loadu_ps(values);
+    __m128 nan = _mm_cmpunord_ps(result, result);
+    u64 i = 4;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(values + i);
+        nan = _mm_or_ps(nan, _mm_cmpunord_ps(v, v));
+        result = _mm_max_ps(result, v);
+    }
+    if(_mm_movemask_ps(nan) != 0)
+        return std::numeric_limits<f32>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(16) f32 rest[8];
+    _mm_store_ps(rest, result);
+    memcpy(rest + 4, values + i, (count - i) * sizeof(f32));
+    return maxScalar(rest, 4 + count - i);
+}
+
+static void addF64Sse2(f64* dst, const f64* a, const f64* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 2 <= count; i += 2)
+        _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    addScalar(dst + i, a + i, b + i, count - i);
+}
+
+static void mulF64Sse2(f64* dst, const f64* a, const f64* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 2 <= count; i += 2)
+        _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mulScalar(dst + i, a + i, b + i, count - i);
+}
+
+static void scaleF64Sse2(f64* values, f64 scalar, u64 count)
+{
+    __m128d s = _mm_set1_pd(scalar);
+    u64 i = 0;
+    for(; i + 2 <= count; i += 2)
+        _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), s));
+    scaleScalar(values + i, scalar, count - i);
+}
+
+static f64 sumF64Sse2(const f64* values, u64 count)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+    }
+    alignas(16) f64 lanes[2];
+    _mm_store_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + sumScalar(values + i, count - i);
+}
+
+static f64 dotF64Sse2(const f64* a, const f64* b, u64 count)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    alignas(16) f64 lanes[2];
+    _mm_store_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + dotScalar(a + i, b + i, count - i);
+}
+
+static f64 minF64Sse2(const f64* values, u64 count)
+{
+    if(count < 2)
+        return minScalar(values, count);
+    __m128d result = _mm_loadu_pd(values);
+    __m128d nan = _mm_cmpunord_pd(result, result);
+    u64 i = 2;
+    for(; i + 2 <= count; i += 2)
+    {
+        __m128d v = _mm_loadu_pd(values + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+        result = _mm_min_pd(result, v);
+    }
+    if(_mm_movemask_pd(nan) != 0)
+        return std::numeric_limits<f64>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(16) f64 rest[4];
+    _mm_store_pd(rest, result);
+    memcpy(rest + 2, values + i, (count - i) * sizeof(f64));
+    return minScalar(rest, 2 + count - i);
+}
+
+static f64 maxF64Sse2(const f64* values, u64 count)
+{
+    if(count < 2)
+        return maxScalar(values, count);
+    __m128d result = _mm_loadu_pd(values);
+    __m128d nan = _mm_cmpunord_pd(result, result);
+    u64 i = 2;
+    for(; i + 2 <= count; i += 2)
+    {
+        __m128d v = _mm_loadu_pd(values + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+        result = _mm_max_pd(result, v);
+    }
+    if(_mm_movemask_pd(nan) != 0)
+        return std::numeric_limits<f64>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(16) f64 rest[4];
+    _mm_store_pd(rest, result);
+    memcpy(rest + 2, values + i, (count - i) * sizeof(f64));
+    return maxScalar(rest, 2 + count - i);
+}
+
+// Avx2 kernels, 8 f32 or 4 f64 lanes. Only called when the cpu has avx2.
+
+TARGET_AVX2 static void addF32Avx2(f32* dst, const f32* a, const f32* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    addScalar(dst + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void mulF32Avx2(f32* dst, const f32* a, const f32* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    mulScalar(dst + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void scaleF32Avx2(f32* values, f32 scalar, u64 count)
+{
+    __m256 s = _mm256_set1_ps(scalar);
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_loadu_ps(values + i), s));
+    scaleScalar(values + i, scalar, count - i);
+}
+
+TARGET_AVX2 static f32 sumF32Avx2(const f32* values, u64 count)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    u64 i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        sum0 = _mm256_add_ps(sum0, _mm256_loadu_ps(values + i));
+        sum1 = _mm256_add_ps(sum1, _mm256_loadu_ps(values + i + 8));
+    }
+    alignas(32) f32 lanes[8];
+    _mm256_store_ps(lanes, _mm256_add_ps(sum0, sum1));
+    return sumScalar(lanes, 8) + sumScalar(values + i, count - i);
+}
+
+TARGET_AVX2 static f32 dotF32Avx2(const f32* a, const f32* b, u64 count)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    u64 i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    alignas(32) f32 lanes[8];
+    _mm256_store_ps(lanes, _mm256_add_ps(sum0, sum1));
+    return sumScalar(lanes, 8) + dotScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static f32 minF32Avx2(const f32* values, u64 count)
+{
+    if(count < 8)
+        return minScalar(values, count);
+    __m256 result = _mm256_loadu_ps(values);
+    __m256 nan = _mm256_cmp_ps(result, result, _CMP_UNORD_Q);
+    u64 i = 8;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(values + i);
+        nan = _mm256_or_ps(nan, _mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        result = _mm256_min_ps(result, v);
+    }
+    if(_mm256_movemask_ps(nan) != 0)
+        return std::numeric_limits<f32>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(32) f32 rest[16];
+    _mm256_store_ps(rest, result);
+    memcpy(rest + 8, values + i, (count - i) * sizeof(f32));
+    return minScalar(rest, 8 + count - i);
+}
+
+TARGET_AVX2 static f32 maxF32Avx2(const f32* values, u64 count)
+{
+    if(count < 8)
+        return maxScalar(values, count);
+    __m256 result = _mm256_loadu_ps(values);
+    __m256 nan = _mm256_cmp_ps(result, result, _CMP_UNORD_Q);
+    u64 i = 8;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(values + i);
+        nan = _mm256_or_ps(nan, _mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        result = _mm256_max_ps(result, v);
+    }
+    if(_mm256_movemask_ps(nan) != 0)
+        return std::numeric_limits<f32>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(32) f32 rest[16];
+    _mm256_store_ps(rest, result);
+    memcpy(rest + 8, values + i, (count - i) * sizeof(f32));
+    return maxScalar(rest, 8 + count - i);
+}
+
+TARGET_AVX2 static void addF64Avx2(f64* dst, const f64* a, const f64* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    addScalar(dst + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void mulF64Avx2(f64* dst, const f64* a, const f64* b, u64 count)
+{
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mulScalar(dst + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void scaleF64Avx2(f64* values, f64 scalar, u64 count)
+{
+    __m256d s = _mm256_set1_pd(scalar);
+    u64 i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), s));
+    scaleScalar(values + i, scalar, count - i);
+}
+
+TARGET_AVX2 static f64 sumF64Avx2(const f64* values, u64 count)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+    alignas(32) f64 lanes[4];
+    _mm256_store_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return sumScalar(lanes, 4) + sumScalar(values + i, count - i);
+}
+
+TARGET_AVX2 static f64 dotF64Avx2(const f64* a, const f64* b, u64 count)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    u64 i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    alignas(32) f64 lanes[4];
+    _mm256_store_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return sumScalar(lanes, 4) + dotScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static f64 minF64Avx2(const f64* values, u64 count)
+{
+    if(count < 4)
+        return minScalar(values, count);
+    __m256d result = _mm256_loadu_pd(values);
+    __m256d nan = _mm256_cmp_pd(result, result, _CMP_UNORD_Q);
+    u64 i = 4;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m256d v = _mm256_loadu_pd(values + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        result = _mm256_min_pd(result, v);
+    }
+    if(_mm256_movemask_pd(nan) != 0)
+        return std::numeric_limits<f64>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(32) f64 rest[8];
+    _mm256_store_pd(rest, result);
+    memcpy(rest + 4, values + i, (count - i) * sizeof(f64));
+    return minScalar(rest, 4 + count - i);
+}
+
+TARGET_AVX2 static f64 maxF64Avx2(const f64* values, u64 count)
+{
+    if(count < 4)
+        return maxScalar(values, count);
+    __m256d result = _mm256_loadu_pd(values);
+    __m256d nan = _mm256_cmp_pd(result, result, _CMP_UNORD_Q);
+    u64 i = 4;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m256d v = _mm256_loadu_pd(values + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        result = _mm256_max_pd(result, v);
+    }
+    if(_mm256_movemask_pd(nan) != 0)
+        return std::numeric_limits<f64>::quiet_NaN();
+    // Lanes and the tail, which is shorter than the lanes.
+    alignas(32) f64 rest[8];
+    _mm256_store_pd(rest, result);
+    memcpy(rest + 4, values + i, (count - i) * sizeof(f64));
+    return maxScalar(rest, 4 + count - i);
+}
+
+#endif
+
+// Floats go to the best kernel the cpu has, other types run the scalar kernels, which the
+// compiler can vectorize for integers since wrapping adds reorder freely.
+
+template<typename T>
+static void addTyped(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b)
+{
+    T* d = (T*)getArrayData(dst);
+    const T* x = (const T*)getArrayData(a);
+    const T* y = (const T*)getArrayData(b);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return addF32Avx2(d, x, y, dst.count);
+        if(level == SimdLevel_Sse2) return addF32Sse2(d, x, y, dst.count);
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return addF64Avx2(d, x, y, dst.count);
+        if(level == SimdLevel_Sse2) return addF64Sse2(d, x, y, dst.count);
+    }
+#endif
+    addScalar(d, x, y, dst.count);
+}
+
+template<typename T>
+static void mulTyped(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b)
+{
+    T* d = (T*)getArrayData(dst);
+    const T* x = (const T*)getArrayData(a);
+    const T* y = (const T*)getArrayData(b);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return mulF32Avx2(d, x, y, dst.count);
+        if(level == SimdLevel_Sse2) return mulF32Sse2(d, x, y, dst.count);
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return mulF64Avx2(d, x, y, dst.count);
+        if(level == SimdLevel_Sse2) return mulF64Sse2(d, x, y, dst.count);
+    }
+#endif
+    mulScalar(d, x, y, dst.count);
+}
+
+template<typename T>
+static void scaleTyped(ScriptArray& array, TypeOfValue scalar)
+{
+    T* values = (T*)getArrayData(array);
+    T s = loadValue<T>(scalar);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return scaleF32Avx2(values, s, array.count);
+        if(level == SimdLevel_Sse2) return scaleF32Sse2(values, s, array.count);
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return scaleF64Avx2(values, s, array.count);
+        if(level == SimdLevel_Sse2) return scaleF64Sse2(values, s, array.count);
+    }
+#endif
+    scaleScalar(values, s, array.count);
+}
+
+template<typename T>
+static TypeOfValue sumTyped(const ScriptArray& array)
+{
+    const T* values = (const T*)getArrayData(array);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(sumF32Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(sumF32Sse2(values, array.count));
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(sumF64Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(sumF64Sse2(values, array.count));
+    }
+#endif
+    return storeValue(sumScalar(values, array.count));
+}
+
+template<typename T>
+static TypeOfValue dotTyped(const ScriptArray& a, const ScriptArray& b)
+{
+    const T* x = (const T*)getArrayData(a);
+    const T* y = (const T*)getArrayData(b);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(dotF32Avx2(x, y, a.count));
+        if(level == SimdLevel_Sse2) return storeValue(dotF32Sse2(x, y, a.count));
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(dotF64Avx2(x, y, a.count));
+        if(level == SimdLevel_Sse2) return storeValue(dotF64Sse2(x, y, a.count));
+    }
+#endif
+    return storeValue(dotScalar(x, y, a.count));
+}
+
+template<typename T>
+static TypeOfValue minTyped(const ScriptArray& array)
+{
+    const T* values = (const T*)getArrayData(array);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(minF32Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(minF32Sse2(values, array.count));
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(minF64Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(minF64Sse2(values, array.count));
+    }
+#endif
+    return storeValue(minScalar(values, array.count));
+}
+
+template<typename T>
+static TypeOfValue maxTyped(const ScriptArray& array)
+{
+    const T* values = (const T*)getArrayData(array);
+#if ARRAY_SIMD_X64
+    SimdLevel level = getSimdLevel();
+    if constexpr(std::is_same_v<T, f32>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(maxF32Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(maxF32Sse2(values, array.count));
+    }
+    if constexpr(std::is_same_v<T, f64>)
+    {
+        if(level == SimdLevel_Avx2) return storeValue(maxF64Avx2(values, array.count));
+        if(level == SimdLevel_Sse2) return storeValue(maxF64Sse2(values, array.count));
+    }
+#endif
+    return storeValue(maxScalar(values, array.count));
+}
+
+// Calls fn<T>() for the element type. Bool and struct arrays have no bulk math.
+#define ARRAY_DISPATCH(type, fn, ...) \
+    switch(type) \
+    { \
+        case ValueTypeI8: return fn<i8>(__VA_ARGS__); \
+        case ValueTypeU8: return fn<u8>(__VA_ARGS__); \
+        case ValueTypeI16: return fn<i16>(__VA_ARGS__); \
+        case ValueTypeU16: return fn<u16>(__VA_ARGS__); \
+        case ValueTypeI32: return fn<i32>(__VA_ARGS__); \
+        case ValueTypeU32: return fn<u32>(__VA_ARGS__); \
+        case ValueTypeI64: return fn<i64>(__VA_ARGS__); \
+        case ValueTypeU64: return fn<u64>(__VA_ARGS__); \
+        case ValueTypeF32: return fn<f32>(__VA_ARGS__); \
+        case ValueTypeF64: return fn<f64>(__VA_ARGS__); \
+        default: break; \
+    }
+
+static bool isSameShape(const ScriptArray& a, const ScriptArray& b)
+{
+    return a.elementType == b.elementType && a.count == b.count && isNumberArray(a);
+}
+
+bool arrayAdd(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b)
+{
+    if(!isSameShape(dst, a) || !isSameShape(a, b))
+    {
+        return false;
+    }
+    auto run = [&]() { ARRAY_DISPATCH(dst.elementType, addTyped, dst, a, b); };
+    run();
+    return true;
+}
+
+bool arrayMul(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b)
+{
+    if(!isSameShape(dst, a) || !isSameShape(a, b))
+    {
+        return false;
+    }
+    auto run = [&]() { ARRAY_DISPATCH(dst.elementType, mulTyped, dst, a, b); };
+    run();
+    return true;
+}
+
+void arrayScale(ScriptArray& array, TypeOfValue scalar)
+{
+    ARRAY_DISPATCH(array.elementType, scaleTyped, array, scalar);
+}
+
+TypeOfValue arraySum(const ScriptArray& array)
+{
+    ARRAY_DISPATCH(array.elementType, sumTyped, array);
+    return 0;
+}
+
+TypeOfValue arrayMin(const ScriptArray& array)
+{
+    ARRAY_DISPATCH(array.elementType, minTyped, array);
+    return 0;
+}
+
+TypeOfValue arrayMax(const ScriptArray& array)
+{
+    ARRAY_DISPATCH(array.elementType, maxTyped, array);
+    return 0;
+}
+
+bool arrayDot(const ScriptArray& a, const ScriptArray& b, TypeOfValue& outValue)
+{
+    if(!isSameShape(a, b))
+    {
+        return false;
+    }
+    auto run = [&]() -> TypeOfValue { ARRAY_DISPATCH(a.elementType, dotTyped, a, b); return 0; };
+    outValue = run();
+    return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+#include "mytypes.h"
+
+#include <memory>
+#include <vector>
+
+// Contiguous typed array, values of ValueTypeArray index to VMState arrays. States running
+// tasks of the same run share the arrays, so parallel for chunks can fill different elements.
+struct ScriptArray
+{
+    ValueType elementType;
+    // Struct of the elements for ValueTypeStruct, structs are stored by value one after another.
+    u16 structIndex;
+    u32 elementSize;
+    u64 count;
+    // Elements packed by their size, u64 storage keeps them 8 byte aligned.
+    std::vector<u64> storage;
+};
+
+using ScriptArrayRef = std::shared_ptr<ScriptArray>;
+
+enum SimdLevel
+{
+    SimdLevel_Scalar,
+    SimdLevel_Sse2,
+    SimdLevel_Avx2,
+};
+
+// Best level the cpu supports, detected once.
+SimdLevel getSupportedSimdLevel();
+// Bulk ops and lane batches use at most this level, for comparing kernels. Returns the level in use.
+// Scalar runs batch rows one at a time.
+SimdLevel setArraySimdLevel(SimdLevel level);
+SimdLevel getArraySimdLevel();
+const char* getSimdLevelName(SimdLevel level);
+
+// Only bool and number elements, returns null for other types.
+ScriptArrayRef arrayCreate(ValueType elementType, u64 count);
+// Zeroed structs of structSize bytes.
+ScriptArrayRef arrayCreateStructs(u16 structIndex, u32 structSize, u64 count);
+
+// Bulk ops work on these.
+static bool isNumberArray(const ScriptArray& array)
+{
+    return array.elementType >= ValueTypeI8 && array.elementType <= ValueTypeF64;
+}
+
+static u8* getArrayData(ScriptArray& array)
+{
+    return (u8*)array.storage.data();
+}
+static const u8* getArrayData(const ScriptArray& array)
+{
+    return (const u8*)array.storage.data();
+}
+
+// Element value in the low bytes like every other value, index is checked by the caller.
+// Not for struct elements.
+TypeOfValue arrayGet(const ScriptArray& array, u64 index);
+void arraySet(ScriptArray& array, u64 index, TypeOfValue value);
+
+// Elementwise dst = a op b, every array has the same type and count. Returns false otherwise.
+bool arrayAdd(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b);
+bool arrayMul(ScriptArray& dst, const ScriptArray& a, const ScriptArray& b);
+// Multiplies every element by scalar of the element type, in place.
+void arrayScale(ScriptArray& array, TypeOfValue scalar);
+// Reductions in the element type, integer sums wrap around. Min and max need at least one element,
+// they are NaN if any element is.
+TypeOfValue arraySum(const ScriptArray& array);
+TypeOfValue arrayMin(const ScriptArray& array);
+TypeOfValue arrayMax(const ScriptArray& array);
+bool arrayDot(const ScriptArray& a, const ScriptArray& b, TypeOfValue& outValue);
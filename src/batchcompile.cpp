@@ -0,0 +1,68 @@
+#include "batchcompile.h"
+
+#include "compiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+BatchCompileResult compileFiles(const std::vector<const char*>& filenames, i32 threadCount)
+{
+    BatchCompileResult result = {};
+    result.mems.resize(filenames.size());
+    result.compiled.assign(filenames.size(), 0);
+
+    threadCount = threadCount > 0 ? threadCount : (i32)std::thread::hardware_concurrency();
+    threadCount = threadCount > 0 ? threadCount : 1;
+    if(threadCount > (i32)filenames.size())
+    {
+        threadCount = filenames.size() > 0 ? (i32)filenames.size() : 1;
+    }
+
+    std::atomic<size_t> nextFile = 0;
+    auto worker = [&]()
+    {
+        while(true)
+        {
+            size_t index = nextFile.fetch_add(1, std::memory_order_relaxed);
+            if(index >= filenames.size())
+            {
+                break;
+            }
+            MyMemory& mem = result.mems[index];
+            Script& script = mem.scripts[addNewScript(mem)];
+            if(!loadScriptFile(mem, filenames[index]))
+            {
+                fprintf(stderr, "Failed to load: %s\n", filenames[index]);
+                continue;
+            }
+            // Files are already spread over the threads, so bodies of one file compile on one.
+            if(!compile(mem, script, 1))
+            {
+                fprintf(stderr, "Failed to compile: %s\n", filenames[index]);
+                continue;
+            }
+            result.compiled[index] = 1;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(i32 i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    result.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for(u8 compiled : result.compiled)
+    {
+        result.failed += compiled ? 0 : 1;
+    }
+    return result;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "mymemory.h"
+#include "mytypes.h"
+
+#include <vector>
+
+struct BatchCompileResult
+{
+    // One for each file, compiled script is scripts[0]. Source stays here, tokens point into it.
+    std::vector<MyMemory> mems;
+    // 1 when the file was loaded and compiled.
+    std::vector<u8> compiled;
+    u64 failed;
+    double wallMs;
+};
+
+// Loads and compiles every file into its own MyMemory on threadCount threads, 0 uses every
+// hardware thread. Compiler keeps all of its state in the parser and the file's MyMemory,
+// so workers share nothing but the next file index.
+BatchCompileResult compileFiles(const std::vector<const char*>& filenames, i32 threadCount);
@@ -0,0 +1,178 @@
+#include "carpscript.h"
+
+#include "compiler.h"
+#include "mymemory.h"
+#include "script.h"
+#include "vmops.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct CarpProgram
+{
+    // Tokens of the compiled script point into mem.scriptFile.
+    MyMemory mem;
+};
+
+struct CarpInstance
+{
+    const Script& script;
+    VMState state;
+};
+
+CarpProgram* carpCompile(const char* source, size_t size)
+{
+    CarpProgram* program = new CarpProgram{};
+    MyMemory& mem = program->mem;
+    Script& script = mem.scripts[addNewScript(mem)];
+    mem.scriptFile.assign((const u8*)source, (const u8*)source + size);
+    mem.scriptFile.push_back('\0');
+    if(!compile(mem, script))
+    {
+        delete program;
+        return nullptr;
+    }
+    return program;
+}
+
+void carpDestroyProgram(CarpProgram* program)
+{
+    delete program;
+}
+
+i32 carpFindFunction(const CarpProgram* program, const char* name)
+{
+    const Script& script = program->mem.scripts[0];
+    for(i32 i = 0; i < script.functions.size(); ++i)
+    {
+        const Function& fn = script.functions[i];
+        if(fn.defined && script.allSymbolNames[fn.functionNameIndex] == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+i32 carpGetParameterCount(const CarpProgram* program, i32 functionIndex)
+{
+    return (i32)program->mem.scripts[0].functions[functionIndex].functionParameterNameIndices.size();
+}
+
+CarpInstance* carpCreateInstance(const CarpProgram* program, const VMOptions& options)
+{
+    CarpInstance* instance = new CarpInstance{.script = program->mem.scripts[0]};
+    VMState& state = instance->state;
+    if(!initVMState(state, instance->script))
+    {
+        delete instance;
+        return nullptr;
+    }
+    state.channels = options.channels;
+    if(runCode(instance->script, state, options) != InterpretResult_Ok)
+    {
+        delete instance;
+        return nullptr;
+    }
+    beginFunctionCalls(instance->script, state, options);
+    return instance;
+}
+
+void carpDestroyInstance(CarpInstance* instance)
+{
+    if(instance != nullptr)
+    {
+        endFunctionCalls(instance->state);
+    }
+    delete instance;
+}
+
+// Function has to take arguments of these types, values or columns. Prints why not.
+template <typename T>
+static bool checkArguments(const Script& script, i32 functionIndex, const T* args, i32 argCount)
+{
+    if(functionIndex < 0 || functionIndex >= script.functions.size() || !script.functions[functionIndex].defined)
+    {
+        fprintf(stderr, "No script function: %i\n", functionIndex);
+        return false;
+    }
+    const Function& fn = script.functions[functionIndex];
+    const char* name = script.allSymbolNames[fn.functionNameIndex].c_str();
+    if(argCount != fn.functionParamenterValueTypes.size())
+    {
+        fprintf(stderr, "Function %s takes %i arguments, got %i\n", name, (i32)fn.functionParamenterValueTypes.size(), argCount);
+        return false;
+    }
+    for(i32 i = 0; i < argCount; ++i)
+    {
+        ValueType type = fn.functionParamenterValueTypes[i].valueType;
+        if(type < ValueTypeBool || type > ValueTypeF64 || args[i].type != type)
+        {
+            fprintf(stderr, "Function %s argument %i needs type: %i, got: %i\n", name, i, type, args[i].type);
+            return false;
+        }
+    }
+    return true;
+}
+
+InterpretResult carpCall(CarpInstance* instance, i32 functionIndex, const CarpValue* args, i32 argCount,
+    CarpValue* outResult)
+{
+    const Script& script = instance->script;
+    VMState& state = instance->state;
+    if(!checkArguments(script, functionIndex, args, argCount))
+    {
+        return InterpretResult_RuntimeError;
+    }
+    // Strings, arrays and structs a pure fn makes are garbage once it returns, other fns can
+    // store them into globals.
+    size_t stringCount = state.stackStrings.size();
+    size_t arrayCount = state.arrays.size();
+    size_t structMemorySize = state.structMemory.size();
+    state.stack.clear();
+    state.stackValueInfo.clear();
+    for(i32 i = 0; i < argCount; ++i)
+    {
+        state.stack.push_back(args[i].value);
+        state.stackValueInfo.push_back({.valueType = args[i].type});
+    }
+
+    InterpretResult result = callFunction(script, state, functionIndex);
+    if(outResult != nullptr)
+    {
+        // Function falling off its end leaves nothing, that is nil.
+        *outResult = {.type = ValueTypeNull, .value = 0};
+        if(result == InterpretResult_Ok && state.stack.size() > 0)
+        {
+            *outResult = {.type = state.stackValueInfo[0].valueType, .value = state.stack[0]};
+        }
+    }
+    if(script.functions[functionIndex].pure)
+    {
+        state.stackStrings.resize(stringCount);
+        trimArrays(state, arrayCount);
+        state.structMemory.resize(structMemorySize);
+    }
+    else if(state.stackStrings.size() > stringCount || state.arrays.size() > arrayCount
+        || state.structMemory.size() > structMemorySize)
+    {
+        releaseCallValues(state, script);
+    }
+    return result;
+}
+
+InterpretResult carpCallBatch(CarpInstance* instance, i32 functionIndex, const CarpColumn* args, i32 argCount,
+    i64 rowCount, CarpColumn results)
+{
+    const Script& script = instance->script;
+    if(!checkArguments(script, functionIndex, args, argCount))
+    {
+        return InterpretResult_RuntimeError;
+    }
+    if(results.type < ValueTypeBool || results.type > ValueTypeF64)
+    {
+        fprintf(stderr, "Results need to be bool or number, got type: %i\n", results.type);
+        return InterpretResult_RuntimeError;
+    }
+    return callFunctionBatch(script, instance->state, functionIndex, args, rowCount, results);
+}
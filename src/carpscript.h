@@ -0,0 +1,98 @@
+#pragma once
+
+// Embedding api of libcarpscript. A program is compiled once from a source buffer and only read
+// after that, so any number of instances can share it. An instance runs the top level once and
+// keeps the globals, then its functions can be called any number of times, each call only runs
+// the function. One thread at a time uses an instance, use an instance for each thread.
+
+#include "common.h"
+#include "mytypes.h"
+#include "vm.h"
+
+#include <string.h> // memcpy
+#include <type_traits>
+
+struct CarpProgram;
+struct CarpInstance;
+
+// Bool or number argument or result, value has the low bytes of the type like on the vm stack.
+// Functions that return nothing give ValueTypeNone or ValueTypeNull.
+struct CarpValue
+{
+    ValueType type;
+    TypeOfValue value;
+};
+
+template <typename T>
+static constexpr ValueType carpValueType()
+{
+    if constexpr(std::is_same_v<T, bool>) return ValueTypeBool;
+    else if constexpr(std::is_same_v<T, i8>) return ValueTypeI8;
+    else if constexpr(std::is_same_v<T, u8>) return ValueTypeU8;
+    else if constexpr(std::is_same_v<T, i16>) return ValueTypeI16;
+    else if constexpr(std::is_same_v<T, u16>) return ValueTypeU16;
+    else if constexpr(std::is_same_v<T, i32>) return ValueTypeI32;
+    else if constexpr(std::is_same_v<T, u32>) return ValueTypeU32;
+    else if constexpr(std::is_same_v<T, i64>) return ValueTypeI64;
+    else if constexpr(std::is_same_v<T, u64>) return ValueTypeU64;
+    else if constexpr(std::is_same_v<T, f32>) return ValueTypeF32;
+    else if constexpr(std::is_same_v<T, f64>) return ValueTypeF64;
+    else return ValueTypeNone;
+}
+
+// Values of one argument or result for every row of a batch, in an array of the type.
+using CarpColumn = ValueColumn;
+
+template <typename T>
+static CarpValue carpValue(T value)
+{
+    static_assert(carpValueType<T>() != ValueTypeNone, "Only bool and number values");
+    CarpValue result = {.type = carpValueType<T>(), .value = 0};
+    memcpy(&result.value, &value, sizeof(T));
+    return result;
+}
+
+// Returns false if the value is of another type.
+template <typename T>
+static bool carpGetValue(const CarpValue& value, T& outValue)
+{
+    if(value.type != carpValueType<T>())
+    {
+        return false;
+    }
+    memcpy(&outValue, &value.value, sizeof(T));
+    return true;
+}
+
+template <typename T>
+static CarpColumn carpColumn(T* values)
+{
+    static_assert(carpValueType<std::remove_const_t<T>>() != ValueTypeNone, "Only bool and number values");
+    return {.type = carpValueType<std::remove_const_t<T>>(), .data = (void*)values};
+}
+
+// Copies the source, size does not include a terminating zero. Returns nullptr and prints the
+// errors if it fails to compile.
+CarpProgram* carpCompile(const char* source, size_t size);
+void carpDestroyProgram(CarpProgram* program);
+
+// Index of the script function to call, -1 if there is no function with the name.
+i32 carpFindFunction(const CarpProgram* program, const char* name);
+i32 carpGetParameterCount(const CarpProgram* program, i32 functionIndex);
+
+// Binds natives and runs the top level of the program. Returns nullptr if either fails.
+// Program has to outlive its instances.
+CarpInstance* carpCreateInstance(const CarpProgram* program, const VMOptions& options = {});
+void carpDestroyInstance(CarpInstance* instance);
+
+// Calls the function with arguments of its parameter types. outResult gets the first value the
+// function returns, results other than bool or number only have their type. Can be nullptr.
+// Strings, arrays and structs the call makes are freed when it returns, unless a global keeps them.
+InterpretResult carpCall(CarpInstance* instance, i32 functionIndex, const CarpValue* args, i32 argCount,
+    CarpValue* outResult);
+
+// Calls the function once for every row, rows read their arguments from args, a column for each
+// parameter. Results gets the first value each row returns and has to be of that type. Checks and
+// frame setup are done once for the batch, only the function runs for each row.
+InterpretResult carpCallBatch(CarpInstance* instance, i32 functionIndex, const CarpColumn* args, i32 argCount,
+    i64 rowCount, CarpColumn results);
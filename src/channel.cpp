@@ -0,0 +1,86 @@
+#include "channel.h"
+
+i32 channelCreate(Channels& channels, ValueType type, u32 capacity)
+{
+    // With one slot, the sequence of a full slot would read as free for the next send.
+    u64 size = 2;
+    while(size < capacity)
+    {
+        size <<= 1;
+    }
+    Channel& channel = channels.channels.emplace_back();
+    channel.type = type;
+    channel.mask = size - 1;
+    channel.slots = std::vector<ChannelSlot>(size);
+    for(u64 i = 0; i < size; ++i)
+    {
+        channel.slots[i].sequence = i;
+    }
+    channel.tail = 0;
+    channel.head = 0;
+    return (i32)channels.channels.size() - 1;
+}
+
+// Slot is free for position pos when its sequence is pos, and holds a value when it is pos + 1.
+bool channelTrySend(Channel& channel, TypeOfValue value, ValueTypeDesc desc)
+{
+    u64 pos = channel.tail.load(std::memory_order_relaxed);
+    ChannelSlot* slot = nullptr;
+    while(true)
+    {
+        slot = &channel.slots[pos & channel.mask];
+        u64 sequence = slot->sequence.load(std::memory_order_acquire);
+        i64 diff = i64(sequence) - i64(pos);
+        if(diff == 0)
+        {
+            if(channel.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = channel.tail.load(std::memory_order_relaxed);
+        }
+    }
+    slot->value = value;
+    slot->desc = desc;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool channelTryRecv(Channel& channel, TypeOfValue& outValue, ValueTypeDesc& outDesc)
+{
+    u64 pos = channel.head.load(std::memory_order_relaxed);
+    ChannelSlot* slot = nullptr;
+    while(true)
+    {
+        slot = &channel.slots[pos & channel.mask];
+        u64 sequence = slot->sequence.load(std::memory_order_acquire);
+        i64 diff = i64(sequence) - i64(pos + 1);
+        if(diff == 0)
+        {
+            if(channel.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = channel.head.load(std::memory_order_relaxed);
+        }
+    }
+    outValue = slot->value;
+    outDesc = slot->desc;
+    // Free for the sender one lap later.
+    slot->sequence.store(pos + channel.mask + 1, std::memory_order_release);
+    return true;
+}
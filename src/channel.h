@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+#include "mytypes.h"
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+// Bounded typed channel between script states running at the same time. Lock free ring
+// buffer with a sequence number in every slot, any number of senders and receivers.
+// Values move as they are, so only value types fit, strings live in the sending state.
+struct ChannelSlot
+{
+    std::atomic<u64> sequence;
+    TypeOfValue value;
+    ValueTypeDesc desc;
+};
+
+struct Channel
+{
+    ValueType type;
+    u64 mask;
+    std::vector<ChannelSlot> slots;
+    // Senders and receivers on their own cache lines.
+    alignas(64) std::atomic<u64> tail;
+    alignas(64) std::atomic<u64> head;
+};
+
+// Created by the host before scripts run, then only read. Scripts refer to channels by index.
+struct Channels
+{
+    std::deque<Channel> channels;
+};
+
+// Capacity is rounded up to a power of two, at least 2. Returns index of the channel.
+i32 channelCreate(Channels& channels, ValueType type, u32 capacity);
+// Both return false when the channel is full or empty, nothing waits.
+bool channelTrySend(Channel& channel, TypeOfValue value, ValueTypeDesc desc);
+bool channelTryRecv(Channel& channel, TypeOfValue& outValue, ValueTypeDesc& outDesc);
@@ -6,7 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 
-void printValue(const Script& script, const u64* value, ValueType type)
+void printValue(const Script& script, const std::vector<std::string>& stackStrings, const u64* value, ValueType type)
 {
     switch(type)
     {
@@ -14,7 +14,7 @@ void printValue(const Script& script, const u64* value, ValueType type)
         case ValueTypeI8: printf("%" PRIi8, *((i8*)value)); break;
         case ValueTypeU8: printf("%" PRIu8, *((u8*)value)); break;
         case ValueTypeI16: printf("%" PRIi16, *((i16*)value)); break;
-        case ValueTypeU16: printf("%" PRIu16, *((i16*)value)); break;
+        case ValueTypeU16: printf("%" PRIu16, *((u16*)value)); break;
         case ValueTypeI32: printf("%" PRIi32, *((i32*)value)); break;
         case ValueTypeU32: printf("%" PRIu32, *((u32*)value)); break;
         case ValueTypeI64: printf("%" PRIi64, *((i64*)value)); break;
@@ -22,7 +22,9 @@ void printValue(const Script& script, const u64* value, ValueType type)
         case ValueTypeF32: printf("%f", *((f32*)value)); break;
         case ValueTypeF64: printf("%f", *((f64*)value)); break;
         case ValueTypeStringLiteral: printf("%s", script.stringLiterals[*value].c_str()); break;
-        case ValueTypeString: printf("%s", script.stackStrings[*value].c_str()); break;
+        case ValueTypeString: printf("%s", stackStrings[*value].c_str()); break;
+        case ValueTypeTask: printf("task %" PRIu32, u32(*value)); break;
+        case ValueTypeArray: printf("array %" PRIu64, *value); break;
 
         break;
 
@@ -8,11 +8,19 @@
 #include <vector>
 
 
+// Disassemble every compiled script, carpbench builds with this off.
+#ifndef DEBUG_PRINT_CODE
 #define DEBUG_PRINT_CODE 1
+#endif
 #define DEBUG_TRACE_EXEC 0
 #define DEBUG_PRINT_LOCALS  0
 #define DEBUG_PRINT_STACK 0
 
+// Per op execution counters for --stats, build with -DCARP_VM_STATS=ON to get them.
+#ifndef VM_STATS
+#define VM_STATS 0
+#endif
+
 struct Script;
 using TypeOfValue = u64;
 
@@ -34,6 +42,10 @@ enum ValueType: u8
     ValueTypeF64,
     ValueTypeStringLiteral,
     ValueTypeString,
+    // Handle to a spawned task, index to VMState tasks.
+    ValueTypeTask,
+    // Typed array, index to VMState arrays.
+    ValueTypeArray,
 
     ValueTypeStruct,
 
@@ -67,7 +79,13 @@ constexpr i32 getValueTypeSizeInBytes(ValueType type)
 {
     switch(type)
     {
+        // Not packed, values are indices or handles in a slot of their own.
         case ValueTypeNone:
+        case ValueTypeNull:
+        case ValueTypeStringLiteral:
+        case ValueTypeString:
+        case ValueTypeTask:
+        case ValueTypeArray:
         case ValueTypeStruct:
         case ValueTypeCount:
             return 0;
@@ -87,6 +105,7 @@ constexpr i32 getValueTypeSizeInBytes(ValueType type)
         case ValueTypeF64:
             return 8;
     }
+    return 0;
 }
 
 constexpr i32 getValueTypeSizeInOpCodes(ValueType type)
@@ -99,12 +118,34 @@ constexpr i32 getValueTypeSizeInOpCodes(ValueType type)
 
 struct ValueTypeDesc
 {
-    u16 structIndex; // If custom type like struct
+    u16 structIndex; // If custom type like struct, index to script structDescs. Element type id for arrays.
     ValueType valueType;
     // How many *s, like *** = 3, direct value = 0
     u8 valueDerefLevel;
 };
 
+// Type as one operand: the value type for bool and numbers, ValueTypeCount + struct index for structs.
+static u16 getTypeId(ValueTypeDesc desc)
+{
+    return desc.valueType == ValueTypeStruct ? u16(ValueTypeCount + desc.structIndex) : u16(desc.valueType);
+}
+static ValueTypeDesc getTypeDesc(u16 typeId)
+{
+    if(typeId >= ValueTypeCount)
+    {
+        return {.structIndex = u16(typeId - ValueTypeCount), .valueType = ValueTypeStruct};
+    }
+    return {.valueType = ValueType(typeId)};
+}
+static ValueTypeDesc getArrayDesc(ValueTypeDesc elementDesc)
+{
+    return {.structIndex = getTypeId(elementDesc), .valueType = ValueTypeArray};
+}
+static ValueTypeDesc getArrayElementDesc(ValueTypeDesc arrayDesc)
+{
+    return getTypeDesc(arrayDesc.structIndex);
+}
+
 
 // Using linear memory, for example 12 functions before needed 47 parameters,
 // parameterMemoryOffset = 47 and parametersCount could be 2.
@@ -125,9 +166,12 @@ struct StructDesc
     // Might take several rounds to evaluate, if component structs.
     // Maybe require define in order. A should not have B inside if B has A.
     u32 structSize;
+    // Largest field alignment, structSize is a multiple of it.
+    u32 structAlignment;
 };
 
-void printValue(const Script& script, const TypeOfValue* value, ValueType type);
+// stackStrings are from VMState, for ValueTypeString values.
+void printValue(const Script& script, const std::vector<std::string>& stackStrings, const TypeOfValue* value, ValueType type);
 std::string getStringFromTokenName(const Token& token);
 bool areTokensSame(const Token& tokenA, const Token& tokenB);
 
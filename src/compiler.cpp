@@ -1,10 +1,15 @@
 #include "compiler.h"
 
+#include "nativefns.h"
 #include "scanner.h"
 
+#include <atomic>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // memcmp
+#include <thread>
+#include <unordered_map>
 
 #if DEBUG_PRINT_CODE
 #include "debug.h"
@@ -14,11 +19,99 @@ struct Parser;
 
 using ParseFn = void(*)(Parser& parser);
 
+struct FunctionBody
+{
+    i32 functionIndex;
+    // Body is from '{' to '}', tokens point into the source.
+    Token openBrace;
+    Token closeBrace;
+    // Globals declared before the fn, only these are visible in the body. -1 until the top
+    // level code reaches the fn.
+    i32 globalCount;
+    std::vector<Token> parameters;
+    // Body is return expression; calling no script fns, callers get the expression compiled in.
+    bool inlinable;
+};
+
+// Expression of a while loop that no iteration changes, computed once before the loop.
+struct LoopHoist
+{
+    // Token before the expression and its last one, to compile it again before the loop.
+    Token before;
+    Token last;
+    Token value;
+    ValueType type;
+};
+
+// Counter times an invariant factor, kept in a hidden value that gets step * factor added
+// whenever the counter steps.
+struct LoopProduct
+{
+    Token counter;
+    Token factor;
+    Token value;
+};
+
+// Step times a factor variable, added to the products of the factor.
+struct LoopStep
+{
+    Token factor;
+    i32 step;
+    Token value;
+};
+
+struct LoopInfo
+{
+    LoopInfo* outer;
+    // Names the loop assigns or declares.
+    std::vector<Token> mutated;
+    // Calls can change any global.
+    bool hasCalls;
+    // Hidden values go to the scope of the loop.
+    i32 structIndex;
+    i32 nextValueName;
+    std::vector<LoopHoist> hoists;
+    std::vector<LoopProduct> products;
+    std::vector<LoopStep> steps;
+};
+
+// Call being compiled into its caller. Parameters are hidden values of the caller, other
+// names are the globals the fn sees.
+struct InlineCall
+{
+    std::vector<Token> parameters;
+    std::vector<Token> values;
+};
+
 struct Parser
 {
     MyMemory& mem;
     Scanner& scanner;
     Script& script;
+    // Has the top level fns and globals. Same as script, except when compiling a fn body segment.
+    const Script& shared;
+    // Top level fn bodies, compiled after the top level code. Null when compiling a fn body.
+    std::vector<FunctionBody>* functionBodies;
+    // Every top level fn body, for inlining. Null in the first pass.
+    const std::vector<FunctionBody>* inlineBodies;
+    // Fn name to index in shared.functions, filled by the first pass.
+    std::unordered_map<std::string, i32>& functionIndices;
+    i32 nextFunctionBody;
+    // How many globals are visible, -1 for all of them.
+    i32 globalCount;
+    // Parallel for body runs as tasks, it has nowhere to return to.
+    bool inParallelFor;
+    // Pure fn body only uses its own values and calls pure fns and natives.
+    bool inPureFn;
+    // Type of the value the last expression left, when known. Field access needs it for
+    // structs and arrays, variables of a known bool or number type get packed.
+    ValueTypeDesc exprType;
+    // Innermost while loop being optimized, null when there is none.
+    LoopInfo* loop;
+    // Last expression only reads values the loop does not change.
+    bool exprInvariant;
+    // Fn body being inlined, null when there is none.
+    const InlineCall* inlined;
     Token previousPrevious;
     Token previous;
     Token current;
@@ -68,10 +161,22 @@ static void variable(Parser& parser);
 static void andFn(Parser& parser);
 static void orFn(Parser& parser);
 static void fnCall(Parser& parser);
+static void spawnFn(Parser& parser);
+static void joinFn(Parser& parser);
+static void sendFn(Parser& parser);
+static void recvFn(Parser& parser);
+static void arrayFn(Parser& parser);
+static void indexFn(Parser& parser);
+static void dotFn(Parser& parser);
 
 static void statement(Parser& parser);
 static void declaration(Parser& parser);
+static void letDeclaration(Parser& parser);
+static void skipPast(Parser& parser, const Token& token);
+static void convertStoredLiteral(Parser& parser, i32 valueStart, ValueTypeDesc type);
 static void printStatement(Parser& parser);
+static i32 identifierConstant(Parser& parser, const Token& token, ValueTypeDesc type = {});
+static void defineVariable(Parser& parser, i32 index, const Token& token);
 
 static void advance(Parser& parser);
 static void callNatFn(Parser& parser);
@@ -107,12 +212,18 @@ static ParseRule getRule(TokenType type)
     switch(type)
     {
         case TokenType::NATCALL:          return {callNatFn,NULL,       PREC_NATCALL};      break;
+        case TokenType::SPAWN:            return {spawnFn,  NULL,       PREC_NONE};         break;
+        case TokenType::JOIN:             return {joinFn,   NULL,       PREC_NONE};         break;
+        case TokenType::SEND:             return {sendFn,   NULL,       PREC_NONE};         break;
+        case TokenType::RECV:             return {recvFn,   NULL,       PREC_NONE};         break;
         case TokenType::LEFT_PAREN:       return {grouping, fnCall,     PREC_CALL};         break;
         case TokenType::RIGHT_PAREN:      return {NULL,     NULL,       PREC_NONE};         break;
         case TokenType::LEFT_BRACE:       return {NULL,     NULL,       PREC_NONE};         break;
+        case TokenType::LEFT_BRACKET:     return {arrayFn,  indexFn,    PREC_CALL};         break;
+        case TokenType::RIGHT_BRACKET:    return {NULL,     NULL,       PREC_NONE};         break;
         case TokenType::RIGHT_BRACE:      return {NULL,     NULL,       PREC_NONE};         break;
         case TokenType::COMMA:            return {NULL,     NULL,       PREC_NONE};         break;
-        case TokenType::DOT:              return {NULL,     NULL,       PREC_NONE};         break;
+        case TokenType::DOT:              return {NULL,     dotFn,      PREC_CALL};         break;
         case TokenType::MINUS:            return {unary,    binary,     PREC_TERM};         break;
         case TokenType::PLUS:             return {NULL,     binary,     PREC_TERM};         break;
         case TokenType::SEMICOLON:        return {NULL,     NULL,       PREC_NONE};         break;
@@ -237,7 +348,7 @@ static void number(Parser& parser)
         i32 value = (i32)strtol((const char*)parser.previous.start, &end, 10);
         emitByteCode(parser, OP_CONSTANT_I32);
         addConstant(parser.script, value, parser.previous.line);
-
+        parser.exprType = {.valueType = ValueTypeI32};
     }
     else
     {
@@ -245,8 +356,9 @@ static void number(Parser& parser)
         f32 value = strtof((const char*)parser.previous.start, &end);
         emitByteCode(parser, OP_CONSTANT_F32);
         addConstant(parser.script, value, parser.previous.line);
-
+        parser.exprType = {.valueType = ValueTypeF32};
     }
+    parser.exprInvariant = true;
 }
 
 static void literal(Parser& parser)
@@ -255,9 +367,11 @@ static void literal(Parser& parser)
     {
         case TokenType::FALSE: emitByteCode(parser, OP_CONSTANT_BOOL);  addConstant(parser.script, false, parser.previous.line); break;
         case TokenType::TRUE:  emitByteCode(parser, OP_CONSTANT_BOOL);  addConstant(parser.script, true, parser.previous.line); break;
-        case TokenType::NIL:   emitByteCode(parser, OP_NIL); break;
+        case TokenType::NIL:   emitByteCode(parser, OP_NIL); parser.exprType = {}; parser.exprInvariant = false; return;
         default: return;
     }
+    parser.exprType = {.valueType = ValueTypeBool};
+    parser.exprInvariant = true;
 }
 
 static i32 emitJump(Parser& parser, Op op)
@@ -286,12 +400,30 @@ static void patchJumpAbsolute(Parser& parser, i32 codeAddressToPatch, i32 absolu
 
 }
 
+// Width specific load or store for a packed value of the type.
+static Op getPackedOp(ValueType type, bool store)
+{
+    i32 width = 0;
+    switch(getValueTypeSizeInBytes(type))
+    {
+        case 1: width = 0; break;
+        case 2: width = 1; break;
+        case 4: width = 2; break;
+        default: width = 3; break;
+    }
+    return Op((store ? OP_STORE_8 : OP_LOAD_8) + width);
+}
+
+// Index is a slot, or a byte offset when packed. For locals both count back from the end
+// of the owning struct stack, globals count from the start.
 static bool findVariableToken(
     const Parser& parser,
     const Token& token,
     i32& outStructIndex,
     i32& outIndex,
-    i32& outDepthChange)
+    i32& outDepthChange,
+    ValueTypeDesc* outType = nullptr,
+    bool* outPacked = nullptr)
 {
     i32 structIndex = outStructIndex;
     std::string searchString = getStringFromTokenName(token);
@@ -299,32 +431,59 @@ static bool findVariableToken(
     outDepthChange = 0;
     while(structIndex != -1)
     {
-        const StructStack& s = parser.script.structStacks[structIndex];
+        // Globals live in the shared script when compiling a fn body segment.
+        const Script& owner = structIndex > 0 ? parser.script : parser.shared;
+        const StructStack& s = owner.structStacks[structIndex];
+        i32 foundIndex = -1;
         if(structIndex > 0)
         {
             for (i32 index = s.structSymbolNameIndices.size() - 1; index >= 0; --index)
             {
-                --backIndex;
-                i32 realIndex = index;
-                if (parser.script.allSymbolNames[s.structSymbolNameIndices[realIndex]] == searchString)
+                if(s.structSymbolLocations[index] >= 0)
+                {
+                    --backIndex;
+                }
+                if (owner.allSymbolNames[s.structSymbolNameIndices[index]] == searchString)
                 {
-                    outIndex = backIndex;
-                    return true;
+                    foundIndex = index;
+                    break;
                 }
             }
         }
         else
         {
-            for (i32 index = 0; index < s.structSymbolNameIndices.size(); ++index)
+            i32 count = (i32)s.structSymbolNameIndices.size();
+            if(parser.globalCount >= 0 && parser.globalCount < count)
             {
-                i32 realIndex = index;
-                if (parser.script.allSymbolNames[s.structSymbolNameIndices[realIndex]] == searchString)
+                count = parser.globalCount;
+            }
+            for (i32 index = 0; index < count; ++index)
+            {
+                if (owner.allSymbolNames[s.structSymbolNameIndices[index]] == searchString)
                 {
-                    outIndex = index; // +backIndex;
-                    return true;
+                    foundIndex = index;
+                    break;
                 }
             }
         }
+        if(foundIndex >= 0)
+        {
+            i32 location = s.structSymbolLocations[foundIndex];
+            if(location >= 0)
+            {
+                outIndex = structIndex > 0 ? backIndex : location;
+            }
+            else
+            {
+                i32 frameBytes = (i32)(s.structPackedValues.size() * sizeof(u64));
+                outIndex = structIndex > 0 ? ~location - frameBytes : ~location;
+            }
+            if(outType)
+                *outType = s.structSymbolTypes[foundIndex];
+            if(outPacked)
+                *outPacked = location < 0;
+            return true;
+        }
         outDepthChange++;
         structIndex = s.parentStructIndex;
         outStructIndex = structIndex;
@@ -332,12 +491,45 @@ static bool findVariableToken(
     return false;
 }
 
-static bool namedVariable(Parser& parser, const Token& token, i32& outStructIndex, i32& outIndex, i32& outDepthChange)
+// Pure fns can not have side effects or wait for anything.
+static void checkNotPure(Parser& parser, const char* what)
+{
+    if(parser.inPureFn)
+    {
+        std::string errorStr = "Pure fn can not use ";
+        errorStr += what;
+        errorStr += ".";
+        errorAt(parser, parser.previous, errorStr.c_str());
+    }
+}
+
+static bool isInlinedValue(const InlineCall& inlined, const Token& token)
+{
+    for(const Token& value : inlined.values)
+    {
+        if(areTokensSame(value, token))
+            return true;
+    }
+    return false;
+}
+
+static bool namedVariable(Parser& parser, const Token& token, i32& outStructIndex, i32& outIndex, i32& outDepthChange,
+    ValueTypeDesc* outType = nullptr, bool* outPacked = nullptr)
 {
     outStructIndex = parser.script.structIndex;
+    if(parser.inlined != nullptr && !isInlinedValue(*parser.inlined, token))
+    {
+        outStructIndex = 0;
+    }
     outIndex = 0;
-    if(findVariableToken(parser, token, outStructIndex, outIndex, outDepthChange))
+    if(findVariableToken(parser, token, outStructIndex, outIndex, outDepthChange, outType, outPacked))
     {
+        if(parser.inPureFn && outStructIndex == 0)
+        {
+            std::string errorStr = "Pure fn can not use global: ";
+            errorStr += getStringFromTokenName(token);
+            errorAt(parser, token, errorStr.c_str());
+        }
         return true;
     }
     std::string searchString = getStringFromTokenName(token);
@@ -348,85 +540,462 @@ static bool namedVariable(Parser& parser, const Token& token, i32& outStructInde
     return false;
 }
 
-static void variable(Parser& parser)
+// Struct types are declared on the top level by the first pass, -1 if the name is not one.
+static i32 findStructType(const Parser& parser, const Token& token)
 {
-    if(check(parser, TokenType::LEFT_PAREN))
-        return;
+    const Script& shared = parser.shared;
+    std::string name = getStringFromTokenName(token);
+    for(i32 i = 0; i < shared.structNameIndices.size(); ++i)
+    {
+        if(shared.allSymbolNames[shared.structNameIndices[i]] == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Name { a: 1, b: 2 }, every field in declaration order.
+static void structLiteral(Parser& parser, i32 structIndex)
+{
+    const Script& shared = parser.shared;
+    const StructDesc& desc = shared.structDescs[structIndex];
+    consume(parser, TokenType::LEFT_BRACE, "Expect '{' after struct name.");
+    for(u16 i = 0; i < desc.parametersCount; ++i)
+    {
+        u32 field = desc.parameterStartIndex + i;
+        consume(parser, TokenType::IDENTIFIER, "Expect field name in struct literal.");
+        if(getStringFromTokenName(parser.previous) != shared.allSymbolNames[shared.structFieldNameIndices[field]])
+        {
+            error(parser, "Struct literal needs every field in declaration order.");
+            return;
+        }
+        consume(parser, TokenType::COLON, "Expect ':' after field name.");
+        i32 valueStart = (i32)parser.script.byteCode.size();
+        expression(parser);
+        convertStoredLiteral(parser, valueStart, shared.structFieldTypes[field]);
+        if(i + 1 < desc.parametersCount)
+        {
+            consume(parser, TokenType::COMMA, "Expect ',' after field value.");
+        }
+    }
+    match(parser, TokenType::COMMA);
+    consume(parser, TokenType::RIGHT_BRACE, "Expect '}' after struct literal.");
+    emitByteCode(parser, OP_STRUCT_LITERAL);
+    emitByteCode(parser, Op(structIndex));
+    parser.exprType = {.structIndex = u16(structIndex), .valueType = ValueTypeStruct};
+}
+
+// Index operand of a variable, patched once every scope is known.
+static void emitVariableIndex(Parser& parser, const Token& token, i32 structIndex, i32 index)
+{
+    parser.script.patchGetters.push_back({
+        .token = token,
+        .currentStructIndex = parser.script.structIndex,
+        .structIndex = structIndex,
+        .byteCodeIndex = i32(parser.script.byteCode.size())
+    });
+    emitByteCode(parser, Op(index));
+}
+
+// Parameter of an inlined body is the hidden value its argument went to.
+static const Token& getInlinedName(const Parser& parser, const Token& token)
+{
+    if(parser.inlined == nullptr)
+        return token;
+    const InlineCall& inlined = *parser.inlined;
+    for(i32 i = 0; i < (i32)inlined.parameters.size(); ++i)
+    {
+        if(areTokensSame(inlined.parameters[i], token))
+            return inlined.values[i];
+    }
+    return token;
+}
+
+// Emits get or set of a named variable. Packed values
+// use the load or store of their width. Returns the type of the variable when known.
+static ValueTypeDesc emitVariableOp(Parser& parser, Op op, const Token& nameToken)
+{
+    const Token& token = getInlinedName(parser, nameToken);
     i32 structIndex = -1;
-    Token previous = parser.previous;
     i32 index = -1;
     i32 depthChange = 0;
-    bool success = namedVariable(parser, previous, structIndex, index, depthChange);
+    ValueTypeDesc type = {};
+    bool packed = false;
+    if(!namedVariable(parser, token, structIndex, index, depthChange, &type, &packed))
+    {
+        return {};
+    }
+    emitByteCode(parser, packed ? getPackedOp(type.valueType, op == OP_SET_GLOBAL) : op);
+    emitVariableIndex(parser, token, structIndex, index);
+    if(packed)
+    {
+        emitByteCode(parser, Op(type.valueType));
+    }
+    return type;
+}
 
+// Names of the hidden values while loops and inlined calls add to a scope, no identifier
+// has a space.
+constexpr i32 LoopValueMax = 256;
+struct HiddenValueNames
+{
+    char names[LoopValueMax][20];
+};
 
-    if(success)
+static constexpr HiddenValueNames makeHiddenValueNames(const char* prefix)
+{
+    HiddenValueNames result = {};
+    for(i32 i = 0; i < LoopValueMax; ++i)
     {
-        //bool popping = structIndex != parser.script.structIndex;
-        //if(popping)
-        //{
-        //    emitByteCode(parser, OP_STACK_SET);
-        //    emitByteCode(parser, Op(structIndex));
-        //}
-        //
-        emitByteCode(parser, OP_GET_GLOBAL);
+        i32 len = 0;
+        for(; prefix[len] != '\0'; ++len)
+            result.names[i][len] = prefix[len];
+        if(i >= 100)
+            result.names[i][len++] = char('0' + i / 100);
+        if(i >= 10)
+            result.names[i][len++] = char('0' + i / 10 % 10);
+        result.names[i][len] = char('0' + i % 10);
+    }
+    return result;
+}
+static constexpr HiddenValueNames loopValueNames = makeHiddenValueNames("loop value ");
+static constexpr HiddenValueNames inlineValueNames = makeHiddenValueNames("inline value ");
 
-        parser.script.patchGetters.push_back({
-                .token = previous,
-                .currentStructIndex = parser.script.structIndex,
-                .structIndex = structIndex,
-                .byteCodeIndex = i32(parser.script.byteCode.size())
-            });
+// Adds a hidden value of the type to the scope of the loop, the caller checks there are names left.
+static Token addLoopValue(Parser& parser, LoopInfo& loop, ValueType type)
+{
+    const char* name = loopValueNames.names[loop.nextValueName++];
+    Token token = {
+        .start = (const u8*)name,
+        .len = (i32)strlen(name),
+        .line = parser.previous.line,
+        .type = TokenType::IDENTIFIER,
+    };
+    i32 structIndex = parser.script.structIndex;
+    parser.script.structIndex = loop.structIndex;
+    identifierConstant(parser, token, {.valueType = type});
+    parser.script.structIndex = structIndex;
+    return token;
+}
 
-        emitByteCode(parser, Op(index));
-        //if(popping)
-        //{
-        //    emitByteCode(parser, OP_STACK_SET);
-        //    emitByteCode(parser, Op(parser.script.structIndex));
-        //
-        //}
+// Variable the loop does not change. Calls can change any global.
+static bool isLoopInvariant(const Parser& parser, const LoopInfo& loop, const Token& token, ValueTypeDesc& outType)
+{
+    for(const Token& name : loop.mutated)
+    {
+        if(areTokensSame(name, token))
+            return false;
     }
-    else
+    i32 structIndex = parser.script.structIndex;
+    i32 index = 0;
+    i32 depthChange = 0;
+    if(!findVariableToken(parser, token, structIndex, index, depthChange, &outType))
+        return false;
+    return !loop.hasCalls || structIndex != 0;
+}
+
+// Removes the code from codeStart on, a hidden value or a converted constant replaces it.
+static void dropCode(Parser& parser, i32 codeStart)
+{
+    Script& script = parser.script;
+    while(!script.patchGetters.empty() && script.patchGetters.back().byteCodeIndex >= codeStart)
+    {
+        script.patchGetters.pop_back();
+    }
+    script.byteCode.resize(codeStart);
+    script.byteCodeLines.resize(codeStart);
+}
+
+template <typename T>
+static void emitConstant(Parser& parser, ValueType type, T value)
+{
+    emitByteCode(parser, Op(OP_CONSTANT_BOOL + (type - ValueTypeBool)));
+    addConstant(parser.script, value, parser.previous.line);
+}
+
+// Number literals are only i32 or f32 and there are no casts, so a literal stored into a field or
+// element of another number type, from valueStart on, becomes a constant of that type. Other
+// values are checked when stored.
+static void convertStoredLiteral(Parser& parser, i32 valueStart, ValueTypeDesc type)
+{
+    const std::vector<OpCodeType>& byteCode = parser.script.byteCode;
+    ValueType target = type.valueType;
+    i32 length = (i32)byteCode.size() - valueStart;
+    bool negate = length == 3 && byteCode.back() == OP_NEGATE;
+    bool isFloat = parser.previous.type == TokenType::NUMBER;
+    if((length != 2 && !negate) || (parser.previous.type != TokenType::INTEGER && !isFloat)
+        || (byteCode[valueStart] != OP_CONSTANT_I32 && byteCode[valueStart] != OP_CONSTANT_F32)
+        || target < ValueTypeI8 || target > ValueTypeF64 || target == (isFloat ? ValueTypeF32 : ValueTypeI32))
+    {
+        return;
+    }
+    const char* text = (const char*)parser.previous.start;
+    if(target >= ValueTypeF32)
+    {
+        f64 value = isFloat ? strtod(text, nullptr) : f64(strtoull(text, nullptr, 10));
+        value = negate ? -value : value;
+        dropCode(parser, valueStart);
+        if(target == ValueTypeF32)
+            emitConstant(parser, target, f32(value));
+        else
+            emitConstant(parser, target, value);
+        parser.exprType = type;
+        return;
+    }
+    if(isFloat)
+    {
+        std::string errorStr = "Float literal cannot be stored into integer type: ";
+        errorStr += ValueTypeNames[target];
+        error(parser, errorStr.c_str());
+        return;
+    }
+    errno = 0;
+    u64 magnitude = strtoull(text, nullptr, 10);
+    i32 bits = getValueTypeSizeInBytes(target) * 8;
+    bool isSigned = target == ValueTypeI8 || target == ValueTypeI16 || target == ValueTypeI32 || target == ValueTypeI64;
+    u64 max = isSigned ? (~0ull >> (65 - bits)) + (negate ? 1 : 0) : (negate ? 0 : ~0ull >> (64 - bits));
+    if(errno == ERANGE || magnitude > max)
+    {
+        std::string errorStr = "Integer literal does not fit into type: ";
+        errorStr += ValueTypeNames[target];
+        error(parser, errorStr.c_str());
+        return;
+    }
+    u64 value = negate ? 0 - magnitude : magnitude;
+    dropCode(parser, valueStart);
+    switch(target)
+    {
+        case ValueTypeI8: emitConstant(parser, target, i8(value)); break;
+        case ValueTypeU8: emitConstant(parser, target, u8(value)); break;
+        case ValueTypeI16: emitConstant(parser, target, i16(value)); break;
+        case ValueTypeU16: emitConstant(parser, target, u16(value)); break;
+        case ValueTypeU32: emitConstant(parser, target, u32(value)); break;
+        case ValueTypeI64: emitConstant(parser, target, i64(value)); break;
+        default: emitConstant(parser, target, value); break;
+    }
+    parser.exprType = type;
+}
+
+// Invariant expression from after before to the previous token, its code from codeStart is
+// replaced with a load of a hidden value computed before the loop.
+static void hoistLoopInvariant(Parser& parser, const Token& before, i32 codeStart)
+{
+    LoopInfo& loop = *parser.loop;
+    ValueType type = parser.exprType.valueType;
+    if(type < ValueTypeBool || type > ValueTypeF64 || loop.nextValueName >= LoopValueMax)
+        return;
+    // Parts of it hoisted before are computed by it now.
+    Token value = {};
+    while(!loop.hoists.empty() && loop.hoists.back().before.start >= before.start
+        && loop.hoists.back().last.start <= parser.previous.start)
+    {
+        if(loop.hoists.back().type == type)
+            value = loop.hoists.back().value;
+        loop.hoists.pop_back();
+    }
+    if(value.len == 0)
+        value = addLoopValue(parser, loop, type);
+    dropCode(parser, codeStart);
+    emitVariableOp(parser, OP_GET_GLOBAL, value);
+    loop.hoists.push_back({.before = before, .last = parser.previous, .value = value, .type = type});
+}
+
+// counter * factor of a loop product, its code from codeStart loads the hidden value instead.
+static bool reduceLoopProduct(Parser& parser, const Token& left, const Token& right, i32 codeStart)
+{
+    for(const LoopInfo* loop = parser.loop; loop != nullptr; loop = loop->outer)
+    {
+        for(const LoopProduct& product : loop->products)
+        {
+            if((areTokensSame(product.counter, left) && areTokensSame(product.factor, right))
+                || (areTokensSame(product.counter, right) && areTokensSame(product.factor, left)))
+            {
+                dropCode(parser, codeStart);
+                emitVariableOp(parser, OP_GET_GLOBAL, product.value);
+                parser.exprType = {.valueType = ValueTypeI32};
+                parser.exprInvariant = false;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static i32 getIntegerToken(const Token& token)
+{
+    char* end;
+    return (i32)strtol((const char*)token.start, &end, 10);
+}
+
+// After counter = counter +/- integer, adds step * factor to the products of the counter.
+static void emitLoopProductSteps(Parser& parser, const Token& counter)
+{
+    if(parser.previous.type != TokenType::INTEGER)
+        return;
+    i32 step = getIntegerToken(parser.previous);
+    if(parser.previousPrevious.type == TokenType::MINUS)
+        step = -step;
+    for(const LoopInfo* loop = parser.loop; loop != nullptr; loop = loop->outer)
+    {
+        for(const LoopProduct& product : loop->products)
+        {
+            if(!areTokensSame(product.counter, counter))
+                continue;
+            emitVariableOp(parser, OP_GET_GLOBAL, product.value);
+            if(product.factor.type == TokenType::INTEGER)
+            {
+                emitByteCode(parser, OP_CONSTANT_I32);
+                addConstant(parser.script, i32(u32(step) * u32(getIntegerToken(product.factor))), parser.previous.line);
+            }
+            else
+            {
+                for(const LoopStep& loopStep : loop->steps)
+                {
+                    if(loopStep.step == step && areTokensSame(loopStep.factor, product.factor))
+                    {
+                        emitVariableOp(parser, OP_GET_GLOBAL, loopStep.value);
+                        break;
+                    }
+                }
+            }
+            emitByteCode(parser, OP_ADD);
+            emitVariableOp(parser, OP_SET_GLOBAL, product.value);
+            emitByteCode(parser, OP_POP);
+        }
+    }
+}
+
+static void variable(Parser& parser)
+{
+    parser.exprType = {};
+    parser.exprInvariant = false;
+    if(check(parser, TokenType::LEFT_PAREN))
+        return;
+    Token previous = parser.previous;
+    i32 literalStructIndex = findStructType(parser, previous);
+    if(literalStructIndex >= 0 && check(parser, TokenType::LEFT_BRACE))
     {
-        errorAt(parser, previous, "failed to find proper parsing thingy for getter");
+        structLiteral(parser, literalStructIndex);
+        return;
+    }
+    parser.exprType = emitVariableOp(parser, OP_GET_GLOBAL, previous);
+    if(parser.loop != nullptr)
+    {
+        ValueTypeDesc type = {};
+        parser.exprInvariant = isLoopInvariant(parser, *parser.loop, previous, type);
     }
 }
 
+// Value is either side, so the type is known only when both have the same one.
 static void andFn(Parser& parser)
 {
+    ValueTypeDesc leftType = parser.exprType;
     i32 endJmp = emitJump(parser, OP_JUMP_IF_FALSE);
     emitByteCode(parser, OP_POP);
 
     parsePrecedence(parser, PREC_AND);
     patchJump(parser, endJmp);
+    if(memcmp(&leftType, &parser.exprType, sizeof(leftType)) != 0)
+        parser.exprType = {};
 }
 
 static void orFn(Parser& parser)
 {
+    ValueTypeDesc leftType = parser.exprType;
     i32 endJmp = emitJump(parser, OP_JUMP_IF_TRUE);
     emitByteCode(parser, OP_POP);
 
     parsePrecedence(parser, PREC_OR);
     patchJump(parser, endJmp);
+    if(memcmp(&leftType, &parser.exprType, sizeof(leftType)) != 0)
+        parser.exprType = {};
+}
+
+// Hidden values per type for the parameters of inlined calls.
+constexpr i32 InlineValueMax = 16;
+
+// Hidden value an argument of an inlined call goes to, in the outermost scope of the caller
+// below the globals. No two inlined bodies run at once, so every call reuses them.
+static Token getInlineValue(Parser& parser, ValueType type, i32 number)
+{
+    const char* name = inlineValueNames.names[(type - ValueTypeBool) * InlineValueMax + number];
+    Token token = {
+        .start = (const u8*)name,
+        .len = (i32)strlen(name),
+        .line = parser.previous.line,
+        .type = TokenType::IDENTIFIER,
+    };
+    // Parallel for chunks each run their own scope.
+    i32 structIndex = parser.script.structIndex;
+    while(!parser.inParallelFor && parser.script.structStacks[structIndex].parentStructIndex > 0)
+    {
+        structIndex = parser.script.structStacks[structIndex].parentStructIndex;
+    }
+    const StructStack& sta = parser.script.structStacks[structIndex];
+    for(u32 nameIndex : sta.structSymbolNameIndices)
+    {
+        if(parser.script.allSymbolNames[nameIndex] == name)
+            return token;
+    }
+    i32 currentStructIndex = parser.script.structIndex;
+    parser.script.structIndex = structIndex;
+    identifierConstant(parser, token, {.valueType = type});
+    parser.script.structIndex = currentStructIndex;
+    return token;
+}
+
+// Compiles a call of a fn whose body is return expression; as the expression. Arguments on
+// the stack get stored to hidden values that stand in for the parameters.
+static void inlineCall(Parser& parser, const Function& func, const FunctionBody& body)
+{
+    InlineCall inlined = {.parameters = body.parameters};
+    i32 typeCounts[ValueTypeF64 - ValueTypeBool + 1] = {};
+    for(i32 i = 0; i < (i32)body.parameters.size(); ++i)
+    {
+        ValueType type = func.functionParamenterValueTypes[i].valueType;
+        inlined.values.push_back(getInlineValue(parser, type, typeCounts[type - ValueTypeBool]++));
+    }
+    for(i32 i = (i32)body.parameters.size() - 1; i >= 0; --i)
+    {
+        emitVariableOp(parser, OP_SET_GLOBAL, inlined.values[i]);
+        emitByteCode(parser, OP_POP);
+    }
+
+    Token resume = parser.previous;
+    i32 callerGlobalCount = parser.globalCount;
+    LoopInfo* callerLoop = parser.loop;
+    const u8* callerSrcEnd = parser.scanner.srcEnd;
+    parser.globalCount = body.globalCount;
+    parser.loop = nullptr;
+    parser.inlined = &inlined;
+    parser.scanner.srcEnd = body.closeBrace.start + body.closeBrace.len;
+
+    skipPast(parser, body.openBrace);
+    consume(parser, TokenType::RETURN, "Expect return in inlined function.");
+    expression(parser);
+    ValueTypeDesc type = parser.exprType;
+
+    parser.globalCount = callerGlobalCount;
+    parser.loop = callerLoop;
+    parser.inlined = nullptr;
+    parser.scanner.srcEnd = callerSrcEnd;
+    skipPast(parser, resume);
+    parser.exprType = type;
+    parser.exprInvariant = false;
 }
 
 static void fnCall(Parser& parser)
 {
+    parser.exprType = {};
     if(parser.previousPrevious.type != TokenType::IDENTIFIER)
     {
         errorAt(parser, parser.previousPrevious, "Expected function name identifier for calling function.");
     }
 
     std::string findStr = getStringFromTokenName(parser.previousPrevious);
-    i32 functionIndex = -1;
-    for(i32 i = 0; i < parser.script.functions.size(); ++i)
-    {
-        i32 realIndex = parser.script.functions[i].functionNameIndex;
-        if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == findStr)
-        {
-            functionIndex = i;
-            break;
-        }
-    }
+    auto found = parser.functionIndices.find(findStr);
+    i32 functionIndex = found != parser.functionIndices.end() ? found->second : -1;
     if(functionIndex == -1)
     {
         std::string errStr = "Function ";
@@ -436,7 +1005,11 @@ static void fnCall(Parser& parser)
     }
     else
     {
-        const Function& func = parser.script.functions[functionIndex];
+        const Function& func = parser.shared.functions[functionIndex];
+        if(parser.inPureFn && !func.pure)
+        {
+            errorAt(parser, parser.previousPrevious, "Pure fn can only call pure fns.");
+        }
         //i32 currentAddress = parser.script.byteCode.size();
         //emitByteCode(parser, OP_CONSTANT_I32);
         //i32 constantAddressPosition = addConstant(parser.script, currentAddress, parser.previous.line);
@@ -461,6 +1034,34 @@ static void fnCall(Parser& parser)
             errTxt += " parameters.";
             errorAtCurrent(parser, errTxt.c_str());
         }
+        // Bodies the top level has not reached yet get called, their visible globals are not
+        // known. So do calls from the top level scope and of fns with other than number parameters.
+        const FunctionBody* body = func.defined && parser.inlineBodies != nullptr
+            ? &(*parser.inlineBodies)[func.bodyIndex] : nullptr;
+        bool inlinable = body != nullptr && body->inlinable && body->globalCount >= 0
+            && body->parameters.size() == paramCount && paramCount <= InlineValueMax
+            && func.functionParamenterValueTypes.size() == paramCount && parser.script.structIndex > 0
+            && parser.inlined == nullptr && !parser.hadError;
+        for(const ValueTypeDesc& type : func.functionParamenterValueTypes)
+        {
+            inlinable = inlinable && type.valueType >= ValueTypeBool && type.valueType <= ValueTypeF64;
+        }
+        if(inlinable)
+        {
+            inlineCall(parser, func, *body);
+            return;
+        }
+        // Cached result of a pure fn skips the call.
+        i32 memoJump = -1;
+        if(func.pure)
+        {
+            emitByteCode(parser, OP_MEMO_LOOKUP);
+            emitByteCode(parser, Op(functionIndex));
+            emitByteCode(parser, Op(paramCount));
+            memoJump = (i32)parser.script.byteCode.size();
+            emitByteCode(parser, Op(0xffff));
+            emitByteCode(parser, Op(0xffff));
+        }
         emitByteCode(parser, OP_CODE_PUSH_RETURN_ADDRESS);
         i32 returnAddress = (i32)parser.script.byteCode.size() + 5;
         emitByteCode(parser, Op(returnAddress & 0xffff));
@@ -470,27 +1071,26 @@ static void fnCall(Parser& parser)
         //parser.script.functionReturnAddresses.push_back((i32)parser.script.byteCode.size());
         //parser.script.constants.structValueArray[constantAddressPosition] = parser.script.byteCode.size();
         parser.script.patchFunctions.push_back({.functionIndex = functionIndex, .addressToPatch = jmpPoint});
+        if(func.pure)
+        {
+            emitByteCode(parser, OP_MEMO_STORE);
+            emitByteCode(parser, Op(functionIndex));
+            emitByteCode(parser, Op(paramCount));
+            patchJump(parser, memoJump);
+        }
     }
 }
 
-static void callNatFn(Parser& parser)
+static void spawnFn(Parser& parser)
 {
-    if(parser.current.type != TokenType::IDENTIFIER)
-    {
-        errorAt(parser, parser.current, "Expected function name identifier for native calling function.");
-    }
-    Token currentToken = parser.current;
-    i32 foundIndex = -1;
-    for(i32 i = 0; i < parser.script.nativePatchFunctions.size(); ++i)
-    {
-        if(areTokensSame(currentToken, parser.script.nativePatchFunctions[i].token))
-        {
-            foundIndex = i;
-            break;
-        }
-    }
-    consume(parser, TokenType::IDENTIFIER, "Expected function name");
-    consume(parser, TokenType::LEFT_PAREN, "Expected '(' after function name");
+    checkNotPure(parser, "spawn");
+    consume(parser, TokenType::IDENTIFIER, "Expect function name after 'spawn'.");
+    Token nameToken = parser.previous;
+    std::string findStr = getStringFromTokenName(nameToken);
+    auto found = parser.functionIndices.find(findStr);
+    i32 functionIndex = found != parser.functionIndices.end() ? found->second : -1;
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after function name.");
+
     i32 paramCount = 0;
     if(!check(parser, TokenType::RIGHT_PAREN))
     {
@@ -502,37 +1102,321 @@ static void callNatFn(Parser& parser)
 
     }
     consume(parser, TokenType::RIGHT_PAREN, "Expected ')' after function arguments");
-    if(foundIndex != -1)
+    if(functionIndex == -1)
     {
-        NativePatchFunction &fn = parser.script.nativePatchFunctions[foundIndex];
-        if(fn.parameterTypes.size() != paramCount)
-        {
-            std::string errTxt = "Expected parameter count: ";
-            errTxt += std::to_string(fn.parameterTypes.size());
-            errTxt += " got ";
-            errTxt += std::to_string(paramCount);
-            errTxt += " parameters.";
-            errorAtCurrent(parser, errTxt.c_str());
-        }
+        std::string errStr = "Function ";
+        errStr += findStr;
+        errStr += " has not been declared.";
+        errorAt(parser, nameToken, errStr.c_str());
+        return;
     }
-    else
+    const Function& func = parser.shared.functions[functionIndex];
+    if(func.functionParameterNameIndices.size() != paramCount)
     {
-        parser.script.nativePatchFunctions.push_back({});
-        foundIndex = parser.script.nativePatchFunctions.size() - 1;
-        for(int i = 0; i < paramCount; ++i)
-        {
-            // TODO: fix the actual types?
-            parser.script.nativePatchFunctions[foundIndex].parameterTypes.push_back({});
-        }
-        parser.script.nativePatchFunctions[foundIndex].token = currentToken;
-        parser.script.nativePatchFunctions[foundIndex].callFn = nullptr;
+        std::string errTxt = "Expected parameter count: ";
+        errTxt += std::to_string(func.functionParameterNameIndices.size());
+        errTxt += " got ";
+        errTxt += std::to_string(paramCount);
+        errTxt += " parameters.";
+        errorAtCurrent(parser, errTxt.c_str());
     }
-    emitByteCode(parser, OP_NATIVE_CALL);
-    emitByteCode(parser, Op(foundIndex));
+    emitByteCode(parser, OP_SPAWN);
+    emitByteCode(parser, Op(functionIndex));
 }
 
-
-static void string(Parser& parser)
+static void joinFn(Parser& parser)
+{
+    checkNotPure(parser, "join");
+    parsePrecedence(parser, Precedence::PREC_UNARY);
+    emitByteCode(parser, OP_JOIN);
+}
+
+// send(channel, value), channel is an index to the channels the host bound.
+static void sendFn(Parser& parser)
+{
+    checkNotPure(parser, "send");
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'send'.");
+    expression(parser);
+    consume(parser, TokenType::COMMA, "Expect ',' after channel.");
+    expression(parser);
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after value to send.");
+    emitByteCode(parser, OP_SEND);
+}
+
+// recv(channel)
+static void recvFn(Parser& parser)
+{
+    checkNotPure(parser, "recv");
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'recv'.");
+    expression(parser);
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after channel.");
+    emitByteCode(parser, OP_RECV);
+}
+
+// Types fields and arrays can have, bools, numbers and declared structs.
+static bool matchValueType(Parser& parser, ValueTypeDesc& outType)
+{
+    ValueType type = ValueTypeNone;
+    switch(parser.current.type)
+    {
+        case TokenType::BOOL: type = ValueTypeBool; break;
+        case TokenType::I8: type = ValueTypeI8; break;
+        case TokenType::U8: type = ValueTypeU8; break;
+        case TokenType::I16: type = ValueTypeI16; break;
+        case TokenType::U16: type = ValueTypeU16; break;
+        case TokenType::I32: type = ValueTypeI32; break;
+        case TokenType::U32: type = ValueTypeU32; break;
+        case TokenType::I64: type = ValueTypeI64; break;
+        case TokenType::U64: type = ValueTypeU64; break;
+        case TokenType::F32: type = ValueTypeF32; break;
+        case TokenType::F64: type = ValueTypeF64; break;
+        case TokenType::IDENTIFIER:
+        {
+            i32 structIndex = findStructType(parser, parser.current);
+            if(structIndex < 0)
+            {
+                return false;
+            }
+            advance(parser);
+            outType = {.structIndex = u16(structIndex), .valueType = ValueTypeStruct};
+            return true;
+        }
+        default: return false;
+    }
+    advance(parser);
+    outType = {.valueType = type};
+    return true;
+}
+
+// [f32; count] makes a zeroed array, [a, b, c] an array of the values.
+static void arrayFn(Parser& parser)
+{
+    ValueTypeDesc elementType = {};
+    // [Point; n] has a struct name where [p, q] has a variable.
+    bool isType = !check(parser, TokenType::IDENTIFIER) || check2(parser, TokenType::SEMICOLON);
+    if(isType && matchValueType(parser, elementType))
+    {
+        consume(parser, TokenType::SEMICOLON, "Expect ';' after array element type.");
+        expression(parser);
+        consume(parser, TokenType::RIGHT_BRACKET, "Expect ']' after array count.");
+        emitByteCode(parser, OP_ARRAY_NEW);
+        emitByteCode(parser, Op(getTypeId(elementType)));
+        parser.exprType = getArrayDesc(elementType);
+        return;
+    }
+    i32 count = 0;
+    if(!check(parser, TokenType::RIGHT_BRACKET))
+    {
+        do {
+            expression(parser);
+            if(count == 0 && parser.exprType.valueType == ValueTypeStruct)
+            {
+                elementType = parser.exprType;
+            }
+            ++count;
+
+        } while(match(parser, TokenType::COMMA));
+    }
+    consume(parser, TokenType::RIGHT_BRACKET, "Expect ']' after array elements.");
+    if(count > 0xffff)
+    {
+        error(parser, "Too many elements in array literal.");
+    }
+    emitByteCode(parser, OP_ARRAY_LITERAL);
+    emitByteCode(parser, Op(count));
+    parser.exprType = getArrayDesc(elementType);
+}
+
+// Resolves .a.b after the '.' of a value of struct type. Nested field offsets add up to one,
+// so the whole path is a single field op.
+static bool parseFieldPath(Parser& parser, ValueTypeDesc& inOutType, u16& outOffset)
+{
+    const Script& shared = parser.shared;
+    u32 offset = 0;
+    do
+    {
+        if(inOutType.valueType != ValueTypeStruct)
+        {
+            error(parser, "Field access needs a struct of known type.");
+            return false;
+        }
+        consume(parser, TokenType::IDENTIFIER, "Expect field name after '.'.");
+        const StructDesc& desc = shared.structDescs[inOutType.structIndex];
+        std::string name = getStringFromTokenName(parser.previous);
+        i32 field = -1;
+        for(u16 i = 0; i < desc.parametersCount; ++i)
+        {
+            if(shared.allSymbolNames[shared.structFieldNameIndices[desc.parameterStartIndex + i]] == name)
+            {
+                field = desc.parameterStartIndex + i;
+                break;
+            }
+        }
+        if(field == -1)
+        {
+            std::string errStr = "Struct ";
+            errStr += shared.allSymbolNames[shared.structNameIndices[inOutType.structIndex]];
+            errStr += " has no field ";
+            errStr += name;
+            error(parser, errStr.c_str());
+            return false;
+        }
+        offset += shared.structFieldOffsets[field];
+        inOutType = shared.structFieldTypes[field];
+    } while(match(parser, TokenType::DOT));
+    outOffset = u16(offset);
+    return true;
+}
+
+static void emitFieldOp(Parser& parser, Op op, u16 structIndex, u16 offset, ValueTypeDesc fieldType)
+{
+    emitByteCode(parser, op);
+    emitByteCode(parser, Op(structIndex));
+    emitByteCode(parser, Op(offset));
+    emitByteCode(parser, Op(getTypeId(fieldType)));
+}
+
+// struct.field, or struct.field = value.
+static void dotFn(Parser& parser)
+{
+    ValueTypeDesc structType = parser.exprType;
+    ValueTypeDesc fieldType = structType;
+    u16 offset = 0;
+    if(!parseFieldPath(parser, fieldType, offset))
+    {
+        return;
+    }
+    if(match(parser, TokenType::EQUAL))
+    {
+        i32 valueStart = (i32)parser.script.byteCode.size();
+        expression(parser);
+        convertStoredLiteral(parser, valueStart, fieldType);
+        emitFieldOp(parser, OP_FIELD_SET, structType.structIndex, offset, fieldType);
+        parser.exprType = {};
+        return;
+    }
+    emitFieldOp(parser, OP_FIELD_GET, structType.structIndex, offset, fieldType);
+    parser.exprType = fieldType;
+}
+
+// array[index], or array[index] = value. Fields of struct elements are read and written
+// in place, array[index].field.
+static void indexFn(Parser& parser)
+{
+    ValueTypeDesc elementType = parser.exprType.valueType == ValueTypeArray
+        ? getArrayElementDesc(parser.exprType) : ValueTypeDesc{};
+    expression(parser);
+    consume(parser, TokenType::RIGHT_BRACKET, "Expect ']' after index.");
+    if(match(parser, TokenType::DOT))
+    {
+        ValueTypeDesc fieldType = elementType;
+        u16 offset = 0;
+        if(!parseFieldPath(parser, fieldType, offset))
+        {
+            return;
+        }
+        if(match(parser, TokenType::EQUAL))
+        {
+            i32 valueStart = (i32)parser.script.byteCode.size();
+            expression(parser);
+            convertStoredLiteral(parser, valueStart, fieldType);
+            emitFieldOp(parser, OP_ARRAY_FIELD_SET, elementType.structIndex, offset, fieldType);
+            parser.exprType = {};
+            return;
+        }
+        emitFieldOp(parser, OP_ARRAY_FIELD_GET, elementType.structIndex, offset, fieldType);
+        parser.exprType = fieldType;
+        return;
+    }
+    if(match(parser, TokenType::EQUAL))
+    {
+        i32 valueStart = (i32)parser.script.byteCode.size();
+        expression(parser);
+        convertStoredLiteral(parser, valueStart, elementType);
+        emitByteCode(parser, OP_ARRAY_SET);
+        parser.exprType = {};
+        return;
+    }
+    emitByteCode(parser, OP_ARRAY_GET);
+    parser.exprType = elementType;
+}
+
+static bool isPureNative(const Token& token)
+{
+    std::string name = getStringFromTokenName(token);
+    for(const NativeBinding& binding : NativeBindings)
+    {
+        if(name == binding.name)
+        {
+            return binding.pure;
+        }
+    }
+    return false;
+}
+
+static void callNatFn(Parser& parser)
+{
+    if(parser.current.type != TokenType::IDENTIFIER)
+    {
+        errorAt(parser, parser.current, "Expected function name identifier for native calling function.");
+    }
+    Token currentToken = parser.current;
+    i32 foundIndex = -1;
+    for(i32 i = 0; i < parser.script.nativePatchFunctions.size(); ++i)
+    {
+        if(areTokensSame(currentToken, parser.script.nativePatchFunctions[i].token))
+        {
+            foundIndex = i;
+            break;
+        }
+    }
+    consume(parser, TokenType::IDENTIFIER, "Expected function name");
+    if(parser.inPureFn && !isPureNative(currentToken))
+    {
+        errorAt(parser, currentToken, "Pure fn can only call pure natives.");
+    }
+    consume(parser, TokenType::LEFT_PAREN, "Expected '(' after function name");
+    i32 paramCount = 0;
+    if(!check(parser, TokenType::RIGHT_PAREN))
+    {
+        do {
+            expression(parser);
+            ++paramCount;
+
+        } while(match(parser, TokenType::COMMA));
+
+    }
+    consume(parser, TokenType::RIGHT_PAREN, "Expected ')' after function arguments");
+    if(foundIndex != -1)
+    {
+        NativePatchFunction &fn = parser.script.nativePatchFunctions[foundIndex];
+        if(fn.parameterTypes.size() != paramCount)
+        {
+            std::string errTxt = "Expected parameter count: ";
+            errTxt += std::to_string(fn.parameterTypes.size());
+            errTxt += " got ";
+            errTxt += std::to_string(paramCount);
+            errTxt += " parameters.";
+            errorAtCurrent(parser, errTxt.c_str());
+        }
+    }
+    else
+    {
+        parser.script.nativePatchFunctions.push_back({});
+        foundIndex = parser.script.nativePatchFunctions.size() - 1;
+        for(int i = 0; i < paramCount; ++i)
+        {
+            // TODO: fix the actual types?
+            parser.script.nativePatchFunctions[foundIndex].parameterTypes.push_back({});
+        }
+        parser.script.nativePatchFunctions[foundIndex].token = currentToken;
+    }
+    emitByteCode(parser, OP_NATIVE_CALL);
+    emitByteCode(parser, Op(foundIndex));
+}
+
+
+static void string(Parser& parser)
 {
     std::string s = std::string((const char*)parser.previous.start + 1, parser.previous.len - 2);
 
@@ -552,11 +1436,19 @@ static void unary(Parser& parser)
     TokenType operatorType = parser.previous.type;
 
     parsePrecedence(parser, Precedence::PREC_UNARY);
+    ValueType type = parser.exprType.valueType;
 
     switch(operatorType)
     {
-        case TokenType::BANG:  emitByteCode(parser, OP_NOT); break;
-        case TokenType::MINUS: emitByteCode(parser, OP_NEGATE); break;
+        case TokenType::BANG:
+            emitByteCode(parser, OP_NOT);
+            parser.exprType = {.valueType = ValueTypeBool};
+            parser.exprInvariant = parser.exprInvariant && type == ValueTypeBool;
+            break;
+        case TokenType::MINUS:
+            emitByteCode(parser, OP_NEGATE);
+            parser.exprInvariant = parser.exprInvariant && type >= ValueTypeI8 && type <= ValueTypeF64;
+            break;
         default: return;
     }
 };
@@ -565,7 +1457,23 @@ static void binary(Parser& parser)
 {
     TokenType operatorType = parser.previous.type;
     const ParseRule& rule = getRule(operatorType);
+    // Both sides need the same type, arithmetic keeps it and comparisons give a bool.
+    ValueTypeDesc leftType = parser.exprType;
+    bool leftInvariant = parser.exprInvariant;
     parsePrecedence(parser, Precedence(rule.precedence + 1));
+    bool isNumber = leftType.valueType >= ValueTypeI8 && leftType.valueType <= ValueTypeF64;
+    // Hoisting runs the op before the loop, so it must be one that cannot fail: same types
+    // and no integer division by anything but a nonzero literal.
+    bool isEquality = operatorType == TokenType::EQUAL_EQUAL || operatorType == TokenType::BANG_EQUAL;
+    parser.exprInvariant = leftInvariant && parser.exprInvariant && parser.exprType.valueType == leftType.valueType
+        && (isNumber || (isEquality && leftType.valueType == ValueTypeBool));
+    if(operatorType == TokenType::SLASH && leftType.valueType < ValueTypeF32
+        && (parser.previousPrevious.type != TokenType::SLASH || parser.previous.type != TokenType::INTEGER
+            || getIntegerToken(parser.previous) == 0))
+    {
+        parser.exprInvariant = false;
+    }
+    parser.exprType = {.valueType = ValueTypeBool};
 
     switch(operatorType)
     {
@@ -576,17 +1484,62 @@ static void binary(Parser& parser)
         case TokenType::LESSER:         emitByteCode(parser, OP_LESSER); break;
         case TokenType::LESSER_EQUAL:   emitBytes(parser, OP_GREATER, OP_NOT); break;
 
-        case TokenType::PLUS:  emitByteCode(parser, OP_ADD); break;
-        case TokenType::MINUS: emitByteCode(parser, OP_SUB); break;
-        case TokenType::STAR:  emitByteCode(parser, OP_MUL); break;
-        case TokenType::SLASH: emitByteCode(parser, OP_DIV); break;
-        default: return;
+        case TokenType::PLUS:  emitByteCode(parser, OP_ADD); parser.exprType = isNumber ? leftType : ValueTypeDesc{}; break;
+        case TokenType::MINUS: emitByteCode(parser, OP_SUB); parser.exprType = isNumber ? leftType : ValueTypeDesc{}; break;
+        case TokenType::STAR:  emitByteCode(parser, OP_MUL); parser.exprType = isNumber ? leftType : ValueTypeDesc{}; break;
+        case TokenType::SLASH: emitByteCode(parser, OP_DIV); parser.exprType = isNumber ? leftType : ValueTypeDesc{}; break;
+        default: parser.exprType = {}; return;
     }
 }
 
 
+// Rules that set the type of the value they leave, others leave no known type.
+static bool setsExprType(ParseFn fn)
+{
+    return fn == variable || fn == grouping || fn == arrayFn || fn == indexFn || fn == dotFn
+        || fn == number || fn == literal || fn == unary || fn == binary || fn == andFn || fn == orFn
+        || fn == fnCall;
+}
+
+// Rules that tell if their value is loop invariant, others never are.
+static bool setsExprInvariant(ParseFn fn)
+{
+    return fn == variable || fn == grouping || fn == number || fn == literal || fn == unary || fn == binary;
+}
+
+// Operators after an operand, as long as they bind at least as tight as precedence. The operand
+// starts after the before token, its code at codeStart. Inside a while loop invariant parts
+// get hoisted and counter products reduced.
+static void parseInfix(Parser& parser, Precedence precedence, const Token& before, i32 codeStart)
+{
+    while(precedence <= getRule(parser.current.type).precedence)
+    {
+        bool singleToken = parser.previousPrevious.start == before.start;
+        Token left = parser.previous;
+        advance(parser);
+        Token op = parser.previous;
+        ParseFn infixRule = getRule(op.type).infix;
+        infixRule(parser);
+        if(!setsExprType(infixRule))
+            parser.exprType = {};
+        if(!setsExprInvariant(infixRule))
+            parser.exprInvariant = false;
+        if(parser.loop == nullptr)
+            continue;
+        if(singleToken && op.type == TokenType::STAR && parser.previousPrevious.start == op.start
+            && reduceLoopProduct(parser, left, parser.previous, codeStart))
+        {
+            continue;
+        }
+        if(parser.exprInvariant)
+            hoistLoopInvariant(parser, before, codeStart);
+    }
+}
+
 static void parsePrecedence(Parser& parser, Precedence precedence)
 {
+    Token before = parser.previous;
+    i32 codeStart = (i32)parser.script.byteCode.size();
     advance(parser);
     ParseFn prefixRule = getRule(parser.previous.type).prefix;
     if(prefixRule == nullptr)
@@ -595,12 +1548,12 @@ static void parsePrecedence(Parser& parser, Precedence precedence)
         return;
     }
     prefixRule(parser);
+    if(!setsExprType(prefixRule))
+        parser.exprType = {};
+    if(!setsExprInvariant(prefixRule))
+        parser.exprInvariant = false;
 
-    while(precedence <= getRule(parser.current.type).precedence)
-    {
-        advance(parser);
-        getRule(parser.previous.type).infix(parser);
-    }
+    parseInfix(parser, precedence, before, codeStart);
 }
 
 static void expression(Parser& parser)
@@ -612,42 +1565,12 @@ static void expression(Parser& parser)
         advance(parser);
 
         expression(parser);
-
-        i32 structIndex = -1;
-        i32 index = -1;
-        i32 depthChange = 0;
-        bool success = namedVariable(parser, previousToken, structIndex, index, depthChange);
-
-        if(success)
-        {
-            //bool popping = structIndex != parser.script.structIndex;
-            //if(popping)
-            //{
-            //    emitByteCode(parser, OP_STACK_SET);
-            //    emitByteCode(parser, Op(structIndex));
-            //
-            //}
-            emitByteCode(parser, OP_SET_GLOBAL);
-
-            parser.script.patchGetters.push_back({
-                .token = previousToken,
-                .currentStructIndex = parser.script.structIndex,
-                .structIndex = structIndex,
-                .byteCodeIndex = i32(parser.script.byteCode.size())
-            });
-
-            emitByteCode(parser, Op(index));
-            //if(popping)
-            //{
-            //    emitByteCode(parser, OP_STACK_SET);
-            //    emitByteCode(parser, Op(parser.script.structIndex));
-            //
-            //}
-        }
-        else
-        {
-            errorAt(parser, previousToken, "failed to find proper parsing thingy for assignment");
-        }
+        ValueTypeDesc type = parser.exprType;
+        emitVariableOp(parser, OP_SET_GLOBAL, previousToken);
+        if(parser.loop != nullptr)
+            emitLoopProductSteps(parser, previousToken);
+        parser.exprType = type;
+        parser.exprInvariant = false;
     }
     else
     {
@@ -728,50 +1651,682 @@ static void emitLoop(Parser& parser, i32 loopStart)
     emitByteCode(parser, Op((offset >> 16) & 0xffff));
 }
 
-static void whileStatement(Parser& parser)
+// Reads the tokens of a while loop ahead, from its condition to the end of its body, and
+// rewinds. False when the body is not a block.
+static bool scanLoop(Parser& parser, std::vector<Token>& tokens)
 {
-    i32 loopStart = (i32)parser.script.byteCode.size();
-    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
-    expression(parser);
-    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after 'while' condition.");
-
-    i32 exitJmp = emitJump(parser, OP_JUMP_IF_FALSE);
-    emitByteCode(parser, OP_POP);
-    statement(parser);
-    emitLoop(parser, loopStart);
+    Token whileToken = parser.previous;
+    i32 depth = 0;
+    bool inBody = false;
+    bool isBlock = false;
+    while(!check(parser, TokenType::END_OF_FILE))
+    {
+        TokenType type = parser.current.type;
+        tokens.push_back(parser.current);
+        advance(parser);
+        if(type == TokenType::LEFT_PAREN || type == TokenType::LEFT_BRACE || type == TokenType::LEFT_BRACKET)
+            ++depth;
+        else if(type == TokenType::RIGHT_PAREN || type == TokenType::RIGHT_BRACE || type == TokenType::RIGHT_BRACKET)
+            --depth;
+        if(depth > 0)
+            continue;
+        if(inBody)
+            break;
+        inBody = true;
+        isBlock = check(parser, TokenType::LEFT_BRACE);
+        if(!isBlock)
+            break;
+    }
+    skipPast(parser, whileToken);
+    return isBlock && depth == 0;
+}
 
-    patchJump(parser, exitJmp);
-    emitByteCode(parser, OP_POP);
+static TokenType getTokenType(const std::vector<Token>& tokens, i32 index)
+{
+    return index >= 0 && index < (i32)tokens.size() ? tokens[index].type : TokenType::END_OF_FILE;
 }
 
+// Every change of the variable in the loop is name = name +/- integer;
+static bool isLoopCounter(const std::vector<Token>& tokens, const Token& name)
+{
+    bool stepped = false;
+    for(i32 i = 0; i < (i32)tokens.size(); ++i)
+    {
+        if(tokens[i].type != TokenType::IDENTIFIER || !areTokensSame(tokens[i], name))
+            continue;
+        TokenType next = getTokenType(tokens, i + 1);
+        if(next == TokenType::IN || next == TokenType::DOT || next == TokenType::LEFT_BRACKET
+            || getTokenType(tokens, i - 1) == TokenType::LET || getTokenType(tokens, i - 1) == TokenType::DOT)
+        {
+            return false;
+        }
+        if(next != TokenType::EQUAL)
+            continue;
+        TokenType op = getTokenType(tokens, i + 3);
+        if(getTokenType(tokens, i + 2) != TokenType::IDENTIFIER || !areTokensSame(tokens[i + 2], name)
+            || (op != TokenType::PLUS && op != TokenType::MINUS)
+            || getTokenType(tokens, i + 4) != TokenType::INTEGER || getTokenType(tokens, i + 5) != TokenType::SEMICOLON)
+        {
+            return false;
+        }
+        stepped = true;
+    }
+    return stepped;
+}
 
+// Counter stepped only by constants, packed i32 so the products can add in place.
+static bool isLoopProductCounter(const Parser& parser, const LoopInfo& loop, const std::vector<Token>& tokens, const Token& token)
+{
+    if(token.type != TokenType::IDENTIFIER || !isLoopCounter(tokens, token))
+        return false;
+    i32 structIndex = parser.script.structIndex;
+    i32 index = 0;
+    i32 depthChange = 0;
+    ValueTypeDesc type = {};
+    bool packed = false;
+    if(!findVariableToken(parser, token, structIndex, index, depthChange, &type, &packed))
+        return false;
+    return packed && type.valueType == ValueTypeI32 && (!loop.hasCalls || structIndex != 0);
+}
 
+static bool isLoopProductFactor(const Parser& parser, const LoopInfo& loop, const Token& token)
+{
+    ValueTypeDesc type = {};
+    return token.type == TokenType::INTEGER
+        || (token.type == TokenType::IDENTIFIER && isLoopInvariant(parser, loop, token, type) && type.valueType == ValueTypeI32);
+}
 
+static bool isLoopInvariantOperand(const Parser& parser, const LoopInfo& loop, const Token& token)
+{
+    ValueTypeDesc type = {};
+    return token.type == TokenType::INTEGER || token.type == TokenType::NUMBER
+        || (token.type == TokenType::IDENTIFIER && isLoopInvariant(parser, loop, token, type));
+}
 
-static void statement(Parser& parser)
+// Finds what the loop changes and the counter products it can keep up to date with additions.
+// False when there is nothing for hoisting or reducing.
+static bool analyzeLoop(const Parser& parser, LoopInfo& loop, const std::vector<Token>& tokens)
 {
-    if(match(parser, TokenType::PRINT))
+    i32 count = (i32)tokens.size();
+    for(i32 i = 0; i < count; ++i)
     {
-        printStatement(parser);
+        TokenType next = getTokenType(tokens, i + 1);
+        switch(tokens[i].type)
+        {
+            case TokenType::PARALLEL:
+                return false;
+            case TokenType::NATCALL:
+            case TokenType::SPAWN:
+            case TokenType::JOIN:
+            case TokenType::SEND:
+            case TokenType::RECV:
+            case TokenType::YIELD:
+                loop.hasCalls = true;
+                break;
+            case TokenType::LET:
+                if(next == TokenType::IDENTIFIER)
+                    loop.mutated.push_back(tokens[i + 1]);
+                break;
+            case TokenType::IDENTIFIER:
+                if(next == TokenType::LEFT_PAREN)
+                    loop.hasCalls = true;
+                else if(next == TokenType::EQUAL || next == TokenType::IN || next == TokenType::DOT
+                    || next == TokenType::LEFT_BRACKET)
+                    loop.mutated.push_back(tokens[i]);
+                break;
+            default:
+                break;
+        }
     }
-    else if(match(parser, TokenType::RETURN))
+
+    bool hasInvariant = false;
+    for(i32 i = 1; i + 1 < count; ++i)
     {
-        if(match(parser, TokenType::SEMICOLON))
+        TokenType type = tokens[i].type;
+        bool isBinary = type == TokenType::PLUS || type == TokenType::MINUS || type == TokenType::STAR
+            || type == TokenType::SLASH || type == TokenType::LESSER || type == TokenType::LESSER_EQUAL
+            || type == TokenType::GREATER || type == TokenType::GREATER_EQUAL
+            || type == TokenType::EQUAL_EQUAL || type == TokenType::BANG_EQUAL;
+        if(!isBinary)
+            continue;
+        const Token& left = tokens[i - 1];
+        const Token& right = tokens[i + 1];
+        if((left.type == TokenType::RIGHT_PAREN || isLoopInvariantOperand(parser, loop, left))
+            && (right.type == TokenType::LEFT_PAREN || right.type == TokenType::MINUS || right.type == TokenType::BANG
+                || isLoopInvariantOperand(parser, loop, right)))
         {
-            i32 structIndex = parser.script.structIndex;
-            while(structIndex > 0)
-            {
-                emitByteCode(parser, OP_STACK_POP);
-                structIndex = parser.script.structStacks[structIndex].parentStructIndex;
-            }
-            emitReturn(parser);
+            hasInvariant = true;
+        }
+        // Only a product of single tokens, not a part of a longer term or a call.
+        TokenType beforeLeft = getTokenType(tokens, i - 2);
+        TokenType afterRight = getTokenType(tokens, i + 2);
+        if(type != TokenType::STAR || beforeLeft == TokenType::STAR || beforeLeft == TokenType::SLASH
+            || beforeLeft == TokenType::DOT || afterRight == TokenType::LEFT_PAREN
+            || afterRight == TokenType::LEFT_BRACKET || afterRight == TokenType::DOT)
+        {
+            continue;
         }
+        LoopProduct product = {};
+        if(isLoopProductCounter(parser, loop, tokens, left) && isLoopProductFactor(parser, loop, right))
+            product = {.counter = left, .factor = right};
+        else if(isLoopProductCounter(parser, loop, tokens, right) && isLoopProductFactor(parser, loop, left))
+            product = {.counter = right, .factor = left};
         else
+            continue;
+        bool found = false;
+        for(const LoopProduct& other : loop.products)
         {
-            expression(parser);
-            consume(parser, TokenType::SEMICOLON, "Expected ';' after return expression.");
-            i32 structIndex = parser.script.structIndex;
-            while(structIndex > 0)
+            found = found || (areTokensSame(other.counter, product.counter) && areTokensSame(other.factor, product.factor));
+        }
+        if(!found)
+            loop.products.push_back(product);
+    }
+
+    // Steps of a factor variable, one for each different step of the counter.
+    for(const LoopProduct& product : loop.products)
+    {
+        if(product.factor.type != TokenType::IDENTIFIER)
+            continue;
+        for(i32 i = 0; i + 4 < count; ++i)
+        {
+            if(tokens[i].type != TokenType::IDENTIFIER || tokens[i + 1].type != TokenType::EQUAL
+                || !areTokensSame(tokens[i], product.counter))
+            {
+                continue;
+            }
+            i32 step = getIntegerToken(tokens[i + 4]);
+            if(tokens[i + 3].type == TokenType::MINUS)
+                step = -step;
+            bool found = false;
+            for(const LoopStep& other : loop.steps)
+            {
+                found = found || (other.step == step && areTokensSame(other.factor, product.factor));
+            }
+            if(!found)
+                loop.steps.push_back({.factor = product.factor, .step = step});
+        }
+    }
+    return hasInvariant || !loop.products.empty();
+}
+
+// Computes the hidden values before the first iteration. Hoisted expressions are compiled
+// again from their tokens.
+static void emitLoopValues(Parser& parser, const LoopInfo& loop)
+{
+    Token resume = parser.previous;
+    for(const LoopHoist& hoist : loop.hoists)
+    {
+        skipPast(parser, hoist.before);
+        advance(parser);
+        getRule(parser.previous.type).prefix(parser);
+        while(parser.previous.start != hoist.last.start && parser.previous.type != TokenType::END_OF_FILE)
+        {
+            advance(parser);
+            getRule(parser.previous.type).infix(parser);
+        }
+        emitVariableOp(parser, OP_SET_GLOBAL, hoist.value);
+        emitByteCode(parser, OP_POP);
+    }
+    if(!loop.hoists.empty())
+        skipPast(parser, resume);
+    for(const LoopProduct& product : loop.products)
+    {
+        emitVariableOp(parser, OP_GET_GLOBAL, product.counter);
+        if(product.factor.type == TokenType::INTEGER)
+        {
+            emitByteCode(parser, OP_CONSTANT_I32);
+            addConstant(parser.script, getIntegerToken(product.factor), parser.previous.line);
+        }
+        else
+        {
+            emitVariableOp(parser, OP_GET_GLOBAL, product.factor);
+        }
+        emitByteCode(parser, OP_MUL);
+        emitVariableOp(parser, OP_SET_GLOBAL, product.value);
+        emitByteCode(parser, OP_POP);
+    }
+    for(const LoopStep& step : loop.steps)
+    {
+        emitVariableOp(parser, OP_GET_GLOBAL, step.factor);
+        emitByteCode(parser, OP_CONSTANT_I32);
+        addConstant(parser.script, step.step, parser.previous.line);
+        emitByteCode(parser, OP_MUL);
+        emitVariableOp(parser, OP_SET_GLOBAL, step.value);
+        emitByteCode(parser, OP_POP);
+    }
+}
+
+// A while loop with a block body that has invariant expressions or counter products gets a
+// scope of its own for the hidden values, and a preheader computing them that runs first:
+// jump to preheader, condition, body, jump to condition, preheader, jump to condition.
+static void whileStatement(Parser& parser)
+{
+    std::vector<Token> tokens;
+    LoopInfo loop = {
+        .outer = parser.loop,
+        .nextValueName = parser.loop != nullptr ? parser.loop->nextValueName : 0,
+    };
+    bool optimized = scanLoop(parser, tokens) && analyzeLoop(parser, loop, tokens);
+    i32 preheaderJump = -1;
+    if(optimized)
+    {
+        beginScope(parser);
+        loop.structIndex = parser.script.structIndex;
+        // Products whose hidden values do not fit are left as they are.
+        std::vector<LoopProduct> products;
+        products.swap(loop.products);
+        for(LoopProduct& product : products)
+        {
+            if(loop.nextValueName + 1 + (i32)loop.steps.size() > LoopValueMax)
+                break;
+            product.value = addLoopValue(parser, loop, ValueTypeI32);
+            loop.products.push_back(product);
+        }
+        for(LoopStep& step : loop.steps)
+        {
+            if(loop.nextValueName < LoopValueMax)
+                step.value = addLoopValue(parser, loop, ValueTypeI32);
+        }
+        parser.loop = &loop;
+        preheaderJump = emitJump(parser, OP_JUMP);
+    }
+
+    i32 loopStart = (i32)parser.script.byteCode.size();
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after 'while' condition.");
+
+    i32 exitJmp = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByteCode(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    if(optimized)
+    {
+        parser.loop = nullptr;
+        patchJump(parser, preheaderJump);
+        emitLoopValues(parser, loop);
+        emitLoop(parser, loopStart);
+        parser.loop = loop.outer;
+    }
+
+    patchJump(parser, exitJmp);
+    emitByteCode(parser, OP_POP);
+    if(optimized)
+        endScope(parser);
+}
+
+// parallel for (i in start..end) sum(a) min(b) max(c) { ... }
+// Body is compiled inline as a block that runs one chunk of the range and leaves the
+// reduction values on the stack. Reduction variables are chunk locals starting from the
+// identity, other writes to outer variables stay inside the chunk.
+static void parallelForStatement(Parser& parser)
+{
+    static const char forEndName[] = "for end";
+    consume(parser, TokenType::FOR, "Expect 'for' after 'parallel'.");
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
+    consume(parser, TokenType::IDENTIFIER, "Expect loop variable name.");
+    Token indexToken = parser.previous;
+    consume(parser, TokenType::IN, "Expect 'in' after loop variable.");
+    expression(parser);
+    consume(parser, TokenType::DOT_DOT, "Expect '..' in range.");
+    expression(parser);
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after range.");
+
+    Token reductionTokens[ParallelReductionMaxCount];
+    u16 reductions = 0;
+    i32 reductionCount = 0;
+    while(check(parser, TokenType::IDENTIFIER))
+    {
+        std::string name = getStringFromTokenName(parser.current);
+        ParallelReduction kind = ParallelReduction_Sum;
+        if(name == "min")
+            kind = ParallelReduction_Min;
+        else if(name == "max")
+            kind = ParallelReduction_Max;
+        else if(name != "sum")
+        {
+            errorAtCurrent(parser, "Expect sum, min or max reduction.");
+            return;
+        }
+        if(reductionCount >= ParallelReductionMaxCount)
+        {
+            errorAtCurrent(parser, "Too many reductions in parallel for.");
+            return;
+        }
+        advance(parser);
+        consume(parser, TokenType::LEFT_PAREN, "Expect '(' after reduction.");
+        consume(parser, TokenType::IDENTIFIER, "Expect variable name to reduce into.");
+        reductionTokens[reductionCount] = parser.previous;
+        consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after reduction variable.");
+        emitVariableOp(parser, OP_GET_GLOBAL, reductionTokens[reductionCount]);
+        reductions |= u16(kind << (4 + reductionCount * 2));
+        ++reductionCount;
+    }
+    reductions |= u16(reductionCount);
+
+    emitByteCode(parser, OP_PARALLEL_FOR);
+    i32 bodyOffset = (i32)parser.script.byteCode.size();
+    emitByteCode(parser, Op(0));
+    emitByteCode(parser, Op(0));
+    emitByteCode(parser, Op(reductions));
+    for(i32 i = reductionCount - 1; i >= 0; --i)
+    {
+        emitVariableOp(parser, OP_SET_GLOBAL, reductionTokens[i]);
+        emitByteCode(parser, OP_POP);
+    }
+    i32 skipBody = emitJump(parser, OP_JUMP);
+
+    // Body start, relative to the end of OP_PARALLEL_FOR so fn body relocation does not touch it.
+    i32 bodyStart = (i32)parser.script.byteCode.size() - bodyOffset - 3;
+    parser.script.byteCode[bodyOffset + 0] = bodyStart & 0xffff;
+    parser.script.byteCode[bodyOffset + 1] = (bodyStart >> 16) & 0xffff;
+
+    consume(parser, TokenType::LEFT_BRACE, "Expect '{' before parallel for body.");
+    beginScope(parser);
+    // Task stack has chunk start, chunk end and the reduction identities.
+    Token forEndToken = {
+        .start = (const u8*)forEndName,
+        .len = (i32)sizeof(forEndName) - 1,
+        .line = indexToken.line,
+        .type = TokenType::IDENTIFIER,
+    };
+    for(i32 i = reductionCount - 1; i >= 0; --i)
+    {
+        defineVariable(parser, identifierConstant(parser, reductionTokens[i]), reductionTokens[i]);
+    }
+    defineVariable(parser, identifierConstant(parser, forEndToken), forEndToken);
+    defineVariable(parser, identifierConstant(parser, indexToken), indexToken);
+
+    i32 loopStart = (i32)parser.script.byteCode.size();
+    emitVariableOp(parser, OP_GET_GLOBAL, indexToken);
+    emitVariableOp(parser, OP_GET_GLOBAL, forEndToken);
+    emitByteCode(parser, OP_LESSER);
+    i32 exitJmp = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByteCode(parser, OP_POP);
+
+    bool wasInParallelFor = parser.inParallelFor;
+    parser.inParallelFor = true;
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+    parser.inParallelFor = wasInParallelFor;
+
+    emitVariableOp(parser, OP_GET_GLOBAL, indexToken);
+    emitByteCode(parser, OP_CONSTANT_I32);
+    addConstant(parser.script, 1, parser.previous.line);
+    emitByteCode(parser, OP_ADD);
+    emitVariableOp(parser, OP_SET_GLOBAL, indexToken);
+    emitByteCode(parser, OP_POP);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJmp);
+    emitByteCode(parser, OP_POP);
+    for(i32 i = 0; i < reductionCount; ++i)
+    {
+        emitVariableOp(parser, OP_GET_GLOBAL, reductionTokens[i]);
+    }
+    endScope(parser);
+    emitByteCode(parser, OP_RETURN);
+
+    patchJump(parser, skipBody);
+}
+
+// Packed integer counter the OP_FOR_LOOP can step, type is none for others.
+static ValueType getForCounterType(Parser& parser, const Token& counter)
+{
+    i32 structIndex = -1;
+    i32 index = -1;
+    i32 depthChange = 0;
+    ValueTypeDesc type = {};
+    bool packed = false;
+    if(!namedVariable(parser, counter, structIndex, index, depthChange, &type, &packed) || !packed
+        || type.valueType < ValueTypeI8 || type.valueType > ValueTypeU64)
+    {
+        return ValueTypeNone;
+    }
+    return type.valueType;
+}
+
+// Pushes the limit again and steps the counter, jumping back to the body while it is in range.
+// Limit is an integer literal or a variable.
+static void emitForLoop(Parser& parser, const Token& counter, const Token& limit, i16 step, i32 bodyStart)
+{
+    if(limit.type == TokenType::INTEGER)
+    {
+        char* end;
+        emitByteCode(parser, OP_CONSTANT_I32);
+        addConstant(parser.script, (i32)strtol((const char*)limit.start, &end, 10), limit.line);
+    }
+    else
+    {
+        emitVariableOp(parser, OP_GET_GLOBAL, limit);
+    }
+    i32 structIndex = -1;
+    i32 index = -1;
+    i32 depthChange = 0;
+    ValueTypeDesc type = {};
+    namedVariable(parser, counter, structIndex, index, depthChange, &type);
+    emitByteCode(parser, OP_FOR_LOOP);
+    emitVariableIndex(parser, counter, structIndex, index);
+    emitByteCode(parser, Op(type.valueType));
+    emitByteCode(parser, Op(u16(step)));
+    i64 offset = bodyStart - (i32)parser.script.byteCode.size() - 2;
+    if(offset > INT32_MAX || offset < INT32_MIN)
+    {
+        error(parser, "Loop body jump too large.");
+    }
+    emitByteCode(parser, Op(offset & 0xffff));
+    emitByteCode(parser, Op((offset >> 16) & 0xffff));
+}
+
+// Body starts after the condition, exit jump pops the condition. A stepped loop falls out of
+// the OP_FOR_LOOP with nothing to pop.
+static void endForLoop(Parser& parser, i32 exitJump, bool stepped)
+{
+    i32 doneJump = stepped ? emitJump(parser, OP_JUMP) : -1;
+    if(exitJump >= 0)
+    {
+        patchJump(parser, exitJump);
+        emitByteCode(parser, OP_POP);
+    }
+    if(doneJump >= 0)
+    {
+        patchJump(parser, doneJump);
+    }
+}
+
+// for (i in start..end), counts up by one.
+static void rangeForStatement(Parser& parser)
+{
+    static const char forEndName[] = "for end";
+    consume(parser, TokenType::IDENTIFIER, "Expect loop variable name.");
+    Token counter = parser.previous;
+    consume(parser, TokenType::IN, "Expect 'in' after loop variable.");
+    expression(parser);
+    defineVariable(parser, identifierConstant(parser, counter, parser.exprType), counter);
+    consume(parser, TokenType::DOT_DOT, "Expect '..' in range.");
+    expression(parser);
+    Token forEndToken = {
+        .start = (const u8*)forEndName,
+        .len = (i32)sizeof(forEndName) - 1,
+        .line = counter.line,
+        .type = TokenType::IDENTIFIER,
+    };
+    defineVariable(parser, identifierConstant(parser, forEndToken, parser.exprType), forEndToken);
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after range.");
+
+    i32 loopStart = (i32)parser.script.byteCode.size();
+    emitVariableOp(parser, OP_GET_GLOBAL, counter);
+    emitVariableOp(parser, OP_GET_GLOBAL, forEndToken);
+    emitByteCode(parser, OP_LESSER);
+    i32 exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByteCode(parser, OP_POP);
+
+    i32 bodyStart = (i32)parser.script.byteCode.size();
+    statement(parser);
+
+    bool stepped = getForCounterType(parser, counter) != ValueTypeNone;
+    if(stepped)
+    {
+        emitForLoop(parser, counter, forEndToken, 1, bodyStart);
+    }
+    else
+    {
+        emitVariableOp(parser, OP_GET_GLOBAL, counter);
+        emitByteCode(parser, OP_CONSTANT_I32);
+        addConstant(parser.script, 1, parser.previous.line);
+        emitByteCode(parser, OP_ADD);
+        emitVariableOp(parser, OP_SET_GLOBAL, counter);
+        emitByteCode(parser, OP_POP);
+        emitLoop(parser, loopStart);
+    }
+    endForLoop(parser, exitJump, stepped);
+}
+
+// for (let i = 0; i < n; i = i + 1). When the condition compares the counter to a literal or
+// variable and the increment adds a literal to it, the loop steps with OP_FOR_LOOP. Otherwise
+// the increment is compiled after the body, like in a while loop.
+static void countedForStatement(Parser& parser)
+{
+    Token counter = {};
+    if(match(parser, TokenType::LET))
+    {
+        counter = parser.current;
+        letDeclaration(parser);
+    }
+    else if(!match(parser, TokenType::SEMICOLON))
+    {
+        expressionStatement(parser);
+    }
+
+    i32 loopStart = (i32)parser.script.byteCode.size();
+    i32 exitJump = -1;
+    Token limit = {};
+    bool countsUp = false;
+    bool hasLimit = false;
+    if(!match(parser, TokenType::SEMICOLON))
+    {
+        if(counter.len > 0 && check(parser, TokenType::IDENTIFIER) && areTokensSame(parser.current, counter)
+            && (check2(parser, TokenType::LESSER) || check2(parser, TokenType::GREATER)))
+        {
+            Token before = parser.previous;
+            i32 codeStart = (i32)parser.script.byteCode.size();
+            advance(parser);
+            variable(parser);
+            advance(parser);
+            countsUp = parser.previous.type == TokenType::LESSER;
+            hasLimit = (check(parser, TokenType::INTEGER) || check(parser, TokenType::IDENTIFIER))
+                && check2(parser, TokenType::SEMICOLON);
+            limit = parser.current;
+            binary(parser);
+            parseInfix(parser, PREC_ASSIGNMENT, before, codeStart);
+        }
+        else
+        {
+            expression(parser);
+        }
+        consume(parser, TokenType::SEMICOLON, "Expect ';' after loop condition.");
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByteCode(parser, OP_POP);
+    }
+
+    // Increment is skipped for now, only checking if it is counter = counter +/- literal.
+    Token incrementStart = parser.previous;
+    Token tokens[5];
+    i32 tokenCount = 0;
+    i32 depth = 0;
+    while((depth > 0 || !check(parser, TokenType::RIGHT_PAREN)) && !check(parser, TokenType::END_OF_FILE))
+    {
+        if(check(parser, TokenType::LEFT_PAREN))
+            ++depth;
+        else if(check(parser, TokenType::RIGHT_PAREN))
+            --depth;
+        if(tokenCount < 5)
+            tokens[tokenCount] = parser.current;
+        ++tokenCount;
+        advance(parser);
+    }
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+    i32 step = 0;
+    if(hasLimit && tokenCount == 5
+        && areTokensSame(tokens[0], counter) && tokens[1].type == TokenType::EQUAL
+        && areTokensSame(tokens[2], counter) && tokens[4].type == TokenType::INTEGER)
+    {
+        char* end;
+        i32 value = (i32)strtol((const char*)tokens[4].start, &end, 10);
+        step = tokens[3].type == TokenType::PLUS ? value : tokens[3].type == TokenType::MINUS ? -value : 0;
+    }
+    // Step literal is an i32, so only an i32 counter adds it without a type error.
+    bool stepped = step != 0 && step >= INT16_MIN && step <= INT16_MAX && (step > 0) == countsUp
+        && getForCounterType(parser, counter) == ValueTypeI32;
+
+    i32 bodyStart = (i32)parser.script.byteCode.size();
+    statement(parser);
+
+    if(stepped)
+    {
+        emitForLoop(parser, counter, limit, i16(step), bodyStart);
+    }
+    else
+    {
+        if(tokenCount > 0)
+        {
+            Token bodyEnd = parser.previous;
+            skipPast(parser, incrementStart);
+            expression(parser);
+            emitByteCode(parser, OP_POP);
+            skipPast(parser, bodyEnd);
+        }
+        emitLoop(parser, loopStart);
+    }
+    endForLoop(parser, exitJump, stepped);
+}
+
+static void forStatement(Parser& parser)
+{
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
+    // Loop variables are in a scope of their own.
+    beginScope(parser);
+    if(check(parser, TokenType::IDENTIFIER) && check2(parser, TokenType::IN))
+    {
+        rangeForStatement(parser);
+    }
+    else
+    {
+        countedForStatement(parser);
+    }
+    endScope(parser);
+}
+
+static void statement(Parser& parser)
+{
+    if(match(parser, TokenType::PRINT))
+    {
+        printStatement(parser);
+    }
+    else if(match(parser, TokenType::RETURN))
+    {
+        if(parser.inParallelFor)
+        {
+            error(parser, "Cannot return from parallel for body.");
+        }
+        if(match(parser, TokenType::SEMICOLON))
+        {
+            i32 structIndex = parser.script.structIndex;
+            while(structIndex > 0)
+            {
+                emitByteCode(parser, OP_STACK_POP);
+                structIndex = parser.script.structStacks[structIndex].parentStructIndex;
+            }
+            emitReturn(parser);
+        }
+        else
+        {
+            expression(parser);
+            consume(parser, TokenType::SEMICOLON, "Expected ';' after return expression.");
+            i32 structIndex = parser.script.structIndex;
+            while(structIndex > 0)
             {
                 emitByteCode(parser, OP_STACK_POP);
                 structIndex = parser.script.structStacks[structIndex].parentStructIndex;
@@ -781,321 +2336,847 @@ static void statement(Parser& parser)
     }
     else if(match(parser, TokenType::IF))
     {
-        ifStatement(parser);
+        ifStatement(parser);
+    }
+    else if(match(parser, TokenType::WHILE))
+    {
+        whileStatement(parser);
+    }
+    else if(match(parser, TokenType::FOR))
+    {
+        forStatement(parser);
+    }
+    else if(match(parser, TokenType::PARALLEL))
+    {
+        checkNotPure(parser, "parallel for");
+        parallelForStatement(parser);
+    }
+    else if(match(parser, TokenType::YIELD))
+    {
+        checkNotPure(parser, "yield");
+        consume(parser, TokenType::SEMICOLON, "Expect ';' after 'yield'.");
+        emitByteCode(parser, OP_YIELD);
+    }
+    else if(match(parser, TokenType::LEFT_BRACE))
+    {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+    }
+    else
+    {
+        expressionStatement(parser);
+    }
+}
+
+static void printStatement(Parser& parser)
+{
+    checkNotPure(parser, "print");
+    expression(parser);
+    consume(parser, TokenType::SEMICOLON, "Expect ';' after value.");
+    emitByteCode(parser, OP_PRINT);
+}
+
+static void synchronize(Parser& parser)
+{
+    while(parser.current.type != TokenType::END_OF_FILE)
+    {
+        if(parser.previous.type == TokenType::SEMICOLON)
+            return;
+
+        switch(parser.current.type)
+        {
+            case TokenType::STRUCT:
+            case TokenType::FN:
+            case TokenType::PURE:
+            case TokenType::LET:
+            case TokenType::IF:
+            case TokenType::WHILE:
+            case TokenType::FOR:
+            case TokenType::PARALLEL:
+            case TokenType::YIELD:
+            case TokenType::PRINT:
+            case TokenType::RETURN:
+                return;
+            default:
+                break;
+        }
+        advance(parser);
+    }
+}
+
+// Bools and numbers of a known type get packed at their natural size and alignment,
+// others take a slot. Packed offsets are i16 operands, once a frame is full the rest get
+// slots too. Returns the location, slot index or ~byte offset.
+static i32 identifierConstant(Parser& parser, const Token& token, ValueTypeDesc type)
+{
+    std::string str = getStringFromTokenName(token);
+
+    StructStack& sta = parser.script.structStacks[parser.script.structIndex];
+    bool found = false;
+    for(i32 i = 0; i < sta.structSymbolNameIndices.size(); ++i)
+    {
+        i32 realIndex = (i32)sta.structSymbolNameIndices[i];
+        if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == str)
+        {
+            found = true;
+            break;
+        }
+    }
+    i32 location = -1;
+    if(found)
+    {
+        std::string ss = "Variable ";
+        ss += str;
+        ss += " has already been defined!";
+        errorAt(parser, token, ss.c_str());
+    }
+    else
+    {
+        i32 symbolIndex = addSymbolName(parser.script, str.c_str());
+        sta.structSymbolNameIndices.push_back(symbolIndex);
+        sta.structSymbolTypes.push_back(type);
+        u32 size = getValueTypeSizeInBytes(type.valueType);
+        u32 offset = (sta.desc.structSize + size - 1) & ~(size - 1);
+        if(type.valueType >= ValueTypeBool && type.valueType <= ValueTypeF64 && offset + size <= INT16_MAX + 1)
+        {
+            sta.desc.structSize = offset + size;
+            sta.structPackedValues.resize((sta.desc.structSize + sizeof(u64) - 1) / sizeof(u64), 0);
+            location = ~i32(offset);
+        }
+        else
+        {
+            location = (i32)sta.structValueArray.size();
+            sta.structValueTypes.push_back({});
+            sta.structValueArray.push_back({});
+        }
+        sta.structSymbolLocations.push_back(location);
+    }
+    return location;
+}
+
+static i32 parseVariable(Parser& parser, const char* errorMessage)
+{
+    consume(parser, TokenType::IDENTIFIER, errorMessage);
+    return identifierConstant(parser, parser.previous);
+}
+
+static void defineVariable(Parser& parser, i32 index, const Token& token)
+{
+    ValueType type = ValueTypeNone;
+    if(index >= 0)
+    {
+        emitByteCode(parser, OP_DEFINE_GLOBAL);
+    }
+    else
+    {
+        const StructStack& sta = getCurrentStructStack(parser.script);
+        for(i32 i = 0; i < sta.structSymbolLocations.size(); ++i)
+        {
+            if(sta.structSymbolLocations[i] == index)
+            {
+                type = sta.structSymbolTypes[i].valueType;
+                break;
+            }
+        }
+        emitByteCode(parser, getPackedOp(type, true));
+    }
+    if(parser.script.structIndex > 0)
+    {
+        parser.script.patchGetters.push_back({
+             .token = token,
+             .currentStructIndex = parser.script.structIndex,
+             .structIndex = parser.script.structIndex,
+             .byteCodeIndex = i32(parser.script.byteCode.size())
+         });
+    }
+    if(index >= 0)
+    {
+        emitByteCode(parser, Op(index));
+        return;
+    }
+    // Store leaves the value on the stack like an assignment.
+    emitByteCode(parser, Op(~index));
+    emitByteCode(parser, Op(type));
+    emitByteCode(parser, OP_POP);
+}
+
+static void letDeclaration(Parser& parser)
+{
+    consume(parser, TokenType::IDENTIFIER, "Expect variable name.");
+    Token previous = parser.previous;
+    consume(parser, TokenType::EQUAL, "Expect '=' with variable declaration.");
+    expression(parser);
+    ValueTypeDesc type = parser.exprType;
+
+    consume(parser, TokenType::SEMICOLON, "Expect ';' after variable declaration.");
+
+    i32 global = identifierConstant(parser, previous, type);
+
+    defineVariable(parser, global, previous);
+}
+
+// Parses fn name and parameters, tokens gets the parameter names. Returns index of the fn.
+static i32 functionHeader(Parser& parser, Token* tokens, i32& tokenCount, bool pure)
+{
+    consume(parser, TokenType::IDENTIFIER, "Expect function name.");
+    std::string str = getStringFromTokenName(parser.previous);
+
+    auto found = parser.functionIndices.find(str);
+    i32 foundIndex = found != parser.functionIndices.end() ? found->second : -1;
+    if(foundIndex == -1)
+    {
+        i32 symbolIndex = addSymbolName(parser.script, str.c_str());
+        parser.script.functions.emplace_back();
+        Function& func = parser.script.functions.back();
+        func.functionNameIndex = symbolIndex;
+        foundIndex = parser.script.functions.size() - 1;
+        parser.functionIndices.emplace(str, foundIndex);
+    }
+    Function& func = parser.script.functions[foundIndex];
+
+    bool parsedParametersBefore = func.defined || func.declared;
+    if(parsedParametersBefore && func.pure != pure)
+    {
+        errorAtCurrent(parser, "Pure mismatched from previous define of function.");
+    }
+    func.pure = pure;
+
+    consume(parser, TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    if(!check(parser, TokenType::RIGHT_PAREN))
+    {
+        do
+        {
+            consume(parser, TokenType::IDENTIFIER, "Expected identifier for parameter name.");
+            Token name = parser.previous;
+            tokens[tokenCount++] = name;
+            std::string paramName = getStringFromTokenName(name);
+
+            i32 foundParamNameIndex = -1;
+            for(i32 i = 0; i < func.functionParameterNameIndices.size(); ++i)
+            {
+                i32 realIndex = func.functionParameterNameIndices[i];
+                if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == paramName)
+                {
+                    foundParamNameIndex = i;
+                    break;
+                }
+            }
+            if(foundParamNameIndex != -1 && !parsedParametersBefore)
+            {
+                errorAtCurrent(parser, "Parameter name already defined.");
+            }
+            consume(parser, TokenType::COLON, "Expected ':' and type for parameter.");
+            ValueTypeDesc valueType{};
+            if(match(parser, TokenType::LEFT_BRACKET))
+            {
+                // Array parameter, element type id goes to struct index.
+                ValueTypeDesc elementType{};
+                if(!matchValueType(parser, elementType))
+                {
+                    errorAtCurrent(parser, "Unknown element type for an array parameter");
+                    break;
+                }
+                consume(parser, TokenType::RIGHT_BRACKET, "Expect ']' after array element type.");
+                valueType = getArrayDesc(elementType);
+            }
+            else if(matchValueType(parser, valueType))
+            {
+            }
+            else if(check(parser, TokenType::COMMA))
+            {
+                errorAtCurrent(parser, "Missing type for a parameter");
+                break;
+            }
+            else
+            {
+                errorAtCurrent(parser, "Unknown type for a parameter");
+                break;
+            }
+            // Arguments are the key of the cached result.
+            if(pure && (valueType.valueType < ValueTypeBool || valueType.valueType > ValueTypeF64))
+            {
+                errorAtCurrent(parser, "Pure fn parameters need a bool or number type.");
+            }
+            if(!parsedParametersBefore)
+            {
+                func.functionParameterNameIndices.push_back(addSymbolName(parser.script, paramName.c_str()));
+                func.functionParamenterValueTypes.push_back(valueType);
+            }
+            else if(tokenCount > func.functionParameterNameIndices.size()
+                || tokenCount > func.functionParamenterValueTypes.size())
+            {
+                errorAtCurrent(parser, "Parameter amount mismatched from previously defined.");
+            }
+            else if(tokenCount - 1 != foundParamNameIndex)
+            {
+                errorAtCurrent(parser, "Parameter names /order of names mismatched from previous define of function.");
+            }
+            else if(memcmp(&func.functionParamenterValueTypes[tokenCount - 1], &valueType, sizeof(valueType)) != 0)
+            {
+                errorAtCurrent(parser, "Parameter names /order of names mismatched from previous define of function.");
+            }
+
+
+        } while(match(parser, TokenType::COMMA));
+    }
+    consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after function parameters.");
+    return foundIndex;
+}
+
+// Continues parsing right after the token, everything before it is skipped.
+static void skipPast(Parser& parser, const Token& token)
+{
+    parser.scanner.current = token.start + token.len;
+    parser.scanner.startToken = parser.scanner.current;
+    parser.scanner.line = token.line;
+    parser.next = token;
+    advance(parser);
+    advance(parser);
+}
+
+// struct Name { a: f32, b: i32 } on the top level, declared by the first pass so every fn can
+// use it. Fields are laid out by alignment, largest first, so the packed struct has no padding
+// between fields, only at its end to keep arrays of it aligned.
+static void structDeclaration(Parser& parser)
+{
+    Script& script = parser.script;
+    consume(parser, TokenType::IDENTIFIER, "Expect struct name.");
+    Token nameToken = parser.previous;
+    if(findStructType(parser, nameToken) >= 0)
+    {
+        error(parser, "Struct has already been defined.");
+        return;
+    }
+    consume(parser, TokenType::LEFT_BRACE, "Expect '{' after struct name.");
+    if(script.structFieldTypes.size() > 0xffff)
+    {
+        error(parser, "Too many struct fields.");
+        return;
+    }
+    StructDesc desc = {
+        .parametersCount = 0,
+        .parameterStartIndex = u16(script.structFieldTypes.size()),
+        .structSize = 0,
+        .structAlignment = 1,
+    };
+    while(!check(parser, TokenType::RIGHT_BRACE) && !check(parser, TokenType::END_OF_FILE))
+    {
+        consume(parser, TokenType::IDENTIFIER, "Expect field name.");
+        std::string fieldName = getStringFromTokenName(parser.previous);
+        for(u16 i = 0; i < desc.parametersCount; ++i)
+        {
+            if(script.allSymbolNames[script.structFieldNameIndices[desc.parameterStartIndex + i]] == fieldName)
+            {
+                error(parser, "Field has already been defined.");
+                return;
+            }
+        }
+        consume(parser, TokenType::COLON, "Expect ':' and type for field.");
+        ValueTypeDesc fieldType{};
+        if(!matchValueType(parser, fieldType))
+        {
+            errorAtCurrent(parser, "Unknown type for a field.");
+            return;
+        }
+        script.structFieldNameIndices.push_back(addSymbolName(script, fieldName.c_str()));
+        script.structFieldTypes.push_back(fieldType);
+        script.structFieldOffsets.push_back(0);
+        ++desc.parametersCount;
+        if(!match(parser, TokenType::COMMA))
+            break;
+    }
+    consume(parser, TokenType::RIGHT_BRACE, "Expect '}' after struct fields.");
+    if(desc.parametersCount == 0)
+    {
+        error(parser, "Struct needs at least one field.");
+        return;
+    }
+
+    u32 offset = 0;
+    for(u32 alignment = 8; alignment > 0; alignment /= 2)
+    {
+        for(u16 i = 0; i < desc.parametersCount; ++i)
+        {
+            u32 field = desc.parameterStartIndex + i;
+            ValueTypeDesc type = script.structFieldTypes[field];
+            bool isStruct = type.valueType == ValueTypeStruct;
+            u32 fieldAlignment = isStruct ? script.structDescs[type.structIndex].structAlignment : getValueTypeSizeInBytes(type.valueType);
+            if(fieldAlignment != alignment)
+                continue;
+            script.structFieldOffsets[field] = offset;
+            offset += isStruct ? script.structDescs[type.structIndex].structSize : fieldAlignment;
+            desc.structAlignment = desc.structAlignment > alignment ? desc.structAlignment : alignment;
+        }
+    }
+    desc.structSize = (offset + desc.structAlignment - 1) / desc.structAlignment * desc.structAlignment;
+    if(desc.structSize > 0xffff)
+    {
+        errorAt(parser, nameToken, "Struct is too large, field offsets need to fit 16 bits.");
+        return;
+    }
+    script.structDescs.push_back(desc);
+    script.structNameIndices.push_back(addSymbolName(script, getStringFromTokenName(nameToken).c_str()));
+}
+
+// Tokens of a fn body, braces included, that can get compiled into every caller.
+constexpr i32 InlineMaxTokens = 40;
+
+// First pass over the tokens. Declares every top level fn like a forward declaration would,
+// and records where their bodies are.
+
+static void declareFunctions(Parser& parser, std::vector<FunctionBody>& bodies)
+{
+    i32 depth = 0;
+    while(!check(parser, TokenType::END_OF_FILE) && !parser.hadError)
+    {
+        if(depth == 0 && match(parser, TokenType::STRUCT))
+        {
+            structDeclaration(parser);
+            continue;
+        }
+        bool pure = depth == 0 && match(parser, TokenType::PURE);
+        if(pure)
+        {
+            consume(parser, TokenType::FN, "Expect 'fn' after 'pure'.");
+        }
+        else if(depth != 0 || !match(parser, TokenType::FN))
+        {
+            if(check(parser, TokenType::LEFT_BRACE))
+                ++depth;
+            else if(check(parser, TokenType::RIGHT_BRACE))
+                --depth;
+            advance(parser);
+            continue;
+        }
+        Token tokens[256];
+        i32 tokenCount = 0;
+        i32 functionIndex = functionHeader(parser, tokens, tokenCount, pure);
+        Function& func = parser.script.functions[functionIndex];
+        if(match(parser, TokenType::SEMICOLON))
+        {
+            func.declared = true;
+            continue;
+        }
+        // Missing body gets reported when compiling.
+        if(!check(parser, TokenType::LEFT_BRACE))
+        {
+            continue;
+        }
+        if(func.defined)
+        {
+            std::string ss = "Function ";
+            ss += parser.script.allSymbolNames[func.functionNameIndex];
+            ss += " has already been defined!";
+            errorAtCurrent(parser, ss.c_str());
+            break;
+        }
+        func.defined = true;
+        func.bodyIndex = (i32)bodies.size();
+
+        FunctionBody body = {
+            .functionIndex = functionIndex,
+            .openBrace = parser.current,
+            .globalCount = -1,
+        };
+        // Inlinable body is return expression; calling no script fns.
+        i32 bodyDepth = 0;
+        i32 bodyTokens = 0;
+        i32 returnCount = 0;
+        i32 semicolonsAfterReturn = 0;
+        bool returnFirst = false;
+        bool isLeaf = true;
+        TokenType previousType = TokenType::LEFT_BRACE;
+        TokenType previousPreviousType = TokenType::LEFT_BRACE;
+        do
+        {
+            TokenType type = parser.current.type;
+            if(type == TokenType::LEFT_BRACE)
+                ++bodyDepth;
+            else if(type == TokenType::RIGHT_BRACE)
+                --bodyDepth;
+            else if(type == TokenType::RETURN)
+            {
+                ++returnCount;
+                semicolonsAfterReturn = 0;
+                returnFirst = bodyDepth == 1 && bodyTokens == 1;
+            }
+            else if(type == TokenType::SEMICOLON)
+                ++semicolonsAfterReturn;
+            else if(type == TokenType::SPAWN || type == TokenType::PARALLEL || type == TokenType::YIELD
+                || (type == TokenType::LEFT_PAREN && previousType == TokenType::IDENTIFIER
+                    && previousPreviousType != TokenType::NATCALL))
+                isLeaf = false;
+            previousPreviousType = previousType;
+            previousType = type;
+            ++bodyTokens;
+            advance(parser);
+        } while(bodyDepth > 0 && !check(parser, TokenType::END_OF_FILE));
+        body.closeBrace = parser.previous;
+        body.inlinable = isLeaf && returnCount == 1 && returnFirst && semicolonsAfterReturn == 1
+            && previousPreviousType == TokenType::SEMICOLON && bodyTokens <= InlineMaxTokens;
+        bodies.push_back(body);
+    }
+}
+
+static void fnBody(Parser& parser, const Token* tokens, const std::vector<ValueTypeDesc>& types, i32 tokenCount)
+{
+    consume(parser, TokenType::LEFT_BRACE, "Expect '{' before function body.");
+
+    beginScope(parser);
+
+    for(int i = tokenCount - 1; i >= 0; --i)
+    {
+        i32 global = identifierConstant(parser, tokens[i], i < types.size() ? types[i] : ValueTypeDesc{});
+        defineVariable(parser, global, tokens[i]);
+    }
+
+    block(parser);
+    endScope(parser);
+
+    emitByteCode(parser, OP_RETURN);
+}
+
+static void fnDeclaration(Parser& parser, bool pure)
+{
+    const StructStack& sta = parser.script.structStacks[parser.script.structIndex];
+    if(sta.parentStructIndex != -1 || parser.functionBodies == nullptr)
+    {
+        errorAtCurrent(parser, "Expect fns to be only on top level.");
+        return;
     }
-    else if(match(parser, TokenType::WHILE))
+
+    Token tokens[256];
+    i32 tokenCount = 0;
+    i32 functionIndex = functionHeader(parser, tokens, tokenCount, pure);
+    Function& func = parser.script.functions[functionIndex];
+    if(match(parser, TokenType::SEMICOLON))
     {
-        whileStatement(parser);
+        if(tokenCount != func.functionParameterNameIndices.size())
+        {
+            errorAtCurrent(parser, "Function declaration does not match parameter count.");
+        }
+        return;
     }
-    else if(match(parser, TokenType::LEFT_BRACE))
+    std::vector<FunctionBody>& bodies = *parser.functionBodies;
+    if(!check(parser, TokenType::LEFT_BRACE))
     {
-        beginScope(parser);
-        block(parser);
-        endScope(parser);
+        consume(parser, TokenType::LEFT_BRACE, "Expect '{' before function body.");
+        return;
     }
-    else
+    if(parser.nextFunctionBody >= bodies.size() || bodies[parser.nextFunctionBody].functionIndex != functionIndex)
     {
-        expressionStatement(parser);
+        errorAtCurrent(parser, "Function body was not found by the first pass.");
+        return;
     }
-}
 
-static void printStatement(Parser& parser)
-{
-    expression(parser);
-    consume(parser, TokenType::SEMICOLON, "Expect ';' after value.");
-    emitByteCode(parser, OP_PRINT);
+    // Body gets compiled after the top level code, into its own segment.
+    FunctionBody& body = bodies[parser.nextFunctionBody++];
+    body.globalCount = (i32)parser.script.structStacks[0].structSymbolNameIndices.size();
+    body.parameters.assign(tokens, tokens + tokenCount);
+    skipPast(parser, body.closeBrace);
 }
 
-static void synchronize(Parser& parser)
+// Struct was declared by the first pass, this only checks it is on the top level.
+static void skipStructDeclaration(Parser& parser)
 {
-    while(parser.current.type != TokenType::END_OF_FILE)
+    const StructStack& sta = parser.script.structStacks[parser.script.structIndex];
+    if(sta.parentStructIndex != -1 || parser.functionBodies == nullptr)
+    {
+        errorAtCurrent(parser, "Expect structs to be only on top level.");
+        return;
+    }
+    consume(parser, TokenType::IDENTIFIER, "Expect struct name.");
+    consume(parser, TokenType::LEFT_BRACE, "Expect '{' after struct name.");
+    while(!check(parser, TokenType::RIGHT_BRACE) && !check(parser, TokenType::END_OF_FILE))
     {
-        if(parser.previous.type == TokenType::SEMICOLON)
-            return;
-
-        switch(parser.current.type)
-        {
-            case TokenType::STRUCT:
-            case TokenType::FN:
-            case TokenType::LET:
-            case TokenType::IF:
-            case TokenType::WHILE:
-            case TokenType::PRINT:
-            case TokenType::RETURN:
-                return;
-            default:
-                break;
-        }
         advance(parser);
     }
+    consume(parser, TokenType::RIGHT_BRACE, "Expect '}' after struct fields.");
 }
 
-static i32 identifierConstant(Parser& parser, const Token& token)
+static void declaration(Parser& parser)
 {
-    std::string str = getStringFromTokenName(token);
-
-    StructStack& sta = parser.script.structStacks[parser.script.structIndex];
-    bool found = false;
-    for(i32 i = 0; i < sta.structSymbolNameIndices.size(); ++i)
+    if(match(parser, TokenType::LET))
     {
-        i32 realIndex = (i32)sta.structSymbolNameIndices[i];
-        if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == str)
-        {
-            found = true;
-            break;
-        }
+        letDeclaration(parser);
     }
-    i32 newIndex = -1;
-    if(found)
+    else if(match(parser,TokenType::FN))
     {
-        std::string ss = "Variable ";
-        ss += str;
-        ss += " has already been defined!";
-        errorAt(parser, token, ss.c_str());
+        fnDeclaration(parser, false);
+    }
+    else if(match(parser, TokenType::PURE))
+    {
+        consume(parser, TokenType::FN, "Expect 'fn' after 'pure'.");
+        fnDeclaration(parser, true);
+    }
+    else if(match(parser, TokenType::STRUCT))
+    {
+        skipStructDeclaration(parser);
     }
     else
     {
-        i32 symbolIndex = addSymbolName(parser.script, str.c_str());
-        newIndex = (i32)sta.structSymbolNameIndices.size();
-        sta.structSymbolNameIndices.push_back(symbolIndex);
-        sta.structValueTypes.push_back({});
-        sta.structValueArray.push_back({});
+        statement(parser);
+    }
+    if(parser.panicMode)
+    {
+        synchronize(parser);
     }
-    return newIndex;
 }
 
-static i32 parseVariable(Parser& parser, const char* errorMessage)
+// Compiles one fn body into its own script. Only reads the shared script, so bodies can be
+// compiled on many threads at once.
+static bool compileFunctionBody(
+    MyMemory& mem,
+    const Script& shared,
+    std::unordered_map<std::string, i32>& functionIndices,
+    const std::vector<FunctionBody>& bodies,
+    const FunctionBody& body,
+    Script& segment)
 {
-    consume(parser, TokenType::IDENTIFIER, errorMessage);
-    return identifierConstant(parser, parser.previous);
+    segment.allSymbolNames.emplace_back("constant");
+    addStruct(segment, "global", -1);
+
+    Scanner scanner = {
+        .mem = mem,
+        .src = mem.scriptFile.data(),
+        .srcEnd = body.closeBrace.start + body.closeBrace.len,
+        .startToken = body.openBrace.start,
+        .current = body.openBrace.start,
+        .line = body.openBrace.line,
+        .hasErrors = false,
+    };
+    Parser parser = {
+        .mem = mem,
+        .scanner = scanner,
+        .script = segment,
+        .shared = shared,
+        .functionBodies = nullptr,
+        .inlineBodies = &bodies,
+        .functionIndices = functionIndices,
+        .nextFunctionBody = 0,
+        .globalCount = body.globalCount,
+        .inPureFn = shared.functions[body.functionIndex].pure,
+        .hadError = false,
+    };
+    advance(parser);
+    advance(parser);
+    const Function& func = shared.functions[body.functionIndex];
+    fnBody(parser, body.parameters.data(), func.functionParamenterValueTypes, (i32)body.parameters.size());
+    return !parser.hadError;
 }
 
-static void defineVariable(Parser& parser, i32 index, const Token& token)
+static i32 addSymbolNameIndexed(Script& script, std::unordered_map<std::string, i32>& symbolIndices, const std::string& name)
 {
-    emitByteCode(parser, OP_DEFINE_GLOBAL);
-    if(parser.script.structIndex > 0)
+    auto it = symbolIndices.find(name);
+    if(it != symbolIndices.end())
     {
-        parser.script.patchGetters.push_back({
-             .token = token,
-             .currentStructIndex = parser.script.structIndex,
-             .structIndex = parser.script.structIndex,
-             .byteCodeIndex = i32(parser.script.byteCode.size())
-         });
+        return it->second;
     }
-    emitByteCode(parser, Op(index));
-}
-
-static void letDeclaration(Parser& parser)
-{
-    consume(parser, TokenType::IDENTIFIER, "Expect variable name.");
-    Token previous = parser.previous;
-    consume(parser, TokenType::EQUAL, "Expect '=' with variable declaration.");
-    expression(parser);
-
-    consume(parser, TokenType::SEMICOLON, "Expect ';' after variable declaration.");
-
-    i32 global = identifierConstant(parser, previous);
-
-    defineVariable(parser, global, previous);
+    i32 index = (i32)script.allSymbolNames.size();
+    script.allSymbolNames.push_back(name);
+    symbolIndices.emplace(name, index);
+    return index;
 }
 
-static void fnDeclaration(Parser& parser)
+// Appends a compiled fn body to the end of the code, moving its symbols, structs, constants and
+// natives over and relocating every operand that points into them.
+static void appendFunctionBody(
+    Parser& parser,
+    const FunctionBody& body,
+    Script& segment,
+    std::unordered_map<std::string, i32>& symbolIndices)
 {
-
-    consume(parser, TokenType::IDENTIFIER, "Expect function name.");
-
-
-    const StructStack& sta = parser.script.structStacks[parser.script.structIndex];
-    if(sta.parentStructIndex != -1)
+    Script& script = parser.script;
+    i32 codeOffset = (i32)script.byteCode.size();
+    i32 constantOffset = (i32)script.constants.structValueArray.size();
+    i32 stringOffset = (i32)script.stringLiterals.size();
+    // Struct 0 is the global struct in both.
+    i32 structOffset = (i32)script.structStacks.size() - 1;
+
+    std::vector<i32> symbols(segment.allSymbolNames.size());
+    for(i32 i = 0; i < segment.allSymbolNames.size(); ++i)
     {
-        error(parser, "Expect fns to be only on top level.");
+        symbols[i] = addSymbolNameIndexed(script, symbolIndices, segment.allSymbolNames[i]);
     }
-    std::string str = getStringFromTokenName(parser.previous);
+    auto relocateStruct = [structOffset](i32 structIndex)
+    {
+        return structIndex > 0 ? structIndex + structOffset : structIndex;
+    };
 
+    for(i32 i = 1; i < segment.structStacks.size(); ++i)
+    {
+        StructStack& s = segment.structStacks[i];
+        for(u32& symbolIndex : s.structSymbolNameIndices)
+        {
+            symbolIndex = symbols[symbolIndex];
+        }
+        s.parentStructIndex = relocateStruct(s.parentStructIndex);
+        script.structStacks.push_back(std::move(s));
+    }
 
-    i32 foundIndex = -1;
-    for(i32 i = 0; i < parser.script.functions.size(); ++i)
+    StructStack& constants = segment.constants;
+    for(i32 i = 0; i < constants.structValueArray.size(); ++i)
     {
-        i32 realIndex = (i32)parser.script.functions[i].functionNameIndex;
-        if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == str)
+        TypeOfValue value = constants.structValueArray[i];
+        if(constants.structValueTypes[i].valueType == ValueTypeStringLiteral)
         {
-            foundIndex = i;
-            break;
+            *(i32*)&value += stringOffset;
         }
+        script.constants.structValueArray.push_back(value);
+        script.constants.structValueTypes.push_back(constants.structValueTypes[i]);
+        script.constants.structSymbolNameIndices.push_back(symbols[constants.structSymbolNameIndices[i]]);
     }
-    if(foundIndex >= 0 && parser.script.functions[foundIndex].defined)
+    script.constants.desc.parametersCount += constants.desc.parametersCount;
+    for(std::string& str : segment.stringLiterals)
     {
-        std::string ss = "Function ";
-        ss += str;
-        ss += " has already been defined!";
-        errorAt(parser, parser.previous, ss.c_str());
+        script.stringLiterals.push_back(std::move(str));
     }
-    else
+
+    std::vector<i32> natives(segment.nativePatchFunctions.size());
+    for(i32 i = 0; i < segment.nativePatchFunctions.size(); ++i)
     {
+        const NativePatchFunction& fn = segment.nativePatchFunctions[i];
+        i32 foundIndex = -1;
+        for(i32 j = 0; j < script.nativePatchFunctions.size(); ++j)
+        {
+            if(areTokensSame(fn.token, script.nativePatchFunctions[j].token))
+            {
+                foundIndex = j;
+                break;
+            }
+        }
         if(foundIndex == -1)
         {
-            i32 symbolIndex = addSymbolName(parser.script, str.c_str());
-            parser.script.functions.emplace_back();
-            Function& func = parser.script.functions.back();
-            func.functionNameIndex = symbolIndex;
-            foundIndex = parser.script.functions.size() - 1;
+            foundIndex = (i32)script.nativePatchFunctions.size();
+            script.nativePatchFunctions.push_back(fn);
         }
-        Function& func = parser.script.functions[foundIndex];
-
-        i32 parameters = 0;
-
-        bool parsedParametersBefore = func.defined || func.declared;
-        Token tokens[256];
-        i32 tokenCount = 0;
-
+        else if(script.nativePatchFunctions[foundIndex].parameterTypes.size() != fn.parameterTypes.size())
+        {
+            errorAt(parser, fn.token, "Native called with different parameter counts.");
+        }
+        natives[i] = foundIndex;
+    }
 
-        consume(parser, TokenType::LEFT_PAREN, "Expect '(' after function name.");
-        if(!check(parser, TokenType::RIGHT_PAREN))
+    const std::vector<OpCodeType>& code = segment.byteCode;
+    for(i32 i = 0; i < code.size();)
+    {
+        i32 length = getOpCodeLength(code[i]);
+        assert(length > 0 && i + length <= code.size());
+        script.byteCode.insert(script.byteCode.end(), code.begin() + i, code.begin() + i + length);
+        OpCodeType* operands = &script.byteCode[codeOffset + i + 1];
+        switch(code[i])
         {
-            do
+            case OP_CONSTANT_BOOL:
+            case OP_CONSTANT_I8:
+            case OP_CONSTANT_U8:
+            case OP_CONSTANT_I16:
+            case OP_CONSTANT_U16:
+            case OP_CONSTANT_I32:
+            case OP_CONSTANT_U32:
+            case OP_CONSTANT_I64:
+            case OP_CONSTANT_U64:
+            case OP_CONSTANT_F32:
+            case OP_CONSTANT_F64:
+            case OP_CONSTANT_STRING:
             {
-                consume(parser, TokenType::IDENTIFIER, "Expected identifier for parameter name.");
-                Token name = parser.previous;
-                tokens[tokenCount++] = name;
-                std::string paramName = getStringFromTokenName(name);
-
-                i32 foundParamNameIndex = -1;
-                for(i32 i = 0; i < func.functionParameterNameIndices.size(); ++i)
-                {
-                    i32 realIndex = func.functionParameterNameIndices[i];
-                    if(realIndex < parser.script.allSymbolNames.size() && parser.script.allSymbolNames[realIndex] == paramName)
-                    {
-                        foundParamNameIndex = i;
-                        break;
-                    }
-                }
-                if(foundParamNameIndex != -1 && !parsedParametersBefore)
-                {
-                    errorAtCurrent(parser, "Parameter name already defined.");
-                }
-                consume(parser, TokenType::COLON, "Expected ':' and type for parameter.");
-                ValueTypeDesc valueType{};
-                if(match(parser, TokenType::I8))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeI8 };
-                }
-                else if(match(parser,TokenType::I16))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeI16 };
-                }
-                else if(match(parser, TokenType::I32))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeI32 };
-                }
-                else if(match(parser, TokenType::U8))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeU8 };
-                }
-                else if(match(parser,TokenType::U16))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeU16 };
-                }
-                else if(match(parser, TokenType::U32))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeU32 };
-                }
-                else if(match(parser,TokenType::F32))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeF32 };
-                }
-                else if(match(parser,TokenType::F64))
-                {
-                    valueType = ValueTypeDesc{.valueType = ValueTypeF64 };
-                }
-                else if(check(parser, TokenType::COMMA))
-                {
-                    errorAtCurrent(parser, "Missing type for a parameter");
-                    break;
-                }
-                else
-                {
-                    errorAtCurrent(parser, "Unknown type for a parameter");
-                    break;
-                }
-                if(!parsedParametersBefore)
-                {
-                    func.functionParameterNameIndices.push_back(addSymbolName(parser.script, paramName.c_str()));
-                    func.functionParamenterValueTypes.push_back(valueType);
-                }
-                else if(tokenCount > func.functionParameterNameIndices.size()
-                    || tokenCount > func.functionParamenterValueTypes.size())
-                {
-                    errorAtCurrent(parser, "Parameter amount mismatched from previously defined.");
-                }
-                else if(tokenCount - 1 != foundParamNameIndex)
-                {
-                    errorAtCurrent(parser, "Parameter names /order of names mismatched from previous define of function.");
-                }
-                else if(memcmp(&func.functionParamenterValueTypes[tokenCount - 1], &valueType, sizeof(valueType)) != 0)
+                i32 constantIndex = operands[0] + constantOffset;
+                if(constantIndex > 0xffff)
                 {
-                    errorAtCurrent(parser, "Parameter names /order of names mismatched from previous define of function.");
+                    errorAt(parser, body.openBrace, "Too many constants.");
                 }
-
-
-            } while(match(parser, TokenType::COMMA));
-        }
-        consume(parser, TokenType::RIGHT_PAREN, "Expect ')' after function parameters.");
-        if(match(parser, TokenType::SEMICOLON))
-        {
-            if(func.declared && parameters != func.functionParameterNameIndices.size())
+                operands[0] = OpCodeType(constantIndex);
+                break;
+            }
+            case OP_STACK_SET:
+                operands[0] = OpCodeType(relocateStruct(operands[0]));
+                break;
+            case OP_NATIVE_CALL:
+                operands[0] = OpCodeType(natives[operands[0]]);
+                break;
+            case OP_CODE_PUSH_RETURN_ADDRESS:
             {
-                errorAtCurrent(parser, "Function declaration does not match parameter count.");
-
+                i32 address = (i32(operands[0]) | (i32(operands[1]) << 16)) + codeOffset;
+                operands[0] = OpCodeType(address & 0xffff);
+                operands[1] = OpCodeType(address >> 16);
+                break;
             }
-            // very bad but needed for now...
-            //patchJump(parser, jumpEnd);
-            func.declared = true;
-            return;
+            default:
+                break;
         }
-        i32 jumpEnd = emitJump(parser, OP_JUMP);
-        i32 functionStartLocation = (i32)parser.script.byteCode.size();
-
-        func.functionStartLocation = functionStartLocation;
-
-        consume(parser, TokenType::LEFT_BRACE, "Expect '{' before function body.");
-
-        beginScope(parser);
+        i += length;
+    }
+    script.byteCodeLines.insert(script.byteCodeLines.end(), segment.byteCodeLines.begin(), segment.byteCodeLines.end());
 
-        for(int i = func.functionParameterNameIndices.size() - 1; i >= 0; --i)
-        {
-            i32 global = identifierConstant(parser, tokens[i]);
-            defineVariable(parser, global, tokens[i]);
-        }
+    for(const PatchFunction& patchFn : segment.patchFunctions)
+    {
+        script.patchFunctions.push_back({
+            .functionIndex = patchFn.functionIndex,
+            .addressToPatch = patchFn.addressToPatch + codeOffset
+        });
+    }
+    for(const PatchGetter& patchGet : segment.patchGetters)
+    {
+        script.patchGetters.push_back({
+            .token = patchGet.token,
+            .currentStructIndex = relocateStruct(patchGet.currentStructIndex),
+            .structIndex = relocateStruct(patchGet.structIndex),
+            .byteCodeIndex = patchGet.byteCodeIndex + codeOffset
+        });
+    }
 
-        block(parser);
-        endScope(parser);
+    Function& func = script.functions[body.functionIndex];
+    func.functionStartLocation = codeOffset;
+    func.functionEndLocation = (i32)script.byteCode.size();
+}
 
-        emitByteCode(parser, OP_RETURN);
-        func.functionEndLocation = (i32)parser.script.byteCode.size();
+// Bodies per thread before another thread is worth starting.
+constexpr i32 MinFunctionBodiesPerThread = 16;
 
-        // Patch jump over to end of function.
-        patchJump(parser, jumpEnd);
+static void compileFunctionBodies(Parser& parser, const std::vector<FunctionBody>& bodies, i32 threadCount)
+{
+    std::vector<Script> segments(bodies.size());
+    std::vector<u8> compiled(bodies.size(), 0);
 
-    }
-}
+    threadCount = threadCount > 0 ? threadCount : (i32)std::thread::hardware_concurrency();
+    i32 maxThreads = (i32)bodies.size() / MinFunctionBodiesPerThread;
+    threadCount = threadCount < maxThreads ? threadCount : maxThreads;
+    threadCount = threadCount > 0 ? threadCount : 1;
 
-static void declaration(Parser& parser)
-{
-    if(match(parser, TokenType::LET))
+    std::atomic<size_t> nextBody = 0;
+    auto worker = [&]()
     {
-        letDeclaration(parser);
+        while(true)
+        {
+            size_t index = nextBody.fetch_add(1, std::memory_order_relaxed);
+            if(index >= bodies.size())
+            {
+                break;
+            }
+            compiled[index] = compileFunctionBody(parser.mem, parser.script, parser.functionIndices, bodies, bodies[index], segments[index]) ? 1 : 0;
+        }
+    };
+    std::vector<std::thread> threads;
+    for(i32 i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker);
     }
-    else if(match(parser,TokenType::FN))
+    worker();
+    for(std::thread& thread : threads)
     {
-        fnDeclaration(parser);
+        thread.join();
     }
-    else
+
+    // Appending in source order keeps the output the same for any thread count.
+    std::unordered_map<std::string, i32> symbolIndices;
+    for(i32 i = 0; i < parser.script.allSymbolNames.size(); ++i)
     {
-        statement(parser);
+        symbolIndices.emplace(parser.script.allSymbolNames[i], i);
     }
-    if(parser.panicMode)
+    for(i32 i = 0; i < bodies.size(); ++i)
     {
-        synchronize(parser);
+        parser.hadError |= compiled[i] == 0;
+        appendFunctionBody(parser, bodies[i], segments[i], symbolIndices);
     }
 }
 
@@ -1128,14 +3209,20 @@ static void endCompiler(Parser& parser)
             i32 offset = 0;
             i32 depthChange = 0;
             i32 structIndex = patchGet.structIndex;
+            bool packed = false;
 
-            findVariableToken(parser, patchGet.token, structIndex, offset, depthChange);
+            findVariableToken(parser, patchGet.token, structIndex, offset, depthChange, nullptr, &packed);
             i32 currentStructIndex = patchGet.currentStructIndex;
             while(patchGet.structIndex != 0 && currentStructIndex != patchGet.structIndex)
             {
                 assert(currentStructIndex >= 0);
-                offset -= (i32)parser.script.structStacks[currentStructIndex].structValueArray.size();
-                currentStructIndex = parser.script.structStacks[currentStructIndex].parentStructIndex;
+                const StructStack& s = parser.script.structStacks[currentStructIndex];
+                offset -= packed ? (i32)(s.structPackedValues.size() * sizeof(u64)) : (i32)s.structValueArray.size();
+                currentStructIndex = s.parentStructIndex;
+            }
+            if(offset < INT16_MIN || offset > INT16_MAX)
+            {
+                errorAt(parser, patchGet.token, "Too many variables to address.");
             }
             //while(depthChange > 0)
             //{
@@ -1156,16 +3243,48 @@ static void endCompiler(Parser& parser)
     if(!parser.hadError)
     {
         disassembleCode(parser.script, "code");
-        parser.script.structIndex = 0;
     }
 #endif
-    emitReturn(parser);
+    // Vm starts running from the top level struct stack.
+    parser.script.structIndex = 0;
 }
 
 
-bool compile(MyMemory& mem, Script& script)
+bool compile(MyMemory& mem, Script& script, i32 threadCount)
 {
     const u8* src = mem.scriptFile.data();
+    std::vector<FunctionBody> bodies;
+    std::unordered_map<std::string, i32> functionIndices;
+    {
+        Scanner scanner = {
+            .mem = mem,
+            .src = src,
+            .srcEnd = src + mem.scriptFile.size(),
+            .startToken = src,
+            .current = src,
+            .line = 1,
+            .hasErrors = false,
+        };
+        Parser parser = {
+            .mem = mem,
+            .scanner = scanner,
+            .script = script,
+            .shared = script,
+            .functionBodies = nullptr,
+            .functionIndices = functionIndices,
+            .nextFunctionBody = 0,
+            .globalCount = -1,
+            .hadError = false,
+        };
+        advance(parser);
+        advance(parser);
+        declareFunctions(parser, bodies);
+        if(parser.hadError)
+        {
+            return false;
+        }
+    }
+
     Scanner scanner = {
         .mem = mem,
         .src = src,
@@ -1179,6 +3298,12 @@ bool compile(MyMemory& mem, Script& script)
         .mem = mem,
         .scanner = scanner,
         .script = script,
+        .shared = script,
+        .functionBodies = &bodies,
+        .inlineBodies = &bodies,
+        .functionIndices = functionIndices,
+        .nextFunctionBody = 0,
+        .globalCount = -1,
         .hadError = false,
     };
     advance(parser);
@@ -1190,7 +3315,17 @@ bool compile(MyMemory& mem, Script& script)
     {
         declaration(parser);
     }
+    if(parser.nextFunctionBody != bodies.size())
+    {
+        errorAtCurrent(parser, "Function bodies mismatched with the first pass.");
+    }
+    // Top level code ends here, fn bodies get appended after it.
+    emitReturn(parser);
 
+    if(!parser.hadError)
+    {
+        compileFunctionBodies(parser, bodies, threadCount);
+    }
     endCompiler(parser);
     return !parser.hadError;
 }
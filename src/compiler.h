@@ -3,4 +3,5 @@
 #include "mymemory.h"
 #include "script.h"
 
-bool compile(MyMemory& mem, Script& script);
+// Top level fn bodies are compiled on threadCount threads, 0 uses every hardware thread.
+bool compile(MyMemory& mem, Script& script, i32 threadCount = 0);
@@ -30,7 +30,7 @@ static i32 constantOpCode(const char* name, const Script& script, i32 offset, Va
 
     printf("%-32s %8x '", name, lookupIndex);
 
-    printValue(script, &script.constants.structValueArray[lookupIndex], type);
+    printValue(script, {}, &script.constants.structValueArray[lookupIndex], type);
     printf("'\n");
 
     return offset + 1 + 1; // getValueTypeSizeInOpCodes(type);
@@ -41,9 +41,7 @@ static i32 constantStringOpCode(const char* name, const Script& script, i32 offs
     u16 lookupIndex = script.byteCode[offset + 1];
 
     printf("%-32s %8x '", name, lookupIndex);
-    i32 stringIndex = script.constants.structValueArray[lookupIndex];
-    const std::string& str = script.stackStrings[stringIndex];
-    printValue(script, &script.constants.structValueArray[lookupIndex], type);
+    printValue(script, {}, &script.constants.structValueArray[lookupIndex], type);
     printf("'\n");
 
     return offset + 1 + 1; // getValueTypeSizeInOpCodes(type);
@@ -58,6 +56,30 @@ static i32 jumpInstruction(const char* name, const Script& script, i32 offset)
     return offset + 3;
 }
 
+static i32 forLoopInstruction(const char* name, const Script& script, i32 offset)
+{
+    i16 counterOffset = i16(script.byteCode[offset + 1]);
+    u16 type = script.byteCode[offset + 2];
+    i16 step = i16(script.byteCode[offset + 3]);
+    i32 jump = i32(script.byteCode[offset + 4]) | (i32(script.byteCode[offset + 5]) << 16);
+    printf("%-32s %8i type %u step %i -> %-8x\n", name, counterOffset, type, step, offset + 6 + jump);
+    return offset + 6;
+}
+
+static i32 memoInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 functionIndex = script.byteCode[offset + 1];
+    u16 argCount = script.byteCode[offset + 2];
+    if(script.byteCode[offset] == OP_MEMO_STORE)
+    {
+        printf("%-32s %8u args %u\n", name, functionIndex, argCount);
+        return offset + 3;
+    }
+    i32 jump = i32(script.byteCode[offset + 3]) | (i32(script.byteCode[offset + 4]) << 16);
+    printf("%-32s %8u args %u -> %-8x\n", name, functionIndex, argCount, offset + 5 + jump);
+    return offset + 5;
+}
+
 static i32 directJumpInstruction(const char* name, const Script& script, i32 offset)
 {
     i32 address1 = script.byteCode[offset + 1];
@@ -66,12 +88,62 @@ static i32 directJumpInstruction(const char* name, const Script& script, i32 off
     printf("%-32s %8x -> %-8x\n", name, offset, address);
     return offset + 3;
 }
+static i32 spawnInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 functionIndex = script.byteCode[offset + 1];
+    const char* functionName = functionIndex < script.functions.size()
+        ? script.allSymbolNames[script.functions[functionIndex].functionNameIndex].c_str() : "UNKNOWN";
+    printf("%-32s %8x '%s'\n", name, functionIndex, functionName);
+    return offset + 2;
+}
+static i32 parallelForInstruction(const char* name, const Script& script, i32 offset)
+{
+    i32 offset1 = script.byteCode[offset + 1];
+    i32 offset2 = script.byteCode[offset + 2];
+    i32 jump = offset1 | (offset2 << 16);
+    u16 reductions = script.byteCode[offset + 3];
+    printf("%-32s %8x -> %-8x %i reductions\n", name, offset,
+           offset + 4 + jump, reductions & ParallelReductionCountMask);
+    return offset + 4;
+}
+static i32 arrayNewInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 elementType = script.byteCode[offset + 1];
+    printf("%-32s %8x\n", name, elementType);
+    return offset + 2;
+}
+static i32 arrayLiteralInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 count = script.byteCode[offset + 1];
+    printf("%-32s %8x elements\n", name, count);
+    return offset + 2;
+}
+static i32 structLiteralInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 structIndex = script.byteCode[offset + 1];
+    const char* structName = structIndex < script.structNameIndices.size()
+        ? script.allSymbolNames[script.structNameIndices[structIndex]].c_str() : "UNKNOWN";
+    printf("%-32s %8x '%s'\n", name, structIndex, structName);
+    return offset + 2;
+}
+static i32 fieldInstruction(const char* name, const Script& script, i32 offset)
+{
+    u16 structIndex = script.byteCode[offset + 1];
+    u16 fieldOffset = script.byteCode[offset + 2];
+    u16 typeId = script.byteCode[offset + 3];
+    printf("%-32s %8x +%-4u type %u\n", name, structIndex, fieldOffset, typeId);
+    return offset + 4;
+}
+static i32 packedInstruction(const char* name, const Script& script, i32 offset)
+{
+    i16 valueOffset = i16(script.byteCode[offset + 1]);
+    u16 type = script.byteCode[offset + 2];
+    printf("%-32s %8i type %u\n", name, valueOffset, type);
+    return offset + 3;
+}
 static i32 returnInstruction(const char* name, const Script& script, i32 offset)
 {
-    i32 returnAddress = script.functionReturnAddresses.size() > 0
-        ? script.functionReturnAddresses.back()
-        : script.byteCode.size();
-    printf("%-32s %8x -> %-8x\n", name, offset, returnAddress);
+    printf("%-32s %8x\n", name, offset);
     return offset + 1;
 }
 
@@ -161,6 +233,12 @@ i32 disassembleInstruction(Script& script, i32 offset, bool executeStackInPop)
         case OP_GREATER:
         case OP_LESSER:
         case OP_EQUAL:
+        case OP_JOIN:
+        case OP_YIELD:
+        case OP_SEND:
+        case OP_RECV:
+        case OP_ARRAY_GET:
+        case OP_ARRAY_SET:
             return simpleOpCode(opName, offset);
 
         case OP_STACK_SET:
@@ -185,16 +263,45 @@ i32 disassembleInstruction(Script& script, i32 offset, bool executeStackInPop)
         {
             return globalVar(opName, script, offset);
         }
+        case OP_LOAD_8:
+        case OP_LOAD_16:
+        case OP_LOAD_32:
+        case OP_LOAD_64:
+        case OP_STORE_8:
+        case OP_STORE_16:
+        case OP_STORE_32:
+        case OP_STORE_64:
+            return packedInstruction(opName, script, offset);
         case OP_JUMP:
         case OP_JUMP_IF_FALSE:
 
             return jumpInstruction(opName, script, offset);
+        case OP_FOR_LOOP:
+            return forLoopInstruction(opName, script, offset);
+        case OP_MEMO_LOOKUP:
+        case OP_MEMO_STORE:
+            return memoInstruction(opName, script, offset);
 
         case OP_CODE_PUSH_RETURN_ADDRESS:
         case OP_JUMP_ADDRESS_DIRECTLY:
             return directJumpInstruction(opName, script, offset);
         case OP_RETURN:
             return returnInstruction(opName, script, offset);
+        case OP_SPAWN:
+            return spawnInstruction(opName, script, offset);
+        case OP_PARALLEL_FOR:
+            return parallelForInstruction(opName, script, offset);
+        case OP_ARRAY_NEW:
+            return arrayNewInstruction(opName, script, offset);
+        case OP_ARRAY_LITERAL:
+            return arrayLiteralInstruction(opName, script, offset);
+        case OP_STRUCT_LITERAL:
+            return structLiteralInstruction(opName, script, offset);
+        case OP_FIELD_GET:
+        case OP_FIELD_SET:
+        case OP_ARRAY_FIELD_GET:
+        case OP_ARRAY_FIELD_SET:
+            return fieldInstruction(opName, script, offset);
 
         default:
         {
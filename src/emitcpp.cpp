@@ -0,0 +1,499 @@
+#include "emitcpp.h"
+
+#include "error.h"
+#include "nativefns.h"
+#include "op.h"
+#include "script.h"
+#include "vm.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+struct CppEmitter
+{
+    const Script& script;
+    FILE* file;
+    // Function index for every function start address, -1 for others.
+    std::vector<i32> addressToFunction;
+    // Which addresses need a label for goto.
+    std::vector<bool> jumpTargets;
+    bool hadError;
+};
+
+static i32 readAddress(const Script& script, i32 address)
+{
+    return i32(script.byteCode[address]) | (i32(script.byteCode[address + 1]) << 16);
+}
+
+static std::string getFunctionName(const Script& script, i32 functionIndex)
+{
+    const Function& fn = script.functions[functionIndex];
+    return "carp_" + script.allSymbolNames[fn.functionNameIndex];
+}
+
+static void emitString(FILE* file, const std::string& str)
+{
+    fputc('"', file);
+    for(char c : str)
+    {
+        switch(c)
+        {
+            case '"': fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\n': fputs("\\n", file); break;
+            case '\r': fputs("\\r", file); break;
+            case '\t': fputs("\\t", file); break;
+            default:
+                if(u8(c) < 0x20 || u8(c) >= 0x7f)
+                {
+                    fprintf(file, "\\%03o", u8(c));
+                }
+                else
+                {
+                    fputc(c, file);
+                }
+                break;
+        }
+    }
+    fputc('"', file);
+}
+
+static void emitCheckedOp(CppEmitter& e, i32 address, const char* call)
+{
+    fprintf(e.file, "    vm.ip = codeSpace + %i;\n", address + 1);
+    fprintf(e.file, "    if(!%s) return InterpretResult_RuntimeError;\n", call);
+}
+
+// Emits code from start to end, skipping the ranges of script functions if emitting top level.
+static void emitCode(CppEmitter& e, i32 start, i32 end, bool topLevel)
+{
+    const Script& script = e.script;
+    i32 address = start;
+    char buffer[256];
+    while(address < end)
+    {
+        i32 functionIndex = e.addressToFunction[address];
+        if(topLevel && functionIndex >= 0)
+        {
+            address = script.functions[functionIndex].functionEndLocation;
+            continue;
+        }
+        if(e.jumpTargets[address])
+        {
+            fprintf(e.file, "L_%x:;\n", address);
+        }
+        OpCodeType opCode = script.byteCode[address];
+        i32 len = getOpCodeLength(opCode);
+        if(len == 0 || address + len > end)
+        {
+            LOG_ERROR("Unknown op code when emitting C++");
+            e.hadError = true;
+            return;
+        }
+        OpCodeType operand = len > 1 ? script.byteCode[address + 1] : 0;
+        switch(opCode)
+        {
+            case OP_CONSTANT_BOOL:
+            case OP_CONSTANT_I8:
+            case OP_CONSTANT_U8:
+            case OP_CONSTANT_I16:
+            case OP_CONSTANT_U16:
+            case OP_CONSTANT_I32:
+            case OP_CONSTANT_U32:
+            case OP_CONSTANT_I64:
+            case OP_CONSTANT_U64:
+            case OP_CONSTANT_F32:
+            case OP_CONSTANT_F64:
+                fprintf(e.file, "    opConstant(vm, %s, %u);\n", getOpCodeName(opCode), operand);
+                break;
+            case OP_CONSTANT_STRING: fprintf(e.file, "    opConstantString(vm, %u);\n", operand); break;
+            case OP_NOT: fprintf(e.file, "    opNot(vm);\n"); break;
+            case OP_NIL: fprintf(e.file, "    opNil(vm);\n"); break;
+            case OP_EQUAL: fprintf(e.file, "    opEqual(vm);\n"); break;
+            case OP_PRINT: fprintf(e.file, "    opPrint(vm);\n"); break;
+            case OP_POP: fprintf(e.file, "    opPop(vm);\n"); break;
+            case OP_GET_GLOBAL: fprintf(e.file, "    opGetGlobal(vm, %i);\n", i16(operand)); break;
+
+            case OP_NEGATE: emitCheckedOp(e, address, "opNegate(vm)"); break;
+            case OP_STACK_POP: emitCheckedOp(e, address, "opStackPop(vm)"); break;
+            case OP_DEFINE_GLOBAL:
+                snprintf(buffer, sizeof(buffer), "opDefineGlobal(vm, %i)", i16(operand));
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_SET_GLOBAL:
+                snprintf(buffer, sizeof(buffer), "opSetGlobal(vm, %i)", i16(operand));
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_LOAD_8:
+            case OP_LOAD_16:
+            case OP_LOAD_32:
+            case OP_LOAD_64:
+            {
+                static const char* types[] = {"u8", "u16", "u32", "u64"};
+                fprintf(e.file, "    opLoadPacked<%s>(vm, %i, %u);\n", types[opCode - OP_LOAD_8], i16(operand),
+                    script.byteCode[address + 2]);
+                break;
+            }
+            case OP_STORE_8:
+            case OP_STORE_16:
+            case OP_STORE_32:
+            case OP_STORE_64:
+            {
+                static const char* types[] = {"u8", "u16", "u32", "u64"};
+                snprintf(buffer, sizeof(buffer), "opStorePacked<%s>(vm, %i, %u)", types[opCode - OP_STORE_8],
+                    i16(operand), script.byteCode[address + 2]);
+                emitCheckedOp(e, address, buffer);
+                break;
+            }
+            case OP_STACK_SET:
+                snprintf(buffer, sizeof(buffer), "opStackSet(vm, %u)", operand);
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_NATIVE_CALL:
+                snprintf(buffer, sizeof(buffer), "opNativeCall(vm, %i)", i16(operand));
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_GREATER:
+            case OP_LESSER:
+                snprintf(buffer, sizeof(buffer), "opBinary(vm, %s)", getOpCodeName(opCode));
+                emitCheckedOp(e, address, buffer);
+                break;
+
+            case OP_ARRAY_NEW:
+                snprintf(buffer, sizeof(buffer), "opArrayNew(vm, %u)", operand);
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_ARRAY_LITERAL:
+                snprintf(buffer, sizeof(buffer), "opArrayLiteral(vm, %u)", operand);
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_ARRAY_GET: emitCheckedOp(e, address, "opArrayGet(vm)"); break;
+            case OP_ARRAY_SET: emitCheckedOp(e, address, "opArraySet(vm)"); break;
+            case OP_STRUCT_LITERAL:
+                snprintf(buffer, sizeof(buffer), "opStructLiteral(vm, %u)", operand);
+                emitCheckedOp(e, address, buffer);
+                break;
+            case OP_FIELD_GET:
+            case OP_FIELD_SET:
+            case OP_ARRAY_FIELD_GET:
+            case OP_ARRAY_FIELD_SET:
+            {
+                const char* fn = opCode == OP_FIELD_GET ? "opFieldGet"
+                    : opCode == OP_FIELD_SET ? "opFieldSet"
+                    : opCode == OP_ARRAY_FIELD_GET ? "opArrayFieldGet" : "opArrayFieldSet";
+                snprintf(buffer, sizeof(buffer), "%s(vm, %u, %u, %u)", fn, operand,
+                    script.byteCode[address + 2], script.byteCode[address + 3]);
+                emitCheckedOp(e, address, buffer);
+                break;
+            }
+
+            case OP_JUMP:
+                fprintf(e.file, "    goto L_%x;\n", address + 3 + readAddress(script, address + 1));
+                break;
+            case OP_JUMP_IF_FALSE:
+                fprintf(e.file, "    if(!truthy(peekStack(vm.stack))) goto L_%x;\n",
+                    address + 3 + readAddress(script, address + 1));
+                break;
+            case OP_JUMP_IF_TRUE:
+                fprintf(e.file, "    if(truthy(peekStack(vm.stack))) goto L_%x;\n",
+                    address + 3 + readAddress(script, address + 1));
+                break;
+            case OP_FOR_LOOP:
+                fprintf(e.file, "    vm.ip = codeSpace + %i;\n", address + 1);
+                fprintf(e.file, "    { bool loop = false; if(!opForLoop(vm, %i, %u, %i, loop)) return InterpretResult_RuntimeError;"
+                    " if(loop) goto L_%x; }\n", i16(operand), script.byteCode[address + 2], i16(script.byteCode[address + 3]),
+                    address + 6 + readAddress(script, address + 4));
+                break;
+            case OP_MEMO_LOOKUP:
+                fprintf(e.file, "    { bool hit = false; opMemoLookup(vm, %u, %u, hit); if(hit) goto L_%x; }\n",
+                    operand, script.byteCode[address + 2], address + 5 + readAddress(script, address + 3));
+                break;
+            case OP_MEMO_STORE:
+                fprintf(e.file, "    opMemoStore(vm, %u, %u);\n", operand, script.byteCode[address + 2]);
+                break;
+            case OP_CODE_PUSH_RETURN_ADDRESS:
+                // C++ call returns by itself.
+                break;
+            case OP_JUMP_ADDRESS_DIRECTLY:
+            {
+                i32 calledIndex = e.addressToFunction[readAddress(script, address + 1)];
+                fprintf(e.file, "    { InterpretResult result = %s(vm); if(result != InterpretResult_Ok) return result; }\n",
+                    getFunctionName(script, calledIndex).c_str());
+                break;
+            }
+            case OP_RETURN: fprintf(e.file, "    return InterpretResult_Ok;\n"); break;
+            case OP_END_OF_FILE: fprintf(e.file, "    return InterpretResult_RuntimeError;\n"); break;
+            default:
+                LOG_ERROR("Op code not supported when emitting C++");
+                e.hadError = true;
+                return;
+        }
+        address += len;
+    }
+}
+
+static bool findJumpTargets(CppEmitter& e)
+{
+    const Script& script = e.script;
+    i32 address = 0;
+    i32 size = (i32)script.byteCode.size();
+    while(address < size)
+    {
+        OpCodeType opCode = script.byteCode[address];
+        i32 len = getOpCodeLength(opCode);
+        if(len == 0 || address + len > size)
+        {
+            LOG_ERROR("Unknown op code when emitting C++");
+            return false;
+        }
+        if(opCode == OP_JUMP || opCode == OP_JUMP_IF_FALSE || opCode == OP_JUMP_IF_TRUE)
+        {
+            i32 target = address + 3 + readAddress(script, address + 1);
+            if(target < 0 || target > size)
+            {
+                LOG_ERROR("Jump outside of the code when emitting C++");
+                return false;
+            }
+            e.jumpTargets[target] = true;
+        }
+        else if(opCode == OP_FOR_LOOP || opCode == OP_MEMO_LOOKUP)
+        {
+            i32 target = address + len + readAddress(script, address + len - 2);
+            if(target < 0 || target > size)
+            {
+                LOG_ERROR("Jump outside of the code when emitting C++");
+                return false;
+            }
+            e.jumpTargets[target] = true;
+        }
+        else if(opCode == OP_JUMP_ADDRESS_DIRECTLY)
+        {
+            i32 target = readAddress(script, address + 1);
+            if(target < 0 || target >= size || e.addressToFunction[target] < 0)
+            {
+                LOG_ERROR("Call into unknown function when emitting C++");
+                return false;
+            }
+        }
+        address += len;
+    }
+    return true;
+}
+
+static void emitScriptTables(CppEmitter& e)
+{
+    const Script& script = e.script;
+    FILE* file = e.file;
+
+    // Only used for reporting lines of runtime errors, runtimeError takes instruction index from ip.
+    fprintf(file, "static const OpCodeType codeSpace[%zu] = {};\n", script.byteCode.size() + 1);
+    fprintf(file, "static const i32 byteCodeLines[%zu] = {", script.byteCodeLines.size() + 1);
+    for(i32 i = 0; i < script.byteCodeLines.size(); ++i)
+    {
+        fprintf(file, "%s%i,", i % 32 == 0 ? "\n    " : " ", script.byteCodeLines[i]);
+    }
+    fprintf(file, "\n};\n\n");
+
+    fprintf(file, "static void initScript(Script& script)\n{\n");
+    fprintf(file, "    script.constants.structValueArray = {");
+    const std::vector<TypeOfValue>& constants = script.constants.structValueArray;
+    for(i32 i = 0; i < constants.size(); ++i)
+    {
+        fprintf(file, "%s0x%" PRIx64 ",", i % 8 == 0 ? "\n        " : " ", constants[i]);
+    }
+    fprintf(file, "\n    };\n");
+
+    fprintf(file, "    script.stringLiterals = {\n");
+    for(const std::string& str : script.stringLiterals)
+    {
+        fprintf(file, "        ");
+        emitString(file, str);
+        fprintf(file, ",\n");
+    }
+    fprintf(file, "    };\n");
+
+    // Struct stacks get copied into locals on OP_STACK_SET, compiler leaves their values zeroed.
+    fprintf(file, "    script.structStacks.resize(%zu);\n", script.structStacks.size());
+    for(i32 i = 0; i < script.structStacks.size(); ++i)
+    {
+        size_t count = script.structStacks[i].structValueArray.size();
+        if(count > 0)
+        {
+            fprintf(file, "    script.structStacks[%i].structValueArray.resize(%zu);\n", i, count);
+            fprintf(file, "    script.structStacks[%i].structValueTypes.resize(%zu);\n", i, count);
+        }
+        size_t packedCount = script.structStacks[i].structPackedValues.size();
+        if(packedCount > 0)
+        {
+            fprintf(file, "    script.structStacks[%i].structPackedValues.resize(%zu);\n", i, packedCount);
+        }
+    }
+
+    // Struct layouts, names are only for printing.
+    if(script.structDescs.size() > 0)
+    {
+        fprintf(file, "    script.allSymbolNames = {\n");
+        for(const std::string& name : script.allSymbolNames)
+        {
+            fprintf(file, "        ");
+            emitString(file, name);
+            fprintf(file, ",\n");
+        }
+        fprintf(file, "    };\n");
+        fprintf(file, "    script.structDescs = {\n");
+        for(const StructDesc& desc : script.structDescs)
+        {
+            fprintf(file, "        {%u, %u, %u, %u},\n", desc.parametersCount, desc.parameterStartIndex,
+                desc.structSize, desc.structAlignment);
+        }
+        fprintf(file, "    };\n");
+        fprintf(file, "    script.structNameIndices = {");
+        for(u32 index : script.structNameIndices)
+        {
+            fprintf(file, " %u,", index);
+        }
+        fprintf(file, " };\n");
+        fprintf(file, "    script.structFieldNameIndices = {");
+        for(u32 index : script.structFieldNameIndices)
+        {
+            fprintf(file, " %u,", index);
+        }
+        fprintf(file, " };\n");
+        fprintf(file, "    script.structFieldOffsets = {");
+        for(u32 offset : script.structFieldOffsets)
+        {
+            fprintf(file, " %u,", offset);
+        }
+        fprintf(file, " };\n");
+        fprintf(file, "    script.structFieldTypes = {");
+        for(ValueTypeDesc desc : script.structFieldTypes)
+        {
+            fprintf(file, " {%u, ValueType(%u), %u},", desc.structIndex, desc.valueType, desc.valueDerefLevel);
+        }
+        fprintf(file, " };\n");
+    }
+
+    fprintf(file, "    script.nativePatchFunctions.resize(%zu);\n", script.nativePatchFunctions.size());
+    for(i32 i = 0; i < script.nativePatchFunctions.size(); ++i)
+    {
+        const NativePatchFunction& fn = script.nativePatchFunctions[i];
+        std::string name = getStringFromTokenName(fn.token);
+        const NativeBinding* found = nullptr;
+        for(const NativeBinding& binding : NativeBindings)
+        {
+            if(name == binding.name)
+            {
+                found = &binding;
+            }
+        }
+        if(found == nullptr)
+        {
+            fprintf(stderr, "No native function: %s\n", name.c_str());
+            e.hadError = true;
+            continue;
+        }
+        fprintf(file, "    script.nativePatchFunctions[%i].parameterTypes.resize(%zu);\n", i, fn.parameterTypes.size());
+    }
+    fprintf(file, "}\n\n");
+
+    fprintf(file, "static void initNatives(VMState& state)\n{\n");
+    fprintf(file, "    state.natives = {\n");
+    for(const NativePatchFunction& fn : script.nativePatchFunctions)
+    {
+        std::string name = getStringFromTokenName(fn.token);
+        for(const NativeBinding& binding : NativeBindings)
+        {
+            if(name == binding.name)
+            {
+                fprintf(file, "        &%s,\n", binding.functionName);
+                break;
+            }
+        }
+    }
+    fprintf(file, "    };\n}\n\n");
+}
+
+bool emitCpp(const Script& script, const char* sourceName, FILE* file)
+{
+    CppEmitter e = {
+        .script = script,
+        .file = file,
+        .hadError = false,
+    };
+    e.addressToFunction.assign(script.byteCode.size() + 1, -1);
+    e.jumpTargets.assign(script.byteCode.size() + 1, false);
+    for(i32 i = 0; i < script.functions.size(); ++i)
+    {
+        const Function& fn = script.functions[i];
+        if(fn.functionEndLocation > fn.functionStartLocation)
+        {
+            e.addressToFunction[fn.functionStartLocation] = i;
+        }
+    }
+    if(!findJumpTargets(e))
+    {
+        return false;
+    }
+
+    fprintf(file, "// Generated by carpscript --emit-cpp from %s\n\n", sourceName);
+    fprintf(file, "#include \"nativefns.h\"\n#include \"script.h\"\n#include \"vm.h\"\n#include \"vmops.h\"\n\n");
+    emitScriptTables(e);
+
+    for(i32 i = 0; i < script.functions.size(); ++i)
+    {
+        if(e.addressToFunction[script.functions[i].functionStartLocation] == i)
+        {
+            fprintf(file, "static InterpretResult %s(VMRuntime& vm);\n", getFunctionName(script, i).c_str());
+        }
+    }
+    fprintf(file, "\n");
+
+    for(i32 i = 0; i < script.functions.size(); ++i)
+    {
+        const Function& fn = script.functions[i];
+        if(e.addressToFunction[fn.functionStartLocation] != i)
+        {
+            continue;
+        }
+        fprintf(file, "static InterpretResult %s(VMRuntime& vm)\n{\n", getFunctionName(script, i).c_str());
+        emitCode(e, fn.functionStartLocation, fn.functionEndLocation, false);
+        fprintf(file, "    return InterpretResult_Ok;\n}\n\n");
+    }
+
+    fprintf(file, "static InterpretResult carpTopLevel(VMRuntime& vm)\n{\n");
+    emitCode(e, 0, (i32)script.byteCode.size(), true);
+    if(e.jumpTargets[script.byteCode.size()])
+    {
+        fprintf(file, "L_%zx:;\n", script.byteCode.size());
+    }
+    fprintf(file, "    return InterpretResult_Ok;\n}\n\n");
+
+    fprintf(file,
+        "int main(int argc, const char** argv)\n"
+        "{\n"
+        "    Script script{};\n"
+        "    initScript(script);\n"
+        "    VMState state{};\n"
+        "    initNatives(state);\n"
+        "    state.stack.reserve(1024);\n"
+        "    state.stackValueInfo.reserve(1024);\n"
+        "    state.memoEntries = %i;\n"
+        "    resetVMState(state, script);\n"
+        "    VMRuntime vm = {\n"
+        "        .script = script,\n"
+        "        .state = state,\n"
+        "        .stack = state.stack,\n"
+        "        .stackValueInfo = state.stackValueInfo,\n"
+        "        .codeStart = codeSpace,\n"
+        "        .ip = codeSpace,\n"
+        "        .lines = byteCodeLines,\n"
+        "    };\n"
+        "    return carpTopLevel(vm) == InterpretResult_Ok ? 0 : 1;\n"
+        "}\n", VMOptions{}.memoEntries);
+
+    return !e.hadError;
+}
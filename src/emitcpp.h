@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+
+struct Script;
+
+// Writes a compiled script as a C++ translation unit with a main. Every script function
+// becomes a C++ function, ops call the same op functions the interpreter uses from vmops.h
+// and natives are bound through NativeBindings. Returns false if script cannot be emitted.
+bool emitCpp(const Script& script, const char* sourceName, FILE* file);
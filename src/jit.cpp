@@ -0,0 +1,793 @@
+#include "jit.h"
+
+#if JIT_ENABLED
+
+#include "op.h"
+#include "script.h"
+#include "vm.h"
+#include "vmops.h"
+
+#include <string.h> // memcpy
+
+#if _MSC_VER
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using JitHelper = i32 (*)(VMRuntime* vm, const OpCodeType* ip);
+
+struct JitState
+{
+    const Script& script;
+    // Function index for every function start address, -1 for others.
+    std::vector<i32> addressToFunction;
+    std::vector<i32> callCounts;
+    std::vector<bool> failed;
+    // Jitted functions call each other through these, so the vector must never be resized.
+    std::vector<JitFn> entries;
+
+    std::vector<void*> codeBlocks;
+    std::vector<size_t> codeBlockSizes;
+};
+
+struct JitFixup
+{
+    // Position of the rel32 in the code buffer.
+    i32 codePosition;
+    // Bytecode address to jump into, -1 for the function exit.
+    i32 targetAddress;
+};
+
+struct JitEmitter
+{
+    std::vector<u8> code;
+    std::vector<JitFixup> fixups;
+    // Code position for every bytecode address inside the function being emitted.
+    std::vector<i32> labels;
+    i32 exitLabel;
+};
+
+
+// Helpers called from the jitted code. ip points past the op code, same as in interpreter.
+
+static i32 helperConstant(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opConstant(*vm, ip[-1], ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperConstantString(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opConstantString(*vm, ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperNot(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opNot(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperNil(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opNil(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperEqual(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opEqual(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperNegate(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opNegate(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperPrint(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opPrint(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperPop(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opPop(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperDefineGlobal(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opDefineGlobal(*vm, (i16)ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperGetGlobal(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opGetGlobal(*vm, (i16)ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperSetGlobal(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opSetGlobal(*vm, (i16)ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+template <typename T>
+static i32 helperLoadPacked(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opLoadPacked<T>(*vm, (i16)ip[0], ip[1]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+template <typename T>
+static i32 helperStorePacked(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opStorePacked<T>(*vm, (i16)ip[0], ip[1]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperStackSet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opStackSet(*vm, ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperStackPop(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opStackPop(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperNativeCall(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opNativeCall(*vm, (i16)ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperBinary(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opBinary(*vm, ip[-1]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArrayNew(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArrayNew(*vm, ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArrayLiteral(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArrayLiteral(*vm, ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArrayGet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArrayGet(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArraySet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArraySet(*vm) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperStructLiteral(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opStructLiteral(*vm, ip[0]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperFieldGet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opFieldGet(*vm, ip[0], ip[1], ip[2]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperFieldSet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opFieldSet(*vm, ip[0], ip[1], ip[2]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArrayFieldGet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArrayFieldGet(*vm, ip[0], ip[1], ip[2]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperArrayFieldSet(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    return opArrayFieldSet(*vm, ip[0], ip[1], ip[2]) ? InterpretResult_Ok : InterpretResult_RuntimeError;
+}
+
+static i32 helperEndOfFile(VMRuntime* vm, const OpCodeType* ip)
+{
+    return InterpretResult_RuntimeError;
+}
+
+// Not a status, returns 1 when top of the stack is truthy.
+static i32 helperTruthy(VMRuntime* vm, const OpCodeType* ip)
+{
+    return truthy(peekStack(vm->stack)) ? 1 : 0;
+}
+
+// Returned by the for loop and memo lookup helpers when they jump, other values are statuses.
+constexpr i32 JitTakeJump = -1;
+
+static i32 helperForLoop(VMRuntime* vm, const OpCodeType* ip)
+{
+    vm->ip = ip;
+    bool loop = false;
+    if(!opForLoop(*vm, (i16)ip[0], ip[1], (i16)ip[2], loop))
+    {
+        return InterpretResult_RuntimeError;
+    }
+    return loop ? JitTakeJump : InterpretResult_Ok;
+}
+
+static i32 helperMemoLookup(VMRuntime* vm, const OpCodeType* ip)
+{
+    bool hit = false;
+    opMemoLookup(*vm, ip[0], ip[1], hit);
+    return hit ? JitTakeJump : InterpretResult_Ok;
+}
+
+static i32 helperMemoStore(VMRuntime* vm, const OpCodeType* ip)
+{
+    opMemoStore(*vm, ip[0], ip[1]);
+    return InterpretResult_Ok;
+}
+
+// Before a call between jitted functions, ip points to the called address.
+static i32 helperEnterCall(VMRuntime* vm, const OpCodeType* ip)
+{
+    if(vm->jitCallDepth >= JitMaxCallDepth)
+    {
+        vm->state.resumeAddress = i32(ip[0]) | (i32(ip[1]) << 16);
+        return InterpretResult_Yield;
+    }
+    ++vm->jitCallDepth;
+    return InterpretResult_Ok;
+}
+
+// After the call returns, passes its status through.
+static i32 helperLeaveCall(VMRuntime* vm, i32 status)
+{
+    --vm->jitCallDepth;
+    return status;
+}
+
+static i32 helperPushReturnAddress(VMRuntime* vm, const OpCodeType* ip)
+{
+    i32 address = i32(ip[0]) | (i32(ip[1]) << 16);
+    vm->state.functionReturnAddresses.push_back(address);
+    return InterpretResult_Ok;
+}
+
+static i32 helperReturn(VMRuntime* vm, const OpCodeType* ip)
+{
+    std::vector<i32>& returnAddresses = vm->state.functionReturnAddresses;
+    if(returnAddresses.size() == 0)
+    {
+        // Interpreter treats return address 0 as end of the script.
+        vm->returnAddress = 0;
+        return InterpretResult_Ok;
+    }
+    vm->returnAddress = returnAddresses.back();
+    returnAddresses.pop_back();
+    return InterpretResult_Ok;
+}
+
+static JitHelper getHelper(OpCodeType opCode)
+{
+    switch(opCode)
+    {
+        case OP_CONSTANT_BOOL:
+        case OP_CONSTANT_I8:
+        case OP_CONSTANT_U8:
+        case OP_CONSTANT_I16:
+        case OP_CONSTANT_U16:
+        case OP_CONSTANT_I32:
+        case OP_CONSTANT_U32:
+        case OP_CONSTANT_I64:
+        case OP_CONSTANT_U64:
+        case OP_CONSTANT_F32:
+        case OP_CONSTANT_F64:
+            return helperConstant;
+        case OP_CONSTANT_STRING: return helperConstantString;
+        case OP_NOT: return helperNot;
+        case OP_NIL: return helperNil;
+        case OP_EQUAL: return helperEqual;
+        case OP_NEGATE: return helperNegate;
+        case OP_PRINT: return helperPrint;
+        case OP_POP: return helperPop;
+        case OP_DEFINE_GLOBAL: return helperDefineGlobal;
+        case OP_GET_GLOBAL: return helperGetGlobal;
+        case OP_SET_GLOBAL: return helperSetGlobal;
+        case OP_LOAD_8: return helperLoadPacked<u8>;
+        case OP_LOAD_16: return helperLoadPacked<u16>;
+        case OP_LOAD_32: return helperLoadPacked<u32>;
+        case OP_LOAD_64: return helperLoadPacked<u64>;
+        case OP_STORE_8: return helperStorePacked<u8>;
+        case OP_STORE_16: return helperStorePacked<u16>;
+        case OP_STORE_32: return helperStorePacked<u32>;
+        case OP_STORE_64: return helperStorePacked<u64>;
+        case OP_STACK_SET: return helperStackSet;
+        case OP_STACK_POP: return helperStackPop;
+        case OP_NATIVE_CALL: return helperNativeCall;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_GREATER:
+        case OP_LESSER:
+            return helperBinary;
+        case OP_ARRAY_NEW: return helperArrayNew;
+        case OP_ARRAY_LITERAL: return helperArrayLiteral;
+        case OP_ARRAY_GET: return helperArrayGet;
+        case OP_ARRAY_SET: return helperArraySet;
+        case OP_STRUCT_LITERAL: return helperStructLiteral;
+        case OP_FIELD_GET: return helperFieldGet;
+        case OP_FIELD_SET: return helperFieldSet;
+        case OP_ARRAY_FIELD_GET: return helperArrayFieldGet;
+        case OP_ARRAY_FIELD_SET: return helperArrayFieldSet;
+        case OP_END_OF_FILE: return helperEndOfFile;
+        case OP_CODE_PUSH_RETURN_ADDRESS: return helperPushReturnAddress;
+        case OP_MEMO_STORE: return helperMemoStore;
+        case OP_RETURN: return helperReturn;
+        default:
+            return nullptr;
+    }
+}
+
+
+// x86-64 encoding. Jitted code keeps VMRuntime* in rbx.
+
+static void emit8(JitEmitter& e, u8 value)
+{
+    e.code.push_back(value);
+}
+
+static void emit32(JitEmitter& e, u32 value)
+{
+    for(i32 i = 0; i < 4; ++i)
+    {
+        e.code.push_back(u8(value >> (i * 8)));
+    }
+}
+
+static void emit64(JitEmitter& e, u64 value)
+{
+    for(i32 i = 0; i < 8; ++i)
+    {
+        e.code.push_back(u8(value >> (i * 8)));
+    }
+}
+
+static void emitPrologue(JitEmitter& e)
+{
+    // push rbx
+    emit8(e, 0x53);
+#if _MSC_VER
+    // mov rbx, rcx
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xcb);
+#else
+    // mov rbx, rdi
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xfb);
+#endif
+    // sub rsp, 32, shadow space on windows and keeps the stack 16 byte aligned on both.
+    emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xec); emit8(e, 0x20);
+}
+
+static void emitEpilogue(JitEmitter& e)
+{
+    // add rsp, 32
+    emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xc4); emit8(e, 0x20);
+    // pop rbx
+    emit8(e, 0x5b);
+    // ret
+    emit8(e, 0xc3);
+}
+
+static void emitFirstArgVm(JitEmitter& e)
+{
+#if _MSC_VER
+    // mov rcx, rbx
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xd9);
+#else
+    // mov rdi, rbx
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xdf);
+#endif
+}
+
+static void emitHelperCall(JitEmitter& e, JitHelper helper, const OpCodeType* ip)
+{
+    emitFirstArgVm(e);
+#if _MSC_VER
+    // mov rdx, imm64
+    emit8(e, 0x48); emit8(e, 0xba);
+#else
+    // mov rsi, imm64
+    emit8(e, 0x48); emit8(e, 0xbe);
+#endif
+    emit64(e, u64(intptr_t(ip)));
+    // mov rax, imm64
+    emit8(e, 0x48); emit8(e, 0xb8);
+    emit64(e, u64(intptr_t(helper)));
+    // call rax
+    emit8(e, 0xff); emit8(e, 0xd0);
+}
+
+static void emitJumpRel32(JitEmitter& e, i32 targetAddress)
+{
+    e.fixups.push_back({.codePosition = (i32)e.code.size(), .targetAddress = targetAddress});
+    emit32(e, 0);
+}
+
+// Leaves the function with the status in eax, if it is not InterpretResult_Ok.
+static void emitCheckStatus(JitEmitter& e)
+{
+    // test eax, eax
+    emit8(e, 0x85); emit8(e, 0xc0);
+    // jnz exit
+    emit8(e, 0x0f); emit8(e, 0x85);
+    emitJumpRel32(e, -1);
+}
+
+static bool isFunctionBodyValid(const JitState& jit, const Function& fn)
+{
+    const std::vector<OpCodeType>& byteCode = jit.script.byteCode;
+    std::vector<bool> instructionStarts(fn.functionEndLocation - fn.functionStartLocation, false);
+    i32 address = fn.functionStartLocation;
+    while(address < fn.functionEndLocation)
+    {
+        instructionStarts[address - fn.functionStartLocation] = true;
+        i32 len = getOpCodeLength(byteCode[address]);
+        if(len == 0 || address + len > fn.functionEndLocation)
+        {
+            return false;
+        }
+        address += len;
+    }
+
+    address = fn.functionStartLocation;
+    while(address < fn.functionEndLocation)
+    {
+        OpCodeType opCode = byteCode[address];
+        i32 len = getOpCodeLength(opCode);
+        i32 operand = len == 3 ? (i32(byteCode[address + 1]) | (i32(byteCode[address + 2]) << 16)) : 0;
+        switch(opCode)
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            {
+                i32 target = address + 3 + operand;
+                if(target < fn.functionStartLocation || target >= fn.functionEndLocation
+                    || !instructionStarts[target - fn.functionStartLocation])
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_MEMO_LOOKUP:
+            {
+                i32 target = address + len
+                    + (i32(byteCode[address + len - 2]) | (i32(byteCode[address + len - 1]) << 16));
+                if(target < fn.functionStartLocation || target >= fn.functionEndLocation
+                    || !instructionStarts[target - fn.functionStartLocation])
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_JUMP_ADDRESS_DIRECTLY:
+            {
+                // Calls must return to next instruction, that is where native call returns to.
+                if(operand < 0 || operand >= jit.addressToFunction.size() || jit.addressToFunction[operand] < 0)
+                {
+                    return false;
+                }
+                if(address < fn.functionStartLocation + 3 || byteCode[address - 3] != OP_CODE_PUSH_RETURN_ADDRESS)
+                {
+                    return false;
+                }
+                i32 returnAddress = i32(byteCode[address - 2]) | (i32(byteCode[address - 1]) << 16);
+                if(returnAddress != address + 3)
+                {
+                    return false;
+                }
+                break;
+            }
+            default:
+                if(getHelper(opCode) == nullptr)
+                {
+                    return false;
+                }
+                break;
+        }
+        address += len;
+    }
+    return true;
+}
+
+static void emitFunction(JitState& jit, JitEmitter& e, const Function& fn)
+{
+    const std::vector<OpCodeType>& byteCode = jit.script.byteCode;
+    e.fixups.clear();
+    e.labels.assign(fn.functionEndLocation - fn.functionStartLocation, -1);
+
+    emitPrologue(e);
+
+    i32 address = fn.functionStartLocation;
+    while(address < fn.functionEndLocation)
+    {
+        e.labels[address - fn.functionStartLocation] = (i32)e.code.size();
+
+        OpCodeType opCode = byteCode[address];
+        i32 len = getOpCodeLength(opCode);
+        const OpCodeType* ip = byteCode.data() + address + 1;
+        i32 operand = len == 3 ? (i32(ip[0]) | (i32(ip[1]) << 16)) : 0;
+        switch(opCode)
+        {
+            case OP_JUMP:
+            {
+                // jmp rel32
+                emit8(e, 0xe9);
+                emitJumpRel32(e, address + 3 + operand);
+                break;
+            }
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            {
+                emitHelperCall(e, helperTruthy, ip);
+                // test eax, eax
+                emit8(e, 0x85); emit8(e, 0xc0);
+                // jz / jnz rel32
+                emit8(e, 0x0f); emit8(e, opCode == OP_JUMP_IF_FALSE ? 0x84 : 0x85);
+                emitJumpRel32(e, address + 3 + operand);
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_MEMO_LOOKUP:
+            {
+                emitHelperCall(e, opCode == OP_FOR_LOOP ? helperForLoop : helperMemoLookup, ip);
+                // cmp eax, JitTakeJump
+                emit8(e, 0x83); emit8(e, 0xf8); emit8(e, u8(JitTakeJump));
+                // je rel32
+                emit8(e, 0x0f); emit8(e, 0x84);
+                emitJumpRel32(e, address + len + (i32(ip[len - 3]) | (i32(ip[len - 2]) << 16)));
+                emitCheckStatus(e);
+                break;
+            }
+            case OP_JUMP_ADDRESS_DIRECTLY:
+            {
+                i32 functionIndex = jit.addressToFunction[operand];
+                emitHelperCall(e, helperEnterCall, ip);
+                emitCheckStatus(e);
+                emitFirstArgVm(e);
+                // mov rax, imm64
+                emit8(e, 0x48); emit8(e, 0xb8);
+                emit64(e, u64(intptr_t(&jit.entries[functionIndex])));
+                // call [rax]
+                emit8(e, 0xff); emit8(e, 0x10);
+                emitFirstArgVm(e);
+            #if _MSC_VER
+                // mov edx, eax
+                emit8(e, 0x89); emit8(e, 0xc2);
+            #else
+                // mov esi, eax
+                emit8(e, 0x89); emit8(e, 0xc6);
+            #endif
+                // mov rax, imm64
+                emit8(e, 0x48); emit8(e, 0xb8);
+                emit64(e, u64(intptr_t(helperLeaveCall)));
+                // call rax
+                emit8(e, 0xff); emit8(e, 0xd0);
+                emitCheckStatus(e);
+                break;
+            }
+            case OP_RETURN:
+            case OP_END_OF_FILE:
+            {
+                emitHelperCall(e, getHelper(opCode), ip);
+                // jmp exit
+                emit8(e, 0xe9);
+                emitJumpRel32(e, -1);
+                break;
+            }
+            default:
+            {
+                emitHelperCall(e, getHelper(opCode), ip);
+                emitCheckStatus(e);
+                break;
+            }
+        }
+        address += len;
+    }
+
+    e.exitLabel = (i32)e.code.size();
+    emitEpilogue(e);
+
+    for(const JitFixup& fixup : e.fixups)
+    {
+        i32 target = fixup.targetAddress < 0
+            ? e.exitLabel
+            : e.labels[fixup.targetAddress - fn.functionStartLocation];
+        i32 rel = target - (fixup.codePosition + 4);
+        memcpy(&e.code[fixup.codePosition], &rel, sizeof(rel));
+    }
+}
+
+static void* allocateExecutable(const std::vector<u8>& code)
+{
+#if _MSC_VER
+    void* mem = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if(mem == nullptr)
+    {
+        return nullptr;
+    }
+    memcpy(mem, code.data(), code.size());
+    DWORD oldProtect;
+    if(!VirtualProtect(mem, code.size(), PAGE_EXECUTE_READ, &oldProtect))
+    {
+        VirtualFree(mem, 0, MEM_RELEASE);
+        return nullptr;
+    }
+#else
+    void* mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    memcpy(mem, code.data(), code.size());
+    if(mprotect(mem, code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, code.size());
+        return nullptr;
+    }
+#endif
+    return mem;
+}
+
+static void freeExecutable(void* mem, size_t size)
+{
+#if _MSC_VER
+    VirtualFree(mem, 0, MEM_RELEASE);
+#else
+    munmap(mem, size);
+#endif
+}
+
+// Compiles the function and every function it can call, since jitted code calls them directly.
+static void compileFunctions(JitState& jit, i32 functionIndex)
+{
+    const std::vector<OpCodeType>& byteCode = jit.script.byteCode;
+    std::vector<i32> batch;
+    std::vector<i32> todo = { functionIndex };
+    std::vector<bool> inBatch(jit.entries.size(), false);
+    inBatch[functionIndex] = true;
+    bool valid = true;
+    while(!todo.empty())
+    {
+        i32 index = todo.back();
+        todo.pop_back();
+        batch.push_back(index);
+        const Function& fn = jit.script.functions[index];
+        if(jit.failed[index] || !isFunctionBodyValid(jit, fn))
+        {
+            valid = false;
+            break;
+        }
+        for(i32 address = fn.functionStartLocation; address < fn.functionEndLocation;
+            address += getOpCodeLength(byteCode[address]))
+        {
+            if(byteCode[address] != OP_JUMP_ADDRESS_DIRECTLY)
+            {
+                continue;
+            }
+            i32 target = i32(byteCode[address + 1]) | (i32(byteCode[address + 2]) << 16);
+            i32 calledIndex = jit.addressToFunction[target];
+            if(jit.entries[calledIndex] == nullptr && !inBatch[calledIndex])
+            {
+                inBatch[calledIndex] = true;
+                todo.push_back(calledIndex);
+            }
+        }
+    }
+
+    JitEmitter e{};
+    std::vector<i32> functionOffsets;
+    if(valid)
+    {
+        for(i32 index : batch)
+        {
+            functionOffsets.push_back((i32)e.code.size());
+            emitFunction(jit, e, jit.script.functions[index]);
+        }
+    }
+    void* mem = valid ? allocateExecutable(e.code) : nullptr;
+    if(mem == nullptr)
+    {
+        for(i32 index : batch)
+        {
+            jit.failed[index] = true;
+        }
+        return;
+    }
+    jit.codeBlocks.push_back(mem);
+    jit.codeBlockSizes.push_back(e.code.size());
+    for(i32 i = 0; i < batch.size(); ++i)
+    {
+        jit.entries[batch[i]] = (JitFn)((u8*)mem + functionOffsets[i]);
+    }
+}
+
+JitState* jitCreate(const Script& script)
+{
+    JitState* jit = new JitState{ .script = script };
+    i32 functionCount = (i32)script.functions.size();
+    jit->addressToFunction.assign(script.byteCode.size() + 1, -1);
+    jit->callCounts.assign(functionCount, 0);
+    jit->failed.assign(functionCount, false);
+    jit->entries.assign(functionCount, nullptr);
+    for(i32 i = 0; i < functionCount; ++i)
+    {
+        const Function& fn = script.functions[i];
+        // Only forward declared, never got a body.
+        if(fn.functionEndLocation <= fn.functionStartLocation)
+        {
+            jit->failed[i] = true;
+            continue;
+        }
+        jit->addressToFunction[fn.functionStartLocation] = i;
+    }
+    return jit;
+}
+
+void jitDestroy(JitState* jit)
+{
+    if(jit == nullptr)
+    {
+        return;
+    }
+    for(i32 i = 0; i < jit->codeBlocks.size(); ++i)
+    {
+        freeExecutable(jit->codeBlocks[i], jit->codeBlockSizes[i]);
+    }
+    delete jit;
+}
+
+JitFn jitFunctionEntry(JitState* jit, i32 address)
+{
+    if(address < 0 || address >= jit->addressToFunction.size())
+    {
+        return nullptr;
+    }
+    i32 functionIndex = jit->addressToFunction[address];
+    if(functionIndex < 0)
+    {
+        return nullptr;
+    }
+    if(jit->entries[functionIndex] != nullptr || jit->failed[functionIndex])
+    {
+        return jit->entries[functionIndex];
+    }
+    if(++jit->callCounts[functionIndex] >= JitCallThreshold)
+    {
+        compileFunctions(*jit, functionIndex);
+    }
+    return jit->entries[functionIndex];
+}
+
+#endif
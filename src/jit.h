@@ -0,0 +1,35 @@
+#pragma once
+
+#include "mytypes.h"
+
+// Baseline jit translating hot script functions into x86-64 code. Every op becomes a call into
+// the same op functions the interpreter uses, jumps and calls between jitted functions are native.
+// Can be turned off at build time by defining JIT_ENABLED=0 and at runtime with --no-jit.
+#ifndef JIT_ENABLED
+    #if defined(__x86_64__) || defined(_M_X64)
+        #define JIT_ENABLED 1
+    #else
+        #define JIT_ENABLED 0
+    #endif
+#endif
+
+// How many calls into a function before it gets compiled.
+constexpr i32 JitCallThreshold = 64;
+// Jitted functions call each other on the native stack. A call deeper than this returns
+// InterpretResult_Yield through every jitted frame, and the interpreter continues from the called
+// function, the return addresses are on the vm stack already.
+constexpr i32 JitMaxCallDepth = 4096;
+
+struct Script;
+struct VMRuntime;
+struct JitState;
+
+// Returns InterpretResult, on InterpretResult_Ok vm->returnAddress is where the interpreter continues.
+using JitFn = i32 (*)(VMRuntime* vm);
+
+JitState* jitCreate(const Script& script);
+void jitDestroy(JitState* jit);
+
+// Counts a call into the function starting at address and compiles it once it gets hot.
+// Returns nullptr if function is not jitted.
+JitFn jitFunctionEntry(JitState* jit, i32 address);
@@ -0,0 +1,360 @@
+#include "lanes.h"
+
+#include "array.h"
+#include "op.h"
+#include "script.h"
+#include "vm.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LANES_SIMD_X64 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define LANES_SIMD_X64 0
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LANES_INLINE __forceinline
+#else
+// Inlined into the avx2 function, so the lane loops get compiled for avx2 there.
+#define LANES_INLINE inline __attribute__((always_inline))
+#endif
+
+// Values of one register for LaneCount rows.
+union alignas(64) LaneRegister
+{
+    u32 i[LaneCount];
+    f32 f[LaneCount];
+};
+
+struct LaneBuilder
+{
+    LaneProgram& program;
+    // Register of every value on the stack.
+    std::vector<u8> stack;
+    std::vector<ValueType> registerTypes;
+    // Frame locals by their offset from the end of the packed values, and the register stored last.
+    std::vector<i16> localOffsets;
+    std::vector<u8> localRegisters;
+};
+
+static bool isLaneType(u16 type)
+{
+    return type == ValueTypeI32 || type == ValueTypeF32;
+}
+
+static bool newRegister(LaneBuilder& builder, ValueType type)
+{
+    if(builder.program.registerCount >= LaneRegisterMax)
+    {
+        return false;
+    }
+    builder.stack.push_back(u8(builder.program.registerCount++));
+    builder.registerTypes.push_back(type);
+    return true;
+}
+
+static bool pushUniform(LaneBuilder& builder, ValueType type, u32 value)
+{
+    if(!newRegister(builder, type))
+    {
+        return false;
+    }
+    builder.program.uniforms.push_back({.reg = builder.stack.back(), .value = value});
+    return true;
+}
+
+static bool pushOp(LaneBuilder& builder, LaneOpKind kind, u8 a, u8 b)
+{
+    ValueType type = builder.registerTypes[a];
+    if(!newRegister(builder, type))
+    {
+        return false;
+    }
+    builder.program.ops.push_back({.kind = kind, .dst = builder.stack.back(), .a = a, .b = b});
+    return true;
+}
+
+static bool binaryOp(LaneBuilder& builder, OpCodeType opCode)
+{
+    if(builder.stack.size() < 2)
+    {
+        return false;
+    }
+    u8 b = builder.stack.back();
+    builder.stack.pop_back();
+    u8 a = builder.stack.back();
+    builder.stack.pop_back();
+    ValueType type = builder.registerTypes[a];
+    if(type != builder.registerTypes[b])
+    {
+        return false;
+    }
+    // Integer division can trap, it stays with the interpreter.
+    switch(opCode)
+    {
+        case OP_ADD: return pushOp(builder, type == ValueTypeI32 ? LaneOp_AddI32 : LaneOp_AddF32, a, b);
+        case OP_SUB: return pushOp(builder, type == ValueTypeI32 ? LaneOp_SubI32 : LaneOp_SubF32, a, b);
+        case OP_MUL: return pushOp(builder, type == ValueTypeI32 ? LaneOp_MulI32 : LaneOp_MulF32, a, b);
+        case OP_DIV: return type == ValueTypeF32 && pushOp(builder, LaneOp_DivF32, a, b);
+        default: return false;
+    }
+}
+
+static i32 findLocal(const LaneBuilder& builder, i16 offset)
+{
+    for(i32 i = 0; i < builder.localOffsets.size(); ++i)
+    {
+        if(builder.localOffsets[i] == offset)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool buildLaneProgram(LaneProgram& program, const Script& script, const VMState& state, i32 functionIndex)
+{
+    program = {};
+    const Function& fn = script.functions[functionIndex];
+    LaneBuilder builder = {.program = program};
+    program.argCount = (i32)fn.functionParamenterValueTypes.size();
+    for(const ValueTypeDesc& desc : fn.functionParamenterValueTypes)
+    {
+        if(!isLaneType(desc.valueType) || !newRegister(builder, desc.valueType))
+        {
+            return false;
+        }
+    }
+
+    const OpCodeType* code = script.byteCode.data();
+    i32 address = fn.functionStartLocation;
+    i32 end = fn.functionEndLocation;
+    // Body starts by entering the frame of the function.
+    if(address + 2 > end || code[address] != OP_STACK_SET || code[address + 1] >= script.structStacks.size())
+    {
+        return false;
+    }
+    u16 frameIndex = code[address + 1];
+    address += 2;
+    // Negative offsets are from the end of the frame, locals read before they are stored get the template value.
+    const std::vector<u64>& frameTemplate = script.structStacks[frameIndex].structPackedValues;
+    i32 frameBytes = i32(frameTemplate.size() * sizeof(u64));
+    const std::vector<u64>& globals = state.locals.structPackedValues;
+    i32 globalBytes = i32(globals.size() * sizeof(u64));
+    bool framePopped = false;
+    while(address < end)
+    {
+        OpCodeType opCode = code[address];
+        const OpCodeType* ip = code + address + 1;
+        switch(opCode)
+        {
+            case OP_CONSTANT_I32:
+            case OP_CONSTANT_F32:
+            {
+                ValueType type = opCode == OP_CONSTANT_I32 ? ValueTypeI32 : ValueTypeF32;
+                if(!pushUniform(builder, type, u32(script.constants.structValueArray[ip[0]])))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_LOAD_32:
+            {
+                i16 offset = i16(ip[0]);
+                u16 type = ip[1];
+                if(!isLaneType(type))
+                {
+                    return false;
+                }
+                i32 local = offset < 0 ? findLocal(builder, offset) : -1;
+                if(local >= 0)
+                {
+                    u8 reg = builder.localRegisters[local];
+                    if(builder.registerTypes[reg] != type)
+                    {
+                        return false;
+                    }
+                    builder.stack.push_back(reg);
+                    break;
+                }
+                // Globals and template values do not change during the batch.
+                const u8* bytes = offset < 0 ? (const u8*)frameTemplate.data() + frameBytes : (const u8*)globals.data();
+                i32 limit = offset < 0 ? 0 : globalBytes;
+                if((offset < 0 && frameBytes + offset < 0) || offset + 4 > limit)
+                {
+                    return false;
+                }
+                u32 value = 0;
+                memcpy(&value, bytes + offset, sizeof(u32));
+                if(!pushUniform(builder, ValueType(type), value))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_STORE_32:
+            {
+                i16 offset = i16(ip[0]);
+                u16 type = ip[1];
+                // Stores into globals are side effects rows would see in order.
+                if(offset >= 0 || builder.stack.empty() || builder.registerTypes[builder.stack.back()] != type)
+                {
+                    return false;
+                }
+                i32 local = findLocal(builder, offset);
+                if(local < 0)
+                {
+                    builder.localOffsets.push_back(offset);
+                    builder.localRegisters.push_back(builder.stack.back());
+                }
+                else
+                {
+                    builder.localRegisters[local] = builder.stack.back();
+                }
+                break;
+            }
+            case OP_POP:
+            {
+                if(builder.stack.empty())
+                {
+                    return false;
+                }
+                builder.stack.pop_back();
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            {
+                if(!binaryOp(builder, opCode))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_NEGATE:
+            {
+                if(builder.stack.empty())
+                {
+                    return false;
+                }
+                u8 a = builder.stack.back();
+                builder.stack.pop_back();
+                LaneOpKind kind = builder.registerTypes[a] == ValueTypeI32 ? LaneOp_NegateI32 : LaneOp_NegateF32;
+                if(!pushOp(builder, kind, a, a))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OP_STACK_POP:
+            {
+                if(framePopped)
+                {
+                    return false;
+                }
+                framePopped = true;
+                break;
+            }
+            case OP_RETURN:
+            {
+                // The result has to be all that is left, like the interpreter leaves it.
+                if(!framePopped || builder.stack.size() != 1)
+                {
+                    return false;
+                }
+                program.resultRegister = builder.stack[0];
+                program.resultType = builder.registerTypes[program.resultRegister];
+                return true;
+            }
+            default:
+            {
+                // Jumps, calls and everything else run one row at a time.
+                return false;
+            }
+        }
+        address += getOpCodeLength(opCode);
+    }
+    return false;
+}
+
+static LANES_INLINE void runLaneOp(const LaneOp& op, LaneRegister* registers)
+{
+    LaneRegister& dst = registers[op.dst];
+    const LaneRegister& a = registers[op.a];
+    const LaneRegister& b = registers[op.b];
+    // Integer ops wrap around like the interpreter, done as unsigned to keep them defined.
+    switch(op.kind)
+    {
+        case LaneOp_AddI32: for(i32 l = 0; l < LaneCount; ++l) dst.i[l] = a.i[l] + b.i[l]; break;
+        case LaneOp_SubI32: for(i32 l = 0; l < LaneCount; ++l) dst.i[l] = a.i[l] - b.i[l]; break;
+        case LaneOp_MulI32: for(i32 l = 0; l < LaneCount; ++l) dst.i[l] = a.i[l] * b.i[l]; break;
+        case LaneOp_NegateI32: for(i32 l = 0; l < LaneCount; ++l) dst.i[l] = 0u - a.i[l]; break;
+        case LaneOp_AddF32: for(i32 l = 0; l < LaneCount; ++l) dst.f[l] = a.f[l] + b.f[l]; break;
+        case LaneOp_SubF32: for(i32 l = 0; l < LaneCount; ++l) dst.f[l] = a.f[l] - b.f[l]; break;
+        case LaneOp_MulF32: for(i32 l = 0; l < LaneCount; ++l) dst.f[l] = a.f[l] * b.f[l]; break;
+        case LaneOp_DivF32: for(i32 l = 0; l < LaneCount; ++l) dst.f[l] = a.f[l] / b.f[l]; break;
+        case LaneOp_NegateF32: for(i32 l = 0; l < LaneCount; ++l) dst.f[l] = -a.f[l]; break;
+    }
+}
+
+static LANES_INLINE void runLaneGroupsInline(const LaneProgram& program, const ValueColumn* args, i64 groupCount,
+    const ValueColumn& results, LaneRegister* registers)
+{
+    for(i64 group = 0; group < groupCount; ++group)
+    {
+        i64 row = group * LaneCount;
+        for(i32 i = 0; i < program.argCount; ++i)
+        {
+            memcpy(registers[i].i, (const u32*)args[i].data + row, sizeof(LaneRegister));
+        }
+        for(const LaneOp& op : program.ops)
+        {
+            runLaneOp(op, registers);
+        }
+        memcpy((u32*)results.data + row, registers[program.resultRegister].i, sizeof(LaneRegister));
+    }
+}
+
+static void runLaneGroups(const LaneProgram& program, const ValueColumn* args, i64 groupCount,
+    const ValueColumn& results, LaneRegister* registers)
+{
+    runLaneGroupsInline(program, args, groupCount, results, registers);
+}
+
+#if LANES_SIMD_X64
+TARGET_AVX2 static void runLaneGroupsAvx2(const LaneProgram& program, const ValueColumn* args, i64 groupCount,
+    const ValueColumn& results, LaneRegister* registers)
+{
+    runLaneGroupsInline(program, args, groupCount, results, registers);
+}
+#endif
+
+i64 runLaneProgram(const LaneProgram& program, const ValueColumn* args, i64 rowCount, const ValueColumn& results)
+{
+    std::vector<LaneRegister> registers(program.registerCount);
+    for(const LaneUniform& uniform : program.uniforms)
+    {
+        for(i32 l = 0; l < LaneCount; ++l)
+        {
+            registers[uniform.reg].i[l] = uniform.value;
+        }
+    }
+    i64 groupCount = rowCount / LaneCount;
+#if LANES_SIMD_X64
+    if(getArraySimdLevel() == SimdLevel_Avx2)
+    {
+        runLaneGroupsAvx2(program, args, groupCount, results, registers.data());
+        return groupCount * LaneCount;
+    }
+#endif
+    runLaneGroups(program, args, groupCount, results, registers.data());
+    return groupCount * LaneCount;
+}
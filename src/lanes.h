@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+#include "mytypes.h"
+
+#include <vector>
+
+struct Script;
+struct VMState;
+struct ValueColumn;
+
+// Batches of a straight-line script function run LaneCount rows for every op, with each op
+// working on i32 or f32 lanes instead of one value. Functions with branches, calls or other
+// types run their rows one at a time.
+constexpr i32 LaneCount = 16;
+// Registers a lane program can use, each holds LaneCount values.
+constexpr i32 LaneRegisterMax = 256;
+
+enum LaneOpKind : u8
+{
+    LaneOp_AddI32,
+    LaneOp_SubI32,
+    LaneOp_MulI32,
+    LaneOp_NegateI32,
+    LaneOp_AddF32,
+    LaneOp_SubF32,
+    LaneOp_MulF32,
+    LaneOp_DivF32,
+    LaneOp_NegateF32,
+};
+
+struct LaneOp
+{
+    LaneOpKind kind;
+    u8 dst;
+    u8 a;
+    u8 b;
+};
+
+// Register holding a constant or a global, the same for every row.
+struct LaneUniform
+{
+    u8 reg;
+    u32 value;
+};
+
+// Function body with its stack, locals and pops resolved to registers, every register is written once.
+struct LaneProgram
+{
+    std::vector<LaneOp> ops;
+    std::vector<LaneUniform> uniforms;
+    // Arguments are the first registers.
+    i32 argCount;
+    i32 registerCount;
+    u8 resultRegister;
+    ValueType resultType;
+};
+
+// Fails for functions that are not straight-line i32 and f32 arithmetic. Globals the function
+// reads are taken from state, the function can not change them.
+bool buildLaneProgram(LaneProgram& program, const Script& script, const VMState& state, i32 functionIndex);
+// Runs rows in groups of LaneCount, returns how many rows it did. Remaining rows are fewer than LaneCount.
+i64 runLaneProgram(const LaneProgram& program, const ValueColumn* args, i64 rowCount, const ValueColumn& results);
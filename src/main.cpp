@@ -1,45 +1,64 @@
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <vector>
 
+#include "array.h"
+#include "batchcompile.h"
+#include "channel.h"
+#include "common.h"
+#include "compiler.h"
+#include "emitcpp.h"
 #include "error.h"
 #include "mymemory.h"
 #include "mytypes.h"
+#include "runner.h"
 #include "vm.h"
 
 
-static bool runFile(const char* filename)
+static bool emitCppFile(const char* filename, const char* outFilename)
 {
-    printf("Filename: %s\n", filename);
-
-    if(filename == nullptr)
+    MyMemory mem{};
+    Script& script = mem.scripts[addNewScript(mem)];
+    if(!loadScriptFile(mem, filename))
     {
-        LOG_ERROR("Filename is nullptr");
         return false;
     }
-
-    FILE* file = fopen(filename, "rb");
+    if(!compile(mem, script))
+    {
+        printf("Failed to compile: %s\n", filename);
+        return false;
+    }
+    FILE* file = fopen(outFilename, "wb");
     if(file == nullptr)
     {
-        LOG_ERROR("Failed to open file.");
+        LOG_ERROR("Failed to open output file.");
         return false;
     }
-    MyMemory mem{};
+    bool success = emitCpp(script, filename, file);
+    fclose(file);
+    if(!success)
+    {
+        remove(outFilename);
+    }
+    return success;
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t sz = ftell(file);
-    fseek(file, 0L, SEEK_SET);
+static bool runFile(const char* filename, const VMOptions& options)
+{
+    printf("Filename: %s\n", filename);
 
+    MyMemory mem{};
     Script& script = mem.scripts[addNewScript(mem)];
+    if(!loadScriptFile(mem, filename))
+    {
+        return false;
+    }
 
-    mem.scriptFile.resize(sz + 1);
-    size_t readBytes = fread(mem.scriptFile.data(), 1, sz, file);
-    assert(readBytes == sz);
-    mem.scriptFile[sz] = '\0';
-    fclose(file);
-
-    InterpretResult result = interpret(mem, script);
+    VMOptions fileOptions = options;
+    fileOptions.sourceName = filename;
+    InterpretResult result = interpret(mem, script, fileOptions);
 
     switch(result)
     {
@@ -70,28 +89,229 @@ static bool runFile(const char* filename)
 
 
 
+static bool runFilesParallel(const std::vector<const char*>& filenames, const RunnerOptions& options)
+{
+    // Every file is compiled once, workers only read the compiled scripts.
+    BatchCompileResult batch = compileFiles(filenames, options.threadCount);
+    if(batch.failed > 0)
+    {
+        return false;
+    }
+    std::vector<const Script*> scripts;
+    for(const MyMemory& mem : batch.mems)
+    {
+        scripts.push_back(&mem.scripts[0]);
+    }
+    RunnerStats stats = runScriptsParallel(scripts, options);
+    printRunnerStats(stats);
+    return stats.failed == 0;
+}
+
+static bool runFilesAsCoroutines(const std::vector<const char*>& filenames, const RunnerOptions& options, i32 coroutineCount)
+{
+    BatchCompileResult batch = compileFiles(filenames, options.threadCount);
+    if(batch.failed > 0)
+    {
+        return false;
+    }
+    std::vector<const Script*> scripts;
+    for(const MyMemory& mem : batch.mems)
+    {
+        scripts.push_back(&mem.scripts[0]);
+    }
+    RunnerStats stats = runCoroutines(scripts, options, coroutineCount);
+    printRunnerStats(stats);
+    return stats.failed == 0;
+}
+
+static bool compileFilesOnly(const std::vector<const char*>& filenames, i32 threadCount)
+{
+    BatchCompileResult batch = compileFiles(filenames, threadCount);
+    printf("Compiled %zu files, %" PRIu64 " failed, %.3f ms, %.1f files/s\n",
+        filenames.size(), batch.failed, batch.wallMs,
+        batch.wallMs > 0.0 ? double(filenames.size()) * 1000.0 / batch.wallMs : 0.0);
+    return batch.failed == 0;
+}
+
+// type:capacity, like i32:1024.
+static bool addChannel(Channels& channels, const char* spec)
+{
+    static const char* typeNames[] = { "bool", "i8", "u8", "i16", "u16", "i32", "u32", "i64", "u64", "f32", "f64" };
+    const char* colon = strchr(spec, ':');
+    if(colon == nullptr || atoi(colon + 1) <= 0)
+    {
+        return false;
+    }
+    for(i32 i = 0; i < sizeof(typeNames) / sizeof(typeNames[0]); ++i)
+    {
+        if(strlen(typeNames[i]) == size_t(colon - spec) && strncmp(spec, typeNames[i], colon - spec) == 0)
+        {
+            channelCreate(channels, ValueType(ValueTypeBool + i), (u32)atoi(colon + 1));
+            return true;
+        }
+    }
+    return false;
+}
+
 static void runPrompt()
 {
 }
 
 int main(int argc, const char** argv)
 {
-    if(argc > 3)
+    VMOptions options{};
+    RunnerOptions runnerOptions{};
+    Channels channels{};
+    options.channels = &channels;
+    bool parallel = false;
+    bool compileOnly = false;
+    i32 coroutineCount = 0;
+    std::vector<const char*> filenames;
+    const char* emitCppFilename = nullptr;
+    for(i32 i = 1; i < argc; ++i)
     {
-        printf("Usage: carp [script]\n");
+        if(strcmp(argv[i], "--no-jit") == 0)
+        {
+            options.useJit = false;
+        }
+        else if(strcmp(argv[i], "--stats") == 0)
+        {
+            options.printStats = true;
+            #if !VM_STATS
+                printf("Built without VM_STATS, --stats does nothing.\n");
+            #endif
+        }
+        else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            options.profileFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+        {
+            options.sampleFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--emit-cpp") == 0 && i + 1 < argc)
+        {
+            emitCppFilename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--parallel") == 0 && i + 1 < argc)
+        {
+            parallel = true;
+            runnerOptions.threadCount = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            runnerOptions.repeat = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--pin") == 0)
+        {
+            runnerOptions.pinThreads = true;
+        }
+        else if(strcmp(argv[i], "--task-threads") == 0 && i + 1 < argc)
+        {
+            options.taskThreads = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--memo-entries") == 0 && i + 1 < argc)
+        {
+            options.memoEntries = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--channel") == 0 && i + 1 < argc)
+        {
+            if(!addChannel(channels, argv[++i]))
+            {
+                printf("Bad channel: %s, expected type:capacity like i32:1024\n", argv[i]);
+                return 64;
+            }
+        }
+        else if(strcmp(argv[i], "--coroutines") == 0 && i + 1 < argc)
+        {
+            coroutineCount = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+        {
+            // Caps the bulk array kernels, to compare them. Default is the best the cpu has.
+            ++i;
+            SimdLevel level = SimdLevel_Avx2;
+            while(level > SimdLevel_Scalar && strcmp(argv[i], getSimdLevelName(level)) != 0)
+            {
+                level = SimdLevel(level - 1);
+            }
+            if(strcmp(argv[i], getSimdLevelName(level)) != 0)
+            {
+                printf("Bad simd level: %s, expected scalar, sse2 or avx2\n", argv[i]);
+                return 64;
+            }
+            level = setArraySimdLevel(level);
+            printf("Array kernels: %s\n", getSimdLevelName(level));
+        }
+        else if(strcmp(argv[i], "--compile-only") == 0)
+        {
+            compileOnly = true;
+        }
+        else
+        {
+            filenames.push_back(argv[i]);
+        }
+    }
+    const char* filename = filenames.empty() ? nullptr : filenames[0];
+    if(filenames.size() > 1 && !parallel && !compileOnly && coroutineCount <= 0)
+    {
+        argc = 0;
+    }
+    if(argc == 0)
+    {
+        printf("Usage: carp [--no-jit] [--stats] [--profile out.callgrind] [--sample out.folded] [--emit-cpp output.cpp]\n");
+        printf("            [--task-threads n] [--simd scalar|sse2|avx2] [--memo-entries n] [script]\n");
+        printf("       carp --parallel threads [--repeat n] [--pin] [--no-jit] script...\n");
+        printf("       carp --compile-only [--parallel threads] script...\n");
+        printf("       carp --coroutines n [--parallel threads] [--pin] script...\n");
+        printf("       --channel type:capacity adds a channel for send and recv, like i32:1024, any number of times\n");
+        printf("       --memo-entries n caches up to n results of each pure fn, 0 runs every call, default 4096\n");
         return 64;
     }
-    else if(argc == 2)
+    else if(emitCppFilename != nullptr)
+    {
+        if(filename == nullptr || !emitCppFile(filename, emitCppFilename))
+        {
+            printf("Failed to emit C++ from: %s\n", filename ? filename : "no script");
+            return 1;
+        }
+    }
+    else if(compileOnly && filename != nullptr)
     {
-        if(!runFile(argv[1]))
+        if(!compileFilesOnly(filenames, parallel ? runnerOptions.threadCount : 1))
         {
-            printf("Failed to run file: %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else if(coroutineCount > 0 && filename != nullptr)
+    {
+        runnerOptions.vmOptions = options;
+        if(!runFilesAsCoroutines(filenames, runnerOptions, coroutineCount))
+        {
+            printf("Failed to run coroutines.\n");
+            return 1;
+        }
+    }
+    else if(parallel && filename != nullptr)
+    {
+        runnerOptions.vmOptions = options;
+        if(!runFilesParallel(filenames, runnerOptions))
+        {
+            printf("Failed to run files in parallel.\n");
+            return 1;
+        }
+    }
+    else if(filename != nullptr)
+    {
+        if(!runFile(filename, options))
+        {
+            printf("Failed to run file: %s\n", filename);
         }
     }
     else
     {
         const char* filename = "prog/clock.carp";
-        if(!runFile(filename))
+        if(!runFile(filename, options))
         {
             printf("Failed to run file: %s\n", filename);
         }
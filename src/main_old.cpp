@@ -53,7 +53,7 @@ int mainold()
 
     disassembleCode(script, "test op");
 
-    runCode(script);
+    runCode(script, VMOptions{});
 
     return 0;
 }
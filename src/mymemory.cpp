@@ -1,5 +1,10 @@
 #include "mymemory.h"
 
+#include "error.h"
+
+#include <assert.h>
+#include <stdio.h>
+
 i32 addNewScript(MyMemory& mem)
 {
     Script s{};
@@ -10,3 +15,30 @@ i32 addNewScript(MyMemory& mem)
     addStruct(script, "global", -1);
     return index;
 }
+
+bool loadScriptFile(MyMemory& mem, const char* filename)
+{
+    if(filename == nullptr)
+    {
+        LOG_ERROR("Filename is nullptr");
+        return false;
+    }
+
+    FILE* file = fopen(filename, "rb");
+    if(file == nullptr)
+    {
+        LOG_ERROR("Failed to open file.");
+        return false;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t sz = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    mem.scriptFile.resize(sz + 1);
+    size_t readBytes = fread(mem.scriptFile.data(), 1, sz, file);
+    assert(readBytes == sz);
+    mem.scriptFile[sz] = '\0';
+    fclose(file);
+    return true;
+}
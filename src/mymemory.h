@@ -14,3 +14,5 @@ struct MyMemory
 };
 
 i32 addNewScript(MyMemory& mem);
+// Reads the whole file into mem.scriptFile with a terminating zero.
+bool loadScriptFile(MyMemory& mem, const char* filename);
@@ -2,7 +2,7 @@
 
 #include "time.h"
 
-NativeReturn clockNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+NativeReturn clockNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
 {
     assert(argc == 0);
     double cl = double(clock() / (double)CLOCKS_PER_SEC);
@@ -13,7 +13,7 @@ NativeReturn clockNative(Script& script, i32 argc, const TypeOfValue* values, co
     };
 }
 
-NativeReturn addNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+NativeReturn addNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
 {
     assert(argc == 2);
     assert(descs[0].valueType == ValueTypeF32);
@@ -30,14 +30,149 @@ NativeReturn addNative(Script& script, i32 argc, const TypeOfValue* values, cons
 }
 
 
-NativeReturn stringNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+NativeReturn stringNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
 {
     assert(argc == 2);
-    script.stringLiterals.push_back("Testing some random string");
+    state.stackStrings.push_back("Testing some random string");
 
-    u64 returnVal = script.stringLiterals.size() - 1;
+    u64 returnVal = state.stackStrings.size() - 1;
     return {
         .value = returnVal,
-        .desc = {.valueType = ValueTypeStringLiteral}
+        .desc = {.valueType = ValueTypeString}
+    };
+}
+
+// Wrong arguments return no type, the vm reports it as a runtime error.
+static ScriptArray* getArrayArg(VMState& state, const TypeOfValue* values, const ValueTypeDesc* descs, i32 index)
+{
+    if(descs[index].valueType != ValueTypeArray || values[index] >= state.arrays.size())
+    {
+        return nullptr;
+    }
+    return state.arrays[values[index]].get();
+}
+
+static NativeReturn nilReturn()
+{
+    return {
+        .value = 0,
+        .desc = {.valueType = ValueTypeNull}
+    };
+}
+
+NativeReturn arrayLenNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    ScriptArray* array = argc == 1 ? getArrayArg(state, values, descs, 0) : nullptr;
+    if(array == nullptr)
+    {
+        return {};
+    }
+    // Same type as integer literals, so it compares with loop counters.
+    return {
+        .value = TypeOfValue(u32(array->count)),
+        .desc = {.valueType = ValueTypeI32}
+    };
+}
+
+// arrayAdd(dst, a, b) and arrayMul(dst, a, b), dst can be a or b.
+NativeReturn arrayAddNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    if(argc != 3)
+    {
+        return {};
+    }
+    ScriptArray* dst = getArrayArg(state, values, descs, 0);
+    ScriptArray* a = getArrayArg(state, values, descs, 1);
+    ScriptArray* b = getArrayArg(state, values, descs, 2);
+    if(dst == nullptr || a == nullptr || b == nullptr || !arrayAdd(*dst, *a, *b))
+    {
+        return {};
+    }
+    return nilReturn();
+}
+
+NativeReturn arrayMulNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    if(argc != 3)
+    {
+        return {};
+    }
+    ScriptArray* dst = getArrayArg(state, values, descs, 0);
+    ScriptArray* a = getArrayArg(state, values, descs, 1);
+    ScriptArray* b = getArrayArg(state, values, descs, 2);
+    if(dst == nullptr || a == nullptr || b == nullptr || !arrayMul(*dst, *a, *b))
+    {
+        return {};
+    }
+    return nilReturn();
+}
+
+// arrayScale(array, scalar), scalar has the element type.
+NativeReturn arrayScaleNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    ScriptArray* array = argc == 2 ? getArrayArg(state, values, descs, 0) : nullptr;
+    if(array == nullptr || !isNumberArray(*array) || descs[1].valueType != array->elementType)
+    {
+        return {};
+    }
+    arrayScale(*array, values[1]);
+    return nilReturn();
+}
+
+NativeReturn arraySumNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    ScriptArray* array = argc == 1 ? getArrayArg(state, values, descs, 0) : nullptr;
+    if(array == nullptr || !isNumberArray(*array))
+    {
+        return {};
+    }
+    return {
+        .value = arraySum(*array),
+        .desc = {.valueType = array->elementType}
+    };
+}
+
+NativeReturn arrayMinNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    ScriptArray* array = argc == 1 ? getArrayArg(state, values, descs, 0) : nullptr;
+    if(array == nullptr || !isNumberArray(*array) || array->count == 0)
+    {
+        return {};
+    }
+    return {
+        .value = arrayMin(*array),
+        .desc = {.valueType = array->elementType}
+    };
+}
+
+NativeReturn arrayMaxNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    ScriptArray* array = argc == 1 ? getArrayArg(state, values, descs, 0) : nullptr;
+    if(array == nullptr || !isNumberArray(*array) || array->count == 0)
+    {
+        return {};
+    }
+    return {
+        .value = arrayMax(*array),
+        .desc = {.valueType = array->elementType}
+    };
+}
+
+NativeReturn arrayDotNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs)
+{
+    if(argc != 2)
+    {
+        return {};
+    }
+    ScriptArray* a = getArrayArg(state, values, descs, 0);
+    ScriptArray* b = getArrayArg(state, values, descs, 1);
+    TypeOfValue result = 0;
+    if(a == nullptr || b == nullptr || !arrayDot(*a, *b, result))
+    {
+        return {};
+    }
+    return {
+        .value = result,
+        .desc = {.valueType = a->elementType}
     };
 }
@@ -2,8 +2,45 @@
 
 #include "script.h"
 
-NativeReturn clockNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn clockNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
 
-NativeReturn addNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn addNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
 
-NativeReturn stringNative(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn stringNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+
+// Bulk array ops, run as simd kernels for f32 and f64 arrays.
+NativeReturn arrayLenNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayAddNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayMulNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayScaleNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arraySumNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayMinNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayMaxNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+NativeReturn arrayDotNative(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+
+struct NativeBinding
+{
+    // Name scripts use with call.
+    const char* name;
+    // Name of the C++ function, used when emitting C++ from a script.
+    const char* functionName;
+    NativeFn callFn;
+    // Result only depends on the arguments and nothing else changes, pure fns can call it.
+    bool pure;
+};
+
+static const NativeBinding NativeBindings[] =
+{
+    { "clock", "clockNative", &clockNative, false },
+    { "addNative", "addNative", &addNative, true },
+    { "stringNative", "stringNative", &stringNative, true },
+    // Arrays a pure fn has are its own, changing them is not a side effect.
+    { "arrayLen", "arrayLenNative", &arrayLenNative, true },
+    { "arrayAdd", "arrayAddNative", &arrayAddNative, true },
+    { "arrayMul", "arrayMulNative", &arrayMulNative, true },
+    { "arrayScale", "arrayScaleNative", &arrayScaleNative, true },
+    { "arraySum", "arraySumNative", &arraySumNative, true },
+    { "arrayMin", "arrayMinNative", &arrayMinNative, true },
+    { "arrayMax", "arrayMaxNative", &arrayMaxNative, true },
+    { "arrayDot", "arrayDotNative", &arrayDotNative, true },
+};
@@ -31,6 +31,17 @@ enum Op : OpCodeType
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
+    // Packed value of a known type, byte offset and value type as operands. Negative offset
+    // counts from the end of the locals, positive is a global.
+    OP_LOAD_8,
+    OP_LOAD_16,
+    OP_LOAD_32,
+    OP_LOAD_64,
+    // Same operands, stores the value on top of the stack and leaves it there.
+    OP_STORE_8,
+    OP_STORE_16,
+    OP_STORE_32,
+    OP_STORE_64,
 
     OP_STACK_SET,
     OP_STACK_POP,
@@ -38,10 +49,50 @@ enum Op : OpCodeType
     OP_JUMP_IF_FALSE,
     OP_JUMP_IF_TRUE,
     OP_JUMP,
+    // Packed counter offset, type, step and loop offset. Pops the limit, adds step to the counter
+    // and jumps back while the counter is below the limit, above it for a negative step.
+    OP_FOR_LOOP,
     // No offset, function call direct jump
     OP_JUMP_ADDRESS_DIRECTLY,
     OP_CODE_PUSH_RETURN_ADDRESS,
+    // Function index, argument count and offset. Before a call of a pure fn, when the arguments
+    // on the stack have a cached result it replaces them and the call gets jumped over.
+    OP_MEMO_LOOKUP,
+    // Function index and argument count, after the call. Caches the result for the arguments
+    // the lookup kept.
+    OP_MEMO_STORE,
     OP_NATIVE_CALL,
+    // Function index, runs the call as a task and pushes its handle.
+    OP_SPAWN,
+    // Pops task handle, waits for the task and pushes its result.
+    OP_JOIN,
+    // Body offset and reductions, pops range start, end and reduction values, runs the body
+    // in chunks as tasks and pushes the reduced values.
+    OP_PARALLEL_FOR,
+    // Suspends the run, resuming continues from the next op.
+    OP_YIELD,
+    // Pops channel index and value, pushes nil. Waits while the channel is full.
+    OP_SEND,
+    // Pops channel index, pushes received value. Waits while the channel is empty.
+    OP_RECV,
+    // Element type, pops element count and pushes a new zeroed array.
+    OP_ARRAY_NEW,
+    // Element count, pops the elements and pushes an array of them.
+    OP_ARRAY_LITERAL,
+    // Pops array and index, pushes the element.
+    OP_ARRAY_GET,
+    // Pops array, index and value, stores the value and pushes it.
+    OP_ARRAY_SET,
+    // Struct index, pops the field values in declaration order and pushes the new struct.
+    OP_STRUCT_LITERAL,
+    // Struct index, byte offset and type id of the field. Pops the struct, pushes the field.
+    OP_FIELD_GET,
+    // Same operands, pops the struct and value, stores the value and pushes it.
+    OP_FIELD_SET,
+    // Same operands, pops array and index, pushes the field of the element.
+    OP_ARRAY_FIELD_GET,
+    // Same operands, pops array, index and value, stores the value and pushes it.
+    OP_ARRAY_FIELD_SET,
 
     OP_CONSTANT_BOOL, // = 0x100,
     OP_CONSTANT_I8,
@@ -62,6 +113,21 @@ enum Op : OpCodeType
 
 };
 
+// OP_PARALLEL_FOR reductions operand, count in the low bits and 2 bits of kind for each.
+enum ParallelReduction : u16
+{
+    ParallelReduction_Sum,
+    ParallelReduction_Min,
+    ParallelReduction_Max,
+};
+constexpr u16 ParallelReductionCountMask = 0xf;
+constexpr i32 ParallelReductionMaxCount = 6;
+
+static ParallelReduction getParallelReduction(u16 reductions, i32 index)
+{
+    return ParallelReduction((reductions >> (4 + index * 2)) & 0x3);
+}
+
 static const char* getOpCodeName(OpCodeType type)
 {
     switch(type)
@@ -87,6 +153,14 @@ static const char* getOpCodeName(OpCodeType type)
         case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
         case OP_GET_GLOBAL:return "OP_GET_GLOBAL";
         case OP_SET_GLOBAL:return "OP_SET_GLOBAL";
+        case OP_LOAD_8: return "OP_LOAD_8";
+        case OP_LOAD_16: return "OP_LOAD_16";
+        case OP_LOAD_32: return "OP_LOAD_32";
+        case OP_LOAD_64: return "OP_LOAD_64";
+        case OP_STORE_8: return "OP_STORE_8";
+        case OP_STORE_16: return "OP_STORE_16";
+        case OP_STORE_32: return "OP_STORE_32";
+        case OP_STORE_64: return "OP_STORE_64";
 
         case OP_STACK_SET: return "OP_STACK_SET";
         case OP_STACK_POP: return "OP_STACK_POP";
@@ -94,9 +168,27 @@ static const char* getOpCodeName(OpCodeType type)
         case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
         case OP_JUMP_IF_TRUE: return "OP_JUMP_IF_TRUE";
         case OP_JUMP: return "OP_JUMP";
+        case OP_FOR_LOOP: return "OP_FOR_LOOP";
         case OP_JUMP_ADDRESS_DIRECTLY: return "OP_JUMP_ADDRESS_DIRECTLY";
         case OP_CODE_PUSH_RETURN_ADDRESS: return "OP_CODE_PUSH_RETURN_ADDRESS";
+        case OP_MEMO_LOOKUP: return "OP_MEMO_LOOKUP";
+        case OP_MEMO_STORE: return "OP_MEMO_STORE";
         case OP_NATIVE_CALL: return "OP_NATIVE_CALL";
+        case OP_SPAWN: return "OP_SPAWN";
+        case OP_JOIN: return "OP_JOIN";
+        case OP_PARALLEL_FOR: return "OP_PARALLEL_FOR";
+        case OP_YIELD: return "OP_YIELD";
+        case OP_SEND: return "OP_SEND";
+        case OP_RECV: return "OP_RECV";
+        case OP_ARRAY_NEW: return "OP_ARRAY_NEW";
+        case OP_ARRAY_LITERAL: return "OP_ARRAY_LITERAL";
+        case OP_ARRAY_GET: return "OP_ARRAY_GET";
+        case OP_ARRAY_SET: return "OP_ARRAY_SET";
+        case OP_STRUCT_LITERAL: return "OP_STRUCT_LITERAL";
+        case OP_FIELD_GET: return "OP_FIELD_GET";
+        case OP_FIELD_SET: return "OP_FIELD_SET";
+        case OP_ARRAY_FIELD_GET: return "OP_ARRAY_FIELD_GET";
+        case OP_ARRAY_FIELD_SET: return "OP_ARRAY_FIELD_SET";
 
         case OP_CONSTANT_BOOL: return "OP_CONSTANT_BOOL";
         case OP_CONSTANT_I8: return "OP_CONSTANT_I8";
@@ -118,4 +210,89 @@ static const char* getOpCodeName(OpCodeType type)
             assert(false);
     }
     return "";
-}
\ No newline at end of file
+}
+
+// Instruction length in op codes, including the op code itself. 0 for unknown op codes.
+static i32 getOpCodeLength(OpCodeType type)
+{
+    switch(type)
+    {
+        case OP_END_OF_FILE:
+        case OP_RETURN:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_NIL:
+        case OP_NOT:
+        case OP_GREATER:
+        case OP_LESSER:
+        case OP_EQUAL:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_STACK_POP:
+        case OP_JOIN:
+        case OP_YIELD:
+        case OP_SEND:
+        case OP_RECV:
+        case OP_ARRAY_GET:
+        case OP_ARRAY_SET:
+            return 1;
+
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_STACK_SET:
+        case OP_NATIVE_CALL:
+        case OP_SPAWN:
+        case OP_ARRAY_NEW:
+        case OP_ARRAY_LITERAL:
+        case OP_STRUCT_LITERAL:
+        case OP_CONSTANT_BOOL:
+        case OP_CONSTANT_I8:
+        case OP_CONSTANT_U8:
+        case OP_CONSTANT_I16:
+        case OP_CONSTANT_U16:
+        case OP_CONSTANT_I32:
+        case OP_CONSTANT_U32:
+        case OP_CONSTANT_I64:
+        case OP_CONSTANT_U64:
+        case OP_CONSTANT_F32:
+        case OP_CONSTANT_F64:
+        case OP_CONSTANT_STRING:
+            return 2;
+
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP:
+        case OP_JUMP_ADDRESS_DIRECTLY:
+        case OP_CODE_PUSH_RETURN_ADDRESS:
+        case OP_LOAD_8:
+        case OP_LOAD_16:
+        case OP_LOAD_32:
+        case OP_LOAD_64:
+        case OP_STORE_8:
+        case OP_STORE_16:
+        case OP_STORE_32:
+        case OP_STORE_64:
+        case OP_MEMO_STORE:
+            return 3;
+
+        case OP_PARALLEL_FOR:
+        case OP_FIELD_GET:
+        case OP_FIELD_SET:
+        case OP_ARRAY_FIELD_GET:
+        case OP_ARRAY_FIELD_SET:
+            return 4;
+
+        case OP_MEMO_LOOKUP:
+            return 5;
+
+        case OP_FOR_LOOP:
+            return 6;
+
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,243 @@
+#include "profiler.h"
+
+#include "script.h"
+
+#include <algorithm>
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+
+#if _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static u64 readCycleCounter()
+{
+#if _MSC_VER || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static u64 readNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void enterEntry(Profiler& profiler, i32 entry)
+{
+    profiler.calls[entry]++;
+    profiler.activeCounts[entry]++;
+    // Caller is the innermost frame of an entry.
+    ProfileEdge* edge = nullptr;
+    for(size_t i = profiler.frames.size(); i > 0; --i)
+    {
+        const ProfileFrame& caller = profiler.frames[i - 1];
+        if(caller.entry >= 0)
+        {
+            edge = &profiler.edges[(u64(caller.entry) << 32) | u64(entry)];
+            edge->calls++;
+            edge->activeCount++;
+            break;
+        }
+    }
+    profiler.frames.push_back({ .entry = entry, .startTicks = readCycleCounter(), .childTicks = 0, .edge = edge });
+}
+
+void profilerBegin(Profiler& profiler, const Script& script)
+{
+    profiler.addressToEntry.assign(script.byteCode.size() + 1, -1);
+    profiler.names.push_back("<top level>");
+    profiler.lines.push_back(1);
+    for(const Function& fn : script.functions)
+    {
+        if(fn.functionEndLocation > fn.functionStartLocation)
+        {
+            profiler.addressToEntry[fn.functionStartLocation] = (i32)profiler.names.size();
+        }
+        profiler.names.push_back(script.allSymbolNames[fn.functionNameIndex]);
+        profiler.lines.push_back(fn.functionStartLocation < script.byteCodeLines.size()
+            ? script.byteCodeLines[fn.functionStartLocation] : 0);
+    }
+    profiler.nativeEntryStart = (i32)profiler.names.size();
+    for(const NativePatchFunction& fn : script.nativePatchFunctions)
+    {
+        profiler.names.push_back(getStringFromTokenName(fn.token));
+        profiler.lines.push_back(fn.token.line);
+    }
+    size_t entryCount = profiler.names.size();
+    profiler.calls.assign(entryCount, 0);
+    profiler.inclusiveTicks.assign(entryCount, 0);
+    profiler.exclusiveTicks.assign(entryCount, 0);
+    profiler.activeCounts.assign(entryCount, 0);
+
+    profiler.startNanoseconds = readNanoseconds();
+    profiler.startTicks = readCycleCounter();
+    enterEntry(profiler, 0);
+}
+
+void profilerEnd(Profiler& profiler)
+{
+    while(!profiler.frames.empty())
+    {
+        profilerExit(profiler);
+    }
+    profiler.endTicks = readCycleCounter();
+    profiler.endNanoseconds = readNanoseconds();
+}
+
+void profilerEnterFunction(Profiler& profiler, i32 address)
+{
+    i32 entry = address >= 0 && address < profiler.addressToEntry.size() ? profiler.addressToEntry[address] : -1;
+    if(entry >= 0)
+    {
+        enterEntry(profiler, entry);
+        return;
+    }
+    // Its return still exits a frame.
+    profiler.frames.push_back({ .entry = -1, .startTicks = 0, .childTicks = 0, .edge = nullptr });
+}
+
+void profilerEnterNative(Profiler& profiler, i32 nativeIndex)
+{
+    enterEntry(profiler, profiler.nativeEntryStart + nativeIndex);
+}
+
+void profilerExit(Profiler& profiler)
+{
+    if(profiler.frames.empty())
+    {
+        return;
+    }
+    ProfileFrame frame = profiler.frames.back();
+    profiler.frames.pop_back();
+    if(frame.entry < 0)
+    {
+        // Own time of the frame stays with the caller, only its children are not.
+        if(!profiler.frames.empty())
+        {
+            profiler.frames.back().childTicks += frame.childTicks;
+        }
+        return;
+    }
+    u64 elapsed = readCycleCounter() - frame.startTicks;
+
+    profiler.exclusiveTicks[frame.entry] += elapsed - std::min(elapsed, frame.childTicks);
+    profiler.activeCounts[frame.entry]--;
+    if(profiler.activeCounts[frame.entry] == 0)
+    {
+        profiler.inclusiveTicks[frame.entry] += elapsed;
+    }
+    if(frame.edge != nullptr)
+    {
+        frame.edge->activeCount--;
+        if(frame.edge->activeCount == 0)
+        {
+            frame.edge->inclusiveTicks += elapsed;
+        }
+    }
+    if(!profiler.frames.empty())
+    {
+        profiler.frames.back().childTicks += elapsed;
+    }
+}
+
+static double getTicksPerMillisecond(const Profiler& profiler)
+{
+    u64 ns = profiler.endNanoseconds - profiler.startNanoseconds;
+    u64 ticks = profiler.endTicks - profiler.startTicks;
+    if(ns == 0)
+    {
+        return 1.0;
+    }
+    return double(ticks) / (double(ns) / 1000000.0);
+}
+
+void printProfile(const Profiler& profiler)
+{
+    double ticksPerMs = getTicksPerMillisecond(profiler);
+    u64 totalTicks = std::max(u64(1), profiler.endTicks - profiler.startTicks);
+
+    std::vector<i32> entries;
+    for(i32 i = 0; i < profiler.names.size(); ++i)
+    {
+        if(profiler.calls[i] > 0)
+        {
+            entries.push_back(i);
+        }
+    }
+    std::sort(entries.begin(), entries.end(),
+        [&profiler](i32 a, i32 b) { return profiler.exclusiveTicks[a] > profiler.exclusiveTicks[b]; });
+
+    printf("\n== Profile ==\n");
+    printf("%-24s %12s %14s %8s %14s %8s\n", "Function", "Calls", "Exclusive ms", "%", "Inclusive ms", "%");
+    for(i32 entry : entries)
+    {
+        std::string name = profiler.names[entry];
+        if(entry >= profiler.nativeEntryStart)
+        {
+            name = "native " + name;
+        }
+        printf("%-24s %12" PRIu64 " %14.3f %7.2f%% %14.3f %7.2f%%\n", name.c_str(), profiler.calls[entry],
+            double(profiler.exclusiveTicks[entry]) / ticksPerMs,
+            100.0 * double(profiler.exclusiveTicks[entry]) / double(totalTicks),
+            double(profiler.inclusiveTicks[entry]) / ticksPerMs,
+            100.0 * double(profiler.inclusiveTicks[entry]) / double(totalTicks));
+    }
+
+    std::vector<std::pair<u64, ProfileEdge>> edges(profiler.edges.begin(), profiler.edges.end());
+    std::sort(edges.begin(), edges.end(),
+        [](const auto& a, const auto& b) { return a.second.inclusiveTicks > b.second.inclusiveTicks; });
+    printf("\n%-24s %-24s %12s %14s\n", "Caller", "Callee", "Calls", "Inclusive ms");
+    for(const auto& [key, edge] : edges)
+    {
+        printf("%-24s %-24s %12" PRIu64 " %14.3f\n",
+            profiler.names[key >> 32].c_str(), profiler.names[key & 0xffffffff].c_str(),
+            edge.calls, double(edge.inclusiveTicks) / ticksPerMs);
+    }
+    printf("== End of profile ==\n");
+}
+
+bool writeCallgrindProfile(const Profiler& profiler, const char* sourceName, const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        return false;
+    }
+    fprintf(file, "# callgrind format\nversion: 1\ncreator: carpscript\n");
+    fprintf(file, "positions: line\nevents: Cycles\n");
+    fprintf(file, "summary: %" PRIu64 "\n\n", profiler.endTicks - profiler.startTicks);
+
+    for(i32 entry = 0; entry < profiler.names.size(); ++entry)
+    {
+        if(profiler.calls[entry] == 0)
+        {
+            continue;
+        }
+        bool native = entry >= profiler.nativeEntryStart;
+        fprintf(file, "fl=%s\n", native ? "<natives>" : sourceName);
+        fprintf(file, "fn=%s\n", profiler.names[entry].c_str());
+        fprintf(file, "%i %" PRIu64 "\n", profiler.lines[entry], profiler.exclusiveTicks[entry]);
+        for(const auto& [key, edge] : profiler.edges)
+        {
+            if(i32(key >> 32) != entry)
+            {
+                continue;
+            }
+            i32 callee = i32(key & 0xffffffff);
+            fprintf(file, "cfl=%s\n", callee >= profiler.nativeEntryStart ? "<natives>" : sourceName);
+            fprintf(file, "cfn=%s\n", profiler.names[callee].c_str());
+            fprintf(file, "calls=%" PRIu64 " %i\n", edge.calls, profiler.lines[callee]);
+            fprintf(file, "%i %" PRIu64 "\n", profiler.lines[entry], edge.inclusiveTicks);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "mytypes.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Script;
+
+// Instrumenting profiler for --profile. Entries are the top level code, every script function
+// and every native, timed with a cycle counter on calls, returns and native calls.
+struct ProfileEdge
+{
+    u64 calls;
+    u64 inclusiveTicks;
+    // Frames of the edge on the frame stack, inclusive time is counted only for outermost.
+    i32 activeCount;
+};
+
+struct ProfileFrame
+{
+    // -1 for a call to an address that is not a function, it only keeps calls and returns paired.
+    i32 entry;
+    u64 startTicks;
+    u64 childTicks;
+    // Edge from the caller, null for top level and -1 entries.
+    ProfileEdge* edge;
+};
+
+struct Profiler
+{
+    // Entry index for every script function start address, -1 for others.
+    std::vector<i32> addressToEntry;
+    // Entry 0 is top level, then functions and natives.
+    std::vector<std::string> names;
+    std::vector<i32> lines;
+    std::vector<u64> calls;
+    std::vector<u64> inclusiveTicks;
+    std::vector<u64> exclusiveTicks;
+    // How many times entry is on the frame stack, inclusive time is counted only for outermost.
+    std::vector<i32> activeCounts;
+    i32 nativeEntryStart;
+
+    // Key is caller entry << 32 | callee entry. Frames point to these, map keeps them in place.
+    std::unordered_map<u64, ProfileEdge> edges;
+    std::vector<ProfileFrame> frames;
+
+    u64 startTicks;
+    u64 startNanoseconds;
+    u64 endTicks;
+    u64 endNanoseconds;
+};
+
+void profilerBegin(Profiler& profiler, const Script& script);
+void profilerEnd(Profiler& profiler);
+
+void profilerEnterFunction(Profiler& profiler, i32 address);
+void profilerEnterNative(Profiler& profiler, i32 nativeIndex);
+void profilerExit(Profiler& profiler);
+
+void printProfile(const Profiler& profiler);
+bool writeCallgrindProfile(const Profiler& profiler, const char* sourceName, const char* filename);
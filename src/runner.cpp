@@ -0,0 +1,249 @@
+#include "runner.h"
+
+#include "script.h"
+
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+#include <thread>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static double getMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static void pinCurrentThread(i32 workerIndex)
+{
+    i32 cpuCount = (i32)std::thread::hardware_concurrency();
+    if(cpuCount <= 0)
+    {
+        return;
+    }
+    i32 cpu = workerIndex % cpuCount;
+#if _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (cpu % 64));
+#elif __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+RunnerStats runScriptsParallel(const std::vector<const Script*>& scripts, const RunnerOptions& options)
+{
+    i32 threadCount = options.threadCount > 0 ? options.threadCount : (i32)std::thread::hardware_concurrency();
+    threadCount = threadCount > 0 ? threadCount : 1;
+    u64 jobCount = u64(scripts.size()) * u64(options.repeat > 0 ? options.repeat : 0);
+
+    VMOptions vmOptions = options.vmOptions;
+    vmOptions.profileFile = nullptr;
+    vmOptions.sampleFile = nullptr;
+    // Workers already use every thread, spawned tasks run on the worker that joins them.
+    vmOptions.taskThreads = 1;
+
+    RunnerStats stats = {};
+    stats.workers.resize(threadCount);
+    std::atomic<u64> nextJob = 0;
+
+    auto worker = [&](i32 workerIndex)
+    {
+        if(options.pinThreads)
+        {
+            pinCurrentThread(workerIndex);
+        }
+        RunnerWorkerStats& workerStats = stats.workers[workerIndex];
+        // One state for every job of the worker, so its stacks are reserved once. Natives and
+        // memo caches are kept for each script and switched in with the script.
+        VMState state{};
+        std::vector<std::vector<NativeFn>> natives(scripts.size());
+        std::vector<std::vector<MemoCache>> memoCaches(scripts.size());
+        std::vector<u8> stateBound(scripts.size(), 0);
+        size_t stateScript = scripts.size();
+        while(true)
+        {
+            u64 job = nextJob.fetch_add(1, std::memory_order_relaxed);
+            if(job >= jobCount)
+            {
+                break;
+            }
+            auto start = std::chrono::steady_clock::now();
+            size_t scriptIndex = job % scripts.size();
+            if(stateBound[scriptIndex] == 0)
+            {
+                stateBound[scriptIndex] = initVMState(state, *scripts[scriptIndex]) ? 1 : 2;
+                natives[scriptIndex] = state.natives;
+                state.channels = vmOptions.channels;
+            }
+            else if(stateScript != scriptIndex)
+            {
+                state.natives = natives[scriptIndex];
+            }
+            if(stateScript != scriptIndex)
+            {
+                // Memo caches are by function index of the script.
+                if(stateScript < scripts.size())
+                {
+                    memoCaches[stateScript].swap(state.memoCaches);
+                }
+                state.memoCaches.swap(memoCaches[scriptIndex]);
+                stateScript = scriptIndex;
+            }
+            InterpretResult result = stateBound[scriptIndex] == 1
+                ? runCode(*scripts[scriptIndex], state, vmOptions)
+                : InterpretResult_NativeBindError;
+            auto end = std::chrono::steady_clock::now();
+
+            workerStats.jobs++;
+            workerStats.failed += result != InterpretResult_Ok ? 1 : 0;
+            workerStats.busyMs += getMs(start, end);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(i32 i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    stats.wallMs = getMs(start, std::chrono::steady_clock::now());
+
+    for(const RunnerWorkerStats& workerStats : stats.workers)
+    {
+        stats.jobs += workerStats.jobs;
+        stats.failed += workerStats.failed;
+    }
+    return stats;
+}
+
+// Coroutines mostly wait, stacks of a suspended one are small.
+static constexpr i32 CoroutineStackReserve = 256;
+
+RunnerStats runCoroutines(const std::vector<const Script*>& scripts, const RunnerOptions& options, i32 coroutineCount)
+{
+    i32 threadCount = options.threadCount > 0 ? options.threadCount : (i32)std::thread::hardware_concurrency();
+    threadCount = threadCount > 0 ? threadCount : 1;
+
+    RunnerStats stats = {};
+    stats.workers.resize(threadCount);
+
+    auto worker = [&](i32 workerIndex)
+    {
+        if(options.pinThreads)
+        {
+            pinCurrentThread(workerIndex);
+        }
+        RunnerWorkerStats& workerStats = stats.workers[workerIndex];
+        auto start = std::chrono::steady_clock::now();
+        std::vector<VMState> states;
+        std::vector<i32> scriptIndices;
+        for(i32 i = workerIndex; i < coroutineCount; i += threadCount)
+        {
+            scriptIndices.push_back(i % (i32)scripts.size());
+        }
+        states.resize(scriptIndices.size());
+
+        // Yielded coroutines wait here in the order they yielded.
+        std::vector<i32> ready;
+        for(i32 i = 0; i < states.size(); ++i)
+        {
+            const Script& script = *scripts[scriptIndices[i]];
+            bool bound = initVMState(states[i], script, CoroutineStackReserve);
+            states[i].channels = options.vmOptions.channels;
+            InterpretResult result = bound ? startCoroutine(script, states[i]) : InterpretResult_NativeBindError;
+            if(result == InterpretResult_Yield)
+            {
+                ready.push_back(i);
+                continue;
+            }
+            workerStats.jobs++;
+            workerStats.failed += result != InterpretResult_Ok ? 1 : 0;
+        }
+        std::vector<i32> next;
+        while(!ready.empty())
+        {
+            next.clear();
+            bool allWaiting = true;
+            for(i32 i : ready)
+            {
+                const Script& script = *scripts[scriptIndices[i]];
+                InterpretResult result = resumeCoroutine(script, states[i]);
+                workerStats.resumes++;
+                if(result == InterpretResult_Yield)
+                {
+                    OpCodeType opCode = script.byteCode[states[i].resumeAddress];
+                    allWaiting = allWaiting && (opCode == OP_SEND || opCode == OP_RECV);
+                    next.push_back(i);
+                    continue;
+                }
+                allWaiting = false;
+                workerStats.jobs++;
+                workerStats.failed += result != InterpretResult_Ok ? 1 : 0;
+                // Ended coroutines give their memory back right away.
+                states[i] = VMState{};
+            }
+            ready.swap(next);
+            if(allWaiting)
+            {
+                // Every coroutine here waits on a channel, other workers need to fill or drain it.
+                std::this_thread::yield();
+            }
+        }
+        workerStats.busyMs += getMs(start, std::chrono::steady_clock::now());
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(i32 i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    stats.wallMs = getMs(start, std::chrono::steady_clock::now());
+
+    for(const RunnerWorkerStats& workerStats : stats.workers)
+    {
+        stats.jobs += workerStats.jobs;
+        stats.failed += workerStats.failed;
+        stats.resumes += workerStats.resumes;
+    }
+    return stats;
+}
+
+void printRunnerStats(const RunnerStats& stats)
+{
+    printf("\n== Runner ==\n");
+    printf("Jobs: %" PRIu64 ", failed: %" PRIu64 ", workers: %i\n", stats.jobs, stats.failed, (i32)stats.workers.size());
+    printf("Wall: %.3f ms, throughput: %.1f jobs/s\n", stats.wallMs,
+        stats.wallMs > 0.0 ? double(stats.jobs) * 1000.0 / stats.wallMs : 0.0);
+    if(stats.resumes > 0)
+    {
+        printf("Resumes: %" PRIu64 ", %.1f resumes/s\n", stats.resumes,
+            stats.wallMs > 0.0 ? double(stats.resumes) * 1000.0 / stats.wallMs : 0.0);
+    }
+    for(i32 i = 0; i < stats.workers.size(); ++i)
+    {
+        const RunnerWorkerStats& worker = stats.workers[i];
+        printf("Worker %2i: %8" PRIu64 " jobs, %6.1f%% busy\n", i, worker.jobs,
+            stats.wallMs > 0.0 ? 100.0 * worker.busyMs / stats.wallMs : 0.0);
+    }
+    printf("== End of runner ==\n");
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "mytypes.h"
+#include "vm.h"
+
+#include <vector>
+
+struct Script;
+
+struct RunnerOptions
+{
+    // 0 uses every hardware thread.
+    i32 threadCount = 0;
+    // Pin worker n to cpu n modulo cpu count.
+    bool pinThreads = false;
+    // How many times every script is run.
+    i32 repeat = 1;
+    // Profile and sample outputs are per process, runner does not pass them to workers.
+    // Spawned tasks and parallel for chunks run on the worker running the script.
+    // Every state gets the same channels, scripts waiting on each other need to run as coroutines.
+    VMOptions vmOptions;
+};
+
+struct RunnerWorkerStats
+{
+    u64 jobs;
+    // Coroutine resumes after a yield.
+    u64 resumes;
+    u64 failed;
+    double busyMs;
+};
+
+struct RunnerStats
+{
+    u64 jobs;
+    u64 resumes;
+    u64 failed;
+    double wallMs;
+    std::vector<RunnerWorkerStats> workers;
+};
+
+// Runs every compiled script repeat times on a pool of worker threads. Compiled scripts are
+// only read and shared by all workers, every worker keeps its own VMState for each script.
+RunnerStats runScriptsParallel(const std::vector<const Script*>& scripts, const RunnerOptions& options);
+// Runs coroutineCount coroutines, coroutine n runs script n modulo script count. Every worker owns
+// its share of coroutines and resumes the yielded ones round robin, a job is a coroutine that ended.
+RunnerStats runCoroutines(const std::vector<const Script*>& scripts, const RunnerOptions& options, i32 coroutineCount);
+void printRunnerStats(const RunnerStats& stats);
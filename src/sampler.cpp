@@ -0,0 +1,193 @@
+#include "sampler.h"
+
+#include "script.h"
+#include "vmops.h"
+
+#include <inttypes.h>
+#include <map>
+#include <stdio.h>
+#include <string>
+
+#if !_WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+// Enough for a few minutes of samples at 1 kHz with moderately deep stacks.
+static constexpr size_t SampleBufferSize = 4 * 1024 * 1024;
+// Deeper stacks keep only the innermost frames.
+static constexpr u32 MaxSampleDepth = 128;
+static constexpr u32 TruncatedSampleBit = 0x80000000u;
+// Return address stack is reserved up front, so the signal handler does not read it while
+// push_back is reallocating it.
+static constexpr size_t ReservedReturnAddresses = 64 * 1024;
+
+#if !_WIN32
+static Sampler* activeSampler = nullptr;
+// Only the thread running the sampled vm records, SIGPROF can land on any thread.
+static thread_local const VMRuntime* sampledVm = nullptr;
+static struct sigaction previousAction;
+
+static void sampleSignalHandler(int)
+{
+    Sampler* sampler = activeSampler;
+    const VMRuntime* vm = sampledVm;
+    if(sampler == nullptr || vm == nullptr)
+    {
+        return;
+    }
+    const std::vector<i32>& returnAddresses = vm->state.functionReturnAddresses;
+    u32 returnCount = (u32)returnAddresses.size();
+    if(returnCount > ReservedReturnAddresses)
+    {
+        returnCount = 0;
+    }
+    u32 depth = returnCount < MaxSampleDepth ? returnCount : MaxSampleDepth;
+    if(sampler->used + depth + 2 > sampler->samples.size())
+    {
+        sampler->droppedCount++;
+        return;
+    }
+    u32* record = sampler->samples.data() + sampler->used;
+    record[0] = (depth + 1) | (returnCount > depth ? TruncatedSampleBit : 0);
+    record[1] = (u32)(vm->ip - vm->codeStart);
+    for(u32 i = 0; i < depth; ++i)
+    {
+        record[2 + i] = (u32)returnAddresses[returnCount - 1 - i];
+    }
+    sampler->used += depth + 2;
+    sampler->sampleCount++;
+}
+#endif
+
+bool samplerStart(Sampler& sampler, const VMRuntime& vm, i32 frequency)
+{
+#if _WIN32
+    return false;
+#else
+    if(activeSampler != nullptr || frequency <= 0)
+    {
+        return false;
+    }
+    sampler.samples.assign(SampleBufferSize, 0);
+    sampler.used = 0;
+    sampler.sampleCount = 0;
+    sampler.droppedCount = 0;
+    vm.state.functionReturnAddresses.reserve(ReservedReturnAddresses);
+
+    activeSampler = &sampler;
+    sampledVm = &vm;
+
+    struct sigaction action = {};
+    action.sa_handler = sampleSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, &previousAction) != 0)
+    {
+        activeSampler = nullptr;
+        sampledVm = nullptr;
+        return false;
+    }
+
+    i32 intervalUs = frequency < 1000000 ? 1000000 / frequency : 1;
+    struct itimerval timer = {};
+    timer.it_interval.tv_sec = intervalUs / 1000000;
+    timer.it_interval.tv_usec = intervalUs % 1000000;
+    timer.it_value = timer.it_interval;
+    if(setitimer(ITIMER_PROF, &timer, nullptr) != 0)
+    {
+        sigaction(SIGPROF, &previousAction, nullptr);
+        activeSampler = nullptr;
+        sampledVm = nullptr;
+        return false;
+    }
+    sampler.running = true;
+    return true;
+#endif
+}
+
+void samplerStop(Sampler& sampler)
+{
+#if !_WIN32
+    if(!sampler.running)
+    {
+        return;
+    }
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &previousAction, nullptr);
+    activeSampler = nullptr;
+    sampledVm = nullptr;
+    sampler.running = false;
+#endif
+}
+
+static std::string getFrameName(const Script& script, const std::vector<i32>& addressToFunction, u32 address)
+{
+    if(address >= addressToFunction.size())
+    {
+        return "<unknown>";
+    }
+    i32 functionIndex = addressToFunction[address];
+    std::string name = functionIndex >= 0
+        ? script.allSymbolNames[script.functions[functionIndex].functionNameIndex]
+        : std::string("<top level>");
+    name += ":";
+    name += std::to_string(address < script.byteCodeLines.size() ? script.byteCodeLines[address] : 0);
+    return name;
+}
+
+bool writeFoldedStacks(const Sampler& sampler, const Script& script, const char* filename)
+{
+    std::vector<i32> addressToFunction(script.byteCode.size(), -1);
+    for(i32 i = 0; i < script.functions.size(); ++i)
+    {
+        const Function& fn = script.functions[i];
+        for(i32 address = fn.functionStartLocation; address < fn.functionEndLocation; ++address)
+        {
+            addressToFunction[address] = i;
+        }
+    }
+
+    // Sorted, so the output is stable between runs.
+    std::map<std::string, u64> stacks;
+    std::string stack;
+    for(u64 offset = 0; offset < sampler.used;)
+    {
+        const u32* record = sampler.samples.data() + offset;
+        u32 frameCount = record[0] & ~TruncatedSampleBit;
+        offset += frameCount + 1;
+
+        // Outermost return address is in top level code, unless the stack was truncated.
+        stack.clear();
+        if(record[0] & TruncatedSampleBit)
+        {
+            stack = "<truncated>;";
+        }
+        // Return addresses point after the call, the call itself is one op before.
+        for(u32 i = frameCount - 1; i >= 1; --i)
+        {
+            u32 returnAddress = record[1 + i];
+            stack += getFrameName(script, addressToFunction, returnAddress > 0 ? returnAddress - 1 : 0);
+            stack += ";";
+        }
+        // ip points past the op code being executed.
+        u32 ipAddress = record[1];
+        stack += getFrameName(script, addressToFunction, ipAddress > 0 ? ipAddress - 1 : 0);
+        stacks[stack]++;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        return false;
+    }
+    for(const auto& [key, count] : stacks)
+    {
+        fprintf(file, "%s %" PRIu64 "\n", key.c_str(), count);
+    }
+    fclose(file);
+    printf("Sampled %" PRIu64 " stacks, %" PRIu64 " dropped, wrote: %s\n",
+        sampler.sampleCount, sampler.droppedCount, filename);
+    return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "mytypes.h"
+
+#include <vector>
+
+struct Script;
+struct VMRuntime;
+
+// Statistical profiler for --sample. A SIGPROF timer interrupts the thread running the vm,
+// the handler copies the published vm.ip and the return address stack into a preallocated
+// buffer, nothing else runs in the signal handler. Stacks are mapped to functions and lines
+// only when writing the folded output. Jit stays enabled, since jit helpers publish ip too.
+struct Sampler
+{
+    // Records of [frame count with truncated bit, ip address, return addresses from innermost to outermost...].
+    std::vector<u32> samples;
+    u64 used;
+    u64 sampleCount;
+    u64 droppedCount;
+    bool running;
+};
+
+// Returns false if sampling is not supported on the platform or the timer could not be set.
+bool samplerStart(Sampler& sampler, const VMRuntime& vm, i32 frequency);
+void samplerStop(Sampler& sampler);
+
+// Writes folded stacks, one "frame;frame;frame count" line per unique stack, for flamegraph.pl,
+// inferno or speedscope. Frames are function:line, root is the top level code.
+bool writeFoldedStacks(const Sampler& sampler, const Script& script, const char* filename);
@@ -34,6 +34,7 @@ static constexpr Keyword keywords[]{
     Keyword{ "false", TokenType::FALSE, 5 },
     Keyword{ "true", TokenType::TRUE, 4 },
     Keyword{ "fn", TokenType::FN, 2 },
+    Keyword{ "pure", TokenType::PURE, 4 },
     Keyword{ "if", TokenType::IF, 2 },
     Keyword{ "nil", TokenType::NIL, 3 },
     Keyword{ "or", TokenType::OR, 2 },
@@ -42,6 +43,14 @@ static constexpr Keyword keywords[]{
     Keyword{ "return", TokenType::RETURN, 6 },
     Keyword{ "while", TokenType::WHILE, 5 },
     Keyword{ "call", TokenType::NATCALL, 4 },
+    Keyword{ "spawn", TokenType::SPAWN, 5 },
+    Keyword{ "join", TokenType::JOIN, 4 },
+    Keyword{ "for", TokenType::FOR, 3 },
+    Keyword{ "in", TokenType::IN, 2 },
+    Keyword{ "parallel", TokenType::PARALLEL, 8 },
+    Keyword{ "yield", TokenType::YIELD, 5 },
+    Keyword{ "send", TokenType::SEND, 4 },
+    Keyword{ "recv", TokenType::RECV, 4 },
 };
 
 static i32 getScannerCurrLenToStartToken(const Scanner& scanner)
@@ -227,8 +236,10 @@ Token scanToken(Scanner& scanner)
         case ')': return makeToken(scanner, TokenType::RIGHT_PAREN); break;
         case '{': return makeToken(scanner, TokenType::LEFT_BRACE); break;
         case '}': return makeToken(scanner, TokenType::RIGHT_BRACE); break;
+        case '[': return makeToken(scanner, TokenType::LEFT_BRACKET); break;
+        case ']': return makeToken(scanner, TokenType::RIGHT_BRACKET); break;
         case ',': return makeToken(scanner, TokenType::COMMA); break;
-        case '.': return makeToken(scanner, TokenType::DOT); break;
+        case '.': return makeToken(scanner, matchChar(scanner, '.') ? TokenType::DOT_DOT : TokenType::DOT); break;
         case '-': return makeToken(scanner, TokenType::MINUS); break;
         case '+': return makeToken(scanner, TokenType::PLUS); break;
         case ';': return makeToken(scanner, TokenType::SEMICOLON); break;
@@ -0,0 +1,204 @@
+#include "scheduler.h"
+
+#include "jit.h"
+
+#include <chrono>
+
+static Task* popTask(TaskDeque& deque, bool steal)
+{
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    if(deque.tasks.empty())
+    {
+        return nullptr;
+    }
+    Task* task = nullptr;
+    if(steal)
+    {
+        task = deque.tasks.front();
+        deque.tasks.pop_front();
+    }
+    else
+    {
+        task = deque.tasks.back();
+        deque.tasks.pop_back();
+    }
+    return task;
+}
+
+// Newest task of our own deque first, otherwise the oldest one from the next worker that has any.
+static Task* findTask(Scheduler& scheduler, i32 workerIndex)
+{
+    if(scheduler.queued.load(std::memory_order_acquire) == 0)
+    {
+        return nullptr;
+    }
+    i32 workerCount = (i32)scheduler.deques.size();
+    Task* task = popTask(scheduler.deques[workerIndex], false);
+    for(i32 i = 1; i < workerCount && task == nullptr; ++i)
+    {
+        task = popTask(scheduler.deques[(workerIndex + i) % workerCount], true);
+    }
+    return task;
+}
+
+static void runTask(Scheduler& scheduler, i32 workerIndex, Task& task)
+{
+    scheduler.queued.fetch_sub(1, std::memory_order_acq_rel);
+    scheduler.runFn(scheduler, workerIndex, task);
+    if(task.waitingState == nullptr)
+    {
+        task.done.store(true, std::memory_order_release);
+        return;
+    }
+    // Goes to the stealing end, so the worker tries its other tasks first.
+    {
+        std::lock_guard<std::mutex> lock(scheduler.deques[workerIndex].mutex);
+        scheduler.deques[workerIndex].tasks.push_front(&task);
+    }
+    scheduler.queued.fetch_add(1, std::memory_order_acq_rel);
+    scheduler.wake.notify_one();
+}
+
+static void workerLoop(Scheduler& scheduler, i32 workerIndex)
+{
+    while(!scheduler.quit.load(std::memory_order_acquire))
+    {
+        Task* task = findTask(scheduler, workerIndex);
+        if(task != nullptr)
+        {
+            runTask(scheduler, workerIndex, *task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(scheduler.wakeMutex);
+        scheduler.wake.wait_for(lock, std::chrono::milliseconds(1), [&scheduler]()
+        {
+            return scheduler.quit.load(std::memory_order_acquire) || scheduler.queued.load(std::memory_order_acquire) > 0;
+        });
+    }
+}
+
+Scheduler* schedulerCreate(const Script& script, const std::vector<NativeFn>& natives, Channels* channels,
+    bool useJit, i32 threadCount, TaskRunFn runFn)
+{
+    threadCount = threadCount > 0 ? threadCount : (i32)std::thread::hardware_concurrency();
+    threadCount = threadCount > 0 ? threadCount : 1;
+
+    Scheduler* scheduler = new Scheduler{
+        .script = script,
+        .natives = natives,
+        .channels = channels,
+        .useJit = useJit,
+        .runFn = runFn,
+        .deques = std::vector<TaskDeque>(threadCount),
+        .jits = std::vector<JitState*>(threadCount, nullptr),
+    };
+    scheduler->queued = 0;
+    scheduler->quit = false;
+    for(i32 i = 1; i < threadCount; ++i)
+    {
+        scheduler->threads.emplace_back(workerLoop, std::ref(*scheduler), i);
+    }
+    return scheduler;
+}
+
+void schedulerDestroy(Scheduler* scheduler)
+{
+    if(scheduler == nullptr)
+    {
+        return;
+    }
+    // Tasks nobody joined still run, their side effects like prints are part of the run.
+    for(size_t i = 0;; ++i)
+    {
+        Task* task = nullptr;
+        {
+            // Running tasks can still spawn more.
+            std::lock_guard<std::mutex> lock(scheduler->taskMutex);
+            if(i >= scheduler->tasks.size())
+            {
+                break;
+            }
+            task = &scheduler->tasks[i];
+        }
+        schedulerJoin(*scheduler, 0, *task);
+    }
+    scheduler->quit = true;
+    scheduler->wake.notify_all();
+    for(std::thread& thread : scheduler->threads)
+    {
+        thread.join();
+    }
+#if JIT_ENABLED
+    for(JitState* jit : scheduler->jits)
+    {
+        jitDestroy(jit);
+    }
+#endif
+    delete scheduler;
+}
+
+Task& schedulerNewTask(Scheduler& scheduler)
+{
+    std::lock_guard<std::mutex> lock(scheduler.taskMutex);
+    if(!scheduler.freeTasks.empty())
+    {
+        Task& task = *scheduler.freeTasks.back();
+        scheduler.freeTasks.pop_back();
+        task.done = false;
+        return task;
+    }
+    Task& task = scheduler.tasks.emplace_back();
+    task.waitingState = nullptr;
+    task.done = false;
+    return task;
+}
+
+void schedulerFreeTask(Scheduler& scheduler, Task& task)
+{
+    task.parent = nullptr;
+    task.args.clear();
+    task.argDescs.clear();
+    task.argStrings.clear();
+    task.argArrays.clear();
+    task.argStructMemory.clear();
+    task.values.clear();
+    task.descs.clear();
+    task.resultStrings.clear();
+    task.resultArrays.clear();
+    task.resultStructMemory.clear();
+    std::lock_guard<std::mutex> lock(scheduler.taskMutex);
+    scheduler.freeTasks.push_back(&task);
+}
+
+void schedulerPush(Scheduler& scheduler, i32 workerIndex, Task& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(scheduler.deques[workerIndex].mutex);
+        scheduler.deques[workerIndex].tasks.push_back(&task);
+    }
+    scheduler.queued.fetch_add(1, std::memory_order_acq_rel);
+    scheduler.wake.notify_one();
+}
+
+void schedulerJoin(Scheduler& scheduler, i32 workerIndex, Task& task)
+{
+    while(!task.done.load(std::memory_order_acquire))
+    {
+        if(!schedulerRunPending(scheduler, workerIndex))
+        {
+            // Task is running on another worker.
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool schedulerRunPending(Scheduler& scheduler, i32 workerIndex)
+{
+    Task* task = findTask(scheduler, workerIndex);
+    if(task == nullptr)
+    {
+        return false;
+    }
+    runTask(scheduler, workerIndex, *task);
+    return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+#include "mytypes.h"
+#include "script.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Scheduler;
+
+// Script function call made with spawn, or a chunk of a parallel for. Shares the compiled script read only.
+struct Task
+{
+    // Where the task starts running, function start for spawn.
+    i32 address;
+    // Parallel for chunks start from a copy of the locals of the state running the loop, that
+    // state waits for the chunks so they can read it. Null for spawn, it starts from the global template.
+    const VMState* parent;
+    // Pushed on the stack before running. Strings are copied into argStrings, since the
+    // spawning state owns its strings. Arrays are shared through argArrays, structs are
+    // copied into argStructMemory.
+    std::vector<TypeOfValue> args;
+    std::vector<ValueTypeDesc> argDescs;
+    std::vector<std::string> argStrings;
+    std::vector<ScriptArrayRef> argArrays;
+    std::vector<u64> argStructMemory;
+    // How many values from the top of the stack are the result.
+    i32 resultCount;
+
+    // InterpretResult, valid once done.
+    i32 result;
+    // Strings are copied into resultStrings, arrays shared through resultArrays and structs
+    // copied into resultStructMemory.
+    std::vector<TypeOfValue> values;
+    std::vector<ValueTypeDesc> descs;
+    std::vector<std::string> resultStrings;
+    std::vector<ScriptArrayRef> resultArrays;
+    std::vector<u64> resultStructMemory;
+    // Task stopped at a full or empty channel, it is queued again and continues from its state.
+    VMState* waitingState;
+    std::atomic<bool> done;
+};
+
+// Runs the task on the calling thread, until it is done or sets its waitingState.
+using TaskRunFn = void (*)(Scheduler& scheduler, i32 workerIndex, Task& task);
+
+struct TaskDeque
+{
+    std::mutex mutex;
+    // Owner pushes and pops at the back, thieves steal from the front.
+    std::deque<Task*> tasks;
+};
+
+struct Scheduler
+{
+    const Script& script;
+    // Bound by the state that created the scheduler, every task state gets a copy.
+    std::vector<NativeFn> natives;
+    Channels* channels;
+    bool useJit;
+    // Cache size for pure fns of every task state.
+    i32 memoEntries;
+    TaskRunFn runFn;
+
+    // One for each worker. Worker 0 is the thread that created the scheduler, it only runs
+    // tasks while joining.
+    std::vector<TaskDeque> deques;
+    std::vector<std::thread> threads;
+    // One for each worker when useJit, created by its first task. Tasks on the worker share the
+    // call counts and jitted code, only that worker uses it.
+    std::vector<JitState*> jits;
+
+    // Owns every task of the run, addresses stay valid until the scheduler is destroyed.
+    std::mutex taskMutex;
+    std::deque<Task> tasks;
+    // Joined tasks, new tasks reuse them.
+    std::vector<Task*> freeTasks;
+
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<i32> queued;
+    std::atomic<bool> quit;
+};
+
+// threadCount 0 uses every hardware thread, 1 runs tasks only on the creating thread when joining.
+Scheduler* schedulerCreate(const Script& script, const std::vector<NativeFn>& natives, Channels* channels,
+    bool useJit, i32 threadCount, TaskRunFn runFn);
+// Runs every task that is left, then stops the workers.
+void schedulerDestroy(Scheduler* scheduler);
+
+Task& schedulerNewTask(Scheduler& scheduler);
+// Once the task is joined and its results are read, its values are released and the task is
+// reused by a later schedulerNewTask.
+void schedulerFreeTask(Scheduler& scheduler, Task& task);
+void schedulerPush(Scheduler& scheduler, i32 workerIndex, Task& task);
+// Runs other tasks on the calling worker until task is done.
+void schedulerJoin(Scheduler& scheduler, i32 workerIndex, Task& task);
+// Runs one queued task on the calling worker, false when there was none.
+bool schedulerRunPending(Scheduler& scheduler, i32 workerIndex);
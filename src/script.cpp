@@ -107,7 +107,7 @@ i32 addConstant(Script& script, i64 constantValue, i32 lineNumber)
 }
 i32 addConstant(Script& script, u64 constantValue, i32 lineNumber)
 {
-    return addConsantTemplate(script, constantValue, ValueTypeU16, lineNumber);
+    return addConsantTemplate(script, constantValue, ValueTypeU64, lineNumber);
 }
 i32 addConstant(Script& script, f32 constantValue, i32 lineNumber)
 {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "array.h"
 #include "common.h"
 #include "mytypes.h"
 #include "op.h"
@@ -13,14 +14,28 @@ struct NativeReturn
     ValueTypeDesc desc;
 };
 
-using NativeFn = NativeReturn (*)(Script& script, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
+struct VMState;
+struct Channels;
+struct Scheduler;
+struct Task;
+struct JitState;
+
+using NativeFn = NativeReturn (*)(VMState& state, i32 argc, const TypeOfValue* values, const ValueTypeDesc* descs);
 
 struct StructStack
 {
+    // For variable stacks structSize is the bytes of packed values.
     StructDesc desc;
     std::vector<u32> structSymbolNameIndices;
     std::vector<ValueTypeDesc> structValueTypes;
     std::vector<TypeOfValue> structValueArray;
+    // Values of a known bool or number type, packed at their natural size and alignment instead
+    // of taking a slot and type in the arrays above. Zeroed template like structValueArray.
+    std::vector<u64> structPackedValues;
+    // Only used while compiling, one for each symbol. Slot in structValueArray, or ~byte offset
+    // in structPackedValues, and the type when known at compile time.
+    std::vector<i32> structSymbolLocations;
+    std::vector<ValueTypeDesc> structSymbolTypes;
     i32 parentStructIndex;
 };
 
@@ -33,15 +48,18 @@ struct Function
     i32 functionEndLocation;
     std::vector<i32> functionParameterNameIndices;
     std::vector<ValueTypeDesc> functionParamenterValueTypes;
+    // Only used while compiling, index of the body in source order once defined.
+    i32 bodyIndex;
     bool defined;
     bool declared;
+    // Declared pure fn, calls get their results cached by the argument values.
+    bool pure;
 };
 
 struct NativePatchFunction
 {
     std::vector<ValueTypeDesc> parameterTypes;
     std::vector<i32> patchAddresses;
-    NativeFn callFn;
     Token token;
 };
 
@@ -74,8 +92,6 @@ struct Script
     std::vector<u32> functionSymbolNameIndices;
     std::vector<ValueTypeDesc> functionValueTypes;
 
-    std::vector<i32> functionReturnAddresses;
-
     std::vector<Function> functions;
     std::vector<PatchFunction> patchFunctions;
     std::vector<NativePatchFunction> nativePatchFunctions;
@@ -85,23 +101,93 @@ struct Script
     // Level 0 struct is global
     std::vector<StructStack> structStacks;
 
-    StructStack locals;
-
     StructStack constants;
 
-    //std::vector<StructDesc> structDescs;
-    //std::vector<u32> structSymbolNameIndices;
-    //std::vector<ValueTypeDesc> structValueTypes;
-    //// Need to cast the values into type
-    //std::vector<u64> structValueArray;
-    //// For example u8 = 0, u8 = 1, u32 = 4 for first 3.
-    ////std::vector<i32> structValueMemoryPosition;
+    // Declared struct types. Fields are in linear memory like function parameters, in declaration order.
+    std::vector<StructDesc> structDescs;
+    std::vector<u32> structNameIndices;
+    std::vector<u32> structFieldNameIndices;
+    std::vector<ValueTypeDesc> structFieldTypes;
+    // Byte offset of every field. Fields are laid out by alignment, largest first, so the packed
+    // struct has no holes between fields.
+    std::vector<u32> structFieldOffsets;
 
     std::vector<std::string> stringLiterals;
+
+    // Only used while compiling, vm keeps its own in VMState.
+    i32 structIndex;
+};
+
+// Results of a pure fn by argument values, entryCount entries of argCount values each.
+// Direct mapped, a result replaces the one that had its slot.
+struct MemoCache
+{
+    i32 argCount;
+    i32 entryCount;
+    std::vector<TypeOfValue> args;
+    std::vector<ValueType> argTypes;
+    std::vector<TypeOfValue> results;
+    // ValueTypeNone for an empty entry.
+    std::vector<ValueTypeDesc> resultDescs;
+};
+
+// Everything running a script changes. Script stays read only after compiling, so one
+// compiled script can be run any number of times and from many threads, each with its own state.
+struct VMState
+{
+    std::vector<TypeOfValue> stack;
+    std::vector<ValueTypeDesc> stackValueInfo;
+
+    std::vector<u16> localValueAmounts;
+    std::vector<i32> parentStructIndices;
+    std::vector<i32> functionReturnAddresses;
+
+    StructStack locals;
     std::vector<std::string> stackStrings;
 
+    // One for each of script.nativePatchFunctions.
+    std::vector<NativeFn> natives;
+    // Bound by the host like natives, shared by every state that runs at the same time. Can be null.
+    Channels* channels;
+    // Run as a coroutine, channel ops that would wait yield instead.
+    bool coroutine;
+
+    // Created on the first spawn of a run, shared with the states running its tasks.
+    Scheduler* scheduler;
+    // Worker running this state, spawned tasks go to its deque.
+    i32 workerIndex;
+    // Tasks this state spawned, values of ValueTypeTask have the slot here in the low 32 bits and
+    // its generation in the high ones. Joining frees the slot for the next spawn, which bumps its
+    // generation so the old handle can not join the new task.
+    std::vector<Task*> tasks;
+    std::vector<u32> taskGenerations;
+    std::vector<u32> freeTaskSlots;
+    // Values of ValueTypeArray index here. Copying a value shares the array.
+    std::vector<ScriptArrayRef> arrays;
+    // Slots of arrays no value refers to anymore, new arrays reuse them. Found when arrays grows
+    // to arrayCollectAt, see collectArrays.
+    std::vector<u32> freeArrays;
+    size_t arrayCollectAt;
+    // Packed struct values, values of ValueTypeStruct are byte offsets here. Storing a struct
+    // into a variable copies it, nested struct fields point inside their parent.
+    std::vector<u64> structMemory;
+
     i32 structIndex;
     i32 previousLocalStartIndex;
+    // Op code index a yielded run continues from.
+    i32 resumeAddress;
+
+    // One for each of script.functions, created on the first call of a pure fn. Caches stay
+    // between runs, a pure fn gives the same results every run.
+    std::vector<MemoCache> memoCaches;
+    // Arguments of pure fn calls that missed the cache, their results get stored when they return.
+    std::vector<TypeOfValue> memoArgs;
+    std::vector<ValueType> memoArgTypes;
+    // Entries in each cache, rounded up to a power of two. 0 runs every call.
+    i32 memoEntries;
+    // Only between beginFunctionCalls and endFunctionCalls, kept so hot functions stay jitted
+    // over host calls.
+    JitState* jit;
 };
 
 //template<typename T>
@@ -7,8 +7,8 @@
 enum class TokenType: u8
 {
     //Single character tokens
-    LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE,
-    COMMA, DOT, MINUS, PLUS, SEMICOLON, SLASH, STAR, COLON,
+    LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE, LEFT_BRACKET, RIGHT_BRACKET,
+    COMMA, DOT, DOT_DOT, MINUS, PLUS, SEMICOLON, SLASH, STAR, COLON,
 
     // One or two character tokens.
     BANG, BANG_EQUAL,
@@ -26,6 +26,9 @@ enum class TokenType: u8
     STRUCT,
     AND, OR,
     ELSE, FN, FOR, IF, NIL, WHILE, NATCALL,
+    PURE,
+    SPAWN, JOIN,
+    PARALLEL, IN, YIELD, SEND, RECV,
     PRINT, RETURN,
     TRUE, FALSE,
 
@@ -36,8 +39,8 @@ enum class TokenType: u8
 
 static const char* TOKEN_NAMES[] = {
     //Single character tokens
-    "LEFT_PAREN", "RIGHT_PAREN", "LEFT_BRACE", "RIGHT_BRACE",
-    "COMMA", "DOT", "MINUS", "PLUS", "SEMICOLON", "SLASH", "STAR", "COLON",
+    "LEFT_PAREN", "RIGHT_PAREN", "LEFT_BRACE", "RIGHT_BRACE", "LEFT_BRACKET", "RIGHT_BRACKET",
+    "COMMA", "DOT", "DOT_DOT", "MINUS", "PLUS", "SEMICOLON", "SLASH", "STAR", "COLON",
 
     // One or two character tokens.
     "BANG", "BANG_EQUAL",
@@ -55,6 +58,9 @@ static const char* TOKEN_NAMES[] = {
     "STRUCT",
     "AND", "OR",
     "ELSE", "FN", "FOR", "IF", "NIL", "WHILE", "NATCALL",
+    "PURE",
+    "SPAWN", "JOIN",
+    "PARALLEL", "IN", "YIELD", "SEND", "RECV",
     "PRINT", "RETURN",
     "TRUE", "FALSE",
 
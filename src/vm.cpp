@@ -1,266 +1,372 @@
 #include "vm.h"
 
+#include "channel.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "lanes.h"
 #include "mymemory.h"
 #include "nativefns.h"
 #include "op.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "scheduler.h"
 #include "script.h"
+#include "vmops.h"
 
+#include <algorithm>
 #include <assert.h>
-#include <stdarg.h> // va_start
+#include <inttypes.h>
 #include <string.h> // memcpy
+#include <thread>
 
-struct VMRuntime
+static NativeFn findNative(const std::string& name)
 {
-    std::vector<TypeOfValue> &stack;
-    const OpCodeType *codeStart;
-    const OpCodeType *ip;
-    const i32* lines;
-    i32 line;
-};
-
-static bool setNative(Script& script, const std::string& name, NativeFn callFn)
-{
-    if(callFn == nullptr)
-    {
-        return false;
-    }
-    for(NativePatchFunction& fn : script.nativePatchFunctions)
+    for(const NativeBinding& binding : NativeBindings)
     {
-        const std::string &patchName = getStringFromTokenName(fn.token);
-        if(name == patchName)
+        if(name == binding.name)
         {
-            fn.callFn = callFn;
-            return true;
+            return binding.callFn;
         }
     }
-    return false;
+    return nullptr;
 }
 
-static bool truthy(TypeOfValue value)
+#if VM_STATS
+static void recordStats(VMRuntime& vm, OpCodeType opCode)
 {
-    return value != 0;
+    VMStats& stats = *vm.stats;
+    if(opCode <= OP_ERROR)
+    {
+        stats.opCounts[opCode]++;
+    }
+    stats.maxStackDepth = std::max(stats.maxStackDepth, u64(vm.stack.size()));
+    // Packed locals and slots of the other locals, in bytes.
+    const StructStack& locals = vm.state.locals;
+    u64 localsSize = (locals.structPackedValues.size() + locals.structValueArray.size()) * sizeof(u64);
+    stats.maxLocalsSize = std::max(stats.maxLocalsSize, localsSize);
+    stats.maxReturnAddressDepth = std::max(stats.maxReturnAddressDepth, u64(vm.state.functionReturnAddresses.size()));
 }
+#endif
 
-struct HelperStruct
+static bool opSpawn(VMRuntime& vm, u16 functionIndex)
 {
-    TypeOfValue valueA;
-    TypeOfValue valueB;
-    ValueTypeDesc descA;
-    ValueTypeDesc descB;
-};
+    const Script& script = vm.script;
+    VMState& state = vm.state;
+    if(state.scheduler == nullptr || functionIndex >= script.functions.size())
+    {
+        runtimeError(vm, "Failed to spawn task!");
+        return false;
+    }
+    const Function& fn = script.functions[functionIndex];
+    i32 params = (i32)fn.functionParameterNameIndices.size();
+    if(fn.functionEndLocation <= fn.functionStartLocation || vm.stack.size() < params)
+    {
+        runtimeError(vm, "Failed to spawn task!");
+        return false;
+    }
+    Task& task = schedulerNewTask(*state.scheduler);
+    task.address = fn.functionStartLocation;
+    task.parent = nullptr;
+    task.resultCount = 1;
+    size_t first = vm.stack.size() - params;
+    task.args.assign(vm.stack.begin() + first, vm.stack.end());
+    task.argDescs.assign(vm.stackValueInfo.begin() + first, vm.stackValueInfo.end());
+    for(i32 i = 0; i < params; ++i)
+    {
+        if(task.argDescs[i].valueType == ValueTypeString)
+        {
+            task.argStrings.push_back(state.stackStrings[task.args[i]]);
+            task.args[i] = task.argStrings.size() - 1;
+        }
+        else if(task.argDescs[i].valueType == ValueTypeArray)
+        {
+            task.argArrays.push_back(state.arrays[task.args[i]]);
+            task.args[i] = task.argArrays.size() - 1;
+        }
+        else if(task.argDescs[i].valueType == ValueTypeStruct)
+        {
+            u32 size = script.structDescs[task.argDescs[i].structIndex].structSize;
+            task.args[i] = copyStruct(task.argStructMemory, state.structMemory, task.args[i], size);
+        }
+    }
+    vm.stack.resize(first);
+    vm.stackValueInfo.resize(first);
 
-static HelperStruct valuesEqualHelper(std::vector<TypeOfValue>& stack, std::vector<ValueTypeDesc> &stackValueInfo)
-{
-    assert(stack.size() >= 2);
-    assert(stackValueInfo.size() >= 2);
-    HelperStruct result;
-    result.valueB = stack.back();
-    stack.pop_back();
-    result.valueA = stack.back();
-    stack.pop_back();
-    result.descB = stackValueInfo.back();
-    stackValueInfo.pop_back();
-    result.descA = stackValueInfo.back();
-    stackValueInfo.pop_back();
-    return result;
+    u32 slot = u32(state.tasks.size());
+    if(state.freeTaskSlots.empty())
+    {
+        state.tasks.push_back(&task);
+        state.taskGenerations.push_back(0);
+    }
+    else
+    {
+        slot = state.freeTaskSlots.back();
+        state.freeTaskSlots.pop_back();
+        state.tasks[slot] = &task;
+        ++state.taskGenerations[slot];
+    }
+    vm.stack.push_back(TypeOfValue(slot) | (TypeOfValue(state.taskGenerations[slot]) << 32));
+    vm.stackValueInfo.push_back({.valueType = ValueTypeTask});
+    schedulerPush(*state.scheduler, state.workerIndex, task);
+    return true;
 }
 
-static void valuesEqual(Script& script, std::vector<TypeOfValue>& stack, std::vector<ValueTypeDesc> &stackValueInfo)
+static bool opJoin(VMRuntime& vm)
 {
-    HelperStruct s = valuesEqualHelper(stack, stackValueInfo);
-    bool isTrue = s.descB.valueType == s.descA.valueType;
-    bool equal = isTrue && s.valueA == s.valueB;
-    if(isTrue && s.descA.valueType == ValueTypeString)
+    VMState& state = vm.state;
+    TypeOfValue handle = vm.stack.back();
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    u32 slot = u32(handle);
+    if(desc.valueType != ValueTypeTask || slot >= state.tasks.size())
     {
-        equal = script.stackStrings[s.valueA] == script.stackStrings[s.valueB];
-        script.stackStrings.pop_back();
-        script.stackStrings.pop_back();
+        runtimeError(vm, "Join expects a task, got type: %i", desc.valueType);
+        return false;
     }
-    stack.push_back((equal) ? ~(0) : 0);
-    stackValueInfo.push_back({.valueType = ValueTypeBool});
-
+    if(state.tasks[slot] == nullptr || state.taskGenerations[slot] != u32(handle >> 32))
+    {
+        runtimeError(vm, "Task was joined already!");
+        return false;
+    }
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+
+    Task& task = *state.tasks[slot];
+    state.tasks[slot] = nullptr;
+    state.freeTaskSlots.push_back(slot);
+    schedulerJoin(*state.scheduler, state.workerIndex, task);
+    if(task.result != InterpretResult_Ok)
+    {
+        schedulerFreeTask(*state.scheduler, task);
+        runtimeError(vm, "Joined task failed!");
+        return false;
+    }
+    TypeOfValue value = task.values[0];
+    if(task.descs[0].valueType == ValueTypeString)
+    {
+        value = state.stackStrings.size();
+        state.stackStrings.push_back(task.resultStrings[task.values[0]]);
+    }
+    else if(task.descs[0].valueType == ValueTypeArray)
+    {
+        value = addArray(state, task.resultArrays[task.values[0]]);
+    }
+    else if(task.descs[0].valueType == ValueTypeStruct)
+    {
+        u32 size = vm.script.structDescs[task.descs[0].structIndex].structSize;
+        value = copyStruct(state.structMemory, task.resultStructMemory, task.values[0], size);
+    }
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back(task.descs[0]);
+    schedulerFreeTask(*state.scheduler, task);
+    return true;
 }
 
-static size_t getInstructionIndex(const OpCodeType* current, const OpCodeType* start)
+enum ChannelOpResult
 {
-    return size_t(intptr_t(current) - intptr_t(start)) / OpCodeTypeSize;
-}
+    ChannelOp_Done,
+    // Channel was full or empty, op runs again later.
+    ChannelOp_Wait,
+    ChannelOp_Error,
+};
 
-static void resetStack(std::vector<TypeOfValue> &stack)
+static Channel* getChannel(VMRuntime& vm, size_t stackIndex)
 {
-    stack.clear();
+    VMState& state = vm.state;
+    if(vm.stackValueInfo[stackIndex].valueType != ValueTypeI32)
+    {
+        runtimeError(vm, "Channel needs to be i32 index!");
+        return nullptr;
+    }
+    i32 index = i32(vm.stack[stackIndex]);
+    if(state.channels == nullptr || index < 0 || index >= state.channels->channels.size())
+    {
+        runtimeError(vm, "No channel: %i", index);
+        return nullptr;
+    }
+    return &state.channels->channels[index];
 }
 
-static void runtimeError(VMRuntime runtime, const char* fmt, ...)
+static ChannelOpResult opSend(VMRuntime& vm)
 {
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fputs("\n", stderr);
-
-    size_t inst = getInstructionIndex(runtime.ip, runtime.codeStart) - 1;
-    int line = runtime.lines[runtime.line];
-    fprintf(stderr, "[Line %d] in script\n", line);
-    resetStack(runtime.stack);
+    size_t valueIndex = vm.stack.size() - 1;
+    Channel* channel = getChannel(vm, valueIndex - 1);
+    if(channel == nullptr)
+    {
+        return ChannelOp_Error;
+    }
+    ValueTypeDesc desc = vm.stackValueInfo[valueIndex];
+    if(desc.valueType != channel->type)
+    {
+        runtimeError(vm, "Channel of type: %i cannot send type: %i", channel->type, desc.valueType);
+        return ChannelOp_Error;
+    }
+    if(!channelTrySend(*channel, vm.stack[valueIndex], desc))
+    {
+        return ChannelOp_Wait;
+    }
+    vm.stack.resize(valueIndex - 1);
+    vm.stackValueInfo.resize(valueIndex - 1);
+    opNil(vm);
+    return ChannelOp_Done;
 }
 
-static TypeOfValue peekStack(const std::vector<TypeOfValue>& stack)
+static ChannelOpResult opRecv(VMRuntime& vm)
 {
-    return stack[stack.size() - 1];
+    Channel* channel = getChannel(vm, vm.stack.size() - 1);
+    if(channel == nullptr)
+    {
+        return ChannelOp_Error;
+    }
+    TypeOfValue value = 0;
+    ValueTypeDesc desc = {};
+    if(!channelTryRecv(*channel, value, desc))
+    {
+        return ChannelOp_Wait;
+    }
+    vm.stack.back() = value;
+    vm.stackValueInfo.back() = desc;
+    return ChannelOp_Done;
 }
 
-static bool peek(std::vector<ValueTypeDesc>& descs, int distance, ValueTypeDesc** outDesc)
+// Combines partial results of parallel for chunks in chunk order, so the result does not
+// depend on how many workers there are.
+static bool combineReduction(ParallelReduction kind, TypeOfValue& acc, ValueTypeDesc desc, TypeOfValue value)
 {
-    if(distance >= descs.size())
+    std::vector<TypeOfValue> stack = {acc, value};
+    std::vector<ValueTypeDesc> descs = {desc, desc};
+    if(kind == ParallelReduction_Sum)
+    {
+        if(doBinaryOp(stack, descs, OP_ADD) != 0)
+        {
+            return false;
+        }
+        acc = stack.back();
+        return true;
+    }
+    if(doBinaryOp(stack, descs, kind == ParallelReduction_Min ? OP_GREATER : OP_LESSER) != 0)
     {
-        outDesc = nullptr;
         return false;
     }
-    *outDesc = &descs[descs.size() - distance - 1];
+    // acc > value for min, acc < value for max.
+    if(truthy(stack.back()))
+    {
+        acc = value;
+    }
     return true;
 }
 
-template <typename T>
-static TypeOfValue doBinaryOpOp(const TypeOfValue l, const TypeOfValue r, OpCodeType opCode)
-{
-    const T& lt = *((const T*)&l);
-    const T& rt = *((const T*)&r);
-    TypeOfValue valueStackType = 0;
-    T& value = *((T*)&valueStackType);
+// Few chunks per worker, so stealing evens out uneven iterations.
+static constexpr i64 ParallelChunksPerWorker = 4;
 
-    switch(opCode)
+static bool opParallelFor(VMRuntime& vm, i32 bodyAddress, u16 reductions)
+{
+    VMState& state = vm.state;
+    i32 reductionCount = reductions & ParallelReductionCountMask;
+    if(state.scheduler == nullptr || vm.stack.size() < 2 + reductionCount)
     {
-        case OP_ADD: value = lt + rt; break;
-        case OP_SUB: value = lt - rt; break;
-        case OP_MUL: value = lt * rt; break;
-        case OP_DIV: value = lt / rt; break;
-
-        case OP_GREATER: value = lt > rt; break;
-        case OP_LESSER: value = lt < rt; break;
-        default: break;
+        runtimeError(vm, "Failed to run parallel for!");
+        return false;
     }
-    TypeOfValue returnValue = *((TypeOfValue*)(&value));
-    return returnValue;
-}
-
-static i32 doBinaryOp(
-    std::vector<TypeOfValue>& stack,
-    std::vector<ValueTypeDesc>& stackValueInfo,
-    OpCodeType opCode)
-{
-
-    HelperStruct values = valuesEqualHelper(stack, stackValueInfo);
-
-    assert(values.descA.valueType == values.descB.valueType);
-    if(values.descA.valueType != values.descB.valueType)
+    size_t first = vm.stack.size() - 2 - reductionCount;
+    if(vm.stackValueInfo[first].valueType != ValueTypeI32 || vm.stackValueInfo[first + 1].valueType != ValueTypeI32)
     {
-        return 1;
+        runtimeError(vm, "Parallel for range needs i32 bounds!");
+        return false;
     }
-    TypeOfValue finalValue;
-    ValueTypeDesc newDesc = values.descA;
-    switch(values.descA.valueType)
+    i32 start = i32(vm.stack[first]);
+    i32 end = i32(vm.stack[first + 1]);
+    std::vector<TypeOfValue> values(vm.stack.begin() + first + 2, vm.stack.end());
+    std::vector<ValueTypeDesc> descs(vm.stackValueInfo.begin() + first + 2, vm.stackValueInfo.end());
+    vm.stack.resize(first);
+    vm.stackValueInfo.resize(first);
+    for(const ValueTypeDesc& desc : descs)
     {
-        case ValueTypeI8: finalValue = doBinaryOpOp<i8>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeU8: finalValue = doBinaryOpOp<u8>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeI16: finalValue = doBinaryOpOp<i16>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeU16: finalValue = doBinaryOpOp<u16>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeI32: finalValue = doBinaryOpOp<i32>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeU32: finalValue = doBinaryOpOp<u32>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeI64: finalValue = doBinaryOpOp<i64>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeU64: finalValue = doBinaryOpOp<u64>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeF32: finalValue = doBinaryOpOp<f32>(values.valueA, values.valueB, opCode); break;
-        case ValueTypeF64: finalValue = doBinaryOpOp<f64>(values.valueA, values.valueB, opCode); break;
-        default:
+        if(desc.valueType < ValueTypeI8 || desc.valueType > ValueTypeF64)
         {
-            assert(false);
-            return 2;
+            runtimeError(vm, "Parallel for reduces only numbers, got type: %i", desc.valueType);
+            return false;
         }
     }
-    switch(opCode)
-    {
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-            stackValueInfo.emplace_back(values.descA);
-            break;
-        case OP_GREATER:
-        case OP_LESSER:
-            stackValueInfo.push_back({.valueType = ValueTypeBool});
-            break;
-        default:
-            return 3;
 
+    i64 count = end > start ? i64(end) - i64(start) : 0;
+    i64 chunkCount = std::min(count, i64(state.scheduler->deques.size()) * ParallelChunksPerWorker);
+    std::vector<Task*> chunks;
+    for(i64 i = 0; i < chunkCount; ++i)
+    {
+        Task& task = schedulerNewTask(*state.scheduler);
+        task.address = bodyAddress;
+        task.parent = &state;
+        task.resultCount = reductionCount;
+        task.args = {
+            TypeOfValue(u32(start + count * i / chunkCount)),
+            TypeOfValue(u32(start + count * (i + 1) / chunkCount))
+        };
+        task.argDescs = {{.valueType = ValueTypeI32}, {.valueType = ValueTypeI32}};
+        for(i32 j = 0; j < reductionCount; ++j)
+        {
+            // Sums start from zero, min and max from the value before the loop.
+            ParallelReduction kind = getParallelReduction(reductions, j);
+            task.args.push_back(kind == ParallelReduction_Sum ? 0 : values[j]);
+            task.argDescs.push_back(descs[j]);
+        }
+        chunks.push_back(&task);
+        schedulerPush(*state.scheduler, state.workerIndex, task);
     }
-    stack.push_back(finalValue);
-
-    return 0;
-}
 
-
-
-
-InterpretResult runCode(Script& script)
-{
-    const i32 byteCodeSize = (i32)script.byteCode.size();
-    const OpCodeType* ipStart = (const OpCodeType*) script.byteCode.data();
-    const OpCodeType* ip = ipStart;
-
-    const i32* lines = script.byteCodeLines.data();
-
-    if(!setNative(script, "clock", &clockNative))
+    bool success = true;
+    for(Task* task : chunks)
     {
-        return InterpretResult_NativeBindError;
+        schedulerJoin(*state.scheduler, state.workerIndex, *task);
+        if(task->result != InterpretResult_Ok || task->values.size() != reductionCount)
+        {
+            success = false;
+            continue;
+        }
+        for(i32 j = 0; j < reductionCount; ++j)
+        {
+            if(task->descs[j].valueType != descs[j].valueType
+                || !combineReduction(getParallelReduction(reductions, j), values[j], descs[j], task->values[j]))
+            {
+                success = false;
+            }
+        }
     }
-    if(!setNative(script, "addNative", &addNative))
+    for(Task* task : chunks)
     {
-        return InterpretResult_NativeBindError;
+        schedulerFreeTask(*state.scheduler, *task);
     }
-    if(!setNative(script, "stringNative", &stringNative))
+    if(!success)
     {
-        return InterpretResult_NativeBindError;
+        runtimeError(vm, "Parallel for chunk failed!");
+        return false;
     }
+    vm.stack.insert(vm.stack.end(), values.begin(), values.end());
+    vm.stackValueInfo.insert(vm.stackValueInfo.end(), descs.begin(), descs.end());
+    return true;
+}
 
+static InterpretResult runLoop(VMRuntime& vm, JitState* jit)
+{
+    const Script& script = vm.script;
+    VMState& state = vm.state;
+    const i32 byteCodeSize = (i32)script.byteCode.size();
+    const OpCodeType* ipStart = vm.codeStart;
+    const OpCodeType* ip = vm.ip;
+    std::vector<TypeOfValue>& stack = vm.stack;
+    std::vector<ValueTypeDesc>& stackValueInfo = vm.stackValueInfo;
 
-    // Does stack need type info stack?
-    u32 stackIndex = 0;
-    std::vector<TypeOfValue> stack;
-    std::vector<ValueTypeDesc> stackValueInfo;
-
-    std::vector<u16> localValueAmounts;
-    std::vector<i32> parentStructIndices;
-
-    stack.reserve(1024 * 1024);
-    stackValueInfo.reserve(1024 * 1024);
-
-    i32& lastLocalAmount = script.previousLocalStartIndex;
-    //i32 localDepth = 0;
-    
-    lastLocalAmount = 0;
-    const std::vector<TypeOfValue> &valueArray = getCurrentStructStack(script).structValueArray;
-    const std::vector<ValueTypeDesc> &valueTypeArray = getCurrentStructStack(script).structValueTypes;
-    script.locals.structValueArray.insert(script.locals.structValueArray.end(), valueArray.begin(), valueArray.end());
-    script.locals.structValueTypes.insert(script.locals.structValueTypes.end(), valueTypeArray.begin(), valueTypeArray.end());
-
-    VMRuntime vmRuntimeError = {
-        .stack = stack,
-        .codeStart = ipStart,
-        .ip = ip,
-        .lines = lines,
-    };
     while(true)
     {
         #if DEBUG_TRACE_EXEC
-            disassembleInstruction(script, i32(intptr_t(ip) - intptr_t(ipStart)) / OpCodeTypeSize);
+            // Tracing does not run the stack ops of the disassembler, script is only read.
+            disassembleInstruction(const_cast<Script&>(script), i32(intptr_t(ip) - intptr_t(ipStart)) / OpCodeTypeSize);
         #endif
         #if DEBUG_PRINT_LOCALS
             printf("\n--- Locals ---\n");
-            for(i32 i = 0; i < script.locals.structValueArray.size(); ++i)
+            for(i32 i = 0; i < state.locals.structValueArray.size(); ++i)
             {
-                const StructStack& local = script.locals;
+                const StructStack& local = state.locals;
                 printf("%i: Type: %i, value %i\n",
                        i, local.structValueTypes[i], local.structValueArray[i]);
             }
@@ -278,9 +384,15 @@ InterpretResult runCode(Script& script)
 
         #endif
         assert(ip >= ipStart && ip < ipStart + byteCodeSize);
-         OpCodeType opCode = *ip++;
+        OpCodeType opCode = *ip++;
         assert(ip >= ipStart && ip <= ipStart + byteCodeSize);
-        vmRuntimeError.ip = ip;
+        vm.ip = ip;
+        #if VM_STATS
+            if(vm.stats != nullptr)
+            {
+                recordStats(vm, opCode);
+            }
+        #endif
         switch(opCode)
         {
             case OP_END_OF_FILE:
@@ -289,12 +401,16 @@ InterpretResult runCode(Script& script)
             }
             case OP_RETURN:
             {
-                if(script.functionReturnAddresses.size() == 0)
+                if(state.functionReturnAddresses.size() == 0)
                 {
                     return InterpretResult_Ok;
                 }
-                i32 returnAddress = script.functionReturnAddresses.back();
-                script.functionReturnAddresses.pop_back();
+                i32 returnAddress = state.functionReturnAddresses.back();
+                state.functionReturnAddresses.pop_back();
+                if(vm.profiler != nullptr)
+                {
+                    profilerExit(*vm.profiler);
+                }
 
                 if(returnAddress == 0 || returnAddress == byteCodeSize)
                 {
@@ -321,254 +437,124 @@ InterpretResult runCode(Script& script)
             case OP_CONSTANT_F64:
             {
                 u16 lookupIndex = *ip++;
-                TypeOfValue* value = &script.constants.structValueArray[lookupIndex];
-                stack.push_back(*value);
-                ValueType type = ValueType(opCode - OP_CONSTANT_BOOL + ValueTypeBool);
-                stackValueInfo.push_back(ValueTypeDesc{.valueType = type });
+                opConstant(vm, opCode, lookupIndex);
                 break;
             }
             case OP_NOT:
             {
-                TypeOfValue value = stack.back();
-                stack.pop_back();
-
-                stack.push_back(!truthy(value));
-                stackValueInfo.pop_back();
-                stackValueInfo.push_back({.valueType = ValueTypeBool});
+                opNot(vm);
                 break;
             }
             case OP_CONSTANT_STRING:
             {
                 u16 lookupIndex = *ip++;
-                TypeOfValue value = script.constants.structValueArray[lookupIndex];
-
-                const std::string& s = script.stringLiterals[value];
-
-                i32 index = (i32)script.stackStrings.size();
-                stack.push_back(index);
-
-                script.stackStrings.push_back(s);
-
-                stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeString});
+                opConstantString(vm, lookupIndex);
                 break;
             }
             case OP_NIL:
             {
-                stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeNull});
-                stack.push_back(0);
+                opNil(vm);
                 break;
             }
             case OP_EQUAL:
             {
-                valuesEqual(script, stack, stackValueInfo);
+                opEqual(vm);
                 break;
             }
             case OP_NEGATE:
             {
-                ValueTypeDesc* desc;
-                if(!peek(stackValueInfo, 0, &desc))
+                if(!opNegate(vm))
                 {
-                    runtimeError(vmRuntimeError,
-                                 "Trying to peek stack that does not have enough indices: %i", 0);
-                    return InterpretResult_RuntimeError;
-                }
-                if(desc->valueType >= ValueTypeI8 && desc->valueType <= ValueTypeF64)
-                {
-                    TypeOfValue value = stack.back();
-                    stack.pop_back();
-                    stack.push_back(-value);
-                    break;
-                }
-                else
-                {
-                    const char* valueTypeName = "Unknown value type";
-                    if(desc->valueType >= 0 && desc->valueType < ValueType::ValueTypeCount)
-                    {
-                        valueTypeName = ValueTypeNames[desc->valueType];
-                    }
-                    runtimeError(VMRuntime{.stack = stack, .codeStart = ipStart, .ip = ip,
-                                     .lines = lines, },
-                                 "Cannot negate the type: %i: %s", desc->valueType, valueTypeName);
                     return InterpretResult_RuntimeError;
                 }
+                break;
             }
             case OP_PRINT:
             {
-                TypeOfValue value = stack.back();
-                stack.pop_back();
-
-                ValueTypeDesc valueDesc = stackValueInfo.back();
-                stackValueInfo.pop_back();
-
-                printValue(script, &value, valueDesc.valueType);
-                printf("\n");
-
+                opPrint(vm);
                 break;
             }
             case OP_POP:
             {
-                stack.pop_back();
-                stackValueInfo.pop_back();
+                opPop(vm);
                 break;
             }
             case OP_DEFINE_GLOBAL:
             {
                 i16 lookupIndex = (i16)*ip++;
-                TypeOfValue *value = nullptr;
-                //if(localDepth == 0)
-                //{
-                //    value = &getCurrentStructStack(script).structValueArray[lookupIndex];
-                //}
-                //else
-                i32 arrSize = (i32)script.locals.structValueArray.size();
-                i32 checkIndex = arrSize + lookupIndex;
-                checkIndex %= arrSize;
-                {
-
-                    value = &script.locals.structValueArray[checkIndex];
-                    //value = &script.locals.structValueArray[i32(lookupIndex) + lastLocalAmount]; //getCurrentStructStack(script).structValueArray[lookupIndex];
-                }
-                ValueTypeDesc* descA;
-
-                if(!peek(stackValueInfo, 0, &descA))
+                if(!opDefineGlobal(vm, lookupIndex))
                 {
-                    runtimeError(vmRuntimeError,
-                                 "Trying to peek stack that does not have enough indices: %i", 1);
                     return InterpretResult_RuntimeError;
                 }
-                //if(localDepth == 0)
-                //{
-                //    getCurrentStructStack(script).structValueTypes[lookupIndex] = *descA;
-                //}
-                //else
-                {
-
-                    script.locals.structValueTypes[checkIndex] = *descA;
-                    //script.locals.structValueTypes[i32(lookupIndex) + lastLocalAmount] = *descA;
-                }
-                *value = stack.back();
-                stack.pop_back();
-                stackValueInfo.pop_back();
                 break;
             }
-
             case OP_GET_GLOBAL:
             {
                 i16 lookupIndex = i16(*ip++);
-                TypeOfValue *value = nullptr;
-                ValueTypeDesc *desc = nullptr;
-
-                //if(localDepth == 0)
-                //{
-                //    value = &getCurrentStructStack(script).structValueArray[lookupIndex];
-                //    desc = &getCurrentStructStack(script).structValueTypes[lookupIndex];
-                //}
-                //else
-                {
-                    i32 arrSize = (i32)script.locals.structValueArray.size();
-                    i32 checkIndex = arrSize + lookupIndex;
-                    checkIndex %= arrSize;
-                    value = &script.locals.structValueArray[checkIndex];
-                    desc = &script.locals.structValueTypes[checkIndex];
-                    //value = &script.locals.structValueArray[i32(lookupIndex) + lastLocalAmount];
-                    //desc = &script.locals.structValueTypes[i32(lookupIndex) + lastLocalAmount];
-                }
-                stack.push_back(*value);
-                stackValueInfo.push_back(*desc);
+                opGetGlobal(vm, lookupIndex);
                 break;
             }
             case OP_SET_GLOBAL:
             {
                 i16 lookupIndex = i16(*ip++);
-                TypeOfValue *value = nullptr;
-                ValueTypeDesc *desc = nullptr;
-
-                //if(localDepth == 0)
-                //{
-                //    value = &getCurrentStructStack(script).structValueArray[lookupIndex];
-                //    desc = &getCurrentStructStack(script).structValueTypes[lookupIndex];
-                //}
-                //else
+                if(!opSetGlobal(vm, lookupIndex))
                 {
-                    i32 arrSize = (i32)script.locals.structValueArray.size();
-                    i32 checkIndex = arrSize + lookupIndex;
-                    checkIndex %= arrSize;
-                    value = &script.locals.structValueArray[checkIndex];
-                    desc = &script.locals.structValueTypes[checkIndex];
-                    //value = &script.locals.structValueArray[i32(lookupIndex) + lastLocalAmount];
-                    //desc = &script.locals.structValueTypes[i32(lookupIndex) + lastLocalAmount];
+                    return InterpretResult_RuntimeError;
                 }
-                *value = stack.back();
-                stack.pop_back();
-
-                ValueTypeDesc otherDesc = stackValueInfo.back();
-                assert(desc->valueType == otherDesc.valueType);
-                stackValueInfo.pop_back();
-
-
-                stack.push_back(*value);
-                stackValueInfo.push_back(*desc);
-
-                if(desc->valueType != otherDesc.valueType)
+                break;
+            }
+            case OP_LOAD_8:
+            case OP_LOAD_16:
+            case OP_LOAD_32:
+            case OP_LOAD_64:
+            {
+                i16 offset = i16(*ip++);
+                u16 type = *ip++;
+                switch(opCode)
+                {
+                    case OP_LOAD_8: opLoadPacked<u8>(vm, offset, type); break;
+                    case OP_LOAD_16: opLoadPacked<u16>(vm, offset, type); break;
+                    case OP_LOAD_32: opLoadPacked<u32>(vm, offset, type); break;
+                    default: opLoadPacked<u64>(vm, offset, type); break;
+                }
+                break;
+            }
+            case OP_STORE_8:
+            case OP_STORE_16:
+            case OP_STORE_32:
+            case OP_STORE_64:
+            {
+                i16 offset = i16(*ip++);
+                u16 type = *ip++;
+                bool success = false;
+                switch(opCode)
+                {
+                    case OP_STORE_8: success = opStorePacked<u8>(vm, offset, type); break;
+                    case OP_STORE_16: success = opStorePacked<u16>(vm, offset, type); break;
+                    case OP_STORE_32: success = opStorePacked<u32>(vm, offset, type); break;
+                    default: success = opStorePacked<u64>(vm, offset, type); break;
+                }
+                if(!success)
                 {
-                    runtimeError(VMRuntime {.stack = stack, .codeStart = ipStart, .ip = ip,
-                        .lines = lines, },
-                        "Valuetypes mismatch for assignment: %i vs %i!", desc->valueType, otherDesc.valueType);
                     return InterpretResult_RuntimeError;
-
                 }
-
                 break;
             }
             case OP_STACK_SET:
             {
                 u16 lookupIndex = *ip++;
-                if(lookupIndex < 0 || lookupIndex >= (i32)script.structStacks.size())
+                if(!opStackSet(vm, lookupIndex))
                 {
-                    runtimeError(VMRuntime {.stack = stack, .codeStart = ipStart, .ip = ip,
-                                     .lines = lines, },
-                                 "Stack has no parent index!");
                     return InterpretResult_RuntimeError;
                 }
-                parentStructIndices.push_back(script.structIndex);
-                script.structIndex = (i32)lookupIndex;
-                localValueAmounts.push_back(lastLocalAmount);
-                lastLocalAmount = script.locals.structValueArray.size();
-                const std::vector<TypeOfValue>& valueArray = getCurrentStructStack(script).structValueArray;
-                const std::vector<ValueTypeDesc>& valueTypeArray = getCurrentStructStack(script).structValueTypes;
-                script.locals.structValueArray.insert(script.locals.structValueArray.end(), valueArray.begin(), valueArray.end());
-                script.locals.structValueTypes.insert(script.locals.structValueTypes.end(), valueTypeArray.begin(), valueTypeArray.end());
-
-                //localDepth++;
                 break;
             }
             case OP_STACK_POP:
             {
-                i32 parentIndex = parentStructIndices.back();
-                parentStructIndices.pop_back();
-                //i32 parentIndex = getCurrentStructStack(script).parentStructIndex;
-                if(parentIndex < 0 || parentIndex >= (i32)script.structStacks.size())
+                if(!opStackPop(vm))
                 {
-                    runtimeError(VMRuntime {.stack = stack, .codeStart = ipStart, .ip = ip,
-                         .lines = lines, },
-                     "Stack has no parent index!");
                     return InterpretResult_RuntimeError;
                 }
-                else
-                {
-                    script.structIndex = parentIndex;
-                    //const std::vector<TypeOfValue> &valueArray = getCurrentStructStack(script).structValueArray;
-                    //i32 currentSize = i32(script.locals.structValueArray.size());
-                    script.locals.structValueArray.erase(script.locals.structValueArray.begin() + lastLocalAmount, script.locals.structValueArray.end());
-                    script.locals.structValueTypes.erase(script.locals.structValueTypes.begin() + lastLocalAmount, script.locals.structValueTypes.end());
-
-
-
-                    lastLocalAmount = localValueAmounts.back();
-                    localValueAmounts.pop_back();
-                    //localDepth--;
-                    //assert(localDepth >= 0);
-                }
                 break;
             }
             case OP_JUMP_IF_FALSE:
@@ -604,111 +590,250 @@ InterpretResult runCode(Script& script)
                 break;
             }
 
+            case OP_FOR_LOOP:
+            {
+                i16 offset = i16(*ip++);
+                u16 type = *ip++;
+                i16 step = i16(*ip++);
+                i32 offset1 = *ip++;
+                i32 offset2 = *ip++;
+                bool loop = false;
+                if(!opForLoop(vm, offset, type, step, loop))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                if(loop)
+                {
+                    ip += offset1 | (offset2 << 16);
+                }
+                break;
+            }
+
             case OP_JUMP_ADDRESS_DIRECTLY:
             {
                 i32 address1 = *ip++;
                 i32 address2 = *ip;
 
                 i32 address = address1 | (address2 << 16);
+                if(vm.profiler != nullptr)
+                {
+                    profilerEnterFunction(*vm.profiler, address);
+                }
+            #if JIT_ENABLED
+                JitFn jitFn = jit != nullptr ? jitFunctionEntry(jit, address) : nullptr;
+                if(jitFn != nullptr)
+                {
+                    // Jitted function runs until it returns, continue from the return address it popped.
+                    i32 result = jitFn(&vm);
+                    if(result != InterpretResult_Ok)
+                    {
+                        return InterpretResult(result);
+                    }
+                    address = vm.returnAddress;
+                    if(address == 0 || address == byteCodeSize)
+                    {
+                        return InterpretResult_Ok;
+                    }
+                    if(address < 0 || address > byteCodeSize)
+                    {
+                        return InterpretResult_RuntimeError;
+                    }
+                }
+            #endif
                 ip = ipStart + address;
                 break;
             }
+            case OP_MEMO_LOOKUP:
+            {
+                u16 functionIndex = *ip++;
+                u16 argCount = *ip++;
+                i32 offset1 = *ip++;
+                i32 offset2 = *ip++;
+                bool hit = false;
+                opMemoLookup(vm, functionIndex, argCount, hit);
+                if(hit)
+                {
+                    ip += offset1 | (offset2 << 16);
+                }
+                break;
+            }
+            case OP_MEMO_STORE:
+            {
+                u16 functionIndex = *ip++;
+                u16 argCount = *ip++;
+                opMemoStore(vm, functionIndex, argCount);
+                break;
+            }
             case OP_CODE_PUSH_RETURN_ADDRESS:
             {
                 i32 address1 = *ip++;
                 i32 address2 = *ip++;
 
                 i32 address = address1 | (address2 << 16);
-                script.functionReturnAddresses.push_back(address);
+                state.functionReturnAddresses.push_back(address);
                 break;
             }
             case OP_NATIVE_CALL:
             {
                 i16 nativeCallIndex = *ip++;
-                if(nativeCallIndex >= script.nativePatchFunctions.size() ||
-                    script.nativePatchFunctions[nativeCallIndex].callFn == nullptr)
+                #if VM_STATS
+                    if(vm.stats != nullptr && nativeCallIndex < vm.stats->nativeCallCounts.size())
+                    {
+                        vm.stats->nativeCallCounts[nativeCallIndex]++;
+                    }
+                #endif
+                if(vm.profiler != nullptr)
+                {
+                    profilerEnterNative(*vm.profiler, nativeCallIndex);
+                }
+                if(!opNativeCall(vm, nativeCallIndex))
                 {
-                    runtimeError(VMRuntime {.stack = stack, .codeStart = ipStart, .ip = ip,
-                                     .lines = lines, },
-                                 "Failed to do native call!");
                     return InterpretResult_RuntimeError;
                 }
-                const NativePatchFunction& fn = script.nativePatchFunctions[nativeCallIndex];
-                i32 params = i32(fn.parameterTypes.size());
-                NativeReturn result{};
-                if(params == 0)
+                if(vm.profiler != nullptr)
                 {
-                    result = fn.callFn(script, params, nullptr, nullptr);
+                    profilerExit(*vm.profiler);
                 }
-                else
+                break;
+            }
+            case OP_SPAWN:
+            {
+                u16 functionIndex = *ip++;
+                if(!opSpawn(vm, functionIndex))
                 {
-                    i32 index = i32(stack.size() - params);
-                    result = fn.callFn(script, params, &stack[index], &stackValueInfo[index]);
+                    return InterpretResult_RuntimeError;
                 }
-                for(int i = 0; i < params; ++i)
+                break;
+            }
+            case OP_JOIN:
+            {
+                if(!opJoin(vm))
                 {
-                    stack.pop_back();
-                    stackValueInfo.pop_back();
+                    return InterpretResult_RuntimeError;
                 }
-                stack.push_back(result.value);
-                stackValueInfo.push_back(result.desc);
                 break;
             }
-            case OP_ADD:
-            case OP_SUB:
-            case OP_MUL:
-            case OP_DIV:
-            case OP_GREATER:
-            case OP_LESSER:
+            case OP_PARALLEL_FOR:
             {
-                ValueTypeDesc* descA;
-                ValueTypeDesc* descB;
-                if(!peek(stackValueInfo, 0, &descA) || !peek(stackValueInfo, 1, &descB))
+                i32 offset1 = *ip++;
+                i32 offset2 = *ip++;
+                u16 reductions = *ip++;
+                i32 offset = offset1 | (offset2 << 16);
+                i32 bodyAddress = i32(getInstructionIndex(ip, ipStart)) + offset;
+                if(!opParallelFor(vm, bodyAddress, reductions))
                 {
-                    runtimeError(vmRuntimeError,
-                                 "Trying to peek stack that does not have enough indices: %i", 1);
                     return InterpretResult_RuntimeError;
                 }
-                if(opCode == OP_ADD && descA->valueType == ValueTypeString)
+                break;
+            }
+            case OP_YIELD:
+            {
+                state.resumeAddress = i32(getInstructionIndex(ip, ipStart));
+                return InterpretResult_Yield;
+            }
+            case OP_SEND:
+            case OP_RECV:
+            {
+                ChannelOpResult result = opCode == OP_SEND ? opSend(vm) : opRecv(vm);
+                if(result == ChannelOp_Error)
                 {
-                    HelperStruct values = valuesEqualHelper(stack, stackValueInfo);
-                    const std::string a = script.stackStrings[values.valueA];
-                    const std::string b = script.stackStrings[values.valueB];
-
-                    script.stackStrings.pop_back();
-                    script.stackStrings.pop_back();
-
-                    i32 newIndex = (i32)script.stackStrings.size();
-                    script.stackStrings.push_back(a + b);
-
-                    stack.push_back(newIndex);
-                    stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeString});
-
+                    return InterpretResult_RuntimeError;
                 }
-                else
+                if(result == ChannelOp_Wait)
                 {
-                    i32 result = doBinaryOp(stack, stackValueInfo, opCode);
-                    if (result != 0)
+                    // Run the op again, after other coroutines, tasks or threads had their turn.
+                    --ip;
+                    if(state.coroutine)
                     {
-                        switch (result)
-                        {
-                            case 1:
-                                runtimeError(vmRuntimeError, "Mismatching types on binary op: %i vs %i!",
-                                             descA->valueType, descB->valueType);
-                                break;
-                            case 2:
-                                runtimeError(vmRuntimeError, "Valuetype on binary op not a number: %i!",
-                                             descA->valueType);
-                                break;
-                            case 3:
-                                runtimeError(vmRuntimeError, "Not valid binary op: %i!", opCode);
-                                break;
-                        }
-                        return InterpretResult_RuntimeError;
+                        state.resumeAddress = i32(getInstructionIndex(ip, ipStart));
+                        return InterpretResult_Yield;
+                    }
+                    // Task that would send or receive can be queued behind this one.
+                    if(state.scheduler == nullptr || !schedulerRunPending(*state.scheduler, state.workerIndex))
+                    {
+                        std::this_thread::yield();
                     }
                 }
                 break;
             }
+            case OP_ARRAY_NEW:
+            {
+                u16 elementType = *ip++;
+                if(!opArrayNew(vm, elementType))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_ARRAY_LITERAL:
+            {
+                u16 count = *ip++;
+                if(!opArrayLiteral(vm, count))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_ARRAY_GET:
+            {
+                if(!opArrayGet(vm))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_ARRAY_SET:
+            {
+                if(!opArraySet(vm))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_STRUCT_LITERAL:
+            {
+                u16 structIndex = *ip++;
+                if(!opStructLiteral(vm, structIndex))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_FIELD_GET:
+            case OP_FIELD_SET:
+            case OP_ARRAY_FIELD_GET:
+            case OP_ARRAY_FIELD_SET:
+            {
+                u16 structIndex = *ip++;
+                u16 offset = *ip++;
+                u16 typeId = *ip++;
+                bool success = false;
+                switch(opCode)
+                {
+                    case OP_FIELD_GET: success = opFieldGet(vm, structIndex, offset, typeId); break;
+                    case OP_FIELD_SET: success = opFieldSet(vm, structIndex, offset, typeId); break;
+                    case OP_ARRAY_FIELD_GET: success = opArrayFieldGet(vm, structIndex, offset, typeId); break;
+                    default: success = opArrayFieldSet(vm, structIndex, offset, typeId); break;
+                }
+                if(!success)
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_GREATER:
+            case OP_LESSER:
+            {
+                if(!opBinary(vm, opCode))
+                {
+                    return InterpretResult_RuntimeError;
+                }
+                break;
+            }
             default:
             {
                 printf("Unknown opcode runtime: %u\n", opCode);
@@ -719,13 +844,513 @@ InterpretResult runCode(Script& script)
     }
 }
 
+// Sets up the state of a task, starting from task address. Arguments go on the stack like
+// for a call, with no return address the first return ends the run.
+static void initTaskState(Scheduler& scheduler, Task& task, VMState& state)
+{
+    const Script& script = scheduler.script;
+    state.natives = scheduler.natives;
+    state.channels = scheduler.channels;
+    state.memoEntries = scheduler.memoEntries;
+    resetVMState(state, script);
+    state.scheduler = &scheduler;
+    // Channel ops that would wait yield, the task then waits in the scheduler.
+    state.coroutine = true;
+    state.resumeAddress = task.address;
+    if(task.parent != nullptr)
+    {
+        // Parallel for body addresses locals relative to the scope the loop is in.
+        const VMState& parent = *task.parent;
+        state.locals.structValueArray = parent.locals.structValueArray;
+        state.locals.structValueTypes = parent.locals.structValueTypes;
+        state.locals.structPackedValues = parent.locals.structPackedValues;
+        state.localValueAmounts = parent.localValueAmounts;
+        state.parentStructIndices = parent.parentStructIndices;
+        state.stackStrings = parent.stackStrings;
+        // Shared, so chunks writing to their own elements fill the array of the loop.
+        state.arrays = parent.arrays;
+        state.structMemory = parent.structMemory;
+        state.structIndex = parent.structIndex;
+        state.previousLocalStartIndex = parent.previousLocalStartIndex;
+    }
+    for(i32 i = 0; i < task.args.size(); ++i)
+    {
+        TypeOfValue value = task.args[i];
+        if(task.argDescs[i].valueType == ValueTypeString)
+        {
+            state.stackStrings.push_back(task.argStrings[value]);
+            value = state.stackStrings.size() - 1;
+        }
+        else if(task.argDescs[i].valueType == ValueTypeArray)
+        {
+            state.arrays.push_back(task.argArrays[value]);
+            value = state.arrays.size() - 1;
+        }
+        else if(task.argDescs[i].valueType == ValueTypeStruct)
+        {
+            u32 size = script.structDescs[task.argDescs[i].structIndex].structSize;
+            value = copyStruct(state.structMemory, task.argStructMemory, value, size);
+        }
+        state.stack.push_back(value);
+        state.stackValueInfo.push_back(task.argDescs[i]);
+    }
+}
+
+// Runs the task with a state of its own. A task waiting on a channel keeps its state in
+// waitingState and continues from there the next time it runs, possibly on another worker.
+static void runScriptTask(Scheduler& scheduler, i32 workerIndex, Task& task)
+{
+    const Script& script = scheduler.script;
+    const OpCodeType* ipStart = (const OpCodeType*)script.byteCode.data();
+
+    VMState* waitingState = task.waitingState;
+    task.waitingState = nullptr;
+    if(waitingState == nullptr)
+    {
+        waitingState = new VMState{};
+        initTaskState(scheduler, task, *waitingState);
+    }
+    VMState& state = *waitingState;
+    state.workerIndex = workerIndex;
+
+    VMRuntime vm = {
+        .script = script,
+        .state = state,
+        .stack = state.stack,
+        .stackValueInfo = state.stackValueInfo,
+        .codeStart = ipStart,
+        .ip = ipStart + state.resumeAddress,
+        .lines = script.byteCodeLines.data(),
+    };
+#if VM_STATS
+    vm.stats = nullptr;
+#endif
+    vm.profiler = nullptr;
+
+    JitState* jit = nullptr;
+#if JIT_ENABLED
+    if(scheduler.useJit)
+    {
+        JitState*& workerJit = scheduler.jits[workerIndex];
+        workerJit = workerJit != nullptr ? workerJit : jitCreate(script);
+        jit = workerJit;
+    }
+#endif
+    InterpretResult result = runLoop(vm, jit);
+    while(result == InterpretResult_Yield)
+    {
+        // Full or empty channel, the worker runs other tasks until this one gets its turn again.
+        OpCodeType opCode = script.byteCode[state.resumeAddress];
+        if(opCode == OP_SEND || opCode == OP_RECV)
+        {
+            task.waitingState = &state;
+            return;
+        }
+        // Other yields continue right away.
+        vm.ip = ipStart + state.resumeAddress;
+        result = runLoop(vm, jit);
+    }
+    task.result = result;
+
+    // Function falling off its end leaves nothing, that is nil.
+    task.values.assign(task.resultCount, 0);
+    task.descs.assign(task.resultCount, {.valueType = ValueTypeNull});
+    size_t count = std::min(state.stack.size(), size_t(task.resultCount));
+    size_t first = state.stack.size() - count;
+    for(size_t i = 0; i < count && task.result == InterpretResult_Ok; ++i)
+    {
+        TypeOfValue value = state.stack[first + i];
+        ValueTypeDesc desc = state.stackValueInfo[first + i];
+        if(desc.valueType == ValueTypeString)
+        {
+            task.resultStrings.push_back(state.stackStrings[value]);
+            value = task.resultStrings.size() - 1;
+        }
+        else if(desc.valueType == ValueTypeArray)
+        {
+            task.resultArrays.push_back(state.arrays[value]);
+            value = task.resultArrays.size() - 1;
+        }
+        else if(desc.valueType == ValueTypeStruct)
+        {
+            u32 size = script.structDescs[desc.structIndex].structSize;
+            value = copyStruct(task.resultStructMemory, state.structMemory, value, size);
+        }
+        task.values[i] = value;
+        task.descs[i] = desc;
+    }
+    // Tasks this one spawned but never joined are still running on the same scheduler,
+    // they get waited for when the run ends.
+    delete waitingState;
+}
+
+static bool usesTasks(const Script& script)
+{
+    i32 address = 0;
+    while(address < script.byteCode.size())
+    {
+        OpCodeType opCode = script.byteCode[address];
+        if(opCode == OP_SPAWN || opCode == OP_PARALLEL_FOR)
+        {
+            return true;
+        }
+        i32 len = getOpCodeLength(opCode);
+        address += len > 0 ? len : 1;
+    }
+    return false;
+}
+
+bool initVMState(VMState& state, const Script& script, i32 stackReserve)
+{
+    state.natives.assign(script.nativePatchFunctions.size(), nullptr);
+    bool success = true;
+    // Only natives the script calls need binding.
+    for(i32 i = 0; i < script.nativePatchFunctions.size(); ++i)
+    {
+        std::string name = getStringFromTokenName(script.nativePatchFunctions[i].token);
+        state.natives[i] = findNative(name);
+        if(state.natives[i] == nullptr)
+        {
+            fprintf(stderr, "No native function: %s\n", name.c_str());
+            success = false;
+        }
+    }
+    state.stack.reserve(stackReserve);
+    state.stackValueInfo.reserve(stackReserve);
+    state.memoEntries = VMOptions{}.memoEntries;
+    resetVMState(state, script);
+    return success;
+}
+
+InterpretResult runCode(const Script& script, VMState& state, const VMOptions& options)
+{
+    const OpCodeType* ipStart = (const OpCodeType*) script.byteCode.data();
+    const OpCodeType* ip = ipStart;
+
+    const i32* lines = script.byteCodeLines.data();
+
+    resetVMState(state, script);
+    state.memoEntries = options.memoEntries;
+    VMRuntime vm = {
+        .script = script,
+        .state = state,
+        .stack = state.stack,
+        .stackValueInfo = state.stackValueInfo,
+        .codeStart = ipStart,
+        .ip = ip,
+        .lines = lines,
+    };
+
+    bool useJit = options.useJit;
+#if VM_STATS
+    VMStats stats{};
+    vm.stats = nullptr;
+    if(options.printStats)
+    {
+        stats.nativeCallCounts.resize(script.nativePatchFunctions.size());
+        vm.stats = &stats;
+        // Jitted code does not count ops.
+        useJit = false;
+    }
+#endif
+
+    Profiler profiler{};
+    vm.profiler = nullptr;
+    if(options.profileFile != nullptr)
+    {
+        vm.profiler = &profiler;
+        // Jitted functions do not report calls and returns.
+        useJit = false;
+    }
+
+    JitState* jit = nullptr;
+#if JIT_ENABLED
+    jit = useJit ? jitCreate(script) : nullptr;
+#endif
+    if(vm.profiler != nullptr)
+    {
+        profilerBegin(profiler, script);
+    }
+    Sampler sampler{};
+    if(options.sampleFile != nullptr && !samplerStart(sampler, vm, options.sampleFrequency))
+    {
+        fprintf(stderr, "Sampling profiler is not available.\n");
+    }
+    if(usesTasks(script))
+    {
+        state.scheduler = schedulerCreate(script, state.natives, state.channels, useJit, options.taskThreads, runScriptTask);
+        state.scheduler->memoEntries = state.memoEntries;
+    }
+    InterpretResult result = runLoop(vm, jit);
+    // Nothing else to switch to, yield continues right away.
+    while(result == InterpretResult_Yield)
+    {
+        vm.ip = ipStart + state.resumeAddress;
+        result = runLoop(vm, jit);
+    }
+    schedulerDestroy(state.scheduler);
+    state.scheduler = nullptr;
+    samplerStop(sampler);
+    if(vm.profiler != nullptr)
+    {
+        profilerEnd(profiler);
+    }
+#if JIT_ENABLED
+    jitDestroy(jit);
+#endif
+
+#if VM_STATS
+    if(vm.stats != nullptr)
+    {
+        printStats(script, stats);
+    }
+#endif
+    if(vm.profiler != nullptr)
+    {
+        printProfile(profiler);
+        if(!writeCallgrindProfile(profiler, options.sourceName, options.profileFile))
+        {
+            fprintf(stderr, "Failed to write profile: %s\n", options.profileFile);
+        }
+    }
+    if(options.sampleFile != nullptr && !writeFoldedStacks(sampler, script, options.sampleFile))
+    {
+        fprintf(stderr, "Failed to write samples: %s\n", options.sampleFile);
+    }
+    return result;
+}
+
+
+static InterpretResult runCoroutine(const Script& script, VMState& state)
+{
+    const OpCodeType* ipStart = (const OpCodeType*)script.byteCode.data();
+    VMRuntime vm = {
+        .script = script,
+        .state = state,
+        .stack = state.stack,
+        .stackValueInfo = state.stackValueInfo,
+        .codeStart = ipStart,
+        .ip = ipStart + state.resumeAddress,
+        .lines = script.byteCodeLines.data(),
+    };
+#if VM_STATS
+    vm.stats = nullptr;
+#endif
+    vm.profiler = nullptr;
+    InterpretResult result = runLoop(vm, nullptr);
+    if(result != InterpretResult_Yield)
+    {
+        stopCoroutine(state);
+    }
+    return result;
+}
+
+InterpretResult startCoroutine(const Script& script, VMState& state)
+{
+    stopCoroutine(state);
+    resetVMState(state, script);
+    state.coroutine = true;
+    if(usesTasks(script))
+    {
+        // Coroutines are already spread over the host threads, tasks run when joined.
+        state.scheduler = schedulerCreate(script, state.natives, state.channels, false, 1, runScriptTask);
+        state.scheduler->memoEntries = state.memoEntries;
+    }
+    return runCoroutine(script, state);
+}
+
+InterpretResult resumeCoroutine(const Script& script, VMState& state)
+{
+    // Tasks of a coroutine only run on its thread, a channel op it waits on may need one of them.
+    if(state.scheduler != nullptr)
+    {
+        schedulerRunPending(*state.scheduler, state.workerIndex);
+    }
+    return runCoroutine(script, state);
+}
+
+void stopCoroutine(VMState& state)
+{
+    schedulerDestroy(state.scheduler);
+    state.scheduler = nullptr;
+}
+
+void beginFunctionCalls(const Script& script, VMState& state, const VMOptions& options)
+{
+    endFunctionCalls(state);
+#if JIT_ENABLED
+    state.jit = options.useJit ? jitCreate(script) : nullptr;
+#endif
+    state.memoEntries = options.memoEntries;
+    if(usesTasks(script))
+    {
+        state.scheduler = schedulerCreate(script, state.natives, state.channels, options.useJit, options.taskThreads, runScriptTask);
+        state.scheduler->memoEntries = state.memoEntries;
+    }
+}
+
+InterpretResult callFunction(const Script& script, VMState& state, i32 functionIndex)
+{
+    const OpCodeType* ipStart = (const OpCodeType*)script.byteCode.data();
+    i32 address = script.functions[functionIndex].functionStartLocation;
+    // No return address, the return of the function ends the run.
+    state.functionReturnAddresses.clear();
+    VMRuntime vm = {
+        .script = script,
+        .state = state,
+        .stack = state.stack,
+        .stackValueInfo = state.stackValueInfo,
+        .codeStart = ipStart,
+        .ip = ipStart + address,
+        .lines = script.byteCodeLines.data(),
+    };
+#if VM_STATS
+    vm.stats = nullptr;
+#endif
+    vm.profiler = nullptr;
+    InterpretResult result = InterpretResult_Yield;
+    state.resumeAddress = address;
+#if JIT_ENABLED
+    JitFn jitFn = state.jit != nullptr ? jitFunctionEntry(state.jit, address) : nullptr;
+    if(jitFn != nullptr)
+    {
+        result = InterpretResult(jitFn(&vm));
+    }
+#endif
+    // Yield continues right away, like in runCode.
+    while(result == InterpretResult_Yield)
+    {
+        vm.ip = ipStart + state.resumeAddress;
+        result = runLoop(vm, state.jit);
+    }
+    return result;
+}
+
+InterpretResult callFunctionBatch(const Script& script, VMState& state, i32 functionIndex,
+    const ValueColumn* args, i64 rowCount, ValueColumn results)
+{
+    const OpCodeType* ipStart = (const OpCodeType*)script.byteCode.data();
+    const Function& fn = script.functions[functionIndex];
+    i32 address = fn.functionStartLocation;
+    i32 argCount = (i32)fn.functionParamenterValueTypes.size();
+    i32 resultSize = getValueTypeSizeInBytes(results.type);
+    // Strings, arrays and structs a pure fn makes are garbage once the row is done, other fns
+    // can store them into globals.
+    size_t stringCount = state.stackStrings.size();
+    size_t arrayCount = state.arrays.size();
+    size_t structMemorySize = state.structMemory.size();
+
+    state.functionReturnAddresses.clear();
+    VMRuntime vm = {
+        .script = script,
+        .state = state,
+        .stack = state.stack,
+        .stackValueInfo = state.stackValueInfo,
+        .codeStart = ipStart,
+        .ip = ipStart + address,
+        .lines = script.byteCodeLines.data(),
+    };
+#if VM_STATS
+    vm.stats = nullptr;
+#endif
+    vm.profiler = nullptr;
+    // Straight-line arithmetic runs LaneCount rows for every op, leftover rows run one at a time.
+    i64 row = 0;
+    LaneProgram lanes;
+    if(rowCount >= LaneCount && getArraySimdLevel() != SimdLevel_Scalar &&
+        buildLaneProgram(lanes, script, state, functionIndex) && lanes.resultType == results.type)
+    {
+        row = runLaneProgram(lanes, args, rowCount, results);
+    }
+    JitFn jitFn = nullptr;
+    for(; row < rowCount; ++row)
+    {
+        state.stack.clear();
+        state.stackValueInfo.clear();
+        for(i32 i = 0; i < argCount; ++i)
+        {
+            ValueType type = args[i].type;
+            i32 size = getValueTypeSizeInBytes(type);
+            TypeOfValue value = 0;
+            memcpy(&value, (const u8*)args[i].data + row * size, size);
+            state.stack.push_back(value);
+            state.stackValueInfo.push_back({.valueType = type});
+        }
+
+        InterpretResult result = InterpretResult_Yield;
+        state.resumeAddress = address;
+    #if JIT_ENABLED
+        // Rows count as calls, so the function gets jitted once the batch is past the threshold.
+        if(jitFn == nullptr && state.jit != nullptr)
+        {
+            jitFn = jitFunctionEntry(state.jit, address);
+        }
+        if(jitFn != nullptr)
+        {
+            result = InterpretResult(jitFn(&vm));
+        }
+    #endif
+        while(result == InterpretResult_Yield)
+        {
+            vm.ip = ipStart + state.resumeAddress;
+            result = runLoop(vm, state.jit);
+        }
+        if(result != InterpretResult_Ok)
+        {
+            return result;
+        }
+        if(state.stack.size() == 0 || state.stackValueInfo[0].valueType != results.type)
+        {
+            fprintf(stderr, "Row %" PRIi64 " result type: %i, results are type: %i\n", row,
+                state.stack.size() > 0 ? state.stackValueInfo[0].valueType : ValueTypeNull, results.type);
+            return InterpretResult_RuntimeError;
+        }
+        memcpy((u8*)results.data + row * resultSize, &state.stack[0], resultSize);
+        if(fn.pure)
+        {
+            state.stackStrings.resize(stringCount);
+            trimArrays(state, arrayCount);
+            state.structMemory.resize(structMemorySize);
+        }
+        else if(state.stackStrings.size() > stringCount || state.arrays.size() > arrayCount
+            || state.structMemory.size() > structMemorySize)
+        {
+            releaseCallValues(state, script);
+            stringCount = state.stackStrings.size();
+            arrayCount = state.arrays.size();
+            structMemorySize = state.structMemory.size();
+        }
+    }
+    return InterpretResult_Ok;
+}
+
+void endFunctionCalls(VMState& state)
+{
+    schedulerDestroy(state.scheduler);
+    state.scheduler = nullptr;
+#if JIT_ENABLED
+    jitDestroy(state.jit);
+#endif
+    state.jit = nullptr;
+}
+
+InterpretResult runCode(const Script& script, const VMOptions& options)
+{
+    VMState state{};
+    if(!initVMState(state, script))
+    {
+        return InterpretResult_NativeBindError;
+    }
+    state.channels = options.channels;
+    return runCode(script, state, options);
+}
 
-InterpretResult interpret(MyMemory& mem, Script& script)
+InterpretResult interpret(MyMemory& mem, Script& script, const VMOptions& options)
 {
     if(!compile(mem, script))
     {
         return InterpretResult_CompileError;
     }
 
-    return runCode(script);
+    return runCode(script, options);
 }
\ No newline at end of file
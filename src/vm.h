@@ -1,7 +1,12 @@
 #pragma once
 
+#include "common.h"
+#include "mytypes.h"
+
 struct MyMemory;
 struct Script;
+struct VMState;
+struct Channels;
 
 
 enum InterpretResult
@@ -10,9 +15,67 @@ enum InterpretResult
     InterpretResult_CompileError,
     InterpretResult_NativeBindError,
     InterpretResult_RuntimeError,
+    // Script ran yield, state can be resumed.
+    InterpretResult_Yield,
 
     InterpretResult_Count,
 };
 
-InterpretResult runCode(Script& script);
-InterpretResult interpret(MyMemory& mem, Script& script);
+struct VMOptions
+{
+    // Compile hot functions with jit, if built with JIT_ENABLED.
+    bool useJit = true;
+    // Print op counts when done, if built with VM_STATS.
+    bool printStats = false;
+    // Write callgrind profile of script functions here and print a summary, disables jit.
+    const char* profileFile = nullptr;
+    // Write folded stacks sampled with SIGPROF here, jit stays enabled.
+    const char* sampleFile = nullptr;
+    i32 sampleFrequency = 997;
+    // Script file name used in profile output.
+    const char* sourceName = "script";
+    // Threads running spawned tasks, 0 uses every hardware thread.
+    i32 taskThreads = 0;
+    // Results each pure fn keeps cached, 0 runs every call.
+    i32 memoEntries = 4096;
+    // Channels for send and recv, bound to states runCode and the runner create.
+    Channels* channels = nullptr;
+};
+
+// Binds natives the script calls and reserves the stacks, state can then run script any number of times.
+// Coroutine states use a small stackReserve, stacks still grow when needed.
+bool initVMState(VMState& state, const Script& script, i32 stackReserve = 1024 * 1024);
+// Resets state and runs script from the start to the end, script is only read. Yield continues right away.
+InterpretResult runCode(const Script& script, VMState& state, const VMOptions& options);
+
+// Coroutines keep all of their execution in the state, so many of them can wait suspended and
+// get resumed on any thread, one thread at a time. They run without jit, stats or profiling.
+// Resets state and runs script until it yields or ends, InterpretResult_Yield when it yielded.
+InterpretResult startCoroutine(const Script& script, VMState& state);
+// Continues a yielded coroutine until it yields again or ends.
+InterpretResult resumeCoroutine(const Script& script, VMState& state);
+// Ends a coroutine that is not going to be resumed, waits for tasks it spawned.
+void stopCoroutine(VMState& state);
+// Bool or number values of one argument or result for every row of a batch, packed at the size of type.
+struct ValueColumn
+{
+    ValueType type;
+    void* data;
+};
+
+// Host calls into script functions. After runCode has run the top level once, the state keeps its
+// globals and the calls only run the function. Begin starts jit and tasks shared by the calls.
+void beginFunctionCalls(const Script& script, VMState& state, const VMOptions& options);
+// Runs the function with its arguments already pushed on state.stack, leaves its results there.
+InterpretResult callFunction(const Script& script, VMState& state, i32 functionIndex);
+// Runs the function once for every row, with arguments of the parameter types from args, one
+// column for each parameter. First result of each row goes to results, which has to be its type.
+// Straight-line i32 and f32 arithmetic runs many rows for every op, see lanes.h.
+InterpretResult callFunctionBatch(const Script& script, VMState& state, i32 functionIndex,
+    const ValueColumn* args, i64 rowCount, ValueColumn results);
+// Waits for tasks the calls spawned and frees the jitted code.
+void endFunctionCalls(VMState& state);
+
+// Runs script once with a temporary state.
+InterpretResult runCode(const Script& script, const VMOptions& options);
+InterpretResult interpret(MyMemory& mem, Script& script, const VMOptions& options);
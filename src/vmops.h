@@ -0,0 +1,1259 @@
+#pragma once
+
+// Opcode bodies shared between the interpreter loop in vm.cpp and the jit helpers in jit.cpp.
+// Control flow ops (jumps, calls, returns) are not here, since interpreter and jit handle them differently.
+
+#include "common.h"
+#include "mytypes.h"
+#include "op.h"
+#include "script.h"
+#if VM_STATS
+#include "vmstats.h"
+#endif
+
+#include <algorithm> // std::max
+#include <assert.h>
+#include <stdarg.h> // va_start
+#include <stdio.h>
+#include <string.h> // memcpy
+
+struct Profiler;
+
+struct VMRuntime
+{
+    const Script& script;
+    VMState& state;
+    // Same as state.stack and state.stackValueInfo, every op uses them.
+    std::vector<TypeOfValue>& stack;
+    std::vector<ValueTypeDesc>& stackValueInfo;
+
+    const OpCodeType* codeStart;
+    const OpCodeType* ip;
+    const i32* lines;
+
+    // Set by jitted code when it returns back to interpreter.
+    i32 returnAddress;
+    // Jitted calls on the native stack, calls past JitMaxCallDepth continue in the interpreter.
+    i32 jitCallDepth;
+#if VM_STATS
+    // Only when running with --stats.
+    VMStats* stats;
+#endif
+    // Only when running with --profile.
+    Profiler* profiler;
+};
+
+static bool truthy(TypeOfValue value)
+{
+    return value != 0;
+}
+
+struct HelperStruct
+{
+    TypeOfValue valueA;
+    TypeOfValue valueB;
+    ValueTypeDesc descA;
+    ValueTypeDesc descB;
+};
+
+static HelperStruct valuesEqualHelper(std::vector<TypeOfValue>& stack, std::vector<ValueTypeDesc> &stackValueInfo)
+{
+    assert(stack.size() >= 2);
+    assert(stackValueInfo.size() >= 2);
+    HelperStruct result;
+    result.valueB = stack.back();
+    stack.pop_back();
+    result.valueA = stack.back();
+    stack.pop_back();
+    result.descB = stackValueInfo.back();
+    stackValueInfo.pop_back();
+    result.descA = stackValueInfo.back();
+    stackValueInfo.pop_back();
+    return result;
+}
+
+static void valuesEqual(const Script& script, VMState& state, std::vector<TypeOfValue>& stack, std::vector<ValueTypeDesc> &stackValueInfo)
+{
+    HelperStruct s = valuesEqualHelper(stack, stackValueInfo);
+    bool isTrue = s.descB.valueType == s.descA.valueType;
+    bool equal = isTrue && s.valueA == s.valueB;
+    // Any non zero value is a true bool, packed bools are 0 or 1.
+    if(isTrue && s.descA.valueType == ValueTypeBool)
+    {
+        equal = truthy(s.valueA) == truthy(s.valueB);
+    }
+    if(isTrue && s.descA.valueType == ValueTypeString)
+    {
+        equal = state.stackStrings[s.valueA] == state.stackStrings[s.valueB];
+        state.stackStrings.pop_back();
+        state.stackStrings.pop_back();
+    }
+    // Padding is always zero, so comparing the bytes compares every field.
+    if(isTrue && s.descA.valueType == ValueTypeStruct)
+    {
+        const u8* memory = (const u8*)state.structMemory.data();
+        equal = s.descA.structIndex == s.descB.structIndex
+            && memcmp(memory + s.valueA, memory + s.valueB, script.structDescs[s.descA.structIndex].structSize) == 0;
+    }
+    stack.push_back((equal) ? ~(0) : 0);
+    stackValueInfo.push_back({.valueType = ValueTypeBool});
+
+}
+
+static size_t getInstructionIndex(const OpCodeType* current, const OpCodeType* start)
+{
+    return size_t(intptr_t(current) - intptr_t(start)) / OpCodeTypeSize;
+}
+
+static void resetStack(std::vector<TypeOfValue> &stack)
+{
+    stack.clear();
+}
+
+static void runtimeError(VMRuntime& runtime, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    size_t inst = getInstructionIndex(runtime.ip, runtime.codeStart) - 1;
+    int line = runtime.lines[inst];
+    fprintf(stderr, "[Line %d] in script\n", line);
+    resetStack(runtime.stack);
+}
+
+static TypeOfValue peekStack(const std::vector<TypeOfValue>& stack)
+{
+    return stack[stack.size() - 1];
+}
+
+static bool peek(std::vector<ValueTypeDesc>& descs, int distance, ValueTypeDesc** outDesc)
+{
+    if(distance >= descs.size())
+    {
+        outDesc = nullptr;
+        return false;
+    }
+    *outDesc = &descs[descs.size() - distance - 1];
+    return true;
+}
+
+template <typename T>
+static TypeOfValue doBinaryOpOp(const TypeOfValue l, const TypeOfValue r, OpCodeType opCode)
+{
+    const T& lt = *((const T*)&l);
+    const T& rt = *((const T*)&r);
+    TypeOfValue valueStackType = 0;
+    T& value = *((T*)&valueStackType);
+
+    switch(opCode)
+    {
+        case OP_ADD: value = lt + rt; break;
+        case OP_SUB: value = lt - rt; break;
+        case OP_MUL: value = lt * rt; break;
+        case OP_DIV: value = lt / rt; break;
+
+        case OP_GREATER: value = lt > rt; break;
+        case OP_LESSER: value = lt < rt; break;
+        default: break;
+    }
+    TypeOfValue returnValue = *((TypeOfValue*)(&value));
+    return returnValue;
+}
+
+static i32 doBinaryOp(
+    std::vector<TypeOfValue>& stack,
+    std::vector<ValueTypeDesc>& stackValueInfo,
+    OpCodeType opCode)
+{
+
+    HelperStruct values = valuesEqualHelper(stack, stackValueInfo);
+
+    assert(values.descA.valueType == values.descB.valueType);
+    if(values.descA.valueType != values.descB.valueType)
+    {
+        return 1;
+    }
+    TypeOfValue finalValue;
+    ValueTypeDesc newDesc = values.descA;
+    switch(values.descA.valueType)
+    {
+        case ValueTypeI8: finalValue = doBinaryOpOp<i8>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeU8: finalValue = doBinaryOpOp<u8>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeI16: finalValue = doBinaryOpOp<i16>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeU16: finalValue = doBinaryOpOp<u16>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeI32: finalValue = doBinaryOpOp<i32>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeU32: finalValue = doBinaryOpOp<u32>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeI64: finalValue = doBinaryOpOp<i64>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeU64: finalValue = doBinaryOpOp<u64>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeF32: finalValue = doBinaryOpOp<f32>(values.valueA, values.valueB, opCode); break;
+        case ValueTypeF64: finalValue = doBinaryOpOp<f64>(values.valueA, values.valueB, opCode); break;
+        default:
+        {
+            assert(false);
+            return 2;
+        }
+    }
+    switch(opCode)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            stackValueInfo.emplace_back(values.descA);
+            break;
+        case OP_GREATER:
+        case OP_LESSER:
+            stackValueInfo.push_back({.valueType = ValueTypeBool});
+            break;
+        default:
+            return 3;
+
+    }
+    stack.push_back(finalValue);
+
+    return 0;
+}
+
+static i32 getLocalIndex(const VMState& state, i16 lookupIndex)
+{
+    i32 arrSize = (i32)state.locals.structValueArray.size();
+    i32 checkIndex = arrSize + lookupIndex;
+    checkIndex %= arrSize;
+    return checkIndex;
+}
+
+
+// Clears state for a new run of script, keeps the allocations. Only the global struct
+// template gets copied into locals.
+static void resetVMState(VMState& state, const Script& script)
+{
+    state.stack.clear();
+    state.stackValueInfo.clear();
+    state.localValueAmounts.clear();
+    state.parentStructIndices.clear();
+    state.functionReturnAddresses.clear();
+    state.stackStrings.clear();
+    state.scheduler = nullptr;
+    state.workerIndex = 0;
+    state.tasks.clear();
+    state.taskGenerations.clear();
+    state.freeTaskSlots.clear();
+    state.arrays.clear();
+    state.freeArrays.clear();
+    state.arrayCollectAt = 0;
+    state.structMemory.clear();
+    state.structIndex = 0;
+    state.previousLocalStartIndex = 0;
+    state.resumeAddress = 0;
+    state.coroutine = false;
+    state.memoArgs.clear();
+    state.memoArgTypes.clear();
+    state.locals.structValueArray = script.structStacks[0].structValueArray;
+    state.locals.structValueTypes = script.structStacks[0].structValueTypes;
+    state.locals.structPackedValues = script.structStacks[0].structPackedValues;
+}
+
+// All of the op functions return false on runtime error, after reporting it.
+
+static bool opConstant(VMRuntime& vm, OpCodeType opCode, u16 lookupIndex)
+{
+    const TypeOfValue* value = &vm.script.constants.structValueArray[lookupIndex];
+    vm.stack.push_back(*value);
+    ValueType type = ValueType(opCode - OP_CONSTANT_BOOL + ValueTypeBool);
+    vm.stackValueInfo.push_back(ValueTypeDesc{.valueType = type });
+    return true;
+}
+
+static bool opNot(VMRuntime& vm)
+{
+    TypeOfValue value = vm.stack.back();
+    vm.stack.pop_back();
+
+    vm.stack.push_back(!truthy(value));
+    vm.stackValueInfo.pop_back();
+    vm.stackValueInfo.push_back({.valueType = ValueTypeBool});
+    return true;
+}
+
+static bool opConstantString(VMRuntime& vm, u16 lookupIndex)
+{
+    const Script& script = vm.script;
+    TypeOfValue value = script.constants.structValueArray[lookupIndex];
+
+    const std::string& s = script.stringLiterals[value];
+
+    i32 index = (i32)vm.state.stackStrings.size();
+    vm.stack.push_back(index);
+
+    vm.state.stackStrings.push_back(s);
+
+    vm.stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeString});
+    return true;
+}
+
+static bool opNil(VMRuntime& vm)
+{
+    vm.stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeNull});
+    vm.stack.push_back(0);
+    return true;
+}
+
+static bool opEqual(VMRuntime& vm)
+{
+    valuesEqual(vm.script, vm.state, vm.stack, vm.stackValueInfo);
+    return true;
+}
+
+// Same width as the type, like results of binary ops.
+template <typename T>
+static TypeOfValue negateValue(TypeOfValue value)
+{
+    T t;
+    memcpy(&t, &value, sizeof(T));
+    t = T(-t);
+    TypeOfValue result = 0;
+    memcpy(&result, &t, sizeof(T));
+    return result;
+}
+
+static bool opNegate(VMRuntime& vm)
+{
+    ValueTypeDesc* desc;
+    if(!peek(vm.stackValueInfo, 0, &desc))
+    {
+        runtimeError(vm, "Trying to peek stack that does not have enough indices: %i", 0);
+        return false;
+    }
+    TypeOfValue& value = vm.stack.back();
+    switch(desc->valueType)
+    {
+        case ValueTypeI8: value = negateValue<i8>(value); return true;
+        case ValueTypeU8: value = negateValue<u8>(value); return true;
+        case ValueTypeI16: value = negateValue<i16>(value); return true;
+        case ValueTypeU16: value = negateValue<u16>(value); return true;
+        case ValueTypeI32: value = negateValue<i32>(value); return true;
+        case ValueTypeU32: value = negateValue<u32>(value); return true;
+        case ValueTypeI64: value = negateValue<i64>(value); return true;
+        case ValueTypeU64: value = negateValue<u64>(value); return true;
+        case ValueTypeF32: value = negateValue<f32>(value); return true;
+        case ValueTypeF64: value = negateValue<f64>(value); return true;
+        default: break;
+    }
+    const char* valueTypeName = "Unknown value type";
+    if(desc->valueType >= 0 && desc->valueType < ValueType::ValueTypeCount)
+    {
+        valueTypeName = ValueTypeNames[desc->valueType];
+    }
+    runtimeError(vm, "Cannot negate the type: %i: %s", desc->valueType, valueTypeName);
+    return false;
+}
+
+static u8* getStructData(VMState& state, TypeOfValue handle)
+{
+    return (u8*)state.structMemory.data() + handle;
+}
+
+// Value in packed struct or array memory, structs print every field.
+static void printPacked(const VMRuntime& vm, const u8* data, ValueTypeDesc type)
+{
+    const Script& script = vm.script;
+    if(type.valueType != ValueTypeStruct)
+    {
+        TypeOfValue value = 0;
+        memcpy(&value, data, getValueTypeSizeInBytes(type.valueType));
+        printValue(script, vm.state.stackStrings, &value, type.valueType);
+        return;
+    }
+    const StructDesc& desc = script.structDescs[type.structIndex];
+    printf("%s { ", script.allSymbolNames[script.structNameIndices[type.structIndex]].c_str());
+    for(u16 i = 0; i < desc.parametersCount; ++i)
+    {
+        u32 field = desc.parameterStartIndex + i;
+        printf("%s: ", script.allSymbolNames[script.structFieldNameIndices[field]].c_str());
+        printPacked(vm, data + script.structFieldOffsets[field], script.structFieldTypes[field]);
+        printf(i + 1 < desc.parametersCount ? ", " : " ");
+    }
+    printf("}");
+}
+
+static bool opPrint(VMRuntime& vm)
+{
+    TypeOfValue value = vm.stack.back();
+    vm.stack.pop_back();
+
+    ValueTypeDesc valueDesc = vm.stackValueInfo.back();
+    vm.stackValueInfo.pop_back();
+
+    if(valueDesc.valueType == ValueTypeArray)
+    {
+        const ScriptArray& array = *vm.state.arrays[value];
+        ValueTypeDesc elementDesc = getArrayElementDesc(valueDesc);
+        printf("[");
+        for(u64 i = 0; i < array.count; ++i)
+        {
+            printPacked(vm, getArrayData(array) + i * array.elementSize, elementDesc);
+            printf(i + 1 < array.count ? ", " : "");
+        }
+        printf("]\n");
+        return true;
+    }
+    if(valueDesc.valueType == ValueTypeStruct)
+    {
+        printPacked(vm, getStructData(vm.state, value), valueDesc);
+        printf("\n");
+        return true;
+    }
+    printValue(vm.script, vm.state.stackStrings, &value, valueDesc.valueType);
+    printf("\n");
+    return true;
+}
+
+static bool opPop(VMRuntime& vm)
+{
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    return true;
+}
+
+// Zeroed block of size bytes. Blocks start 8 byte aligned, so every field is naturally aligned.
+static TypeOfValue allocStruct(std::vector<u64>& memory, u32 size)
+{
+    TypeOfValue handle = memory.size() * sizeof(u64);
+    memory.resize(memory.size() + (size + sizeof(u64) - 1) / sizeof(u64), 0);
+    return handle;
+}
+
+// Copies a struct into a new block, source can be the same memory.
+static TypeOfValue copyStruct(std::vector<u64>& memory, const std::vector<u64>& source, TypeOfValue handle, u32 size)
+{
+    TypeOfValue newHandle = allocStruct(memory, size);
+    memcpy((u8*)memory.data() + newHandle, (const u8*)source.data() + handle, size);
+    return newHandle;
+}
+
+static bool opDefineGlobal(VMRuntime& vm, i16 lookupIndex)
+{
+    VMState& state = vm.state;
+    i32 checkIndex = getLocalIndex(state, lookupIndex);
+    TypeOfValue* value = &state.locals.structValueArray[checkIndex];
+
+    ValueTypeDesc* descA;
+    if(!peek(vm.stackValueInfo, 0, &descA))
+    {
+        runtimeError(vm, "Trying to peek stack that does not have enough indices: %i", 1);
+        return false;
+    }
+    state.locals.structValueTypes[checkIndex] = *descA;
+
+    *value = vm.stack.back();
+    // Variables own their struct, the value could be a field of another one.
+    if(descA->valueType == ValueTypeStruct)
+    {
+        u32 size = vm.script.structDescs[descA->structIndex].structSize;
+        *value = copyStruct(state.structMemory, state.structMemory, *value, size);
+    }
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    return true;
+}
+
+static bool opGetGlobal(VMRuntime& vm, i16 lookupIndex)
+{
+    VMState& state = vm.state;
+    i32 checkIndex = getLocalIndex(state, lookupIndex);
+    vm.stack.push_back(state.locals.structValueArray[checkIndex]);
+    vm.stackValueInfo.push_back(state.locals.structValueTypes[checkIndex]);
+    return true;
+}
+
+static bool opSetGlobal(VMRuntime& vm, i16 lookupIndex)
+{
+    VMState& state = vm.state;
+    i32 checkIndex = getLocalIndex(state, lookupIndex);
+    TypeOfValue* value = &state.locals.structValueArray[checkIndex];
+    ValueTypeDesc* desc = &state.locals.structValueTypes[checkIndex];
+
+    ValueTypeDesc otherDesc = vm.stackValueInfo.back();
+    assert(desc->valueType == otherDesc.valueType);
+    vm.stackValueInfo.pop_back();
+
+    // Struct gets copied over the one the variable has, fields pointing into it stay valid.
+    if(desc->valueType == ValueTypeStruct && otherDesc.valueType == ValueTypeStruct)
+    {
+        if(desc->structIndex != otherDesc.structIndex)
+        {
+            runtimeError(vm, "Struct types mismatch for assignment: %i vs %i!", desc->structIndex, otherDesc.structIndex);
+            return false;
+        }
+        u32 size = vm.script.structDescs[desc->structIndex].structSize;
+        memmove(getStructData(state, *value), getStructData(state, vm.stack.back()), size);
+    }
+    else
+    {
+        *value = vm.stack.back();
+    }
+    vm.stack.pop_back();
+
+    vm.stack.push_back(*value);
+    vm.stackValueInfo.push_back(*desc);
+
+    if(desc->valueType != otherDesc.valueType)
+    {
+        runtimeError(vm, "Valuetypes mismatch for assignment: %i vs %i!", desc->valueType, otherDesc.valueType);
+        return false;
+    }
+    return true;
+}
+
+// Packed values of every struct stack, offset is from the end of the locals when negative.
+static u8* getPackedValue(VMState& state, i16 offset)
+{
+    std::vector<u64>& packed = state.locals.structPackedValues;
+    i32 index = offset >= 0 ? offset : i32(packed.size() * sizeof(u64)) + offset;
+    return (u8*)packed.data() + index;
+}
+
+template <typename T>
+static bool opLoadPacked(VMRuntime& vm, i16 offset, u16 type)
+{
+    TypeOfValue value = 0;
+    memcpy(&value, getPackedValue(vm.state, offset), sizeof(T));
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back({.valueType = ValueType(type)});
+    return true;
+}
+
+// Leaves the value on the stack, like set global.
+template <typename T>
+static bool opStorePacked(VMRuntime& vm, i16 offset, u16 type)
+{
+    ValueType valueType = vm.stackValueInfo.back().valueType;
+    if(valueType != type)
+    {
+        runtimeError(vm, "Valuetypes mismatch for assignment: %i vs %i!", type, valueType);
+        return false;
+    }
+    TypeOfValue value = vm.stack.back();
+    if(valueType == ValueTypeBool)
+    {
+        value = truthy(value) ? 1 : 0;
+    }
+    memcpy(getPackedValue(vm.state, offset), &value, sizeof(T));
+    return true;
+}
+
+template <typename T>
+static bool forLoopStep(u8* counter, TypeOfValue limit, i16 step)
+{
+    T value;
+    memcpy(&value, counter, sizeof(T));
+    value = T(value + T(step));
+    memcpy(counter, &value, sizeof(T));
+    T limitValue;
+    memcpy(&limitValue, &limit, sizeof(T));
+    return step > 0 ? value < limitValue : value > limitValue;
+}
+
+// Increment, compare and branch of a counted loop in one op. Limit is popped, outLoop tells
+// if the loop goes on.
+static bool opForLoop(VMRuntime& vm, i16 offset, u16 type, i16 step, bool& outLoop)
+{
+    ValueType limitType = vm.stackValueInfo.back().valueType;
+    if(limitType != type)
+    {
+        runtimeError(vm, "Loop limit type mismatch: %i vs %i!", type, limitType);
+        return false;
+    }
+    TypeOfValue limit = vm.stack.back();
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    u8* counter = getPackedValue(vm.state, offset);
+    switch(type)
+    {
+        case ValueTypeI8: outLoop = forLoopStep<i8>(counter, limit, step); return true;
+        case ValueTypeU8: outLoop = forLoopStep<u8>(counter, limit, step); return true;
+        case ValueTypeI16: outLoop = forLoopStep<i16>(counter, limit, step); return true;
+        case ValueTypeU16: outLoop = forLoopStep<u16>(counter, limit, step); return true;
+        case ValueTypeI32: outLoop = forLoopStep<i32>(counter, limit, step); return true;
+        case ValueTypeU32: outLoop = forLoopStep<u32>(counter, limit, step); return true;
+        case ValueTypeI64: outLoop = forLoopStep<i64>(counter, limit, step); return true;
+        case ValueTypeU64: outLoop = forLoopStep<u64>(counter, limit, step); return true;
+        default: break;
+    }
+    runtimeError(vm, "Loop counter needs an integer type: %i", type);
+    return false;
+}
+
+// Cache of a pure fn, created on its first call. Null when memoization is off.
+static MemoCache* getMemoCache(VMState& state, u16 functionIndex, u16 argCount)
+{
+    if(state.memoEntries <= 0)
+    {
+        return nullptr;
+    }
+    if(functionIndex >= state.memoCaches.size())
+    {
+        state.memoCaches.resize(functionIndex + 1);
+    }
+    MemoCache& cache = state.memoCaches[functionIndex];
+    if(cache.entryCount == 0)
+    {
+        i32 entryCount = 1;
+        while(entryCount < state.memoEntries)
+        {
+            entryCount *= 2;
+        }
+        cache.argCount = argCount;
+        cache.entryCount = entryCount;
+        cache.args.assign(size_t(entryCount) * argCount, 0);
+        cache.argTypes.assign(size_t(entryCount) * argCount, ValueTypeNone);
+        cache.results.assign(entryCount, 0);
+        cache.resultDescs.assign(entryCount, {});
+    }
+    return &cache;
+}
+
+static i32 getMemoEntry(const MemoCache& cache, const TypeOfValue* args, const ValueType* types)
+{
+    u64 hash = 0;
+    for(i32 i = 0; i < cache.argCount; ++i)
+    {
+        hash = (hash ^ args[i] ^ (u64(types[i]) << 56)) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    return i32(hash & u64(cache.entryCount - 1));
+}
+
+// Before a call of a pure fn, replaces the arguments with their cached result and tells the
+// call can be skipped. On a miss the arguments are kept for opMemoStore, only bools and
+// numbers are keys.
+static void opMemoLookup(VMRuntime& vm, u16 functionIndex, u16 argCount, bool& outHit)
+{
+    outHit = false;
+    VMState& state = vm.state;
+    MemoCache* cache = getMemoCache(state, functionIndex, argCount);
+    if(cache == nullptr)
+    {
+        return;
+    }
+    size_t first = vm.stack.size() - argCount;
+    size_t kept = state.memoArgs.size();
+    bool valid = true;
+    for(size_t i = first; i < vm.stack.size(); ++i)
+    {
+        ValueType type = vm.stackValueInfo[i].valueType;
+        valid = valid && type >= ValueTypeBool && type <= ValueTypeF64;
+        state.memoArgs.push_back(vm.stack[i]);
+        state.memoArgTypes.push_back(type);
+    }
+    if(!valid)
+    {
+        // Store sees the missing type and caches nothing.
+        state.memoArgTypes[kept] = ValueTypeNone;
+        return;
+    }
+    const TypeOfValue* args = state.memoArgs.data() + kept;
+    const ValueType* types = state.memoArgTypes.data() + kept;
+    i32 entry = getMemoEntry(*cache, args, types);
+    if(cache->resultDescs[entry].valueType == ValueTypeNone)
+    {
+        return;
+    }
+    size_t entryStart = size_t(entry) * argCount;
+    for(i32 i = 0; i < argCount; ++i)
+    {
+        if(cache->args[entryStart + i] != args[i] || cache->argTypes[entryStart + i] != types[i])
+        {
+            return;
+        }
+    }
+    state.memoArgs.resize(kept);
+    state.memoArgTypes.resize(kept);
+    vm.stack.resize(first);
+    vm.stackValueInfo.resize(first);
+    vm.stack.push_back(cache->results[entry]);
+    vm.stackValueInfo.push_back(cache->resultDescs[entry]);
+    outHit = true;
+}
+
+// After the call, caches the result for the arguments the lookup kept. Only bool and number
+// results get cached, other values belong to the run that made them.
+static void opMemoStore(VMRuntime& vm, u16 functionIndex, u16 argCount)
+{
+    VMState& state = vm.state;
+    MemoCache* cache = getMemoCache(state, functionIndex, argCount);
+    if(cache == nullptr)
+    {
+        return;
+    }
+    size_t kept = state.memoArgs.size() - argCount;
+    const TypeOfValue* args = state.memoArgs.data() + kept;
+    const ValueType* types = state.memoArgTypes.data() + kept;
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    if((argCount == 0 || types[0] != ValueTypeNone)
+        && desc.valueType >= ValueTypeBool && desc.valueType <= ValueTypeF64)
+    {
+        i32 entry = getMemoEntry(*cache, args, types);
+        size_t entryStart = size_t(entry) * argCount;
+        for(i32 i = 0; i < argCount; ++i)
+        {
+            cache->args[entryStart + i] = args[i];
+            cache->argTypes[entryStart + i] = types[i];
+        }
+        cache->results[entry] = vm.stack.back();
+        cache->resultDescs[entry] = desc;
+    }
+    state.memoArgs.resize(kept);
+    state.memoArgTypes.resize(kept);
+}
+
+static bool opStackSet(VMRuntime& vm, u16 lookupIndex)
+{
+    const Script& script = vm.script;
+    VMState& state = vm.state;
+    if(lookupIndex < 0 || lookupIndex >= (i32)script.structStacks.size())
+    {
+        runtimeError(vm, "Stack has no parent index!");
+        return false;
+    }
+    i32& lastLocalAmount = state.previousLocalStartIndex;
+    state.parentStructIndices.push_back(state.structIndex);
+    state.structIndex = (i32)lookupIndex;
+    state.localValueAmounts.push_back(lastLocalAmount);
+    lastLocalAmount = state.locals.structValueArray.size();
+    const std::vector<TypeOfValue>& valueArray = script.structStacks[state.structIndex].structValueArray;
+    const std::vector<ValueTypeDesc>& valueTypeArray = script.structStacks[state.structIndex].structValueTypes;
+    state.locals.structValueArray.insert(state.locals.structValueArray.end(), valueArray.begin(), valueArray.end());
+    state.locals.structValueTypes.insert(state.locals.structValueTypes.end(), valueTypeArray.begin(), valueTypeArray.end());
+    const std::vector<u64>& packedArray = script.structStacks[state.structIndex].structPackedValues;
+    state.locals.structPackedValues.insert(state.locals.structPackedValues.end(), packedArray.begin(), packedArray.end());
+    return true;
+}
+
+static bool opStackPop(VMRuntime& vm)
+{
+    const Script& script = vm.script;
+    VMState& state = vm.state;
+    i32 parentIndex = state.parentStructIndices.back();
+    state.parentStructIndices.pop_back();
+    if(parentIndex < 0 || parentIndex >= (i32)script.structStacks.size())
+    {
+        runtimeError(vm, "Stack has no parent index!");
+        return false;
+    }
+    i32& lastLocalAmount = state.previousLocalStartIndex;
+    std::vector<u64>& packed = state.locals.structPackedValues;
+    packed.resize(packed.size() - script.structStacks[state.structIndex].structPackedValues.size());
+    state.structIndex = parentIndex;
+    state.locals.structValueArray.erase(state.locals.structValueArray.begin() + lastLocalAmount, state.locals.structValueArray.end());
+    state.locals.structValueTypes.erase(state.locals.structValueTypes.begin() + lastLocalAmount, state.locals.structValueTypes.end());
+
+    lastLocalAmount = state.localValueAmounts.back();
+    state.localValueAmounts.pop_back();
+    return true;
+}
+
+static bool opNativeCall(VMRuntime& vm, i16 nativeCallIndex)
+{
+    const Script& script = vm.script;
+    if(nativeCallIndex >= script.nativePatchFunctions.size() ||
+        nativeCallIndex >= vm.state.natives.size() ||
+        vm.state.natives[nativeCallIndex] == nullptr)
+    {
+        runtimeError(vm, "Failed to do native call!");
+        return false;
+    }
+    const NativePatchFunction& fn = script.nativePatchFunctions[nativeCallIndex];
+    NativeFn callFn = vm.state.natives[nativeCallIndex];
+    i32 params = i32(fn.parameterTypes.size());
+    NativeReturn result{};
+    if(params == 0)
+    {
+        result = callFn(vm.state, params, nullptr, nullptr);
+    }
+    else
+    {
+        i32 index = i32(vm.stack.size() - params);
+        result = callFn(vm.state, params, &vm.stack[index], &vm.stackValueInfo[index]);
+    }
+    for(int i = 0; i < params; ++i)
+    {
+        vm.stack.pop_back();
+        vm.stackValueInfo.pop_back();
+    }
+    // Natives return no type when the arguments are wrong.
+    if(result.desc.valueType == ValueTypeNone)
+    {
+        runtimeError(vm, "Native call failed: %s", getStringFromTokenName(fn.token).c_str());
+        return false;
+    }
+    vm.stack.push_back(result.value);
+    vm.stackValueInfo.push_back(result.desc);
+    return true;
+}
+
+static bool isIntegerType(ValueType type)
+{
+    return type >= ValueTypeI8 && type <= ValueTypeU64;
+}
+
+// Pops the index and the array below it. Index can be any integer type.
+static ScriptArray* popArrayIndex(VMRuntime& vm, u64& outIndex)
+{
+    TypeOfValue index = vm.stack.back();
+    ValueType indexType = vm.stackValueInfo.back().valueType;
+    TypeOfValue handle = vm.stack[vm.stack.size() - 2];
+    ValueType arrayType = vm.stackValueInfo[vm.stack.size() - 2].valueType;
+    vm.stack.resize(vm.stack.size() - 2);
+    vm.stackValueInfo.resize(vm.stackValueInfo.size() - 2);
+    if(arrayType != ValueTypeArray || handle >= vm.state.arrays.size() || vm.state.arrays[handle] == nullptr)
+    {
+        runtimeError(vm, "Only arrays can be indexed, got type: %i", arrayType);
+        return nullptr;
+    }
+    if(!isIntegerType(indexType))
+    {
+        runtimeError(vm, "Array index needs to be an integer, got type: %i", indexType);
+        return nullptr;
+    }
+    // Sign extend signed indices, so negative ones are out of bounds.
+    i32 size = getValueTypeSizeInBytes(indexType);
+    bool isSigned = indexType == ValueTypeI8 || indexType == ValueTypeI16 || indexType == ValueTypeI32 || indexType == ValueTypeI64;
+    if(isSigned && size < 8 && (index >> (size * 8 - 1)) != 0)
+    {
+        index |= ~0ull << (size * 8);
+    }
+    ScriptArray* array = vm.state.arrays[handle].get();
+    if(index >= array->count)
+    {
+        runtimeError(vm, "Array index %lli out of bounds, count: %llu", (long long)index, (unsigned long long)array->count);
+        return nullptr;
+    }
+    outIndex = index;
+    return array;
+}
+
+static ValueTypeDesc getElementDesc(const ScriptArray& array)
+{
+    return {.structIndex = array.structIndex, .valueType = array.elementType};
+}
+
+// Fewest array slots before unused ones get looked for.
+static constexpr size_t ArrayCollectMin = 64;
+
+// Frees arrays no value on the stack or in the locals refers to. Arrays are only in those, struct
+// fields and array elements can not be arrays, tasks hold their own references.
+static void collectArrays(VMState& state)
+{
+    std::vector<u8> used(state.arrays.size(), 0);
+    for(size_t i = 0; i < state.stack.size(); ++i)
+    {
+        if(state.stackValueInfo[i].valueType == ValueTypeArray && state.stack[i] < used.size())
+        {
+            used[state.stack[i]] = 1;
+        }
+    }
+    const StructStack& locals = state.locals;
+    for(size_t i = 0; i < locals.structValueArray.size(); ++i)
+    {
+        if(locals.structValueTypes[i].valueType == ValueTypeArray && locals.structValueArray[i] < used.size())
+        {
+            used[locals.structValueArray[i]] = 1;
+        }
+    }
+    size_t usedCount = 0;
+    for(size_t i = 0; i < used.size(); ++i)
+    {
+        if(used[i] != 0)
+        {
+            ++usedCount;
+        }
+        else if(state.arrays[i] != nullptr)
+        {
+            state.arrays[i].reset();
+            state.freeArrays.push_back(u32(i));
+        }
+    }
+    state.arrayCollectAt = std::max(ArrayCollectMin, usedCount * 2);
+}
+
+// Drops arrays made after the first count, their slots can not be free anymore.
+static void trimArrays(VMState& state, size_t count)
+{
+    state.arrays.resize(count);
+    std::erase_if(state.freeArrays, [count](u32 slot) { return slot >= count; });
+}
+
+// Handle for the array, in a slot freed by collectArrays when there is one.
+static TypeOfValue addArray(VMState& state, ScriptArrayRef array)
+{
+    if(state.freeArrays.empty() && state.arrays.size() >= state.arrayCollectAt)
+    {
+        collectArrays(state);
+    }
+    if(state.freeArrays.empty())
+    {
+        state.arrays.push_back(std::move(array));
+        return state.arrays.size() - 1;
+    }
+    u32 slot = state.freeArrays.back();
+    state.freeArrays.pop_back();
+    state.arrays[slot] = std::move(array);
+    return slot;
+}
+
+// Between host calls only variables refer to strings, arrays and structs. Keeps those and
+// drops the rest, so a function making them can be called any number of times. Clears the stack.
+static void releaseCallValues(VMState& state, const Script& script)
+{
+    state.stack.clear();
+    state.stackValueInfo.clear();
+    std::vector<std::string> strings;
+    std::vector<u64> structMemory;
+    StructStack& locals = state.locals;
+    for(size_t i = 0; i < locals.structValueArray.size(); ++i)
+    {
+        TypeOfValue& value = locals.structValueArray[i];
+        ValueTypeDesc type = locals.structValueTypes[i];
+        if(type.valueType == ValueTypeString && value < state.stackStrings.size())
+        {
+            strings.push_back(state.stackStrings[value]);
+            value = strings.size() - 1;
+        }
+        else if(type.valueType == ValueTypeStruct)
+        {
+            value = copyStruct(structMemory, state.structMemory, value, script.structDescs[type.structIndex].structSize);
+        }
+    }
+    state.stackStrings.swap(strings);
+    state.structMemory.swap(structMemory);
+
+    collectArrays(state);
+    size_t arrayCount = state.arrays.size();
+    while(arrayCount > 0 && state.arrays[arrayCount - 1] == nullptr)
+    {
+        --arrayCount;
+    }
+    trimArrays(state, arrayCount);
+}
+
+static void pushArray(VMRuntime& vm, ScriptArrayRef array)
+{
+    ValueTypeDesc desc = getArrayDesc(getElementDesc(*array));
+    TypeOfValue handle = addArray(vm.state, std::move(array));
+    vm.stack.push_back(handle);
+    vm.stackValueInfo.push_back(desc);
+}
+
+// Writes a value into struct or array memory, it needs to have the type of the field.
+// Struct values get copied.
+static bool storePacked(VMRuntime& vm, u8* dst, ValueTypeDesc fieldType, TypeOfValue value, ValueTypeDesc valueDesc)
+{
+    if(getTypeId(valueDesc) != getTypeId(fieldType))
+    {
+        runtimeError(vm, "Field of type: %i cannot store type: %i", getTypeId(fieldType), getTypeId(valueDesc));
+        return false;
+    }
+    if(fieldType.valueType == ValueTypeStruct)
+    {
+        memmove(dst, getStructData(vm.state, value), vm.script.structDescs[fieldType.structIndex].structSize);
+    }
+    else
+    {
+        memcpy(dst, &value, getValueTypeSizeInBytes(fieldType.valueType));
+    }
+    return true;
+}
+
+// Pushes a value from array memory, or a scalar from struct memory. Struct values get copied
+// into struct memory, which can move it.
+static void pushPacked(VMRuntime& vm, const u8* src, ValueTypeDesc type)
+{
+    TypeOfValue value = 0;
+    if(type.valueType == ValueTypeStruct)
+    {
+        u32 size = vm.script.structDescs[type.structIndex].structSize;
+        value = allocStruct(vm.state.structMemory, size);
+        memcpy(getStructData(vm.state, value), src, size);
+    }
+    else
+    {
+        memcpy(&value, src, getValueTypeSizeInBytes(type.valueType));
+    }
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back(type);
+}
+
+// Element type operand is a type id, ValueTypeCount + struct index for arrays of structs.
+static bool opArrayNew(VMRuntime& vm, u16 elementType)
+{
+    TypeOfValue count = vm.stack.back();
+    ValueType countType = vm.stackValueInfo.back().valueType;
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    if(countType != ValueTypeI32 && countType != ValueTypeU32 && countType != ValueTypeI64 && countType != ValueTypeU64)
+    {
+        runtimeError(vm, "Array count needs to be a 32 or 64 bit integer, got type: %i", countType);
+        return false;
+    }
+    if((countType == ValueTypeI32 && i32(count) < 0) || (countType == ValueTypeI64 && i64(count) < 0))
+    {
+        runtimeError(vm, "Array count cannot be negative!");
+        return false;
+    }
+    ValueTypeDesc elementDesc = getTypeDesc(elementType);
+    ScriptArrayRef array = nullptr;
+    if(elementDesc.valueType == ValueTypeStruct && elementDesc.structIndex < vm.script.structDescs.size())
+    {
+        array = arrayCreateStructs(elementDesc.structIndex, vm.script.structDescs[elementDesc.structIndex].structSize, count);
+    }
+    else if(elementDesc.valueType != ValueTypeStruct)
+    {
+        array = arrayCreate(elementDesc.valueType, count);
+    }
+    if(array == nullptr)
+    {
+        runtimeError(vm, "Arrays can only have bools, numbers and structs, got type: %i", elementType);
+        return false;
+    }
+    pushArray(vm, std::move(array));
+    return true;
+}
+
+// Element type comes from the first element, every other one must have the same type.
+static bool opArrayLiteral(VMRuntime& vm, u16 count)
+{
+    size_t first = vm.stack.size() - count;
+    ValueTypeDesc elementDesc = count > 0 ? vm.stackValueInfo[first] : ValueTypeDesc{.valueType = ValueTypeI32};
+    ScriptArrayRef array = elementDesc.valueType == ValueTypeStruct
+        ? arrayCreateStructs(elementDesc.structIndex, vm.script.structDescs[elementDesc.structIndex].structSize, count)
+        : arrayCreate(elementDesc.valueType, count);
+    if(array == nullptr)
+    {
+        runtimeError(vm, "Arrays can only have bools, numbers and structs, got type: %i", elementDesc.valueType);
+        return false;
+    }
+    for(u16 i = 0; i < count; ++i)
+    {
+        u8* element = getArrayData(*array) + u64(i) * array->elementSize;
+        if(!storePacked(vm, element, elementDesc, vm.stack[first + i], vm.stackValueInfo[first + i]))
+        {
+            return false;
+        }
+    }
+    vm.stack.resize(first);
+    vm.stackValueInfo.resize(first);
+    pushArray(vm, std::move(array));
+    return true;
+}
+
+static bool opArrayGet(VMRuntime& vm)
+{
+    u64 index = 0;
+    ScriptArray* array = popArrayIndex(vm, index);
+    if(array == nullptr)
+    {
+        return false;
+    }
+    pushPacked(vm, getArrayData(*array) + index * array->elementSize, getElementDesc(*array));
+    return true;
+}
+
+static bool opArraySet(VMRuntime& vm)
+{
+    TypeOfValue value = vm.stack.back();
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    u64 index = 0;
+    ScriptArray* array = popArrayIndex(vm, index);
+    if(array == nullptr)
+    {
+        return false;
+    }
+    if(!storePacked(vm, getArrayData(*array) + index * array->elementSize, getElementDesc(*array), value, desc))
+    {
+        return false;
+    }
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back(desc);
+    return true;
+}
+
+// Pops the field values in declaration order, pushes the new struct.
+static bool opStructLiteral(VMRuntime& vm, u16 structIndex)
+{
+    const Script& script = vm.script;
+    const StructDesc& desc = script.structDescs[structIndex];
+    size_t first = vm.stack.size() - desc.parametersCount;
+    TypeOfValue handle = allocStruct(vm.state.structMemory, desc.structSize);
+    for(u16 i = 0; i < desc.parametersCount; ++i)
+    {
+        u32 field = desc.parameterStartIndex + i;
+        u8* dst = getStructData(vm.state, handle) + script.structFieldOffsets[field];
+        if(!storePacked(vm, dst, script.structFieldTypes[field], vm.stack[first + i], vm.stackValueInfo[first + i]))
+        {
+            return false;
+        }
+    }
+    vm.stack.resize(first);
+    vm.stackValueInfo.resize(first);
+    vm.stack.push_back(handle);
+    vm.stackValueInfo.push_back({.structIndex = structIndex, .valueType = ValueTypeStruct});
+    return true;
+}
+
+// Field ops have the struct, byte offset of the field and its type id as operands, the
+// compiler folds nested field offsets into one.
+static bool popStruct(VMRuntime& vm, u16 structIndex, TypeOfValue& outHandle)
+{
+    outHandle = vm.stack.back();
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    if(desc.valueType != ValueTypeStruct || desc.structIndex != structIndex)
+    {
+        runtimeError(vm, "Field access expects struct: %i, got type: %i", structIndex, getTypeId(desc));
+        return false;
+    }
+    return true;
+}
+
+// Pops array and index, returns memory of the element.
+static u8* popStructElement(VMRuntime& vm, u16 structIndex)
+{
+    u64 index = 0;
+    ScriptArray* array = popArrayIndex(vm, index);
+    if(array == nullptr)
+    {
+        return nullptr;
+    }
+    if(array->elementType != ValueTypeStruct || array->structIndex != structIndex)
+    {
+        runtimeError(vm, "Field access expects array of struct: %i, got element type: %i",
+            structIndex, getTypeId(getElementDesc(*array)));
+        return nullptr;
+    }
+    return getArrayData(*array) + index * array->elementSize;
+}
+
+static bool opFieldGet(VMRuntime& vm, u16 structIndex, u16 offset, u16 typeId)
+{
+    TypeOfValue handle = 0;
+    if(!popStruct(vm, structIndex, handle))
+    {
+        return false;
+    }
+    ValueTypeDesc type = getTypeDesc(typeId);
+    if(type.valueType == ValueTypeStruct)
+    {
+        // Nested struct is part of its parent, no copy.
+        vm.stack.push_back(handle + offset);
+        vm.stackValueInfo.push_back(type);
+        return true;
+    }
+    pushPacked(vm, getStructData(vm.state, handle) + offset, type);
+    return true;
+}
+
+static bool opFieldSet(VMRuntime& vm, u16 structIndex, u16 offset, u16 typeId)
+{
+    TypeOfValue value = vm.stack.back();
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    TypeOfValue handle = 0;
+    if(!popStruct(vm, structIndex, handle))
+    {
+        return false;
+    }
+    if(!storePacked(vm, getStructData(vm.state, handle) + offset, getTypeDesc(typeId), value, desc))
+    {
+        return false;
+    }
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back(desc);
+    return true;
+}
+
+// Reads straight from the array, only the field gets pushed.
+static bool opArrayFieldGet(VMRuntime& vm, u16 structIndex, u16 offset, u16 typeId)
+{
+    const u8* element = popStructElement(vm, structIndex);
+    if(element == nullptr)
+    {
+        return false;
+    }
+    pushPacked(vm, element + offset, getTypeDesc(typeId));
+    return true;
+}
+
+static bool opArrayFieldSet(VMRuntime& vm, u16 structIndex, u16 offset, u16 typeId)
+{
+    TypeOfValue value = vm.stack.back();
+    ValueTypeDesc desc = vm.stackValueInfo.back();
+    vm.stack.pop_back();
+    vm.stackValueInfo.pop_back();
+    u8* element = popStructElement(vm, structIndex);
+    if(element == nullptr)
+    {
+        return false;
+    }
+    if(!storePacked(vm, element + offset, getTypeDesc(typeId), value, desc))
+    {
+        return false;
+    }
+    vm.stack.push_back(value);
+    vm.stackValueInfo.push_back(desc);
+    return true;
+}
+
+static bool opBinary(VMRuntime& vm, OpCodeType opCode)
+{
+    VMState& state = vm.state;
+    ValueTypeDesc* descA;
+    ValueTypeDesc* descB;
+    if(!peek(vm.stackValueInfo, 0, &descA) || !peek(vm.stackValueInfo, 1, &descB))
+    {
+        runtimeError(vm, "Trying to peek stack that does not have enough indices: %i", 1);
+        return false;
+    }
+    if(opCode == OP_ADD && descA->valueType == ValueTypeString)
+    {
+        HelperStruct values = valuesEqualHelper(vm.stack, vm.stackValueInfo);
+        const std::string a = state.stackStrings[values.valueA];
+        const std::string b = state.stackStrings[values.valueB];
+
+        state.stackStrings.pop_back();
+        state.stackStrings.pop_back();
+
+        i32 newIndex = (i32)state.stackStrings.size();
+        state.stackStrings.push_back(a + b);
+
+        vm.stack.push_back(newIndex);
+        vm.stackValueInfo.push_back(ValueTypeDesc{.valueType = ValueTypeString});
+        return true;
+    }
+    // Copy the types before the binary op pops them for error reporting.
+    ValueType typeA = descA->valueType;
+    ValueType typeB = descB->valueType;
+    i32 result = doBinaryOp(vm.stack, vm.stackValueInfo, opCode);
+    switch (result)
+    {
+        case 0:
+            return true;
+        case 1:
+            runtimeError(vm, "Mismatching types on binary op: %i vs %i!", typeA, typeB);
+            break;
+        case 2:
+            runtimeError(vm, "Valuetype on binary op not a number: %i!", typeA);
+            break;
+        case 3:
+            runtimeError(vm, "Not valid binary op: %i!", opCode);
+            break;
+    }
+    return false;
+}
@@ -0,0 +1,53 @@
+#include "vmstats.h"
+
+#include "script.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+
+void printStats(const Script& script, const VMStats& stats)
+{
+    u64 total = 0;
+    std::vector<i32> ops;
+    for(i32 i = 0; i <= OP_ERROR; ++i)
+    {
+        total += stats.opCounts[i];
+        if(stats.opCounts[i] > 0)
+        {
+            ops.push_back(i);
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [&stats](i32 a, i32 b) { return stats.opCounts[a] > stats.opCounts[b]; });
+
+    printf("\n== Stats ==\n");
+    printf("%-32s %16s %8s\n", "Op", "Count", "%");
+    for(i32 op : ops)
+    {
+        printf("%-32s %16" PRIu64 " %7.2f%%\n", getOpCodeName(op), stats.opCounts[op],
+            100.0 * double(stats.opCounts[op]) / double(total));
+    }
+    printf("%-32s %16" PRIu64 "\n", "Total", total);
+
+    std::vector<i32> natives;
+    for(i32 i = 0; i < stats.nativeCallCounts.size(); ++i)
+    {
+        natives.push_back(i);
+    }
+    std::sort(natives.begin(), natives.end(),
+        [&stats](i32 a, i32 b) { return stats.nativeCallCounts[a] > stats.nativeCallCounts[b]; });
+    if(!natives.empty())
+    {
+        printf("\n%-32s %16s\n", "Native", "Calls");
+    }
+    for(i32 index : natives)
+    {
+        std::string name = getStringFromTokenName(script.nativePatchFunctions[index].token);
+        printf("%-32s %16" PRIu64 "\n", name.c_str(), stats.nativeCallCounts[index]);
+    }
+
+    printf("\nMax stack depth: %" PRIu64 "\n", stats.maxStackDepth);
+    printf("Max locals size: %" PRIu64 " bytes\n", stats.maxLocalsSize);
+    printf("Max return address depth: %" PRIu64 "\n", stats.maxReturnAddressDepth);
+    printf("== End of stats ==\n");
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "mytypes.h"
+#include "op.h"
+
+#include <vector>
+
+struct Script;
+
+struct VMStats
+{
+    u64 opCounts[OP_ERROR + 1];
+    // One for each of script.nativePatchFunctions.
+    std::vector<u64> nativeCallCounts;
+    u64 maxStackDepth;
+    // Bytes of packed locals and slots of the other locals.
+    u64 maxLocalsSize;
+    u64 maxReturnAddressDepth;
+};
+
+void printStats(const Script& script, const VMStats& stats);
@@ -0,0 +1,196 @@
+// Calls script functions that make strings, arrays and structs through libcarpscript a million
+// times, one call at a time and as a batch. Checks the memory the process holds stays the same,
+// and that globals keep their values.
+// carpembedtest [calls]
+
+#include "carpscript.h"
+
+#include <atomic>
+#include <inttypes.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static const char* Source = R"(
+struct Vec2
+{
+    x: f32,
+    y: f32,
+}
+let last = "";
+let origin = Vec2 { x: 1.0, y: 2.0 };
+let keep = [i32; 4];
+keep[1] = 2;
+fn build(n: i32)
+{
+    let text = "item" + "-" + "carp";
+    let values = [f32; 16];
+    values[3] = 1.5;
+    let point = Vec2 { x: 3.0, y: 4.0 };
+    return n + 1;
+}
+fn remember(n: i32)
+{
+    last = "last" + "!";
+    origin = Vec2 { x: origin.x, y: 2.0 };
+    return n;
+}
+fn check()
+{
+    return last == "last!" && origin.x == 1.0 && origin.y == 2.0 && keep[1] == 2;
+}
+)";
+
+// Bytes allocated and not yet freed, the size is kept in front of every block.
+static std::atomic<i64> liveBytes = 0;
+
+static size_t getHeaderSize(size_t alignment)
+{
+    return alignment > 16 ? alignment : 16;
+}
+
+static void* allocate(size_t size, size_t alignment)
+{
+    size_t header = getHeaderSize(alignment);
+    size_t total = header + (size ? size : 1);
+    u8* block = nullptr;
+    if(alignment <= 16)
+    {
+        block = (u8*)malloc(total);
+    }
+    else
+    {
+#if _WIN32
+        block = (u8*)_aligned_malloc(total, alignment);
+#else
+        block = (u8*)aligned_alloc(alignment, (total + alignment - 1) / alignment * alignment);
+#endif
+    }
+    if(block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    memcpy(block + header - sizeof(size_t), &size, sizeof(size_t));
+    liveBytes.fetch_add(i64(size), std::memory_order_relaxed);
+    return block + header;
+}
+
+static void deallocate(void* ptr, size_t alignment) noexcept
+{
+    if(ptr == nullptr)
+    {
+        return;
+    }
+    size_t size = 0;
+    memcpy(&size, (u8*)ptr - sizeof(size_t), sizeof(size_t));
+    liveBytes.fetch_sub(i64(size), std::memory_order_relaxed);
+    u8* block = (u8*)ptr - getHeaderSize(alignment);
+#if _WIN32
+    if(alignment > 16)
+    {
+        _aligned_free(block);
+        return;
+    }
+#endif
+    free(block);
+}
+
+void* operator new(size_t size) { return allocate(size, 0); }
+void* operator new[](size_t size) { return allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, size_t(alignment)); }
+void operator delete(void* ptr) noexcept { deallocate(ptr, 0); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr, 0); }
+void operator delete(void* ptr, size_t) noexcept { deallocate(ptr, 0); }
+void operator delete[](void* ptr, size_t) noexcept { deallocate(ptr, 0); }
+void operator delete(void* ptr, std::align_val_t alignment) noexcept { deallocate(ptr, size_t(alignment)); }
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept { deallocate(ptr, size_t(alignment)); }
+void operator delete(void* ptr, size_t, std::align_val_t alignment) noexcept { deallocate(ptr, size_t(alignment)); }
+void operator delete[](void* ptr, size_t, std::align_val_t alignment) noexcept { deallocate(ptr, size_t(alignment)); }
+
+// Room for allocations that are not per call, like jitted code or a vector growing once more.
+static constexpr i64 AllowedGrowth = 64 * 1024;
+
+static bool callMany(CarpInstance* instance, i32 functionIndex, i32 calls)
+{
+    for(i32 i = 0; i < calls; ++i)
+    {
+        CarpValue args[] = { carpValue(i) };
+        CarpValue result;
+        if(carpCall(instance, functionIndex, args, 1, &result) != InterpretResult_Ok)
+        {
+            fprintf(stderr, "Call %i failed\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool callBatch(CarpInstance* instance, i32 functionIndex, i32 rows)
+{
+    std::vector<i32> args(rows);
+    std::vector<i32> results(rows);
+    for(i32 i = 0; i < rows; ++i)
+    {
+        args[i] = i;
+    }
+    CarpColumn column = carpColumn(args.data());
+    if(carpCallBatch(instance, functionIndex, &column, 1, rows, carpColumn(results.data())) != InterpretResult_Ok)
+    {
+        fprintf(stderr, "Batch failed\n");
+        return false;
+    }
+    return results[rows - 1] == rows;
+}
+
+static bool checkGlobals(CarpInstance* instance, i32 check)
+{
+    CarpValue result;
+    bool ok = false;
+    return carpCall(instance, check, nullptr, 0, &result) == InterpretResult_Ok && carpGetValue(result, ok) && ok;
+}
+
+int main(int argc, const char** argv)
+{
+    i32 calls = argc > 1 ? atoi(argv[1]) : 1000000;
+    CarpProgram* program = carpCompile(Source, strlen(Source));
+    if(program == nullptr)
+    {
+        return 1;
+    }
+    CarpInstance* instance = carpCreateInstance(program);
+    if(instance == nullptr)
+    {
+        return 1;
+    }
+    i32 build = carpFindFunction(program, "build");
+    i32 remember = carpFindFunction(program, "remember");
+    i32 check = carpFindFunction(program, "check");
+
+    // Warm up first, so functions are jitted and vectors are at the size one call needs.
+    i32 warmup = 10000;
+    bool success = callMany(instance, build, warmup) && callMany(instance, remember, warmup)
+        && callBatch(instance, build, warmup);
+    i64 before = liveBytes.load();
+    success = success && callMany(instance, build, calls) && callMany(instance, remember, calls)
+        && callBatch(instance, build, calls);
+    i64 growth = liveBytes.load() - before;
+    printf("%i calls, memory growth: %" PRIi64 " bytes\n", calls, growth);
+    if(growth > AllowedGrowth)
+    {
+        fprintf(stderr, "Memory grows with calls\n");
+        success = false;
+    }
+    if(!checkGlobals(instance, check))
+    {
+        fprintf(stderr, "Globals lost their values\n");
+        success = false;
+    }
+
+    carpDestroyInstance(instance);
+    carpDestroyProgram(program);
+    printf("%s\n", success ? "OK" : "FAILED");
+    return success ? 0 : 1;
+}